@@ -0,0 +1,694 @@
+/******************************************************************************
+ * Archivage des enregistrements tty : sortie du serveur dédupliquée entre
+ * les sessions dans un magasin de morceaux
+ * Bertrand sept 2024
+ *
+ * archive [--store <magasin>] [--output <répertoire>] [--jobs <n>] <fichiers, répertoires ou motifs>...
+ *
+ * Chaque enregistrement (v1 ou v2) est réécrit en v2 compressé, flag
+ * TTY_RECORD_FLAG_CHUNKS : les données des records SERVER_TO_CLIENT d'au moins
+ * ARCHIVE_RECORD_MIN octets sont découpées en morceaux, chaque morceau distinct
+ * rangé une seule fois dans le magasin, et le record n'en garde que les
+ * références. replay et search relisent les fichiers archivés comme les autres.
+ * Formats : voir ttyChunks.h.
+ *
+ * Découpage (FastCDC) : hachage « gear » glissant, h = (h << 1) + gear[octet],
+ * qui ne dépend que des 64 derniers octets lus. Coupure là où ses bits de poids
+ * fort sont nuls, avec un masque plus exigeant avant CHUNK_MOYEN et plus lâche
+ * après, entre CHUNK_MIN et CHUNK_MAX. Après une différence (date, pid, adresse
+ * ip dans la sortie), les coupures retombent aux mêmes endroits et les morceaux
+ * suivants sont de nouveau communs.
+ *
+ * Identité d'un morceau : SipHash-2-4 128 bits avec la clé du magasin, tirée à
+ * sa création. La sortie est choisie par l'attaquant : sans la clé, il ne peut
+ * pas fabriquer deux morceaux de même hash pour faire rendre l'un à la place
+ * de l'autre.
+ *
+ * Parallélisme : les threads prennent les fichiers un à un dans la liste
+ * triée. La table des morceaux est découpée en TABLE_TRANCHES tranches, chacune
+ * sous son mutex ; un nouveau morceau réserve sa place en fin de paquet par un
+ * ajout atomique et y est écrit par pwritev() hors de tout verrou.
+ *
+ * Sûreté : un seul archive à la fois par magasin (flock du paquet). Un fichier
+ * réécrit est d'abord écrit à côté, et ne remplace l'original qu'une fois le
+ * paquet synchronisé et son index écrit : une interruption laisse les
+ * originaux et au plus des morceaux orphelins en fin de paquet, retirés au
+ * passage suivant. Les fichiers modifiés depuis moins de ARCHIVE_REPOS
+ * secondes sont laissés : leur session est peut-être en cours.
+ *
+ * HONEYPOT_CHUNKS   magasin par défaut
+ ******************************************************************************/
+
+
+/* sys */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <time.h>
+
+/* libc */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include "ttyRecordReader.h"
+#include "ttyRecordWriter.h"
+#include "ttyChunks.h"
+
+
+#define CHUNK_MIN           256
+#define CHUNK_MOYEN         1024
+#define CHUNK_MAX           8192
+#define CHUNK_MASQUE_S      0xfff0000000000000ULL   /* 12 bits : coupure rare avant la taille moyenne */
+#define CHUNK_MASQUE_L      0xff00000000000000ULL   /*  8 bits : fréquente après */
+
+#define ARCHIVE_RECORD_MIN  64              /* sortie plus courte : laissée dans l'enregistrement, deflate s'en charge */
+#define ARCHIVE_REPOS       600             /* s sans modification avant d'archiver un fichier */
+#define ARCHIVE_SUFFIXE     ".archive-tmp"
+
+#define TABLE_TRANCHES      64
+#define TABLE_INITIALE      1024            /* entrées par tranche au départ */
+
+
+
+/******************************************************************************
+ * Découpage et hachage des morceaux
+ ******************************************************************************/
+
+static uint64_t gear[256];
+
+/* Table fixe : les mêmes coupures d'un passage et d'un magasin à l'autre */
+static void gearInit(void) {
+    uint64_t x = 0x48504348554e4b53ULL;   /* splitmix64 */
+    for (int i=0; i<256; i++) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+/* Longueur du morceau qui commence en p */
+static size_t decoupe(const uint8_t* p, size_t len) {
+    if (len <= CHUNK_MIN) return len;
+    size_t moyen = len < CHUNK_MOYEN ? len : CHUNK_MOYEN;
+    size_t max   = len < CHUNK_MAX ? len : CHUNK_MAX;
+    uint64_t h = 0;
+    size_t i = CHUNK_MIN;
+
+    for (; i < moyen; i++) {
+        h = (h << 1) + gear[p[i]];
+        if ((h & CHUNK_MASQUE_S) == 0) return i + 1;
+    }
+    for (; i < max; i++) {
+        h = (h << 1) + gear[p[i]];
+        if ((h & CHUNK_MASQUE_L) == 0) return i + 1;
+    }
+    return max;
+}
+
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND \
+    do { \
+        v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+        v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+        v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+        v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+    } while (0)
+
+/* SipHash-2-4, sortie de 128 bits */
+static void siphash128(const uint8_t* cle, const uint8_t* p, size_t len, uint64_t h[2]) {
+    uint64_t k0 = le64Get(cle), k1 = le64Get(cle + 8);
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1 ^ 0xee;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+    size_t fin = len & ~(size_t)7;
+
+    for (size_t i=0; i<fin; i+=8) {
+        uint64_t m = le64Get(p + i);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+    uint64_t b = (uint64_t)len << 56;
+    for (size_t i=fin; i<len; i++) b |= (uint64_t)p[i] << (8 * (i - fin));
+    v3 ^= b;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= b;
+
+    v2 ^= 0xee;
+    SIPROUND; SIPROUND; SIPROUND; SIPROUND;
+    h[0] = v0 ^ v1 ^ v2 ^ v3;
+    v1 ^= 0xdd;
+    SIPROUND; SIPROUND; SIPROUND; SIPROUND;
+    h[1] = v0 ^ v1 ^ v2 ^ v3;
+}
+
+
+
+/******************************************************************************
+ * Magasin : paquet en ajout seul, table des morceaux en mémoire
+ ******************************************************************************/
+
+struct morceau_s {
+    uint64_t h[2];
+    uint64_t offset;      /* des données dans le paquet */
+    uint32_t len;         /* 0 : entrée libre */
+};
+
+struct tranche_s {
+    pthread_mutex_t   mutex;
+    struct morceau_s* e;
+    size_t            capacity;   /* puissance de 2 */
+    size_t            nb;
+};
+
+struct magasin_s {
+    char     chemin[PATH_MAX];    /* absolu, noté dans les fichiers archivés */
+    int      fd;                  /* paquet, verrouillé */
+    uint8_t  cle[TTY_CHUNKS_KEY_LEN];
+    uint64_t fin;                 /* fin du paquet, places réservées comprises ; atomique */
+    uint64_t couvert;             /* fin du paquet au chargement */
+    bool     erreur;              /* écriture ratée : rien ne sera remplacé */
+    struct tranche_s tranches[TABLE_TRANCHES];
+};
+
+static struct tranche_s* magasinTranche(struct magasin_s* m, const uint64_t h[2]) {
+    return &m->tranches[h[1] >> 58];
+}
+
+/* Entrée de ce hash, ou libre où l'ajouter */
+static struct morceau_s* trancheCherche(struct tranche_s* t, const uint64_t h[2]) {
+    size_t i = h[0] & (t->capacity - 1);
+    while (t->e[i].len != 0 && (t->e[i].h[0] != h[0] || t->e[i].h[1] != h[1])) i = (i + 1) & (t->capacity - 1);
+    return &t->e[i];
+}
+
+static void trancheAjoute(struct tranche_s* t, const struct morceau_s* m) {
+    if (2 * (t->nb + 1) > t->capacity) {
+        struct tranche_s plus = { .capacity = 2 * t->capacity };
+        plus.e = calloc(plus.capacity, sizeof(*plus.e));
+        if (plus.e == NULL) {
+            perror("Erreur sur calloc() ");
+            abort();
+        }
+        for (size_t i=0; i<t->capacity; i++) {
+            if (t->e[i].len) *trancheCherche(&plus, t->e[i].h) = t->e[i];
+        }
+        free(t->e);
+        t->e = plus.e;
+        t->capacity = plus.capacity;
+    }
+    struct morceau_s* e = trancheCherche(t, m->h);
+    if (e->len == 0) t->nb++;
+    *e = *m;
+}
+
+/* Index des morceaux laissé par le passage précédent ; -1 s'il manque ou ne correspond pas au paquet */
+static int magasinChargeIndex(struct magasin_s* m, uint64_t taille) {
+    char nom[PATH_MAX];
+    struct stat st;
+    uint8_t entete[TTY_CHUNKS_INDEX_HEADER_LEN];
+
+    int n = snprintf(nom, sizeof(nom), "%s/%s", m->chemin, TTY_CHUNKS_INDEX);
+    if (n < 0 || (size_t)n >= sizeof(nom)) return -1;
+    int fd = open(nom, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) < 0 || pread(fd, entete, sizeof(entete), 0) != sizeof(entete) || memcmp(entete, TTY_CHUNKS_INDEX_MAGIC, 8) != 0) {
+        close(fd);
+        return -1;
+    }
+    uint64_t couvert = le64Get(entete + 8), nb = le64Get(entete + 16);
+    if (couvert < TTY_CHUNKS_HEADER_LEN || couvert > taille || (uint64_t)st.st_size != TTY_CHUNKS_INDEX_HEADER_LEN + nb * TTY_CHUNKS_INDEX_ENTRY_LEN) {
+        close(fd);
+        return -1;
+    }
+
+    const uint8_t* p = nb ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (p == MAP_FAILED) return -1;
+    for (uint64_t i=0; i<nb; i++) {
+        const uint8_t* e = p + TTY_CHUNKS_INDEX_HEADER_LEN + i * TTY_CHUNKS_INDEX_ENTRY_LEN;
+        struct morceau_s c = { { le64Get(e), le64Get(e + 8) }, le64Get(e + 16), le32Get(e + 24) };
+        if (c.len == 0 || c.offset > couvert || c.len > couvert - c.offset) break;
+        trancheAjoute(magasinTranche(m, c.h), &c);
+    }
+    if (nb) munmap((void*)p, st.st_size);
+    m->couvert = couvert;
+    return 0;
+}
+
+/* Sans index : relit le paquet, jusqu'au premier morceau abîmé */
+static void magasinParcourt(struct magasin_s* m, uint64_t taille) {
+    const uint8_t* p = mmap(NULL, taille, PROT_READ, MAP_PRIVATE, m->fd, 0);
+    uint64_t pos = TTY_CHUNKS_HEADER_LEN;
+
+    if (p == MAP_FAILED) {
+        perror("Erreur sur mmap() du paquet ");
+        exit(EXIT_FAILURE);
+    }
+    while (taille - pos >= TTY_CHUNKS_ENTRY_LEN) {
+        struct morceau_s c = { .len = le32Get(p + pos), .offset = pos + TTY_CHUNKS_ENTRY_LEN };
+        if (c.len == 0 || c.len > TTY_CHUNKS_LEN_MAX || c.len > taille - c.offset) break;
+        siphash128(m->cle, p + c.offset, c.len, c.h);
+        if (c.h[0] != le64Get(p + pos + 4) || c.h[1] != le64Get(p + pos + 12)) break;
+        trancheAjoute(magasinTranche(m, c.h), &c);
+        pos = c.offset + c.len;
+    }
+    munmap((void*)p, taille);
+    m->couvert = pos;
+}
+
+void magasinOuvre(struct magasin_s* m, const char* chemin) {
+    char nom[PATH_MAX];
+    struct stat st;
+    uint8_t entete[TTY_CHUNKS_HEADER_LEN];
+
+    memset(m, 0, sizeof(*m));
+    if (mkdir(chemin, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Impossible de créer le magasin %s : %s\n", chemin, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (realpath(chemin, m->chemin) == NULL) {
+        fprintf(stderr, "Impossible de lire le magasin %s : %s\n", chemin, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    int n = snprintf(nom, sizeof(nom), "%s/%s", m->chemin, TTY_CHUNKS_PACK);
+    if (n < 0 || (size_t)n >= sizeof(nom)) {
+        fprintf(stderr, "Nom trop long : %s\n", m->chemin);
+        exit(EXIT_FAILURE);
+    }
+    m->fd = open(nom, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (m->fd < 0) {
+        fprintf(stderr, "Impossible d'ouvrir %s : %s\n", nom, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (flock(m->fd, LOCK_EX | LOCK_NB) < 0) {
+        fprintf(stderr, "%s est pris par un autre archive, attente...\n", nom);
+        flock(m->fd, LOCK_EX);
+    }
+    for (int i=0; i<TABLE_TRANCHES; i++) {
+        pthread_mutex_init(&m->tranches[i].mutex, NULL);
+        m->tranches[i].capacity = TABLE_INITIALE;
+        m->tranches[i].e = calloc(TABLE_INITIALE, sizeof(struct morceau_s));
+        if (m->tranches[i].e == NULL) {
+            perror("Erreur sur calloc() ");
+            abort();
+        }
+    }
+
+    fstat(m->fd, &st);
+    if (st.st_size == 0) {
+        /* nouveau magasin : sa clé */
+        if (getrandom(m->cle, sizeof(m->cle), 0) != sizeof(m->cle)) {
+            perror("Erreur sur getrandom() ");
+            exit(EXIT_FAILURE);
+        }
+        ttyChunksHeaderEncode(entete, m->cle);
+        if (pwrite(m->fd, entete, sizeof(entete), 0) != sizeof(entete) || fdatasync(m->fd) < 0) {
+            fprintf(stderr, "Impossible d'écrire %s : %s\n", nom, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        m->couvert = sizeof(entete);
+    } else {
+        if (pread(m->fd, entete, sizeof(entete), 0) != sizeof(entete) || ttyChunksHeaderDecode(entete, sizeof(entete), m->cle) < 0) {
+            fprintf(stderr, "%s n'est pas un paquet de morceaux\n", nom);
+            exit(EXIT_FAILURE);
+        }
+        if (magasinChargeIndex(m, st.st_size) < 0) magasinParcourt(m, st.st_size);
+        /* au delà : morceaux d'un passage interrompu, qu'aucun fichier archivé ne référence */
+        if ((uint64_t)st.st_size > m->couvert && ftruncate(m->fd, m->couvert) < 0) {
+            fprintf(stderr, "Impossible de tronquer %s : %s\n", nom, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+    m->fin = m->couvert;
+}
+
+/* Offset des données de ce morceau dans le paquet ; vrai s'il vient d'y être ajouté */
+static bool magasinRange(struct magasin_s* m, const uint8_t* p, size_t len, uint64_t* offset) {
+    struct morceau_s c = { .len = len };
+    siphash128(m->cle, p, len, c.h);
+    struct tranche_s* t = magasinTranche(m, c.h);
+
+    pthread_mutex_lock(&t->mutex);
+    struct morceau_s* e = trancheCherche(t, c.h);
+    if (e->len != 0) {
+        *offset = e->offset;
+        pthread_mutex_unlock(&t->mutex);
+        return false;
+    }
+    uint64_t debut = __atomic_fetch_add(&m->fin, TTY_CHUNKS_ENTRY_LEN + len, __ATOMIC_RELAXED);
+    c.offset = debut + TTY_CHUNKS_ENTRY_LEN;
+    trancheAjoute(t, &c);
+    pthread_mutex_unlock(&t->mutex);
+
+    uint8_t entete[TTY_CHUNKS_ENTRY_LEN];
+    le32Put(entete, len);
+    le64Put(entete + 4, c.h[0]);
+    le64Put(entete + 12, c.h[1]);
+    struct iovec iov[2] = { { entete, sizeof(entete) }, { (void*)p, len } };
+    if (pwritev(m->fd, iov, 2, debut) != (ssize_t)(sizeof(entete) + len)) {
+        if (!__atomic_exchange_n(&m->erreur, true, __ATOMIC_RELAXED)) perror("Erreur sur pwritev() du paquet ");
+    }
+    *offset = c.offset;
+    return true;
+}
+
+/* Paquet synchronisé puis index réécrit ; -1 si le passage doit être abandonné */
+int magasinFerme(struct magasin_s* m) {
+    char nom[PATH_MAX], tmp[PATH_MAX];
+    uint64_t nb = 0;
+
+    if (m->erreur) return -1;
+    if (fdatasync(m->fd) < 0) {
+        perror("Erreur sur fdatasync() du paquet ");
+        return -1;
+    }
+    int n = snprintf(nom, sizeof(nom), "%s/%s", m->chemin, TTY_CHUNKS_INDEX);
+    int l = snprintf(tmp, sizeof(tmp), "%s%s", nom, ARCHIVE_SUFFIXE);
+    if (n < 0 || (size_t)n >= sizeof(nom) || l < 0 || (size_t)l >= sizeof(tmp)) {
+        fprintf(stderr, "Nom trop long : %s\n", m->chemin);
+        return -1;
+    }
+    FILE* f = fopen(tmp, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Impossible d'écrire %s : %s\n", tmp, strerror(errno));
+        return -1;
+    }
+    for (int i=0; i<TABLE_TRANCHES; i++) nb += m->tranches[i].nb;
+    uint8_t e[TTY_CHUNKS_INDEX_ENTRY_LEN] = { 0 };
+    memcpy(e, TTY_CHUNKS_INDEX_MAGIC, 8);
+    le64Put(e + 8, m->fin);
+    le64Put(e + 16, nb);
+    fwrite(e, TTY_CHUNKS_INDEX_HEADER_LEN, 1, f);
+    for (int i=0; i<TABLE_TRANCHES; i++) {
+        const struct tranche_s* t = &m->tranches[i];
+        for (size_t k=0; k<t->capacity; k++) {
+            if (t->e[k].len == 0) continue;
+            le64Put(e, t->e[k].h[0]);
+            le64Put(e + 8, t->e[k].h[1]);
+            le64Put(e + 16, t->e[k].offset);
+            le32Put(e + 24, t->e[k].len);
+            fwrite(e, sizeof(e), 1, f);
+        }
+    }
+    if (fflush(f) != 0 || fdatasync(fileno(f)) < 0 || fclose(f) != 0 || rename(tmp, nom) < 0) {
+        fprintf(stderr, "Impossible d'écrire %s : %s\n", nom, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+
+
+/******************************************************************************
+ * Archivage des fichiers, en parallèle
+ ******************************************************************************/
+
+struct bilan_s {
+    uint64_t fichiers;
+    uint64_t deja;            /* déjà archivés */
+    uint64_t recents;         /* modifiés depuis moins de ARCHIVE_REPOS */
+    uint64_t erreurs;
+    uint64_t lus;             /* octets des fichiers d'origine */
+    uint64_t ecrits;          /* octets des fichiers archivés */
+    uint64_t serveur;         /* données SERVER_TO_CLIENT */
+    uint64_t decoupes;        /* dont découpées en morceaux */
+    uint64_t morceaux;
+    uint64_t nouveaux;        /* morceaux ajoutés au magasin */
+    uint64_t octetsNouveaux;
+};
+
+struct archive_s {
+    struct magasin_s magasin;
+    const char* sortie;       /* NULL : fichiers remplacés sur place */
+    char**   noms;
+    size_t   nb;
+    char**   temporaires;     /* par fichier : réécriture à renommer, NULL sinon */
+    char**   destinations;
+    struct stat* origines;    /* état du fichier d'origine à sa lecture */
+    size_t   suivant;         /* prochain fichier à prendre ; atomique */
+};
+
+struct archiveThread_s {
+    struct archive_s* a;
+    struct ttyRecordWriter_s ecriture;
+    uint8_t* refs;
+    size_t   refsCapacity;
+    struct bilan_s bilan;
+};
+
+/* Réécrit un fichier dans son temporaire ; -1 en cas d'erreur */
+static int archiveRecords(struct archiveThread_s* t, struct ttyRecordMap_s* map, int fd) {
+    struct magasin_s* m = &t->a->magasin;
+    struct ttyRecordWriter_s* e = &t->ecriture;
+    struct ttyRecordCursor_s c;
+    struct ttyRecordView_s v;
+
+    ttyRecordWriterOpen(e, fd, TTY_RECORD_FLAG_CHUNKS, map->start);
+    ttyRecordWriterRecord(e, TTY_RECORD_CHUNK_STORE, map->start, m->chemin, strlen(m->chemin));
+
+    ttyRecordCursorInit(&c, map, false);
+    while (ttyRecordCursorNext(&c, &v)) {
+        /* nouvel index en fin de fichier */
+        if (v.type == TTY_RECORD_INDEX || v.type == TTY_RECORD_INDEX_TRAILER) continue;
+
+        if (v.type == TTY_RECORD_SERVER_TO_CLIENT) t->bilan.serveur += v.len;
+        if (v.type != TTY_RECORD_SERVER_TO_CLIENT || v.len < ARCHIVE_RECORD_MIN) {
+            ttyRecordWriterRecord(e, v.type, v.usec, v.data, v.len);
+            continue;
+        }
+
+        const uint8_t* p = (const uint8_t*)v.data;
+        t->refs = agrandit(t->refs, &t->refsCapacity, 10 + (v.len / CHUNK_MIN + 1) * 20);
+        size_t n = varintPut(t->refs, v.len);
+        for (size_t i=0; i<v.len; ) {
+            size_t l = decoupe(p + i, v.len - i);
+            uint64_t offset;
+            if (magasinRange(m, p + i, l, &offset)) {
+                t->bilan.nouveaux++;
+                t->bilan.octetsNouveaux += l;
+            }
+            n += ttyChunksRefEncode(t->refs + n, offset, l);
+            t->bilan.morceaux++;
+            i += l;
+        }
+        t->bilan.decoupes += v.len;
+        ttyRecordWriterRecord(e, TTY_RECORD_CHUNKED, v.usec, t->refs, n);
+    }
+    ttyRecordCursorClose(&c);
+    return ttyRecordWriterClose(e);
+}
+
+static void archiveFichier(struct archiveThread_s* t, size_t i) {
+    struct archive_s* a = t->a;
+    const char* nom = a->noms[i];
+    struct ttyRecordMap_s map;
+    char destination[PATH_MAX], tmp[PATH_MAX];
+
+    if (ttyRecordMapOpen(&map, nom) < 0) {
+        fprintf(stderr, "Impossible de lire %s : %s\n", nom, strerror(errno));
+        t->bilan.erreurs++;
+        return;
+    }
+    if (map.version >= 2 && (map.flags & TTY_RECORD_FLAG_CHUNKS)) {
+        t->bilan.deja++;
+        ttyRecordMapClose(&map);
+        return;
+    }
+    if (map.st.st_mtime > time(NULL) - ARCHIVE_REPOS) {
+        t->bilan.recents++;
+        ttyRecordMapClose(&map);
+        return;
+    }
+
+    const char* base = strrchr(nom, '/');
+    int n = a->sortie ? snprintf(destination, sizeof(destination), "%s/%s", a->sortie, base ? base + 1 : nom)
+                      : snprintf(destination, sizeof(destination), "%s", nom);
+    int l = snprintf(tmp, sizeof(tmp), "%s%s", destination, ARCHIVE_SUFFIXE);
+    if (n < 0 || (size_t)n >= sizeof(destination) || l < 0 || (size_t)l >= sizeof(tmp)) {
+        fprintf(stderr, "Nom trop long : %s\n", nom);
+        t->bilan.erreurs++;
+        ttyRecordMapClose(&map);
+        return;
+    }
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, map.st.st_mode & 07777);
+    if (fd < 0) {
+        fprintf(stderr, "Impossible d'écrire %s : %s\n", tmp, strerror(errno));
+        t->bilan.erreurs++;
+        ttyRecordMapClose(&map);
+        return;
+    }
+
+    int r = archiveRecords(t, &map, fd);
+    /* l'original garde sa date : les sessions restent triées de même */
+    struct timespec dates[2] = { map.st.st_atim, map.st.st_mtim };
+    if (r == 0) futimens(fd, dates);
+    close(fd);
+    if (r < 0) {
+        fprintf(stderr, "Impossible d'écrire %s : %s\n", tmp, strerror(errno));
+        unlink(tmp);
+        t->bilan.erreurs++;
+        ttyRecordMapClose(&map);
+        return;
+    }
+
+    t->bilan.fichiers++;
+    t->bilan.lus    += map.st.st_size;
+    t->bilan.ecrits += t->ecriture.written;
+    a->temporaires[i]  = strdup(tmp);
+    a->destinations[i] = strdup(destination);
+    a->origines[i]     = map.st;
+    ttyRecordMapClose(&map);
+}
+
+void* archiveThread(void* arg) {
+    struct archiveThread_s* t = arg;
+    size_t i;
+    while ((i = __atomic_fetch_add(&t->a->suivant, 1, __ATOMIC_RELAXED)) < t->a->nb) archiveFichier(t, i);
+    return NULL;
+}
+
+/* Les réécritures remplacent les originaux, sauf ceux qui ont changé depuis leur lecture */
+static uint64_t archiveRemplace(struct archive_s* a, bool abandon) {
+    uint64_t remplaces = 0;
+    for (size_t i=0; i<a->nb; i++) {
+        struct stat st;
+        if (a->temporaires[i] == NULL) continue;
+        if (!abandon && !a->sortie && (stat(a->noms[i], &st) < 0 || st.st_size != a->origines[i].st_size || st.st_mtim.tv_sec != a->origines[i].st_mtim.tv_sec || st.st_mtim.tv_nsec != a->origines[i].st_mtim.tv_nsec)) {
+            fprintf(stderr, "%s a changé pendant l'archivage, laissé tel quel\n", a->noms[i]);
+            unlink(a->temporaires[i]);
+        } else if (abandon) {
+            unlink(a->temporaires[i]);
+        } else if (rename(a->temporaires[i], a->destinations[i]) < 0) {
+            fprintf(stderr, "Impossible de renommer %s : %s\n", a->temporaires[i], strerror(errno));
+            unlink(a->temporaires[i]);
+        } else {
+            remplaces++;
+        }
+        free(a->temporaires[i]);
+        free(a->destinations[i]);
+    }
+    return remplaces;
+}
+
+
+
+/******************************************************************************
+ * Programme principal
+ ******************************************************************************/
+
+void usage(const char* nom) {
+    fprintf(stderr, "Usage : %s [--store <magasin>] [--output <répertoire>] [--jobs <n>] <fichiers, répertoires ou motifs>...\n", nom);
+    fprintf(stderr, "  --store    magasin de morceaux, partagé par tous les fichiers archivés (défaut : $%s)\n", TTY_CHUNKS_ENV);
+    fprintf(stderr, "  --output   écrit les fichiers archivés dans ce répertoire au lieu de remplacer les originaux\n");
+    fprintf(stderr, "  --jobs     threads (défaut : nombre de processeurs)\n");
+    exit(EXIT_FAILURE);
+}
+
+static double mo(uint64_t octets) {
+    return octets / (1024.0 * 1024.0);
+}
+
+int main(int argc, char* argv[]) {
+    const struct option options[] = {
+        { "store",  required_argument, NULL, 's' },
+        { "output", required_argument, NULL, 'o' },
+        { "jobs",   required_argument, NULL, 'j' },
+        { NULL, 0, NULL, 0 }
+    };
+    const char* magasin = getenv(TTY_CHUNKS_ENV);
+    int nbThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    struct archive_s a;
+    size_t capacity = 0;
+    int opt;
+
+    memset(&a, 0, sizeof(a));
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+            case 's': magasin = optarg; break;
+            case 'o': a.sortie = optarg; break;
+            case 'j': nbThreads = atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind == argc || magasin == NULL || magasin[0] == 0) usage(argv[0]);
+    if (a.sortie && mkdir(a.sortie, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Impossible de créer %s : %s\n", a.sortie, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    struct timespec debut, fin;
+    clock_gettime(CLOCK_MONOTONIC, &debut);
+    gearInit();
+    magasinOuvre(&a.magasin, magasin);
+
+    for (int k=optind; k<argc; k++) ttyRecordListeAjoute(&a.noms, &a.nb, &capacity, argv[k]);
+    a.nb = ttyRecordListeTrie(a.noms, a.nb);
+
+    if (nbThreads < 1) nbThreads = 1;
+    if ((size_t)nbThreads > a.nb && a.nb > 0) nbThreads = a.nb;
+    a.temporaires  = calloc(a.nb ? a.nb : 1, sizeof(char*));
+    a.destinations = calloc(a.nb ? a.nb : 1, sizeof(char*));
+    a.origines     = calloc(a.nb ? a.nb : 1, sizeof(struct stat));
+    struct archiveThread_s* threads = calloc(nbThreads, sizeof(*threads));
+    pthread_t* tids = calloc(nbThreads, sizeof(*tids));
+    if (a.temporaires == NULL || a.destinations == NULL || a.origines == NULL || threads == NULL || tids == NULL) {
+        perror("Erreur sur calloc() ");
+        abort();
+    }
+
+    for (int k=0; k<nbThreads; k++) {
+        threads[k].a = &a;
+        if (pthread_create(&tids[k], NULL, archiveThread, &threads[k]) != 0) {
+            perror("Erreur sur pthread_create() ");
+            abort();
+        }
+    }
+    struct bilan_s b = { 0 };
+    for (int k=0; k<nbThreads; k++) {
+        pthread_join(tids[k], NULL);
+        struct bilan_s* t = &threads[k].bilan;
+        b.fichiers += t->fichiers;   b.deja += t->deja;         b.recents += t->recents;
+        b.erreurs += t->erreurs;     b.lus += t->lus;           b.ecrits += t->ecrits;
+        b.serveur += t->serveur;     b.decoupes += t->decoupes; b.morceaux += t->morceaux;
+        b.nouveaux += t->nouveaux;   b.octetsNouveaux += t->octetsNouveaux;
+        ttyRecordWriterFree(&threads[k].ecriture);
+        free(threads[k].refs);
+    }
+
+    /* rien n'est remplacé tant que les morceaux ne sont pas sur disque et indexés */
+    bool abandon = magasinFerme(&a.magasin) < 0;
+    uint64_t remplaces = archiveRemplace(&a, abandon);
+    clock_gettime(CLOCK_MONOTONIC, &fin);
+    double duree = (fin.tv_sec - debut.tv_sec) + (fin.tv_nsec - debut.tv_nsec) / 1e9;
+
+    printf("%llu fichiers archivés (%llu déjà archivés, %llu trop récents, %llu erreurs) : %.1f Mo lus en %.2f s, %.2f Go/s\n",
+           (unsigned long long)remplaces, (unsigned long long)b.deja, (unsigned long long)b.recents, (unsigned long long)b.erreurs,
+           mo(b.lus), duree, duree > 0 ? b.lus / duree / 1e9 : 0.0);
+    printf("sortie du serveur : %.1f Mo, dont %.1f Mo en %llu morceaux, %llu nouveaux (%.1f Mo ajoutés au magasin)\n",
+           mo(b.serveur), mo(b.decoupes), (unsigned long long)b.morceaux, (unsigned long long)b.nouveaux, mo(b.octetsNouveaux));
+    if (b.octetsNouveaux) printf("déduplication : %.2fx", (double)b.decoupes / b.octetsNouveaux);
+    else printf("déduplication : %s", b.decoupes ? "tout était déjà au magasin" : "-");
+    printf(" ; fichiers archivés %.1f Mo, avec les nouveaux morceaux %.1f%% de l'original\n", mo(b.ecrits),
+           b.lus ? 100.0 * (b.ecrits + b.octetsNouveaux + b.nouveaux * TTY_CHUNKS_ENTRY_LEN) / b.lus : 0.0);
+    if (abandon) fprintf(stderr, "Magasin non écrit : originaux laissés\n");
+    return abandon || b.erreurs ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,586 @@
+/******************************************************************************
+ * Rapprochement des enregistrements tty et du journal d'audit du noyau
+ * Bertrand sept 2024
+ *
+ * auditMerge [--log <audit.log>] [--index <fichier>] [--output <répertoire>] <fichiers, répertoires ou motifs>...
+ *
+ * honeypotSsh note dans son record START la session d'audit du process qui
+ * l'a lancé (auditSession, lue dans /proc/<pid>/sessionid) : toutes les
+ * commandes lancées dans la session, même par un script ou en tâche de fond,
+ * portent ce ses= dans audit.log. auditMerge insère les événements SYSCALL de
+ * cette session dans l'enregistrement, à leur place dans la chronologie, en
+ * records TTY_RECORD_AUDIT_EXECVE (une commande lancée) ou
+ * TTY_RECORD_AUDIT_SYSCALL (les autres appels audités). replay les affiche.
+ * Format des événements : voir ttyAudit.h.
+ *
+ * Index : audit.log fait vite plusieurs Go, et le relire pour chacun des
+ * milliers d'enregistrements n'est pas envisageable. Un seul passage sur le
+ * journal projeté en mémoire range chaque événement dans un index trié par
+ * (session, date) : position et longueur de ses lignes dans le journal. Les
+ * enregistrements n'y font ensuite qu'une recherche dichotomique, et ne
+ * relisent que les lignes de leurs événements. L'index note le fichier
+ * (périphérique, inode) et jusqu'où il l'a lu : le passage suivant ne lit que
+ * la suite, et un journal remplacé par la rotation d'auditd est réindexé.
+ *
+ * Les lignes d'un événement ne se suivent pas toujours : auditd en entrelace
+ * plusieurs. Les événements ouverts sont suivis par leur numéro de série
+ * jusqu'à leur ligne EOE ; ceux restés ouverts en fin de journal sont relus
+ * au passage suivant.
+ *
+ * Un enregistrement est réécrit (en v2 compressé) à côté puis renommé, les
+ * événements d'un passage précédent remplacés : relancer auditMerge ne
+ * duplique rien. Les fichiers archivés (voir archive.c) et ceux modifiés
+ * depuis moins de AUDIT_REPOS secondes sont laissés : passer auditMerge avant
+ * archive.
+ ******************************************************************************/
+
+
+/* sys */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <getopt.h>
+#include <time.h>
+
+/* libc */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include "ttyRecordReader.h"
+#include "ttyRecordWriter.h"
+#include "ttyAudit.h"
+
+
+#define AUDIT_LOG_DEFAUT     "/var/log/audit/audit.log"
+#define AUDIT_INDEX_DEFAUT   "/tmp/honeypotAudit.idx"
+#define AUDIT_INDEX_MAGIC    "HPAUDIDX"
+#define AUDIT_INDEX_HEADER   48          /* magic, périphérique, inode, octets couverts, nombre d'entrées, réservé */
+#define AUDIT_INDEX_ENTREE   32          /* session, longueur, date, position, série */
+
+#define AUDIT_OUVERTS        1024        /* événements suivis à la fois, par numéro de série modulo */
+#define AUDIT_OUVERT_RECENT  (1 << 20)   /* un événement sans EOE plus loin que ça de la fin est considéré complet */
+#define AUDIT_EVENEMENT_MAX  (1 << 20)   /* étendue maximale des lignes d'un événement dans le journal */
+#define AUDIT_MARGE          1000000     /* µs avant et après la session où ses événements sont pris */
+#define AUDIT_REPOS          600         /* s sans modification avant de compléter un fichier */
+#define AUDIT_SUFFIXE        ".audit-tmp"
+
+
+
+/******************************************************************************
+ * Index du journal
+ ******************************************************************************/
+
+struct evenement_s {
+    uint32_t ses;
+    uint32_t len;         /* des lignes de l'événement, depuis offset */
+    int64_t  usec;
+    uint64_t offset;      /* ligne SYSCALL dans le journal */
+    uint64_t serie;
+};
+
+struct index_s {
+    struct evenement_s* e;
+    size_t   nb;
+    size_t   capacity;
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t couvert;     /* octets du journal déjà indexés */
+};
+
+struct ouvert_s {
+    uint64_t serie;
+    size_t   entree;
+    bool     actif;
+};
+
+static void indexAjoute(struct index_s* x, const struct evenement_s* e) {
+    if (x->nb == x->capacity) {
+        size_t taille = x->capacity * sizeof(*x->e);
+        x->e = agrandit(x->e, &taille, (x->capacity ? 2 * x->capacity : 4096) * sizeof(*x->e));
+        x->capacity = taille / sizeof(*x->e);
+    }
+    x->e[x->nb++] = *e;
+}
+
+static int evenementCompare(const void* a, const void* b) {
+    const struct evenement_s* x = a;
+    const struct evenement_s* y = b;
+    if (x->ses != y->ses) return x->ses < y->ses ? -1 : 1;
+    if (x->usec != y->usec) return x->usec < y->usec ? -1 : 1;
+    return x->serie < y->serie ? -1 : x->serie > y->serie;
+}
+
+/* Index existant, s'il décrit bien ce journal ; sinon x reste vide et tout sera relu */
+static void indexCharge(struct index_s* x, const char* chemin, const struct stat* journal) {
+    uint8_t h[AUDIT_INDEX_HEADER];
+    int fd = open(chemin, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+
+    if (read(fd, h, sizeof(h)) != sizeof(h) || memcmp(h, AUDIT_INDEX_MAGIC, 8) != 0 ||
+        le64Get(h + 8) != (uint64_t)journal->st_dev || le64Get(h + 16) != (uint64_t)journal->st_ino ||
+        le64Get(h + 24) > (uint64_t)journal->st_size) {
+        close(fd);
+        return;
+    }
+    uint64_t nb = le64Get(h + 32);
+    size_t len = nb * AUDIT_INDEX_ENTREE;
+    uint8_t* p = malloc(len ? len : 1);
+    if (p == NULL || pread(fd, p, len, sizeof(h)) != (ssize_t)len) {
+        free(p);
+        close(fd);
+        return;
+    }
+    close(fd);
+
+    x->e = malloc((nb ? nb : 1) * sizeof(*x->e));
+    if (x->e == NULL) {
+        perror("Erreur sur malloc() ");
+        abort();
+    }
+    for (size_t i=0; i<nb; i++) {
+        const uint8_t* q = p + i * AUDIT_INDEX_ENTREE;
+        x->e[i].ses    = le32Get(q);
+        x->e[i].len    = le32Get(q + 4);
+        x->e[i].usec   = (int64_t)le64Get(q + 8);
+        x->e[i].offset = le64Get(q + 16);
+        x->e[i].serie  = le64Get(q + 24);
+    }
+    free(p);
+    x->nb = x->capacity = nb;
+    x->couvert = le64Get(h + 24);
+}
+
+/* Ecrit à côté puis renomme : un autre auditMerge lit l'ancien ou le nouveau, jamais un index à moitié écrit */
+static int indexEcrit(const struct index_s* x, const char* chemin) {
+    char tmp[PATH_MAX];
+    uint8_t h[AUDIT_INDEX_HEADER];
+    snprintf(tmp, sizeof(tmp), "%s.%d", chemin, (int)getpid());
+    FILE* f = fopen(tmp, "we");
+    if (f == NULL) return -1;
+
+    memset(h, 0, sizeof(h));
+    memcpy(h, AUDIT_INDEX_MAGIC, 8);
+    le64Put(h + 8,  x->dev);
+    le64Put(h + 16, x->ino);
+    le64Put(h + 24, x->couvert);
+    le64Put(h + 32, x->nb);
+    fwrite(h, 1, sizeof(h), f);
+    for (size_t i=0; i<x->nb; i++) {
+        uint8_t q[AUDIT_INDEX_ENTREE];
+        le32Put(q,      x->e[i].ses);
+        le32Put(q + 4,  x->e[i].len);
+        le64Put(q + 8,  (uint64_t)x->e[i].usec);
+        le64Put(q + 16, x->e[i].offset);
+        le64Put(q + 24, x->e[i].serie);
+        fwrite(q, 1, sizeof(q), f);
+    }
+    if (fflush(f) != 0 || ferror(f)) {
+        fclose(f);
+        unlink(tmp);
+        return -1;
+    }
+    fclose(f);
+    if (rename(tmp, chemin) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/* Session d'audit d'une ligne SYSCALL ; false si elle n'en a pas (démons, ses=unset) */
+static bool sessionAudit(const struct ttyAuditLigne_s* l, uint32_t* ses) {
+    size_t len;
+    const char* v = ttyAuditChamp(l->champs, l->champsLen, "ses", &len);
+    if (v == NULL || len == 0 || len > 10) return false;
+    uint64_t n = 0;
+    for (size_t i=0; i<len; i++) {
+        if (v[i] < '0' || v[i] > '9') return false;
+        n = n * 10 + (v[i] - '0');
+    }
+    if (n >= 4294967295ULL) return false;   /* TTY_AUDIT_SES_INCONNUE */
+    *ses = (uint32_t)n;
+    return true;
+}
+
+/*
+ Lit le journal de x->couvert à sa fin, en un passage, et ajoute ses
+ événements à l'index. Retourne le nombre d'événements ajoutés.
+ */
+static size_t indexParcourt(struct index_s* x, const uint8_t* journal, uint64_t taille) {
+    static struct ouvert_s ouverts[AUDIT_OUVERTS];
+    size_t premier = x->nb;     /* les nouvelles entrées suivent, dans l'ordre du journal */
+    uint64_t pos = x->couvert;
+
+    memset(ouverts, 0, sizeof(ouverts));
+    while (pos < taille) {
+        const uint8_t* p = journal + pos;
+        const uint8_t* nl = memchr(p, '\n', taille - pos);
+        if (nl == NULL) break;   /* ligne en cours d'écriture par auditd */
+        uint64_t fin = pos + (nl - p) + 1;
+        struct ttyAuditLigne_s l;
+
+        if (ttyAuditLigne((const char*)p, nl - p, &l) == 0) {
+            struct ouvert_s* o = &ouverts[l.serie % AUDIT_OUVERTS];
+            uint32_t ses;
+            if (ttyAuditType(&l, "SYSCALL")) {
+                /* un événement plus ancien sur la même case est complet, ou ne le sera plus */
+                o->actif = false;
+                if (sessionAudit(&l, &ses)) {
+                    struct evenement_s e = { ses, (uint32_t)(fin - pos), l.usec, pos, l.serie };
+                    indexAjoute(x, &e);
+                    o->serie  = l.serie;
+                    o->entree = x->nb - 1;
+                    o->actif  = true;
+                }
+            } else if (o->actif && o->serie == l.serie) {
+                if (ttyAuditType(&l, "EOE")) o->actif = false;
+                else if (fin - x->e[o->entree].offset <= AUDIT_EVENEMENT_MAX) x->e[o->entree].len = fin - x->e[o->entree].offset;
+            }
+        }
+        pos = fin;
+    }
+
+    /* les événements encore ouverts près de la fin, et ce qui les suit, seront relus */
+    uint64_t couvert = pos;
+    for (size_t k=0; k<AUDIT_OUVERTS; k++) {
+        if (!ouverts[k].actif) continue;
+        uint64_t o = x->e[ouverts[k].entree].offset;
+        if (o + AUDIT_OUVERT_RECENT >= pos && o < couvert) couvert = o;
+    }
+    while (x->nb > premier && x->e[x->nb-1].offset >= couvert) x->nb--;
+    x->couvert = couvert;
+
+    /* les nouvelles entrées triées, puis fusionnées avec les anciennes */
+    size_t ajoutes = x->nb - premier;
+    qsort(x->e + premier, ajoutes, sizeof(*x->e), evenementCompare);
+    if (premier > 0 && ajoutes > 0) {
+        struct evenement_s* fusion = malloc(x->nb * sizeof(*fusion));
+        if (fusion == NULL) {
+            perror("Erreur sur malloc() ");
+            abort();
+        }
+        size_t i = 0, j = premier, n = 0;
+        while (i < premier && j < x->nb) fusion[n++] = evenementCompare(&x->e[i], &x->e[j]) <= 0 ? x->e[i++] : x->e[j++];
+        while (i < premier) fusion[n++] = x->e[i++];
+        while (j < x->nb)   fusion[n++] = x->e[j++];
+        free(x->e);
+        x->e = fusion;
+        x->capacity = x->nb;
+    }
+    return ajoutes;
+}
+
+/* Premier événement de la session ses à partir de usec */
+static size_t indexCherche(const struct index_s* x, uint32_t ses, int64_t usec) {
+    size_t a = 0, b = x->nb;
+    while (a < b) {
+        size_t m = a + (b - a) / 2;
+        if (x->e[m].ses < ses || (x->e[m].ses == ses && x->e[m].usec < usec)) a = m + 1;
+        else b = m;
+    }
+    return a;
+}
+
+
+
+/******************************************************************************
+ * Enregistrements
+ ******************************************************************************/
+
+struct bilan_s {
+    uint64_t fichiers;        /* complétés */
+    uint64_t evenements;      /* insérés */
+    uint64_t aJour;
+    uint64_t sansSession;
+    uint64_t archives;
+    uint64_t recents;
+    uint64_t erreurs;
+};
+
+struct merge_s {
+    struct index_s index;
+    const uint8_t* journal;
+    uint64_t taille;
+    const char* sortie;       /* répertoire, NULL : remplace les originaux */
+    struct ttyRecordWriter_s ecriture;
+    uint8_t* lignes;          /* record en construction */
+    size_t   lignesCapacity;
+    struct bilan_s bilan;
+};
+
+/* Session d'audit notée par honeypotSsh dans le record START ; false s'il n'y en a pas */
+static bool sessionStart(const struct ttyRecordView_s* v, uint32_t* ses) {
+    static const char cle[] = "auditSession: ";
+    const char* p = v->data;
+    const char* fin = p + v->len;
+
+    while (p < fin) {
+        const char* nl = memchr(p, '\n', fin - p);
+        if (nl == NULL) nl = fin;
+        if ((size_t)(nl - p) > sizeof(cle) - 1 && memcmp(p, cle, sizeof(cle) - 1) == 0) {
+            char nombre[16];
+            size_t n = nl - p - (sizeof(cle) - 1);
+            if (n >= sizeof(nombre)) return false;
+            memcpy(nombre, p + sizeof(cle) - 1, n);
+            nombre[n] = 0;
+            char* e;
+            unsigned long s = strtoul(nombre, &e, 10);
+            if (*e != 0 || s >= 4294967295UL) return false;
+            *ses = (uint32_t)s;
+            return true;
+        }
+        p = nl + 1;
+    }
+    return false;
+}
+
+/* Lignes de l'événement e dans le journal : celles de sa série, sans EOE ; retourne le type de record */
+static int evenementLignes(struct merge_s* m, const struct evenement_s* e, size_t* len) {
+    const char* p = (const char*)m->journal + e->offset;
+    const char* fin = p + e->len;
+    int type = TTY_RECORD_AUDIT_SYSCALL;
+
+    *len = 0;
+    m->lignes = agrandit(m->lignes, &m->lignesCapacity, e->len);
+    while (p < fin) {
+        const char* nl = memchr(p, '\n', fin - p);
+        if (nl == NULL) nl = fin;
+        struct ttyAuditLigne_s l;
+        if (ttyAuditLigne(p, nl - p, &l) == 0 && l.serie == e->serie && !ttyAuditType(&l, "EOE")) {
+            if (ttyAuditType(&l, "EXECVE")) type = TTY_RECORD_AUDIT_EXECVE;
+            if (*len > 0) m->lignes[(*len)++] = '\n';
+            memcpy(m->lignes + *len, p, nl - p);
+            *len += nl - p;
+        }
+        p = nl + 1;
+    }
+    return type;
+}
+
+static void evenementEcrit(struct merge_s* m, const struct evenement_s* e, int64_t* dernier) {
+    size_t len;
+    int type = evenementLignes(m, e, &len);
+    /* l'audit est à la milliseconde : pas de retour en arrière dans la chronologie */
+    int64_t usec = e->usec > *dernier ? e->usec : *dernier;
+    ttyRecordWriterRecord(&m->ecriture, type, usec, m->lignes, len);
+    *dernier = usec;
+}
+
+/* Réécrit l'enregistrement avec les événements [debut, fin) de l'index ; -1 en cas d'erreur */
+static int mergeRecords(struct merge_s* m, struct ttyRecordMap_s* map, int fd, size_t debut, size_t fin) {
+    struct ttyRecordCursor_s c;
+    struct ttyRecordView_s v;
+    int64_t dernier = map->start;
+    size_t k = debut;
+
+    ttyRecordWriterOpen(&m->ecriture, fd, 0, map->start);
+    ttyRecordCursorInit(&c, map, false);
+    while (ttyRecordCursorNext(&c, &v)) {
+        /* nouvel index en fin de fichier, événements d'un passage précédent remplacés */
+        if (v.type == TTY_RECORD_INDEX || v.type == TTY_RECORD_INDEX_TRAILER) continue;
+        if (v.type == TTY_RECORD_AUDIT_EXECVE || v.type == TTY_RECORD_AUDIT_SYSCALL) continue;
+
+        /* START reste le premier record */
+        if (v.type != TTY_RECORD_START) {
+            while (k < fin && m->index.e[k].usec <= v.usec) evenementEcrit(m, &m->index.e[k++], &dernier);
+        }
+        ttyRecordWriterRecord(&m->ecriture, v.type, v.usec, v.data, v.len);
+        if (v.usec > dernier) dernier = v.usec;
+    }
+    ttyRecordCursorClose(&c);
+    while (k < fin) evenementEcrit(m, &m->index.e[k++], &dernier);
+    return ttyRecordWriterClose(&m->ecriture);
+}
+
+static void mergeFichier(struct merge_s* m, const char* nom) {
+    struct ttyRecordMap_s map;
+    struct ttyRecordCursor_s c;
+    struct ttyRecordView_s v;
+    char destination[PATH_MAX], tmp[PATH_MAX];
+
+    if (ttyRecordMapOpen(&map, nom) < 0) {
+        fprintf(stderr, "Impossible de lire %s : %s\n", nom, strerror(errno));
+        m->bilan.erreurs++;
+        return;
+    }
+    if (map.version >= 2 && (map.flags & TTY_RECORD_FLAG_CHUNKS)) {
+        m->bilan.archives++;
+        ttyRecordMapClose(&map);
+        return;
+    }
+    if (map.st.st_mtime > time(NULL) - AUDIT_REPOS) {
+        m->bilan.recents++;
+        ttyRecordMapClose(&map);
+        return;
+    }
+
+    /* premier passage : session d'audit, fin de session, événements déjà insérés */
+    uint32_t ses = 0;
+    bool aSession = false;
+    int64_t derniere = map.start;
+    size_t deja = 0;
+    ttyRecordCursorInit(&c, &map, false);
+    while (ttyRecordCursorNext(&c, &v)) {
+        if (v.type == TTY_RECORD_START && !aSession) aSession = sessionStart(&v, &ses);
+        else if (v.type == TTY_RECORD_AUDIT_EXECVE || v.type == TTY_RECORD_AUDIT_SYSCALL) deja++;
+        else if (v.type != TTY_RECORD_INDEX && v.type != TTY_RECORD_INDEX_TRAILER && v.usec > derniere) derniere = v.usec;
+    }
+    ttyRecordCursorClose(&c);
+    if (!aSession) {
+        m->bilan.sansSession++;
+        ttyRecordMapClose(&map);
+        return;
+    }
+
+    /* les numéros de session repartent de 1 à chaque démarrage : la date départage */
+    size_t debut = indexCherche(&m->index, ses, map.start - AUDIT_MARGE);
+    size_t fin = debut;
+    while (fin < m->index.nb && m->index.e[fin].ses == ses && m->index.e[fin].usec <= derniere + AUDIT_MARGE) fin++;
+    /* moins d'événements que déjà insérés : journal remplacé par la rotation, on garde ceux du fichier */
+    if (fin - debut <= deja) {
+        m->bilan.aJour++;
+        ttyRecordMapClose(&map);
+        return;
+    }
+
+    const char* base = strrchr(nom, '/');
+    int n = m->sortie ? snprintf(destination, sizeof(destination), "%s/%s", m->sortie, base ? base + 1 : nom)
+                      : snprintf(destination, sizeof(destination), "%s", nom);
+    int l = snprintf(tmp, sizeof(tmp), "%s%s", destination, AUDIT_SUFFIXE);
+    if (n < 0 || (size_t)n >= sizeof(destination) || l < 0 || (size_t)l >= sizeof(tmp)) {
+        fprintf(stderr, "Nom trop long : %s\n", nom);
+        m->bilan.erreurs++;
+        ttyRecordMapClose(&map);
+        return;
+    }
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, map.st.st_mode & 07777);
+    if (fd < 0) {
+        fprintf(stderr, "Impossible d'écrire %s : %s\n", tmp, strerror(errno));
+        m->bilan.erreurs++;
+        ttyRecordMapClose(&map);
+        return;
+    }
+
+    int r = mergeRecords(m, &map, fd, debut, fin);
+    /* l'original garde sa date : les sessions restent triées de même */
+    struct timespec dates[2] = { map.st.st_atim, map.st.st_mtim };
+    if (r == 0) futimens(fd, dates);
+    close(fd);
+
+    /* pas d'écrasement d'un fichier qui a changé depuis sa lecture */
+    struct stat st;
+    if (r == 0 && !m->sortie && (stat(nom, &st) < 0 || st.st_size != map.st.st_size || st.st_mtim.tv_sec != map.st.st_mtim.tv_sec || st.st_mtim.tv_nsec != map.st.st_mtim.tv_nsec)) {
+        fprintf(stderr, "%s a changé pendant la lecture, laissé tel quel\n", nom);
+        unlink(tmp);
+        m->bilan.erreurs++;
+    } else if (r < 0 || rename(tmp, destination) < 0) {
+        fprintf(stderr, "Impossible d'écrire %s : %s\n", r < 0 ? tmp : destination, strerror(errno));
+        unlink(tmp);
+        m->bilan.erreurs++;
+    } else {
+        m->bilan.fichiers++;
+        m->bilan.evenements += fin - debut;
+    }
+    ttyRecordMapClose(&map);
+}
+
+
+
+/******************************************************************************
+ * Programme principal
+ ******************************************************************************/
+
+void usage(const char* nom) {
+    fprintf(stderr, "Usage : %s [--log <audit.log>] [--index <fichier>] [--output <répertoire>] <fichiers, répertoires ou motifs>...\n", nom);
+    fprintf(stderr, "  --log      journal d'auditd (défaut : %s)\n", AUDIT_LOG_DEFAUT);
+    fprintf(stderr, "  --index    index du journal par session, mis à jour à chaque passage (défaut : %s)\n", AUDIT_INDEX_DEFAUT);
+    fprintf(stderr, "  --output   écrit les fichiers complétés dans ce répertoire au lieu de remplacer les originaux\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[]) {
+    const struct option options[] = {
+        { "log",    required_argument, NULL, 'l' },
+        { "index",  required_argument, NULL, 'i' },
+        { "output", required_argument, NULL, 'o' },
+        { NULL, 0, NULL, 0 }
+    };
+    const char* log = AUDIT_LOG_DEFAUT;
+    const char* cheminIndex = AUDIT_INDEX_DEFAUT;
+    struct merge_s m;
+    int opt;
+
+    memset(&m, 0, sizeof(m));
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+            case 'l': log = optarg; break;
+            case 'i': cheminIndex = optarg; break;
+            case 'o': m.sortie = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind == argc) usage(argv[0]);
+    if (m.sortie && mkdir(m.sortie, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Impossible de créer %s : %s\n", m.sortie, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    /* le journal projeté en entier : lu une fois en séquence, puis par morceaux pour chaque session */
+    struct stat st;
+    int fd = open(log, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "Impossible de lire %s : %s\n", log, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    m.taille = st.st_size;
+    if (m.taille > 0) {
+        void* p = mmap(NULL, m.taille, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            fprintf(stderr, "Impossible de lire %s : %s\n", log, strerror(errno));
+            return EXIT_FAILURE;
+        }
+        m.journal = p;
+    }
+    close(fd);
+
+    struct timespec debut, fin;
+    clock_gettime(CLOCK_MONOTONIC, &debut);
+    indexCharge(&m.index, cheminIndex, &st);
+    m.index.dev = st.st_dev;
+    m.index.ino = st.st_ino;
+    uint64_t depuis = m.index.couvert;
+    if (m.taille > depuis) madvise((void*)(m.journal + (depuis & ~(uint64_t)4095)), m.taille - (depuis & ~(uint64_t)4095), MADV_SEQUENTIAL);
+    size_t ajoutes = indexParcourt(&m.index, m.journal, m.taille);
+    if ((ajoutes > 0 || m.index.couvert != depuis) && indexEcrit(&m.index, cheminIndex) < 0) fprintf(stderr, "Impossible d'écrire %s : %s\n", cheminIndex, strerror(errno));
+    clock_gettime(CLOCK_MONOTONIC, &fin);
+    double duree = (fin.tv_sec - debut.tv_sec) + (fin.tv_nsec - debut.tv_nsec) / 1e9;
+    uint64_t lus = m.taille > depuis ? m.taille - depuis : 0;
+    printf("journal : %.1f Mo lus en %.2f s, %.2f Go/s, %zu événements ajoutés à l'index (%zu en tout)\n",
+           lus / (1024.0 * 1024.0), duree, duree > 0 ? lus / duree / 1e9 : 0.0, ajoutes, m.index.nb);
+    if (m.taille > 0) madvise((void*)m.journal, m.taille, MADV_RANDOM);
+
+    char** noms = NULL;
+    size_t nb = 0, capacity = 0;
+    for (int k=optind; k<argc; k++) ttyRecordListeAjoute(&noms, &nb, &capacity, argv[k]);
+    nb = ttyRecordListeTrie(noms, nb);
+    for (size_t k=0; k<nb; k++) mergeFichier(&m, noms[k]);
+    for (size_t k=0; k<nb; k++) free(noms[k]);
+    free(noms);
+
+    struct bilan_s* b = &m.bilan;
+    printf("%llu fichiers complétés, %llu événements insérés (%llu déjà à jour, %llu sans session d'audit, %llu archivés, %llu trop récents, %llu erreurs)\n",
+           (unsigned long long)b->fichiers, (unsigned long long)b->evenements, (unsigned long long)b->aJour, (unsigned long long)b->sansSession,
+           (unsigned long long)b->archives, (unsigned long long)b->recents, (unsigned long long)b->erreurs);
+    ttyRecordWriterFree(&m.ecriture);
+    free(m.lignes);
+    free(m.index.e);
+    return b->erreurs ? EXIT_FAILURE : EXIT_SUCCESS;
+}
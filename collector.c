@@ -0,0 +1,743 @@
+/******************************************************************************
+ * Collecteur local des enregistrements
+ * Bertrand sept 2024
+ *
+ * Chaque honeypotSsh lancé avec HONEYPOT_COLLECTOR envoie son enregistrement
+ * sur une socket unix SOCK_SEQPACKET au lieu d'ouvrir son propre fichier. Le
+ * collecteur reçoit toutes les sessions dans une seule boucle epoll et les
+ * range dans de gros segments en ajout seul : ce qui arrive des différentes
+ * sessions est accumulé en mémoire, puis écrit en un seul writev() suivi d'un
+ * seul fdatasync() (vidage groupé), quand assez d'octets attendent ou que le
+ * plus ancien attend depuis --batch-ms. Un index donne pour chaque session ses
+ * morceaux dans l'ordre, un journal texte les ouvertures et fermetures.
+ * Format : voir ttyCollector.h.
+ *
+ * Si le collecteur ne répond pas, honeypotSsh enregistre en local comme avant ;
+ * s'il disparaît en cours de session, la suite part dans un fichier local.
+ *
+ * collector --list      les sessions du répertoire
+ * collector --extract   restitue l'enregistrement d'une session sur la sortie
+ *                       standard, octet pour octet le fichier qu'aurait écrit
+ *                       honeypotSsh : collector --extract <session> | replay -
+ ******************************************************************************/
+
+
+/* sys */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <limits.h>
+#include <dirent.h>
+#include <signal.h>
+
+
+/* libc */
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+
+/* local */
+#include "ttyRecord.h"
+#include "ttyCollector.h"
+
+
+
+/******************************************************************************
+ * Configuration locale
+ ******************************************************************************/
+#define REPERTOIRE_DEFAUT  "/tmp/honeypotCollector"
+#define SEGMENT_BYTES      (256 << 20)  /* un segment plein, le suivant est ouvert */
+#define BATCH_BYTES        (1 << 20)    /* vidage dès que ce volume attend, toutes sessions confondues */
+#define BATCH_MS           100          /* délai max avant vidage de ce qui attend */
+#define MESSAGES_PAR_TOUR  16           /* messages lus d'une session avant de passer aux autres */
+
+
+
+/******************************************************************************
+ * Etat
+ ******************************************************************************/
+struct session_s {
+    int       fd;                 /* -1 une fois la connexion fermée */
+    uint64_t  id;                 /* 0 tant que le message d'ouverture n'est pas reçu */
+    uint64_t  octets;             /* reçus depuis l'ouverture */
+    uint8_t   ouverture[TTY_COLLECTOR_HELLO_LEN + TTY_COLLECTOR_NAME_MAX];
+    size_t    lenOuverture;       /* message d'ouverture pas encore écrit, 0 une fois écrit */
+    struct ttyCollectorHello_s hello;
+    bool      fermee;             /* fin reçue, morceau de fermeture pas encore écrit */
+    uint8_t*  attente;            /* reçu, pas encore écrit */
+    size_t    used;
+    size_t    capacity;
+    struct session_s* suivante;
+};
+
+struct collecteur_s {
+    const char* repertoire;
+    size_t    segmentBytes;
+    size_t    batchBytes;
+    long      batchMs;
+    bool      sync;
+
+    int       segmentFd;
+    uint32_t  segment;
+    uint64_t  segmentLen;
+    int       indexFd;
+    int       sessionsFd;
+    uint64_t  prochainId;
+
+    struct session_s* sessions;
+    size_t    attente;            /* octets en attente, toutes sessions */
+    bool      evenement;          /* ouverture ou fermeture en attente */
+    uint64_t  attenteDepuisUs;    /* arrivée du plus ancien en attente */
+
+    /* compteurs affichés à l'arrêt */
+    uint64_t  nbSessions;
+    uint64_t  recus;
+    uint64_t  vidages;
+    uint64_t  vidageMaxUs;
+};
+
+static inline uint64_t maintenantUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* write() jusqu'au bout, en reprenant après une écriture partielle ou EINTR */
+int ecritComplet(int fd, const void* data, size_t len) {
+    const char* p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int ecritvComplet(int fd, struct iovec* iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+void* agrandit(void* p, size_t* capacity, size_t besoin, size_t taille) {
+    if (besoin <= *capacity) return p;
+    size_t c = *capacity ? *capacity : 16;
+    while (c < besoin) c *= 2;
+    p = realloc(p, c * taille);
+    if (p == NULL) {
+        perror("Erreur sur realloc() ");
+        abort();
+    }
+    *capacity = c;
+    return p;
+}
+
+int ouvreDans(const char* repertoire, const char* nom, int flags) {
+    char chemin[PATH_MAX];
+    snprintf(chemin, sizeof(chemin), "%s/%s", repertoire, nom);
+    return open(chemin, flags | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP);
+}
+
+
+
+/******************************************************************************
+ * Segments
+ ******************************************************************************/
+
+/* Numéro du dernier segment existant, 0 s'il n'y en a pas */
+uint32_t segmentDernier(const char* repertoire) {
+    uint32_t dernier = 0;
+    DIR* d = opendir(repertoire);
+    if (d == NULL) return 0;
+    struct dirent* e;
+    while ((e = readdir(d)) != NULL) {
+        unsigned n;
+        char fin;
+        if (sscanf(e->d_name, "seg-%u%c", &n, &fin) == 1 && n > dernier) dernier = n;
+    }
+    closedir(d);
+    return dernier;
+}
+
+/* Toujours un segment neuf : la fin d'un segment d'un lancement précédent est peut-être déchirée */
+void segmentOuvre(struct collecteur_s* c, uint32_t numero) {
+    char nom[32];
+    snprintf(nom, sizeof(nom), "seg-%06u", numero);
+    int fd = ouvreDans(c->repertoire, nom, O_WRONLY | O_CREAT | O_EXCL | O_APPEND);
+    if (fd < 0 || ecritComplet(fd, TTY_COLLECTOR_SEGMENT_MAGIC, TTY_COLLECTOR_SEGMENT_MAGIC_LEN) < 0) {
+        perror("Création d'un segment");
+        printf("Erreur sur : %s/%s\n", c->repertoire, nom);
+        abort();
+    }
+    if (c->segmentFd >= 0) close(c->segmentFd);
+    c->segmentFd  = fd;
+    c->segment    = numero;
+    c->segmentLen = TTY_COLLECTOR_SEGMENT_MAGIC_LEN;
+}
+
+
+
+/******************************************************************************
+ * Vidage groupé : un morceau par session et par type en attente, un writev()
+ * pour le segment, un write() pour l'index et un pour le journal, puis un
+ * fdatasync() de chacun.
+ ******************************************************************************/
+struct vidage_s {
+    struct iovec* iov;
+    size_t    nbIov;
+    size_t    capIov;
+    uint8_t*  entetes;            /* TTY_COLLECTOR_CHUNK_LEN par morceau */
+    size_t    nbEntetes;
+    size_t    capEntetes;
+    uint8_t*  index;              /* TTY_COLLECTOR_INDEX_LEN par morceau de données */
+    size_t    lenIndex;
+    size_t    capIndex;
+    char*     journal;
+    size_t    lenJournal;
+    size_t    capJournal;
+};
+
+static struct vidage_s vidage;
+
+/* Ajoute un morceau ; les entêtes sont repérés par leur rang, le tableau peut bouger avant l'écriture */
+void vidageMorceau(struct collecteur_s* c, uint64_t* offset, struct session_s* s, int type, uint8_t* data, size_t len) {
+    struct ttyCollectorChunk_s chunk = { type, len, s->id, crc32(0, data, len) };
+    vidage.entetes = agrandit(vidage.entetes, &vidage.capEntetes, vidage.nbEntetes + 1, TTY_COLLECTOR_CHUNK_LEN);
+    ttyCollectorChunkEncode(vidage.entetes + vidage.nbEntetes * TTY_COLLECTOR_CHUNK_LEN, &chunk);
+    vidage.iov = agrandit(vidage.iov, &vidage.capIov, vidage.nbIov + 2, sizeof(struct iovec));
+    vidage.iov[vidage.nbIov++] = (struct iovec) { (void*)(uintptr_t)vidage.nbEntetes++, TTY_COLLECTOR_CHUNK_LEN };
+    vidage.iov[vidage.nbIov++] = (struct iovec) { data, len };
+
+    if (type == TTY_COLLECTOR_CHUNK_DATA) {
+        struct ttyCollectorIndexEntry_s e = { s->id, c->segment, len, *offset + TTY_COLLECTOR_CHUNK_LEN };
+        vidage.index = agrandit(vidage.index, &vidage.capIndex, vidage.lenIndex + TTY_COLLECTOR_INDEX_LEN, 1);
+        ttyCollectorIndexEncode(vidage.index + vidage.lenIndex, &e);
+        vidage.lenIndex += TTY_COLLECTOR_INDEX_LEN;
+    }
+    *offset += TTY_COLLECTOR_CHUNK_LEN + len;
+}
+
+void vidageJournal(const char* format, ...) __attribute__((format(printf, 1, 2)));
+void vidageJournal(const char* format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    int n = vsnprintf(NULL, 0, format, ap);
+    va_end(ap);
+    vidage.journal = agrandit(vidage.journal, &vidage.capJournal, vidage.lenJournal + n + 1, 1);
+    va_start(ap, format);
+    vsnprintf(vidage.journal + vidage.lenJournal, n + 1, format, ap);
+    va_end(ap);
+    vidage.lenJournal += n;
+}
+
+void collecteurVide(struct collecteur_s* c) {
+    if (c->attente == 0 && !c->evenement) return;
+    uint64_t debut = maintenantUs();
+
+    if (c->segmentLen >= c->segmentBytes) segmentOuvre(c, c->segment + 1);
+    vidage.nbIov = vidage.nbEntetes = vidage.lenIndex = vidage.lenJournal = 0;
+
+    uint64_t offset = c->segmentLen;
+    for (struct session_s* s = c->sessions; s; s = s->suivante) {
+        if (s->id == 0) continue;
+        if (s->lenOuverture) {
+            vidageMorceau(c, &offset, s, TTY_COLLECTOR_CHUNK_OPEN, s->ouverture, s->lenOuverture);
+            vidageJournal("open %016" PRIx64 " %" PRId64 " %" PRIu32 " %s\n", s->id, s->hello.start, s->hello.pid, s->hello.nom);
+        }
+        if (s->used) vidageMorceau(c, &offset, s, TTY_COLLECTOR_CHUNK_DATA, s->attente, s->used);
+        if (s->fermee) {
+            vidageMorceau(c, &offset, s, TTY_COLLECTOR_CHUNK_CLOSE, NULL, 0);
+            vidageJournal("close %016" PRIx64 " %" PRIu64 "\n", s->id, s->octets);
+        }
+    }
+    for (size_t i=0; i<vidage.nbIov; i+=2) {
+        vidage.iov[i].iov_base = vidage.entetes + (uintptr_t)vidage.iov[i].iov_base * TTY_COLLECTOR_CHUNK_LEN;
+    }
+
+    /* les données d'abord : un index ou un journal ne désigne jamais ce qui n'est pas écrit */
+    if (ecritvComplet(c->segmentFd, vidage.iov, vidage.nbIov) < 0) {
+        perror("writev() sur le segment");
+        abort();
+    }
+    if (c->sync && fdatasync(c->segmentFd) < 0) perror("fdatasync() du segment");
+    if (ecritComplet(c->indexFd, vidage.index, vidage.lenIndex) < 0) perror("write() sur l'index");
+    if (ecritComplet(c->sessionsFd, vidage.journal, vidage.lenJournal) < 0) perror("write() sur le journal des sessions");
+    if (c->sync && vidage.lenIndex && fdatasync(c->indexFd) < 0) perror("fdatasync() de l'index");
+    if (c->sync && vidage.lenJournal && fdatasync(c->sessionsFd) < 0) perror("fdatasync() du journal des sessions");
+    c->segmentLen = offset;
+
+    /* sessions terminées libérées, tampons vidés */
+    struct session_s** p = &c->sessions;
+    while (*p) {
+        struct session_s* s = *p;
+        s->lenOuverture = 0;
+        s->used = 0;
+        if (s->fermee || (s->fd < 0 && s->id == 0)) {
+            *p = s->suivante;
+            free(s->attente);
+            free(s);
+            continue;
+        }
+        if (s->capacity > 4 * TTY_COLLECTOR_MESSAGE_MAX) {
+            /* une rafale passée ne garde pas sa mémoire */
+            free(s->attente);
+            s->attente = NULL;
+            s->capacity = 0;
+        }
+        p = &s->suivante;
+    }
+    c->attente = 0;
+    c->evenement = false;
+    c->vidages++;
+    uint64_t duree = maintenantUs() - debut;
+    if (duree > c->vidageMaxUs) c->vidageMaxUs = duree;
+}
+
+
+
+/******************************************************************************
+ * Réception
+ ******************************************************************************/
+void sessionFin(struct collecteur_s* c, int epollFd, struct session_s* s) {
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, s->fd, NULL);
+    close(s->fd);
+    s->fd = -1;
+    if (s->id) {
+        s->fermee = true;
+        c->evenement = true;
+    }
+}
+
+void sessionRecoit(struct collecteur_s* c, int epollFd, struct session_s* s) {
+    for (int i=0; i<MESSAGES_PAR_TOUR; i++) {
+        uint8_t* dest;
+        size_t max = TTY_COLLECTOR_MESSAGE_MAX;
+        if (s->id == 0) {
+            dest = s->ouverture;
+            max  = sizeof(s->ouverture);
+        } else {
+            s->attente = agrandit(s->attente, &s->capacity, s->used + TTY_COLLECTOR_MESSAGE_MAX, 1);
+            dest = s->attente + s->used;
+        }
+        /* MSG_TRUNC : la vraie taille, pour refuser un message trop gros plutôt que de le couper */
+        ssize_t n = recv(s->fd, dest, max, MSG_DONTWAIT | MSG_TRUNC);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (n <= 0 || (size_t)n > max) {
+            if (n > 0) printf("Session %016" PRIx64 " : message de %zd octets, trop gros, connexion fermée\n", s->id, n);
+            sessionFin(c, epollFd, s);
+            return;
+        }
+
+        if (s->id == 0) {
+            if (ttyCollectorHelloDecode(s->ouverture, n, &s->hello) < 0) {
+                printf("Connexion sans message d'ouverture valide, fermée\n");
+                sessionFin(c, epollFd, s);
+                return;
+            }
+            s->id = (uint64_t)c->segment << 32 | c->prochainId++;
+            s->lenOuverture = n;
+            c->evenement = true;
+            c->nbSessions++;
+        } else {
+            s->used   += n;
+            s->octets += n;
+            c->recus  += n;
+            if (c->attente == 0) c->attenteDepuisUs = maintenantUs();
+            c->attente += n;
+        }
+        if (c->attente >= c->batchBytes) collecteurVide(c);
+    }
+}
+
+void collecteurAccepte(struct collecteur_s* c, int epollFd, int ecoute) {
+    while (true) {
+        int fd = accept4(ecoute, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept4()");
+            return;
+        }
+        struct session_s* s = calloc(1, sizeof(struct session_s));
+        if (s == NULL) {
+            perror("Erreur sur malloc() ");
+            abort();
+        }
+        s->fd = fd;
+        s->suivante = c->sessions;
+        c->sessions = s;
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = s };
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            perror("epoll_ctl()");
+            abort();
+        }
+    }
+}
+
+/* Socket d'écoute ; refuse de prendre la place d'un collecteur qui répond encore */
+int collecteurEcoute(const char* chemin) {
+    struct sockaddr_un adresse = { .sun_family = AF_UNIX };
+    if (strlen(chemin) >= sizeof(adresse.sun_path)) {
+        printf("Chemin de socket trop long : %s\n", chemin);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(adresse.sun_path, chemin);
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket()");
+        abort();
+    }
+    int essai = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (essai >= 0 && connect(essai, (struct sockaddr*)&adresse, sizeof(adresse)) == 0) {
+        printf("Un collecteur écoute déjà sur %s\n", chemin);
+        exit(EXIT_FAILURE);
+    }
+    if (essai >= 0) close(essai);
+    unlink(chemin);
+
+    /* les sessions tournent sous l'utilisateur connecté : tout le monde doit pouvoir se connecter */
+    mode_t masque = umask(0);
+    int r = bind(fd, (struct sockaddr*)&adresse, sizeof(adresse));
+    umask(masque);
+    if (r < 0 || listen(fd, 128) < 0) {
+        perror("bind() ou listen() de la socket du collecteur");
+        printf("Erreur sur : %s\n", chemin);
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+void collecteur(struct collecteur_s* c, const char* chemin) {
+    if (mkdir(c->repertoire, S_IRWXU | S_IRGRP | S_IXGRP) < 0 && errno != EEXIST) {
+        perror("mkdir() du répertoire du collecteur");
+        exit(EXIT_FAILURE);
+    }
+    c->segmentFd  = -1;
+    segmentOuvre(c, segmentDernier(c->repertoire) + 1);
+    c->prochainId = 1;
+    c->indexFd    = ouvreDans(c->repertoire, "index",    O_WRONLY | O_CREAT | O_APPEND);
+    c->sessionsFd = ouvreDans(c->repertoire, "sessions", O_WRONLY | O_CREAT | O_APPEND);
+    if (c->indexFd < 0 || c->sessionsFd < 0) {
+        perror("open() de l'index ou du journal des sessions");
+        exit(EXIT_FAILURE);
+    }
+
+    sigset_t masque;
+    sigemptyset(&masque);
+    sigaddset(&masque, SIGINT);
+    sigaddset(&masque, SIGTERM);
+    sigaddset(&masque, SIGHUP);
+    sigprocmask(SIG_BLOCK, &masque, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    int signalFd = signalfd(-1, &masque, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    int ecoute  = collecteurEcoute(chemin);
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd < 0 || signalFd < 0) {
+        perror("epoll_create1() ou signalfd()");
+        abort();
+    }
+    static int marqueEcoute, marqueSignal;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &marqueEcoute };
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, ecoute, &ev);
+    ev.data.ptr = &marqueSignal;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, signalFd, &ev);
+
+    printf("Collecteur sur %s, segments dans %s à partir de seg-%06u\n", chemin, c->repertoire, c->segment);
+    fflush(stdout);
+
+    bool encore = true;
+    while (encore) {
+        int timeout = -1;
+        if (c->attente || c->evenement) {
+            uint64_t age = c->attente ? (maintenantUs() - c->attenteDepuisUs) / 1000 : 0;
+            timeout = age >= (uint64_t)c->batchMs ? 0 : c->batchMs - age;
+        }
+        struct epoll_event evs[64];
+        int n = epoll_wait(epollFd, evs, 64, timeout);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait()");
+            abort();
+        }
+        for (int i=0; i<n; i++) {
+            if (evs[i].data.ptr == &marqueEcoute) {
+                collecteurAccepte(c, epollFd, ecoute);
+            } else if (evs[i].data.ptr == &marqueSignal) {
+                encore = false;
+            } else {
+                struct session_s* s = evs[i].data.ptr;
+                if (s->fd >= 0) sessionRecoit(c, epollFd, s);
+            }
+        }
+        /* une ouverture ou une fermeture part au plus tard avec le prochain lot de données */
+        if (c->attente && (maintenantUs() - c->attenteDepuisUs) / 1000 >= (uint64_t)c->batchMs) collecteurVide(c);
+        else if (c->evenement && c->attente == 0) collecteurVide(c);
+    }
+
+    /* arrêt : les sessions encore connectées passeront sur un fichier local */
+    close(ecoute);
+    unlink(chemin);
+    collecteurVide(c);
+    printf("Arrêt du collecteur : %" PRIu64 " sessions, %" PRIu64 " octets reçus, %" PRIu64 " vidages groupés (max %" PRIu64 " µs)\n",
+        c->nbSessions, c->recus, c->vidages, c->vidageMaxUs);
+}
+
+
+
+/******************************************************************************
+ * Lecture du répertoire : --list, --extract
+ ******************************************************************************/
+struct sessionLue_s {
+    uint64_t  id;
+    int64_t   start;
+    unsigned  pid;
+    int64_t   octets;             /* -1 : pas de fermeture dans le journal */
+    char      nom[TTY_COLLECTOR_NAME_MAX + 1];
+};
+
+/* Sessions du journal, dans l'ordre d'ouverture */
+struct sessionLue_s* sessionsLit(const char* repertoire, size_t* nb) {
+    struct sessionLue_s* sessions = NULL;
+    size_t capacity = 0;
+    *nb = 0;
+
+    char chemin[PATH_MAX];
+    snprintf(chemin, sizeof(chemin), "%s/sessions", repertoire);
+    FILE* f = fopen(chemin, "r");
+    if (f == NULL) {
+        perror("fopen() du journal des sessions");
+        printf("Erreur sur : %s\n", chemin);
+        exit(EXIT_FAILURE);
+    }
+    char ligne[TTY_COLLECTOR_NAME_MAX + 128];
+    while (fgets(ligne, sizeof(ligne), f)) {
+        ligne[strcspn(ligne, "\n")] = 0;
+        struct sessionLue_s s = { .octets = -1 };
+        int debutNom = 0;
+        int64_t octets;
+        if (sscanf(ligne, "open %" SCNx64 " %" SCNd64 " %u %n", &s.id, &s.start, &s.pid, &debutNom) == 3 && debutNom) {
+            snprintf(s.nom, sizeof(s.nom), "%s", ligne + debutNom);
+            sessions = agrandit(sessions, &capacity, *nb + 1, sizeof(*sessions));
+            sessions[(*nb)++] = s;
+        } else if (sscanf(ligne, "close %" SCNx64 " %" SCNd64, &s.id, &octets) == 2) {
+            for (size_t i = *nb; i-- > 0; ) {
+                if (sessions[i].id == s.id) {
+                    sessions[i].octets = octets;
+                    break;
+                }
+            }
+        }
+    }
+    fclose(f);
+    return sessions;
+}
+
+void liste(const char* repertoire) {
+    size_t nb;
+    struct sessionLue_s* sessions = sessionsLit(repertoire, &nb);
+    for (size_t i=0; i<nb; i++) {
+        struct sessionLue_s* s = sessions + i;
+        char date[64];
+        struct tm tm;
+        time_t t = s->start / 1000000;
+        localtime_r(&t, &tm);
+        strftime(date, sizeof(date), "%FT%T%z", &tm);
+        printf("%016" PRIx64 "\t%s\t%u\t", s->id, date, s->pid);
+        if (s->octets >= 0) printf("%" PRId64, s->octets);
+        else printf("en cours ou interrompue");
+        printf("\t%s\n", s->nom);
+    }
+    free(sessions);
+}
+
+/* La session désignée par son identifiant, son nom ou la fin de son nom ; la plus récente si plusieurs */
+uint64_t sessionCherche(const char* repertoire, const char* qui) {
+    size_t nb;
+    struct sessionLue_s* sessions = sessionsLit(repertoire, &nb);
+    uint64_t id = 0;
+    char* fin;
+    uint64_t numero = strtoull(qui, &fin, 16);
+    size_t lenQui = strlen(qui);
+    for (size_t i=0; i<nb; i++) {
+        size_t lenNom = strlen(sessions[i].nom);
+        if ((*fin == 0 && sessions[i].id == numero)
+            || (lenNom >= lenQui && strcmp(sessions[i].nom + lenNom - lenQui, qui) == 0
+                && (lenNom == lenQui || qui[0] == '/' || sessions[i].nom[lenNom - lenQui - 1] == '/'))) {
+            id = sessions[i].id;
+        }
+    }
+    free(sessions);
+    return id;
+}
+
+/* Morceaux de la session dans l'ordre de l'index, vérifiés par leur crc, sur la sortie standard */
+int extrait(const char* repertoire, const char* qui) {
+    uint64_t id = sessionCherche(repertoire, qui);
+    if (id == 0) {
+        fprintf(stderr, "Session inconnue : %s\n", qui);
+        return EXIT_FAILURE;
+    }
+    int indexFd = ouvreDans(repertoire, "index", O_RDONLY);
+    if (indexFd < 0) {
+        perror("open() de l'index");
+        return EXIT_FAILURE;
+    }
+
+    int segmentFd = -1;
+    uint32_t segment = 0;
+    uint8_t* data = NULL;
+    size_t capacity = 0;
+    uint64_t octets = 0;
+    int r = EXIT_SUCCESS;
+    static uint8_t lu[TTY_COLLECTOR_INDEX_LEN * 4096];
+    ssize_t n;
+    size_t reste = 0;
+    while ((n = read(indexFd, lu + reste, sizeof(lu) - reste)) > 0) {
+        size_t len = reste + n, pos;
+        for (pos = 0; pos + TTY_COLLECTOR_INDEX_LEN <= len; pos += TTY_COLLECTOR_INDEX_LEN) {
+            struct ttyCollectorIndexEntry_s e;
+            ttyCollectorIndexDecode(lu + pos, &e);
+            if (e.session != id) continue;
+
+            if (segmentFd < 0 || e.segment != segment) {
+                char nom[32];
+                if (segmentFd >= 0) close(segmentFd);
+                snprintf(nom, sizeof(nom), "seg-%06u", e.segment);
+                segmentFd = ouvreDans(repertoire, nom, O_RDONLY);
+                segment = e.segment;
+                if (segmentFd < 0) {
+                    fprintf(stderr, "Segment %s illisible : %s\n", nom, strerror(errno));
+                    r = EXIT_FAILURE;
+                    continue;
+                }
+            }
+            if (segmentFd < 0) continue;
+            data = agrandit(data, &capacity, TTY_COLLECTOR_CHUNK_LEN + e.len, 1);
+            struct ttyCollectorChunk_s chunk;
+            if (pread(segmentFd, data, TTY_COLLECTOR_CHUNK_LEN + e.len, e.offset - TTY_COLLECTOR_CHUNK_LEN) != (ssize_t)(TTY_COLLECTOR_CHUNK_LEN + e.len)
+                || ttyCollectorChunkDecode(data, &chunk) < 0 || chunk.session != id || chunk.len != e.len
+                || crc32(0, data + TTY_COLLECTOR_CHUNK_LEN, e.len) != chunk.crc) {
+                /* on continue : replay sait sauter une zone abîmée */
+                fprintf(stderr, "Morceau abîmé : seg-%06u offset %" PRIu64 ", %" PRIu32 " octets perdus\n", e.segment, e.offset, e.len);
+                r = EXIT_FAILURE;
+                continue;
+            }
+            if (ecritComplet(1, data + TTY_COLLECTOR_CHUNK_LEN, e.len) < 0) {
+                perror("write() sur la sortie standard");
+                return EXIT_FAILURE;
+            }
+            octets += e.len;
+        }
+        reste = len - pos;
+        memmove(lu, lu + pos, reste);
+    }
+    if (segmentFd >= 0) close(segmentFd);
+    close(indexFd);
+    free(data);
+    if (octets == 0) {
+        fprintf(stderr, "Aucune donnée pour la session %016" PRIx64 "\n", id);
+        r = EXIT_FAILURE;
+    }
+    return r;
+}
+
+
+
+void usage(char* argv0) {
+    printf("%s [options]                  reçoit les enregistrements des sessions\n", argv0);
+    printf("%s [--dir <répertoire>] --list\n", argv0);
+    printf("%s [--dir <répertoire>] --extract <session, nom ou fin du nom>\n", argv0);
+    printf("  --socket <chemin>       socket d'écoute (%s par défaut), à donner à honeypotSsh par HONEYPOT_COLLECTOR\n", TTY_COLLECTOR_SOCKET);
+    printf("  --dir <répertoire>      segments, index et journal des sessions (%s par défaut)\n", REPERTOIRE_DEFAUT);
+    printf("  --segment-bytes <n>     taille d'un segment avant de passer au suivant (%d par défaut)\n", SEGMENT_BYTES);
+    printf("  --batch-bytes <n>       vidage groupé dès que n octets attendent (%d par défaut)\n", BATCH_BYTES);
+    printf("  --batch-ms <n>          délai max avant vidage groupé (%d par défaut)\n", BATCH_MS);
+    printf("  --no-sync               pas de fdatasync() après chaque vidage\n");
+    printf("  --list                  une ligne par session : identifiant, début, pid, octets, nom\n");
+    printf("  --extract               l'enregistrement de la session sur la sortie standard, pour replay -\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[]) {
+    const struct option options[] = {
+        { "socket",        required_argument, NULL, 's' },
+        { "dir",           required_argument, NULL, 'd' },
+        { "segment-bytes", required_argument, NULL, 'g' },
+        { "batch-bytes",   required_argument, NULL, 'b' },
+        { "batch-ms",      required_argument, NULL, 'm' },
+        { "no-sync",       no_argument,       NULL, 'n' },
+        { "list",          no_argument,       NULL, 'l' },
+        { "extract",       required_argument, NULL, 'x' },
+        { NULL, 0, NULL, 0 }
+    };
+    struct collecteur_s c;
+    const char* chemin = TTY_COLLECTOR_SOCKET;
+    const char* extraction = NULL;
+    bool listage = false;
+    int opt;
+
+    memset(&c, 0, sizeof(c));
+    c.repertoire   = REPERTOIRE_DEFAUT;
+    c.segmentBytes = SEGMENT_BYTES;
+    c.batchBytes   = BATCH_BYTES;
+    c.batchMs      = BATCH_MS;
+    c.sync         = true;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+            case 's': chemin = optarg; break;
+            case 'd': c.repertoire = optarg; break;
+            case 'g': c.segmentBytes = strtoull(optarg, NULL, 0); break;
+            case 'b': c.batchBytes = strtoull(optarg, NULL, 0); break;
+            case 'm': c.batchMs = strtol(optarg, NULL, 0); break;
+            case 'n': c.sync = false; break;
+            case 'l': listage = true; break;
+            case 'x': extraction = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind != argc || c.batchMs < 0) usage(argv[0]);
+
+    if (listage) {
+        liste(c.repertoire);
+        return EXIT_SUCCESS;
+    }
+    if (extraction) return extrait(c.repertoire, extraction);
+
+    collecteur(&c, chemin);
+    return EXIT_SUCCESS;
+}
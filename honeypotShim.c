@@ -0,0 +1,196 @@
+/******************************************************************************
+ * Shim de ForceCommand pour le moteur multi-sessions
+ * Bertrand sept 2024
+ *
+ * A mettre en ForceCommand à la place de honeypotSsh : passe stdin, stdout,
+ * stderr et le répertoire courant de la session au moteur (honeypotSsh
+ * --engine), avec ses arguments et son environnement, puis attend la fin de la
+ * session pour sortir avec le code de sortie du shell. Il relaie seulement les
+ * changements de taille du terminal, aucune donnée de la session ne passe par
+ * lui. Protocole : voir ttyEngine.h.
+ *
+ * Si le moteur ne répond pas ou refuse la session, le shim se remplace par le
+ * honeypotSsh de son répertoire, avec les mêmes arguments : la session se
+ * déroule comme sans moteur.
+ *
+ * HONEYPOT_ENGINE   socket du moteur (TTY_ENGINE_SOCKET par défaut), vide
+ *                   pour toujours lancer honeypotSsh
+ ******************************************************************************/
+
+
+/* sys */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/signalfd.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <limits.h>
+
+/* libc */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include "ttyEngine.h"
+
+extern char **environ;
+
+#define SHIM_CLASSIC  "honeypotSsh"   /* lancé à la place, pris dans le répertoire du shim */
+
+
+
+/******************************************************************************
+ * Repli : honeypotSsh sans moteur
+ ******************************************************************************/
+
+void lanceClassique(char* argv[]) {
+    char chemin[PATH_MAX];
+    ssize_t n = readlink("/proc/self/exe", chemin, sizeof(chemin) - sizeof(SHIM_CLASSIC) - 1);
+    char* fin = n > 0 ? memrchr(chemin, '/', n) : NULL;
+    if (fin == NULL) {
+        perror("readlink() de /proc/self/exe");
+        exit(EXIT_FAILURE);
+    }
+    strcpy(fin + 1, SHIM_CLASSIC);
+    execv(chemin, argv);
+    perror("execv() de honeypotSsh");
+    exit(EXIT_FAILURE);
+}
+
+
+
+/******************************************************************************
+ * Ouverture de la session dans le moteur
+ ******************************************************************************/
+
+/* Variables transmises au shell : tout sauf la configuration du honeypot, qui reste celle du moteur */
+static int variableTransmise(const char* v) {
+    return strncmp(v, "HONEYPOT_", 9) != 0;
+}
+
+/* Retourne la socket connectée si le moteur a pris la session, -1 sinon */
+int ouvreSession(const char* chemin, int argc, char* argv[]) {
+    struct sockaddr_un adresse = { .sun_family = AF_UNIX };
+    if (strlen(chemin) >= sizeof(adresse.sun_path)) return -1;
+    strcpy(adresse.sun_path, chemin);
+
+    /* message d'ouverture : entête, arguments, environnement */
+    static uint8_t hello[TTY_ENGINE_HELLO_MAX];
+    size_t len = TTY_ENGINE_HELLO_LEN;
+    uint32_t envc = 0;
+    for (int i=0; i<argc; i++) {
+        size_t l = strlen(argv[i]) + 1;
+        if (len + l > sizeof(hello)) return -1;
+        memcpy(hello + len, argv[i], l);
+        len += l;
+    }
+    for (char** e = environ; *e; e++) {
+        if (!variableTransmise(*e)) continue;
+        size_t l = strlen(*e) + 1;
+        if (len + l > sizeof(hello)) return -1;
+        memcpy(hello + len, *e, l);
+        len += l;
+        envc++;
+    }
+    ttyEngineHelloEncode(hello, getppid(), getsid(0), getpgrp(), argc, envc);
+
+    int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (cwd < 0) cwd = open("/", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (cwd < 0 || fd < 0 || connect(fd, (struct sockaddr*)&adresse, sizeof(adresse)) < 0) {
+        if (cwd >= 0) close(cwd);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    int fds[TTY_ENGINE_FDS] = { 0, 1, 2, cwd };
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr alignement;
+    } controle;
+    memset(&controle, 0, sizeof(controle));
+    struct iovec iov = { hello, len };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = controle.buf, .msg_controllen = sizeof(controle.buf) };
+    struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type  = SCM_RIGHTS;
+    c->cmsg_len   = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(c), fds, sizeof(fds));
+
+    ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    close(cwd);
+    if (n != (ssize_t)len) {
+        close(fd);
+        return -1;
+    }
+
+    uint8_t reponse[TTY_ENGINE_MESSAGE_LEN];
+    uint32_t valeur;
+    do {
+        n = recv(fd, reponse, sizeof(reponse), 0);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0 || ttyEngineMessageDecode(reponse, n, &valeur) != TTY_ENGINE_ACCEPTE) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+
+/******************************************************************************
+ * Programme principal
+ ******************************************************************************/
+
+int main(int argc, char* argv[]) {
+    const char* chemin = getenv("HONEYPOT_ENGINE");
+    if (chemin == NULL) chemin = TTY_ENGINE_SOCKET;
+    if (chemin[0] == 0) lanceClassique(argv);
+
+    /* bloqué dès maintenant : un changement de taille pendant l'ouverture n'est pas perdu */
+    sigset_t masque, ancien;
+    sigemptyset(&masque);
+    sigaddset(&masque, SIGWINCH);
+    sigprocmask(SIG_BLOCK, &masque, &ancien);
+
+    int fd = ouvreSession(chemin, argc, argv);
+    if (fd < 0) {
+        sigprocmask(SIG_SETMASK, &ancien, NULL);
+        lanceClassique(argv);
+    }
+
+    /* la session est au moteur : ce process n'a plus besoin de ses descripteurs standard */
+    close(0);
+    close(1);
+    close(2);
+    int signalFd = signalfd(-1, &masque, SFD_CLOEXEC);
+    struct pollfd pfd[2] = { { fd, POLLIN, 0 }, { signalFd, POLLIN, 0 } };
+    while (true) {
+        if (poll(pfd, signalFd >= 0 ? 2 : 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            return EXIT_FAILURE;
+        }
+        if (pfd[1].revents & POLLIN) {
+            struct signalfd_siginfo si;
+            if (read(signalFd, &si, sizeof(si)) == sizeof(si)) {
+                uint8_t m[TTY_ENGINE_MESSAGE_LEN];
+                ttyEngineMessageEncode(m, TTY_ENGINE_WINCH, 0);
+                send(fd, m, sizeof(m), MSG_NOSIGNAL);
+            }
+        }
+        if (pfd[0].revents) {
+            uint8_t m[TTY_ENGINE_MESSAGE_LEN];
+            uint32_t valeur;
+            ssize_t n = recv(fd, m, sizeof(m), 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return EXIT_FAILURE;
+            if (ttyEngineMessageDecode(m, n, &valeur) == TTY_ENGINE_FIN) return valeur;
+        }
+    }
+}
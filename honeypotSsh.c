@@ -3,7 +3,6 @@
  * Bertrand sept 2024
  * 
  * TODO :
- *  - gestion des logs, messages d'erreur du programme (printf pour l'insant)
  *  - emplacement des enregistrements de session SSH
  * 
  * Peut servir de début pour un bastin SSH. Manque :
@@ -21,17 +20,30 @@
 #include <unistd.h>
 #include <signal.h>
 #include <poll.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>     /* pidfd_open() n'a pas forcément d'enveloppe dans la libc */
 #include <sys/time.h>
+#include <sys/uio.h>         /* writev() pour l'enregistrement */
+#include <sys/socket.h>      /* envoi de l'enregistrement au collecteur */
+#include <sys/un.h>
+#include <getopt.h>
+#include <pthread.h>         /* compression de l'enregistrement hors du chemin chaud */
 #include <malloc.h>
+#include <spawn.h>           /* lancement du shell fils sans copie du parent */
 #include <wait.h>
 #include <termios.h>
 #include <signal.h>
 //#include <asm/termbits.h>  /* ioctl() redimensionnement tty - erreur déjà inclus/défini ! */
 #include <sys/ioctl.h>       /* ioctl() redimensionnement tty */
+#ifdef __SSE2__
+#include <emmintrin.h>       /* recherche vectorisée des caractères de contrôle */
+#endif
 
 /* libc */
 #include <errno.h>
 #include <stdint.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
@@ -40,6 +52,59 @@
 
 
 /* local */
+#include "ttyRecord.h"
+#include "ttyCollector.h"
+#include "ttyEngine.h"
+
+
+
+/******************************************************************************
+ * Journal des messages du programme
+ * Notre stdout est le terminal du client ssh : rien ne doit y apparaître. Les
+ * messages vont dans un fichier partagé par toutes les sessions, une ligne
+ * "date pid message" par write() en O_APPEND, donc jamais entremêlées.
+ ******************************************************************************/
+
+static int journalFd = 1; /* stdout tant que le journal n'est pas ouvert */
+static volatile sig_atomic_t dansHandler = 0; /* handler de signal fatal : pas de repli sur fichier local, journal réduit */
+
+/* nom "-" = stdout, comme avant ; reste sur stdout si le fichier ne s'ouvre pas */
+void journalOuvre(const char* nom) {
+    if (strcmp(nom, "-") == 0) return;
+    int fd = open(nom, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd >= 0) journalFd = fd;
+}
+
+void journal(const char* format, ...) {
+    char ligne[1024];
+    struct timespec ts;
+    struct tm tm;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    gmtime_r(&ts.tv_sec, &tm); /* pas de localtime_r() : évite la lecture du fuseau au démarrage */
+    size_t n = strftime(ligne, sizeof(ligne), "%FT%TZ", &tm);
+    n += snprintf(ligne + n, sizeof(ligne) - n, " %d ", getpid());
+
+    va_list ap;
+    va_start(ap, format);
+    int r = vsnprintf(ligne + n, sizeof(ligne) - n, format, ap);
+    va_end(ap);
+    n = (r < 0) ? n : (n + r < sizeof(ligne) - 1) ? n + r : sizeof(ligne) - 2;
+    if (journalFd == 1) ligne[n++] = '\r'; /* stdout peut déjà être en raw */
+    ligne[n++] = '\n';
+    if (write(journalFd, ligne, n) < 0) { /* rien de mieux à faire */ }
+}
+
+/* Equivalent de perror() */
+void journalErreur(const char* message) {
+    int e = errno;
+    if (dansHandler) {
+        /* depuis le handler de signal : ni stdio, ni strerror(), seulement write() */
+        if (write(journalFd, message, strlen(message)) < 0 || write(journalFd, "\n", 1) < 0) { /* rien de mieux à faire */ }
+    } else {
+        journal("%s : %s", message, strerror(e));
+    }
+    errno = e;
+}
 
 
 
@@ -47,6 +112,84 @@
  * Configuration locale
  ******************************************************************************/
 #define BUFFERSIZE    65536 /* pour le passe-plat */
+#define BUFFERSIZE_MIN 1024
+
+#define RECORD_FLUSH_BYTES  16384 /* taille du tampon d'enregistrement, vidé par writev() une fois plein */
+#define RECORD_FLUSH_MS       250 /* durée max (ms) pendant laquelle un enregistrement reste en mémoire */
+#define RECORD_COMPRESS         0 /* 0 = records écrits tels quels, 1 à 9 = niveau deflate des trames compressées */
+#define RECORD_CRC              1 /* 1 = écritures de l'enregistrement en trames avec crc (sans effet si compressé, qui en a déjà) */
+#define RECORD_SYNC_MS       1000 /* fdatasync() groupé au plus tard ce délai (ms) après une écriture, 0 = jamais */
+#define RECORD_FILE  "/tmp/ttyrecord-%FT%T%z" /* nom de l'enregistrement, passé à strftime() */
+#define COLLECTOR              "" /* socket du collecteur (collector), vide = fichier local ; repli sur le fichier s'il ne répond pas */
+#define STATS_MS             1000 /* période de réécriture des statistiques dans <enregistrement>.stats, 0 = jamais */
+#define RELAY_SPLICE            0 /* 1 = relais zéro-copie par splice()/tee(), repli automatique si le noyau refuse */
+#define INTERCEPT   "03:INT,1a:TSTP,1c:QUIT" /* caractères de contrôle du client traduits en signaux : ^C ^Z ^\ */
+#define LOG_FILE  "/tmp/honeypotSsh.log" /* journal des messages du programme, "-" = stdout */
+
+/* Les valeurs par défaut ci-dessus peuvent être surchargées par des variables
+   d'environnement (SetEnv dans sshd_config par exemple). Elles sont retirées de
+   l'environnement avant de lancer le shell fils, pour ne pas être visibles. */
+struct config_s {
+    long recordFlushBytes; /* HONEYPOT_RECORD_FLUSH_BYTES  0 = écriture immédiate de chaque enregistrement */
+    long recordFlushMs;    /* HONEYPOT_RECORD_FLUSH_MS */
+    long recordCompress;   /* HONEYPOT_RECORD_COMPRESS */
+    long recordCrc;        /* HONEYPOT_RECORD_CRC */
+    long recordSyncMs;     /* HONEYPOT_RECORD_SYNC_MS */
+    char* recordFile;      /* HONEYPOT_RECORD_FILE */
+    char* collector;       /* HONEYPOT_COLLECTOR */
+    long relayBuffer;      /* HONEYPOT_RELAY_BUFFER  taille de la file de chaque sens du relais */
+    long statsMs;          /* HONEYPOT_STATS_MS */
+    long relaySplice;      /* HONEYPOT_SPLICE */
+    char* intercept;       /* HONEYPOT_INTERCEPT  liste "octet hexa:signal", vide = aucune interception */
+    char* logFile;         /* HONEYPOT_LOG */
+};
+
+static struct config_s config;
+
+long configLong(const char* nom, long defaut) {
+    char* val = getenv(nom);
+    if (val == NULL) return defaut;
+
+    char* fin;
+    errno = 0;
+    long r = strtol(val, &fin, 0);
+    if (errno || fin == val || *fin || r < 0) {
+        journal("Valeur incorrecte pour %s : %s, on garde %ld", nom, val, defaut);
+        r = defaut;
+    }
+    unsetenv(nom);
+    return r;
+}
+
+char* configString(const char* nom, char* defaut) {
+    char* val = getenv(nom);
+    if (val == NULL) return defaut;
+
+    char* r = strdup(val);
+    unsetenv(nom);
+    return r;
+}
+
+void configLoad() {
+    config.logFile          = configString("HONEYPOT_LOG",              LOG_FILE);
+    journalOuvre(config.logFile); /* en premier : les valeurs incorrectes y sont signalées */
+    config.recordFlushBytes = configLong("HONEYPOT_RECORD_FLUSH_BYTES", RECORD_FLUSH_BYTES);
+    config.recordFlushMs    = configLong("HONEYPOT_RECORD_FLUSH_MS",    RECORD_FLUSH_MS);
+    config.recordCompress   = configLong("HONEYPOT_RECORD_COMPRESS",    RECORD_COMPRESS);
+    if (config.recordCompress > 9) config.recordCompress = 9;
+    config.recordCrc        = configLong("HONEYPOT_RECORD_CRC",         RECORD_CRC);
+    config.recordSyncMs     = configLong("HONEYPOT_RECORD_SYNC_MS",     RECORD_SYNC_MS);
+    config.recordFile       = configString("HONEYPOT_RECORD_FILE",      RECORD_FILE);
+    config.collector        = configString("HONEYPOT_COLLECTOR",        COLLECTOR);
+    config.relayBuffer      = configLong("HONEYPOT_RELAY_BUFFER",       BUFFERSIZE);
+    if (config.relayBuffer < BUFFERSIZE_MIN) config.relayBuffer = BUFFERSIZE_MIN;
+    /* une trame contient le tampon et au plus un record : les deux doivent y tenir */
+    if (config.relayBuffer > TTY_RECORD_FRAME_MAX / 4) config.relayBuffer = TTY_RECORD_FRAME_MAX / 4;
+    if (config.recordFlushBytes > TTY_RECORD_FRAME_MAX / 2) config.recordFlushBytes = TTY_RECORD_FRAME_MAX / 2;
+    config.statsMs          = configLong("HONEYPOT_STATS_MS",           STATS_MS);
+    config.relaySplice      = configLong("HONEYPOT_SPLICE",             RELAY_SPLICE);
+    config.intercept        = configString("HONEYPOT_INTERCEPT",        INTERCEPT);
+}
 
 
 
@@ -54,79 +197,890 @@
  * Fonctions utilitaires
  ******************************************************************************/
 
-/* pour pouvoir compiler... n'existe que Linux >= 5.3 !!!! Bullseye forensic ok, WSL nok */
-int pidfd_open(pid_t pid, unsigned int flags) { return 99; }
+/* n'existe que Linux >= 5.3 !!!! Bullseye forensic ok, WSL nok : -1 et ENOSYS sinon */
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+int bastionPidfdOpen(pid_t pid) {
+    return syscall(SYS_pidfd_open, pid, 0);
+}
 
 
 
 
 /******************************************************************************
- * Gestion de l'enregistrement
+ * Statistiques du relais
  ******************************************************************************/
 
-#define TTY_RECORD_STDIN       0
-#define TTY_RECORD_STDOUT      1
-#define TTY_RECORD_STDERR      2
+/*
+  Compteurs de la boucle principale et de l'enregistrement, pour voir où passe
+  le temps d'une session sans profileur : de simples incréments, et deux
+  lectures de CLOCK_MONOTONIC (vDSO, sans appel système) par tour de boucle.
+  Un jeu de compteurs par session, dans son état : le moteur en mène plusieurs.
+  Ajoutés au record TTY_RECORD_EXIT, et réécrits pendant la session toutes les
+  config.statsMs dans <enregistrement>.stats, supprimé à la fin.
+
+  Histogrammes en puissances de 2 : la case k compte les valeurs de [2^k, 2^(k+1)),
+  la case 0 aussi les 0, la dernière tout ce qui dépasse.
+ */
+#define STATS_CASES 18
+
+#define SENS_SERVEUR_CLIENT 0
+#define SENS_CLIENT_SERVEUR 1
+
+struct bastionStats_s {
+    uint64_t loops;                    /* tours de la boucle epoll */
+    uint64_t wakeups;                  /* epoll_wait() avec des événements */
+    uint64_t timeouts;                 /* epoll_wait() sur timeout */
+    uint64_t interrupted;              /* epoll_wait() interrompu par un signal */
+    uint64_t waitUs;                   /* temps passé dans epoll_wait() */
+    uint64_t busyUs;                   /* temps passé ailleurs dans la boucle */
+    uint64_t reads[2][STATS_CASES];    /* tailles des lectures du relais, par sens */
+    uint64_t shortWrites[2];           /* écritures partielles vers la destination */
+    uint64_t blockedWrites[2];         /* EAGAIN : destination pleine, attente de EPOLLOUT */
+    uint64_t flushes;                  /* écritures de l'enregistrement (trames en mode compressé) */
+    uint64_t flushUs[STATS_CASES];     /* durée de chaque écriture de l'enregistrement, compression comprise */
+    uint64_t flushMaxUs;
+    uint64_t syncs;                    /* fdatasync() de l'enregistrement */
+    uint64_t syncMaxUs;
+};
+
+static inline uint64_t statsMaintenantUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline void statsHistogramme(uint64_t* cases, uint64_t v) {
+    int k = v > 1 ? 63 - __builtin_clzll(v) : 0;
+    cases[k < STATS_CASES ? k : STATS_CASES - 1]++;
+}
+
+/*
+  Compteurs de l'enregistrement : mis à jour aussi par le thread compresseur et
+  le thread fdatasync, lus par celui de la session. Opérations atomiques.
+ */
+static inline void statsMax(uint64_t* max, uint64_t v) {
+    uint64_t m = __atomic_load_n(max, __ATOMIC_RELAXED);
+    while (v > m && !__atomic_compare_exchange_n(max, &m, v, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) ;
+}
+
+static inline uint64_t statsLit(const uint64_t* compteur) {
+    return __atomic_load_n(compteur, __ATOMIC_RELAXED);
+}
+
+void statsFlush(struct bastionStats_s* stats, uint64_t debutUs) {
+    uint64_t duree = statsMaintenantUs() - debutUs;
+    int k = duree > 1 ? 63 - __builtin_clzll(duree) : 0;
+    __atomic_fetch_add(&stats->flushes, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->flushUs[k < STATS_CASES ? k : STATS_CASES - 1], 1, __ATOMIC_RELAXED);
+    statsMax(&stats->flushMaxUs, duree);
+}
+
+size_t statsHistogrammeFormat(char* dest, size_t reste, const char* nom, const uint64_t* cases) {
+    size_t n = snprintf(dest, reste, "%s:", nom);
+    for (int k=0; k<STATS_CASES && n < reste; k++) n += snprintf(dest + n, reste - n, " %llu", (unsigned long long)statsLit(&cases[k]));
+    if (n < reste) n += snprintf(dest + n, reste - n, "\n");
+    return n < reste ? n : reste;
+}
+
 
-#define TTY_RECORD_SERVER_TO_CLIENT  3 
-#define TTY_RECORD_CLIENT_TO_SERVER  4
-#define TTY_RECORD_NONE              5 /* il ne se passe rien, log juste pour vérifier que rien n'est mort. En lien avec le timeout de poll() */
 
-#define TTY_RECORD_START       21 /* lancement du bastion */
-#define TTY_RECORD_EXIT        22 /* le terminal se ferme, le shell fils a fait exit()      data=son code de retour */
+/******************************************************************************
+ * Gestion de l'enregistrement
+ ******************************************************************************/
 
-#define TTY_RECORD_FILE_UPLOAD   11  /* cas à préciser par la suite */
-#define TTY_RECORD_FILE_DOWNLOAD 12
+/* Format des records : voir ttyRecord.h, écrit ici en v2 */
 
-struct ttyRecordEntry_s {
-    time_t       tv_sec;
-    suseconds_t  tv_usec;
-    int          type;
-    size_t       len;
-    char         data[];
+/*
+  Tampon d'enregistrement : les entêtes et les données sont accumulés en mémoire
+  puis écrits d'un coup par writev(), quand le tampon est plein ou que le plus
+  ancien enregistrement en attente a dépassé config.recordFlushMs.
+  Vidé systématiquement sur TTY_RECORD_EXIT et sur réception d'un signal fatal.
+
+  En mode compressé, chaque vidage produit une trame (voir ttyRecord.h). Le tampon
+  plein est passé à un thread compresseur qui fait deflate et l'écriture, pendant
+  que le relais continue de remplir un second tampon.
+ */
+struct ttyRecordBuffer_s {
+    int            fd;
+    char           nom[1100];          /* nom du fichier, ou nom donné au collecteur */
+    struct bastionStats_s* stats;      /* compteurs de la session */
+    char*          data;
+    size_t         used;
+    size_t         capacity;
+    size_t         flushBytes;         /* seuil de vidage, capacity garde en plus la place d'un record en mode compressé */
+    long           flushMs;
+    struct timeval oldest;             /* horodatage du plus ancien enregistrement pas encore écrit */
+    int64_t        last;               /* horodatage (µs) du dernier record, base du delta du suivant */
+    uint64_t       recno;              /* numéro du prochain record */
+    uint64_t       written;            /* octets déjà écrits dans le fichier */
+    struct ttyRecordIndexEntry_s* index; /* points d'index, écrits en fin de fichier à la fermeture */
+    size_t         indexNb;
+    size_t         indexCapacity;
+    volatile sig_atomic_t flushing;    /* writev() en cours : le handler de signal ne doit pas réécrire */
+
+    /* envoi au collecteur plutôt qu'à un fichier local */
+    size_t         message;            /* taille max d'un message au collecteur, 0 = fichier local */
+    bool           repli;              /* collecteur perdu en cours de session : la suite va dans un fichier local, sans index */
+
+    /* fdatasync() groupé, par le thread commun à tous les enregistrements */
+    long           syncMs;             /* 0 = jamais */
+    uint64_t       synced;             /* valeur de written au dernier fdatasync() */
+    bool           syncEnCours;        /* le thread fdatasync s'en sert, la fermeture attend */
+
+    /* mode en trames : compressé, ou stocké avec crc */
+    bool           frames;
+    int            compress;           /* niveau deflate, 0 = trames stockées ou pas de trames */
+    int64_t        frameStart;         /* base du delta du premier record de la trame en cours de remplissage */
+    uint64_t       frameRecno;         /* numéro du premier record de la trame en cours de remplissage */
+    pthread_t       compresseur;
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    char*          spare;              /* second tampon, NULL tant que le compresseur s'en sert */
+    bool           jobPending;
+    bool           stop;
+    struct {
+        char*      data;
+        size_t     len;
+        int64_t    start;
+        uint64_t   recno;
+    } job;                             /* trame à compresser */
 };
 
-void ttyRecordWrite(int fd, int type, int len, char* data) {
-    struct ttyRecordEntry_s record;
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
+static struct ttyRecordBuffer_s* recordEnCours = NULL; /* pour le vidage depuis un handler de signal, hors moteur */
+void moteurSignalVidage(void);                          /* en moteur, enregistrements du worker qui reçoit le signal */
 
-    record.tv_sec  = tv.tv_sec;
-    record.tv_usec = tv.tv_usec;
-    record.type    = type;
-    record.len     = len;
+/*
+  Thread fdatasync, un seul pour tous les enregistrements du process (un seul hors
+  moteur) : toutes les config.recordSyncMs, fdatasync() de ceux qui ont été écrits
+  depuis le précédent. Le relais n'attend jamais le disque, et une coupure ne perd
+  pas plus que flushMs + syncMs.
+ */
+static struct {
+    pthread_mutex_t mutex;              /* protège aussi le remplacement de rec->fd par le repli */
+    pthread_cond_t  fini;               /* fin d'un fdatasync(), attendue par la fermeture */
+    bool            lance;
+    struct ttyRecordBuffer_s** recs;
+    size_t          nb;
+    size_t          capacite;
+} synchro = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, false, NULL, 0, 0 };
+
+long msDepuis(struct timeval* avant, struct timeval* maintenant) {
+    return (maintenant->tv_sec - avant->tv_sec) * 1000 + (maintenant->tv_usec - avant->tv_usec) / 1000;
+}
+
+/* writev() jusqu'au bout, en reprenant après une écriture partielle ou EINTR */
+int writevComplet(int fd, struct iovec* iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
 
-    write(fd, &record, sizeof(record));
-    if (len>0) write(fd, data, len);
-    
+/*
+  Envoi en messages d'au plus max octets sur une socket SOCK_SEQPACKET : chaque
+  sendmsg() part en entier ou pas du tout. MSG_NOSIGNAL : un collecteur disparu
+  donne EPIPE, pas SIGPIPE.
+ */
+int envoieMessages(int fd, struct iovec* iov, int iovcnt, size_t max) {
+    while (true) {
+        while (iovcnt > 0 && iov->iov_len == 0) {
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt == 0) return 0;  /* jamais de message vide : le collecteur le prendrait pour la fin */
+
+        struct iovec morceau[8];
+        int nb = 0;
+        size_t total = 0;
+        for (int i=0; i<iovcnt && nb < 8 && total < max; i++) {
+            size_t len = iov[i].iov_len < max - total ? iov[i].iov_len : max - total;
+            morceau[nb++] = (struct iovec) { iov[i].iov_base, len };
+            total += len;
+        }
+        struct msghdr msg = { .msg_iov = morceau, .msg_iovlen = nb };
+        if (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (iovcnt > 0 && total >= iov->iov_len) {
+            total -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + total;
+            iov->iov_len -= total;
+        }
+    }
 }
 
-char* ttyRecordFilename() {
-    static char r[1024] = ""; // /home/ber/truc";
-    if (r[0]) return r; /* a déjà été appelé - Pas du tout thread safe !*/
+char* ttyRecordFilename(struct ttyRecordBuffer_s* rec) {
+    if (rec->nom[0]) return rec->nom; /* a déjà été appelé */
     struct tm tm;
     time_t t = time(NULL);
     localtime_r(&t, &tm);
-    strftime(r, 1023, "/tmp/ttyrecord-%FT%T%z", &tm);
-    return r;
+    strftime(rec->nom, 1024, config.recordFile, &tm);
+    return rec->nom;
+}
+
+/*
+  Crée le fichier d'enregistrement local. Le nom a une résolution d'une seconde :
+  si deux sessions tombent dans la même, la seconde prend le suffixe -2, puis -3...
+  O_EXCL évite que deux bastions lancés ensemble écrivent dans le même fichier.
+  Un nom qui n'est pas un fichier ordinaire (/dev/null...) est ouvert tel quel.
+ */
+int ttyRecordCree(struct ttyRecordBuffer_s* rec) {
+    char* nom = ttyRecordFilename(rec);
+    size_t len = strlen(nom);
+    for (int essai = 1; essai < 1000; essai++) {
+        if (essai > 1) snprintf(nom + len, sizeof(rec->nom) - len, "-%d", essai);
+        /* O_CLOEXEC : le moteur lance d'autres shells pendant que celui-ci est ouvert */
+        int r = open(nom, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        if (r >= 0 || errno != EEXIST) return r;
+
+        struct stat st;
+        if (stat(nom, &st) == 0 && !S_ISREG(st.st_mode)) return open(nom, O_WRONLY | O_CLOEXEC);
+    }
+    errno = EEXIST;
+    return -1;
+}
+
+/* Connexion au collecteur et message d'ouverture ; -1 s'il ne répond pas */
+int collecteurConnecte(const char* chemin, int64_t start, pid_t pid, const char* nom) {
+    struct sockaddr_un adresse = { .sun_family = AF_UNIX };
+    if (strlen(chemin) >= sizeof(adresse.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(adresse.sun_path, chemin);
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    uint8_t hello[TTY_COLLECTOR_HELLO_LEN + TTY_COLLECTOR_NAME_MAX];
+    size_t len = ttyCollectorHelloEncode(hello, pid, start, nom);
+    if (connect(fd, (struct sockaddr*)&adresse, sizeof(adresse)) < 0 || send(fd, hello, len, MSG_NOSIGNAL) != (ssize_t)len) {
+        int e = errno;
+        close(fd);
+        errno = e;
+        return -1;
+    }
+    return fd;
+}
+
+/*
+  Le collecteur ne répond plus : la suite de la session part dans un fichier
+  local, derrière un entête de fichier neuf. base est la base du delta du premier
+  record qui y sera écrit. Ce qui a déjà été envoyé reste chez le collecteur ;
+  les offsets de l'index n'ont plus cours, replay le reconstruira.
+ */
+void ttyRecordRepli(struct ttyRecordBuffer_s* rec, int64_t base) {
+    int fd = ttyRecordCree(rec);
+    if (fd < 0) {
+        journalErreur("open() du fichier d'enregistrement de repli");
+        return;
+    }
+    journal("Collecteur perdu, suite de l'enregistrement dans : %s", ttyRecordFilename(rec));
+    pthread_mutex_lock(&synchro.mutex);
+    close(rec->fd);
+    rec->fd = fd;
+    pthread_mutex_unlock(&synchro.mutex);
+    rec->message = 0;
+    rec->repli = true;
+
+    int flags = rec->compress ? TTY_RECORD_FLAG_DEFLATE : (rec->frames ? TTY_RECORD_FLAG_CRC : 0);
+    struct ttyRecordFileHeader_s h = { TTY_RECORD_VERSION, flags, base };
+    uint8_t entete[TTY_RECORD_FILE_HEADER_LEN];
+    ttyRecordFileHeaderEncode(entete, &h);
+    if (write(fd, entete, sizeof(entete)) != sizeof(entete)) {
+        journalErreur("write() de l'entête du fichier d'enregistrement tty");
+    }
+}
+
+/*
+  Toute écriture de l'enregistrement passe par ici (sauf splice() et le handler
+  de signal en mode sans trames) : writev() vers le fichier, ou messages vers le
+  collecteur, avec repli sur un fichier local s'il a disparu. Au plus 4 morceaux.
+ */
+int ttyRecordEnvoie(struct ttyRecordBuffer_s* rec, struct iovec* iov, int iovcnt, int64_t base) {
+    if (rec->message == 0) return writevComplet(rec->fd, iov, iovcnt);
+
+    struct iovec copie[4];
+    memcpy(copie, iov, iovcnt * sizeof(*iov));
+    if (envoieMessages(rec->fd, iov, iovcnt, rec->message) == 0) return 0;
+    if (dansHandler) return -1;
+    journalErreur("envoi au collecteur");
+    ttyRecordRepli(rec, base);
+    return writevComplet(rec->fd, copie, iovcnt);
+}
+
+/* Nouveau point d'index, s'il est assez loin du précédent */
+void ttyRecordIndexAdd(struct ttyRecordBuffer_s* rec, uint64_t offset, uint64_t recno, int64_t base) {
+    if (rec->indexNb > 0 && offset - rec->index[rec->indexNb-1].offset < TTY_RECORD_INDEX_EVERY) return;
+
+    if (rec->indexNb == rec->indexCapacity) {
+        size_t capacity = rec->indexCapacity ? 2 * rec->indexCapacity : 64;
+        struct ttyRecordIndexEntry_s* index = realloc(rec->index, capacity * sizeof(*index));
+        if (index == NULL) return; /* l'index sera reconstruit par replay */
+        rec->index = index;
+        rec->indexCapacity = capacity;
+    }
+    rec->index[rec->indexNb++] = (struct ttyRecordIndexEntry_s) { offset, recno, base };
+}
+
+/*
+  Ecriture directe, en mode non compressé. Avec crc, les morceaux forment une
+  trame stockée : son entête, crc compris, part dans le même writev().
+ */
+void ttyRecordFlushIov(struct ttyRecordBuffer_s* rec, struct iovec* iov, int iovcnt) {
+    uint64_t debut = statsMaintenantUs();
+    struct iovec avecEntete[4];
+    uint8_t entete[TTY_RECORD_FRAME_HEADER_LEN];
+
+    if (rec->frames) {
+        size_t total = 0;
+        uLong crc = crc32(0, NULL, 0);
+        for (int i=0; i<iovcnt; i++) {
+            if (iov[i].iov_len) crc = crc32(crc, iov[i].iov_base, iov[i].iov_len);
+            total += iov[i].iov_len;
+        }
+        struct ttyRecordFrameHeader_s h = { TTY_RECORD_FRAME_STORED, total, total, rec->frameStart, rec->frameRecno, crc };
+        ttyRecordFrameHeaderEncode(entete, &h);
+        ttyRecordIndexAdd(rec, rec->written, rec->frameRecno, rec->frameStart);
+        avecEntete[0] = (struct iovec) { entete, sizeof(entete) };
+        memcpy(avecEntete + 1, iov, iovcnt * sizeof(*iov));
+        iov = avecEntete;
+        iovcnt++;
+    }
+
+    for (int i=0; i<iovcnt; i++) rec->written += iov[i].iov_len;
+    rec->flushing = 1;
+    if (ttyRecordEnvoie(rec, iov, iovcnt, rec->frameStart) < 0) {
+        journalErreur("writev() sur le fichier d'enregistrement tty");
+    }
+    statsFlush(rec->stats, debut);
+    rec->used = 0;
+    rec->flushing = 0;
+}
+
+/* Ecrit une trame, entête et données en un seul writev() */
+void ttyRecordFrameWrite(struct ttyRecordBuffer_s* rec, int method, char* data, size_t clen, size_t ulen, int64_t start, uint64_t recno) {
+    struct ttyRecordFrameHeader_s h = { method, clen, ulen, start, recno, crc32(0, (uint8_t*)data, clen) };
+    uint8_t entete[TTY_RECORD_FRAME_HEADER_LEN];
+    ttyRecordFrameHeaderEncode(entete, &h);
+
+    struct iovec iov[2] = {
+        { entete, sizeof(entete) },
+        { data,   clen }
+    };
+    if (ttyRecordEnvoie(rec, iov, 2, start) < 0) {
+        journalErreur("writev() d'une trame sur le fichier d'enregistrement tty");
+    }
+}
+
+/* Thread compresseur : deflate de chaque trame confiée, puis écriture */
+void* ttyRecordCompresseur(void* arg) {
+    struct ttyRecordBuffer_s* rec = arg;
+    uLongf taille = compressBound(rec->capacity);
+    char* sortie = malloc(taille);
+
+    pthread_mutex_lock(&rec->mutex);
+    while (true) {
+        while (!rec->jobPending && !rec->stop) pthread_cond_wait(&rec->cond, &rec->mutex);
+        if (!rec->jobPending) break;
+        pthread_mutex_unlock(&rec->mutex);
+
+        uint64_t debut = statsMaintenantUs();
+        ttyRecordIndexAdd(rec, rec->written, rec->job.recno, rec->job.start);
+
+        uLongf clen = taille;
+        if (sortie && compress2((Bytef*)sortie, &clen, (Bytef*)rec->job.data, rec->job.len, rec->compress) == Z_OK && clen < rec->job.len) {
+            ttyRecordFrameWrite(rec, TTY_RECORD_FRAME_DEFLATE, sortie, clen, rec->job.len, rec->job.start, rec->job.recno);
+            __atomic_fetch_add(&rec->written, TTY_RECORD_FRAME_HEADER_LEN + clen, __ATOMIC_RELAXED);
+        } else {
+            /* incompressible : trame stockée telle quelle */
+            ttyRecordFrameWrite(rec, TTY_RECORD_FRAME_STORED, rec->job.data, rec->job.len, rec->job.len, rec->job.start, rec->job.recno);
+            __atomic_fetch_add(&rec->written, TTY_RECORD_FRAME_HEADER_LEN + rec->job.len, __ATOMIC_RELAXED);
+        }
+        statsFlush(rec->stats, debut);
+
+        pthread_mutex_lock(&rec->mutex);
+        rec->spare = rec->job.data;
+        rec->jobPending = false;
+        pthread_cond_broadcast(&rec->cond);
+    }
+    pthread_mutex_unlock(&rec->mutex);
+    free(sortie);
+    return NULL;
+}
+
+/* Thread fdatasync, voir synchro plus haut */
+void* ttyRecordSynchroniseur(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&synchro.mutex);
+    while (true) {
+        pthread_mutex_unlock(&synchro.mutex);
+        struct timespec attente = { config.recordSyncMs / 1000, (config.recordSyncMs % 1000) * 1000000 };
+        nanosleep(&attente, NULL);
+        pthread_mutex_lock(&synchro.mutex);
+
+        /* la liste peut changer pendant un fdatasync() : un enregistrement sauté le sera au tour suivant */
+        for (size_t i=0; i<synchro.nb; i++) {
+            struct ttyRecordBuffer_s* rec = synchro.recs[i];
+            uint64_t written = __atomic_load_n(&rec->written, __ATOMIC_RELAXED);
+            if (written == rec->synced) continue;
+            /* copie du descripteur : le repli peut fermer et remplacer rec->fd pendant le fdatasync() */
+            int fd = dup(rec->fd);
+            if (fd < 0) continue;
+            rec->syncEnCours = true;
+            pthread_mutex_unlock(&synchro.mutex);
+
+            uint64_t debut = statsMaintenantUs();
+            if (fdatasync(fd) < 0 && errno != EINVAL) journalErreur("fdatasync() sur le fichier d'enregistrement tty");
+            close(fd);
+            uint64_t duree = statsMaintenantUs() - debut;
+            __atomic_fetch_add(&rec->stats->syncs, 1, __ATOMIC_RELAXED);
+            statsMax(&rec->stats->syncMaxUs, duree);
+
+            pthread_mutex_lock(&synchro.mutex);
+            rec->synced = written;
+            rec->syncEnCours = false;
+            pthread_cond_broadcast(&synchro.fini);
+        }
+    }
+    return NULL;
+}
+
+/* Inscription auprès du thread fdatasync, lancé à la première ; false s'il ne peut pas l'être */
+bool ttyRecordSyncAjoute(struct ttyRecordBuffer_s* rec) {
+    bool ok;
+    pthread_mutex_lock(&synchro.mutex);
+    if (!synchro.lance) {
+        pthread_t thread;
+        synchro.lance = pthread_create(&thread, NULL, ttyRecordSynchroniseur, NULL) == 0;
+        if (synchro.lance) pthread_detach(thread);
+        else journalErreur("pthread_create() du thread fdatasync");
+    }
+    if (synchro.lance && synchro.nb == synchro.capacite) {
+        size_t capacite = synchro.capacite ? 2 * synchro.capacite : 16;
+        struct ttyRecordBuffer_s** recs = realloc(synchro.recs, capacite * sizeof(*recs));
+        if (recs) {
+            synchro.recs = recs;
+            synchro.capacite = capacite;
+        }
+    }
+    ok = synchro.lance && synchro.nb < synchro.capacite;
+    if (ok) synchro.recs[synchro.nb++] = rec;
+    pthread_mutex_unlock(&synchro.mutex);
+    return ok;
+}
+
+/* Désinscription, après le fdatasync() éventuellement en cours sur cet enregistrement */
+void ttyRecordSyncRetire(struct ttyRecordBuffer_s* rec) {
+    pthread_mutex_lock(&synchro.mutex);
+    while (rec->syncEnCours) pthread_cond_wait(&synchro.fini, &synchro.mutex);
+    for (size_t i=0; i<synchro.nb; i++) {
+        if (synchro.recs[i] != rec) continue;
+        synchro.recs[i] = synchro.recs[--synchro.nb];
+        break;
+    }
+    pthread_mutex_unlock(&synchro.mutex);
+}
+
+/* Mode compressé : confie le tampon courant au compresseur et reprend le second */
+void ttyRecordFlushFrame(struct ttyRecordBuffer_s* rec) {
+    pthread_mutex_lock(&rec->mutex);
+    while (rec->jobPending) pthread_cond_wait(&rec->cond, &rec->mutex); /* le précédent n'est pas fini */
+
+    rec->flushing = 1;
+    rec->job.data  = rec->data;
+    rec->job.len   = rec->used;
+    rec->job.start = rec->frameStart;
+    rec->job.recno = rec->frameRecno;
+    rec->jobPending = true;
+    rec->data  = rec->spare;
+    rec->spare = NULL;
+    rec->used  = 0;
+    rec->flushing = 0;
+
+    pthread_cond_broadcast(&rec->cond);
+    pthread_mutex_unlock(&rec->mutex);
 }
 
-int ttyRecordOpen() {
-    int r = open(ttyRecordFilename(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-    printf("Nom de l'enregistrement : %s\n", ttyRecordFilename() );
+void ttyRecordFlush(struct ttyRecordBuffer_s* rec) {
+    if (rec->used == 0) return;
+    if (rec->compress) {
+        ttyRecordFlushFrame(rec);
+        return;
+    }
+    struct iovec iov = { rec->data, rec->used };
+    ttyRecordFlushIov(rec, &iov, 1);
+}
+
+/* Entête v2 du record, horodaté maintenant, delta par rapport au précédent */
+size_t ttyRecordHeader(struct ttyRecordBuffer_s* rec, uint8_t* entete, int type, size_t len, struct timeval* tv) {
+    gettimeofday(tv, NULL);
+    int64_t maintenant = timevalUsec(tv);
+    size_t n = ttyRecordHeaderEncode(entete, type, len, maintenant - rec->last);
+    rec->last = maintenant;
+    return n;
+}
+
+void ttyRecordWrite(struct ttyRecordBuffer_s* rec, int type, int len, char* data) {
+    uint8_t entete[TTY_RECORD_HEADER_MAX];
+    struct timeval tv;
+    int64_t precedent = rec->last;
+    size_t lenEntete = ttyRecordHeader(rec, entete, type, len, &tv);
+    rec->recno++;
+
+    if (rec->compress) {
+        /* un record n'est jamais coupé entre deux trames */
+        if (rec->used + lenEntete + len > rec->capacity) ttyRecordFlush(rec);
+        if (lenEntete + len > rec->capacity) {
+            journal("Record de %d octets trop gros pour une trame, ignoré", len);
+            return;
+        }
+    } else if (rec->used + lenEntete + len > rec->capacity) {
+        if (lenEntete + len > rec->capacity / 2) {
+            /* gros morceau : écrit avec ce qui est en attente, sans recopie dans le tampon */
+            if (rec->used == 0) {
+                rec->frameStart = precedent;
+                rec->frameRecno = rec->recno - 1;
+            }
+            if (!rec->frames) ttyRecordIndexAdd(rec, rec->written + rec->used, rec->recno - 1, precedent);
+            struct iovec iov[3] = {
+                { rec->data, rec->used },
+                { entete,    lenEntete },
+                { data,      len }
+            };
+            ttyRecordFlushIov(rec, iov, 3);
+            return;
+        }
+        ttyRecordFlush(rec);
+    }
+
+    if (rec->used == 0) {
+        rec->oldest     = tv;
+        rec->frameStart = precedent;
+        rec->frameRecno = rec->recno - 1;
+    }
+    if (!rec->frames) ttyRecordIndexAdd(rec, rec->written + rec->used, rec->recno - 1, precedent);
+    /* used n'avance qu'une fois le record complet : le vidage sur signal fatal n'écrit jamais un entête sans ses données */
+    size_t used = rec->used;
+    memcpy(rec->data + used, entete, lenEntete);
+    used += lenEntete;
+    if (len > 0) memcpy(rec->data + used, data, len);
+    used += len;
+    __atomic_signal_fence(__ATOMIC_RELEASE);
+    rec->used = used;
+
+    if (type == TTY_RECORD_EXIT || rec->used >= rec->flushBytes || msDepuis(&rec->oldest, &tv) >= rec->flushMs) ttyRecordFlush(rec);
+}
+
+/*
+  Variante pour le relais zéro-copie : les len octets à enregistrer attendent dans
+  un pipe. Un gros morceau part directement du pipe vers le fichier par splice(),
+  derrière son entête. Sinon, ou si on a besoin de voir les octets (interception
+  des caractères de contrôle, mode compressé), ils sont lus dans buffer puis
+  enregistrés normalement.
+  Retourne le nombre d'octets laissés dans buffer (0 si passés par splice()).
+ */
+size_t ttyRecordWriteFromPipe(struct ttyRecordBuffer_s* rec, int type, int pipeFd, size_t len, char* buffer, bool besoinDonnees) {
+    if (!besoinDonnees && !rec->frames && rec->message == 0 && TTY_RECORD_HEADER_MAX + len > rec->capacity / 2) {
+        uint8_t entete[TTY_RECORD_HEADER_MAX];
+        struct timeval tv;
+        int64_t precedent = rec->last;
+        size_t lenEntete = ttyRecordHeader(rec, entete, type, len, &tv);
+        rec->recno++;
+        ttyRecordIndexAdd(rec, rec->written + rec->used, rec->recno - 1, precedent);
+
+        struct iovec iov[2] = {
+            { rec->data, rec->used },
+            { entete,    lenEntete }
+        };
+        ttyRecordFlushIov(rec, iov, 2);
+
+        size_t reste = len;
+        while (reste > 0) {
+            ssize_t n = splice(pipeFd, NULL, rec->fd, NULL, reste, SPLICE_F_MOVE);
+            if (n <= 0) break;
+            reste -= n;
+            rec->written += n;
+        }
+        if (reste == 0) return 0;
+
+        /* le fichier refuse splice() : on termine par read()/write(), l'entête est déjà écrit */
+        while (reste > 0) {
+            ssize_t n = read(pipeFd, buffer, reste);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            struct iovec morceau = { buffer, n };
+            if (writevComplet(rec->fd, &morceau, 1) < 0) {
+                journalErreur("write() sur le fichier d'enregistrement tty");
+                return 0;
+            }
+            reste -= n;
+            rec->written += n;
+        }
+        if (reste > 0) {
+            /* l'entête annonce len octets : des zéros à la place de ceux perdus, les records suivants restent lisibles */
+            journal("Enregistrement tty : %zu octets perdus dans le pipe, remplacés par des zéros", reste);
+            memset(buffer, 0, reste);
+            struct iovec zeros = { buffer, reste };
+            if (writevComplet(rec->fd, &zeros, 1) < 0) journalErreur("write() sur le fichier d'enregistrement tty");
+            else rec->written += reste;
+        }
+        return 0;
+    }
+
+    size_t nlu = 0;
+    while (nlu < len) {
+        ssize_t n = read(pipeFd, buffer + nlu, len - nlu);
+        if (n <= 0) break;
+        nlu += n;
+    }
+    ttyRecordWrite(rec, type, nlu, buffer);
+    return nlu;
+}
+
+/* Délai en ms avant que le contenu du tampon doive être écrit, -1 s'il est vide */
+int ttyRecordTimeout(struct ttyRecordBuffer_s* rec) {
+    if (rec->used == 0) return -1;
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    long reste = rec->flushMs - msDepuis(&rec->oldest, &tv);
+    return reste > 0 ? reste : 0;
+}
+
+/* A appeler régulièrement depuis la boucle principale */
+void ttyRecordTick(struct ttyRecordBuffer_s* rec) {
+    if (ttyRecordTimeout(rec) == 0) ttyRecordFlush(rec);
+}
+
+/* Ecrit ce qui est en attente, depuis un handler de signal */
+void ttyRecordSignalVidage(struct ttyRecordBuffer_s* rec) {
+    if (rec && !rec->flushing && rec->frames && rec->used) {
+        /* trame stockée sans compression : le thread compresseur est peut-être au milieu
+           de la sienne, qui sera alors incomplète mais ignorée à la relecture */
+        ttyRecordFrameWrite(rec, TTY_RECORD_FRAME_STORED, rec->data, rec->used, rec->used, rec->frameStart, rec->frameRecno);
+        rec->used = 0;
+    }
+    if (rec && !rec->flushing) {
+        /* write() est async-signal-safe, pas de printf ici */
+        char* p = rec->data;
+        size_t reste = rec->used;
+        while (reste > 0) {
+            ssize_t n = write(rec->fd, p, rec->message && reste > rec->message ? rec->message : reste);
+            if (n <= 0) break;
+            p += n;
+            reste -= n;
+        }
+        rec->used = 0;
+    }
+}
+
+/* Sur signal fatal : écrit ce qui est en attente, puis laisse le signal suivre son cours */
+void ttyRecordSignalHandler(int sig) {
+    dansHandler = 1;
+    if (recordEnCours) ttyRecordSignalVidage(recordEnCours);
+    else moteurSignalVidage();
+    raise(sig); /* SA_RESETHAND : le comportement par défaut s'applique au retour */
+}
+
+void installeRecordSignalHandlers() {
+    const int signaux[] = { SIGHUP, SIGINT, SIGQUIT, SIGTERM, SIGABRT, SIGSEGV, SIGBUS, SIGFPE, SIGILL, 0 };
+    struct sigaction act = { 0 };
+
+    act.sa_flags = SA_RESETHAND;
+    act.sa_handler = &ttyRecordSignalHandler;
+
+    for (int i=0; signaux[i]; i++) {
+        if (sigaction(signaux[i], &act, NULL) == -1) {
+            journalErreur("sigaction");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/* pid : celui de la session, annoncé au collecteur (le nôtre, ou celui du shim en moteur) */
+struct ttyRecordBuffer_s* ttyRecordOpen(struct bastionStats_s* stats, pid_t pid) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+
+    struct ttyRecordBuffer_s* rec = calloc(1, sizeof(struct ttyRecordBuffer_s));
+    if (rec == NULL) {
+        journalErreur("Erreur sur malloc()");
+        abort();
+    }
+
+    int r = -1;
+    if (config.collector[0]) {
+        r = collecteurConnecte(config.collector, timevalUsec(&tv), pid, ttyRecordFilename(rec));
+        if (r >= 0) journal("Enregistrement envoyé au collecteur %s sous le nom : %s", config.collector, ttyRecordFilename(rec));
+        else journal("Collecteur %s injoignable (%s), enregistrement local", config.collector, strerror(errno));
+    }
+    bool collecteur = r >= 0;
+    if (!collecteur) {
+        r = ttyRecordCree(rec);
+        journal("Nom de l'enregistrement : %s", ttyRecordFilename(rec) );
+    }
     if (r < 0) {
-        perror("open() sur le fichier d'enregistrement tty");
-        printf("Erreur sur : %s\n", ttyRecordFilename() );
+        journalErreur("open() sur le fichier d'enregistrement tty");
+        journal("Erreur sur : %s", ttyRecordFilename(rec) );
         abort();
     }
-    return r;
+
+    rec->fd         = r;
+    rec->stats      = stats;
+    rec->flushBytes = config.recordFlushBytes;
+    rec->capacity   = config.recordFlushBytes;
+    rec->flushMs    = config.recordFlushMs;
+    rec->compress   = config.recordCompress;
+    rec->frames     = rec->compress || config.recordCrc;
+    rec->syncMs     = collecteur ? 0 : config.recordSyncMs; /* le collecteur fait ses propres fdatasync() */
+    rec->message    = collecteur ? TTY_COLLECTOR_MESSAGE_MAX : 0;
+    if (rec->compress) {
+        /* de quoi loger un record de taille maximale au delà du seuil de vidage */
+        rec->capacity += config.relayBuffer + TTY_RECORD_HEADER_MAX + 1024;
+    }
+    if (rec->capacity > 0) {
+        rec->data = malloc(rec->capacity);
+        if (rec->data == NULL) {
+            journalErreur("Erreur sur malloc()");
+            abort();
+        }
+    }
+    if (rec->compress) {
+        rec->spare = malloc(rec->capacity);
+        if (rec->spare == NULL) {
+            journalErreur("Erreur sur malloc()");
+            abort();
+        }
+        pthread_mutex_init(&rec->mutex, NULL);
+        pthread_cond_init(&rec->cond, NULL);
+        if (pthread_create(&rec->compresseur, NULL, ttyRecordCompresseur, rec) != 0) {
+            journalErreur("pthread_create() du compresseur");
+            abort();
+        }
+    }
+
+    /* entête de fichier v2, écrit tout de suite : il sert de base au premier delta */
+    int flags = rec->compress ? TTY_RECORD_FLAG_DEFLATE : (rec->frames ? TTY_RECORD_FLAG_CRC : 0);
+    struct ttyRecordFileHeader_s h = { TTY_RECORD_VERSION, flags, timevalUsec(&tv) };
+    uint8_t entete[TTY_RECORD_FILE_HEADER_LEN];
+    ttyRecordFileHeaderEncode(entete, &h);
+    struct iovec iov = { entete, sizeof(entete) };
+    if (rec->message) {
+        /* collecteur perdu dès l'entête : le repli en écrit un lui-même */
+        if (envoieMessages(rec->fd, &iov, 1, rec->message) < 0) ttyRecordRepli(rec, h.start);
+    } else if (writevComplet(rec->fd, &iov, 1) < 0) {
+        journalErreur("write() de l'entête du fichier d'enregistrement tty");
+    }
+    rec->written = sizeof(entete);
+    rec->last = h.start;
+
+    if (rec->syncMs > 0 && !ttyRecordSyncAjoute(rec)) rec->syncMs = 0;
+    return rec;
+}
+
+/*
+  Index en fin de fichier : record TTY_RECORD_INDEX puis trailer de taille fixe.
+  En mode compressé, dans une dernière trame stockée, une fois le compresseur arrêté.
+ */
+void ttyRecordWriteIndex(struct ttyRecordBuffer_s* rec) {
+    if (rec->repli) return; /* offsets comptés depuis le début du flux envoyé au collecteur */
+    size_t taille = TTY_RECORD_HEADER_MAX + 10 + rec->indexNb * TTY_RECORD_INDEX_ENTRY_MAX + TTY_RECORD_TRAILER_LEN;
+    uint8_t* buffer = malloc(taille);
+    if (buffer == NULL) return; /* l'index sera reconstruit par replay */
+
+    uint8_t* payload = buffer + TTY_RECORD_HEADER_MAX;
+    size_t lenPayload = ttyRecordIndexEncode(payload, rec->index, rec->indexNb);
+    size_t lenEntete = ttyRecordHeaderEncode(buffer, TTY_RECORD_INDEX, lenPayload, 0);
+    memmove(buffer + lenEntete, payload, lenPayload);
+    size_t n = lenEntete + lenPayload;
+    ttyRecordTrailerEncode(buffer + n, rec->written);
+    n += TTY_RECORD_TRAILER_LEN;
+
+    if (rec->frames) {
+        ttyRecordFrameWrite(rec, TTY_RECORD_FRAME_STORED, (char*)buffer, n, n, rec->last, rec->recno);
+    } else {
+        struct iovec iov = { buffer, n };
+        ttyRecordFlushIov(rec, &iov, 1);
+    }
+    free(buffer);
+}
+
+void ttyRecordClose(struct ttyRecordBuffer_s* rec) {
+    ttyRecordFlush(rec);
+    if (rec->compress) {
+        /* le compresseur termine la dernière trame avant de s'arrêter */
+        pthread_mutex_lock(&rec->mutex);
+        rec->stop = true;
+        pthread_cond_broadcast(&rec->cond);
+        pthread_mutex_unlock(&rec->mutex);
+        pthread_join(rec->compresseur, NULL);
+        free(rec->spare);
+    }
+    if (rec->syncMs > 0) ttyRecordSyncRetire(rec);
+    ttyRecordWriteIndex(rec);
+    if (rec->syncMs > 0) fdatasync(rec->fd);
+    close(rec->fd);
+    free(rec->index);
+    free(rec->data);
+    free(rec);
+}
+
+
+/* Qui a lancé la session : nous-même, ou le shim reçu par le moteur */
+struct ttyRecordOrigine_s {
+    pid_t   pid, ppid, sid, pgid;
+    uid_t   uid;
+    char*   argv0;
+    char**  envp;
+};
+
+/* getenv() dans un environnement donné */
+char* envCherche(char** envp, const char* nom) {
+    size_t len = strlen(nom);
+    for (int i=0; envp && envp[i]; i++) {
+        if (strncmp(envp[i], nom, len) == 0 && envp[i][len] == '=') return envp[i] + len + 1;
+    }
+    return NULL;
 }
 
+/* Petit fichier de /proc/<pid>, sans sa fin de ligne ; vide s'il est illisible */
+void procLit(pid_t pid, const char* nom, char* out, size_t max) {
+    char chemin[64];
+    snprintf(chemin, sizeof(chemin), "/proc/%d/%s", (int)pid, nom);
+    out[0] = 0;
+    int fd = open(chemin, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    ssize_t n = read(fd, out, max - 1);
+    close(fd);
+    if (n < 0) n = 0;
+    while (n > 0 && (out[n-1] == '\n' || out[n-1] == ' ')) n--;
+    out[n] = 0;
+}
 
 /* 
   Mise en forme puis enregistrement du message demarrage de la session
  */
-void ttyRecordStartMessage(int fd, char* argv0, char* childShell) {
+void ttyRecordStartMessage(struct ttyRecordBuffer_s* rec, struct ttyRecordOrigine_s* o, char* childShell) {
     char buffer[1024];
     char *dest = buffer;  
     size_t r, reste=1023;
@@ -134,12 +1088,27 @@ void ttyRecordStartMessage(int fd, char* argv0, char* childShell) {
 
 
     /* les trucs numériques */
-    r = snprintf(dest, reste, "pid: %d\nppid: %d\nuid: %d\nsid: %d\npgid: %d\n",getpid(), getppid(), getuid(), getsid(0), getpgid(0));
+    r = snprintf(dest, reste, "pid: %d\nppid: %d\nuid: %d\nsid: %d\npgid: %d\n", o->pid, o->ppid, o->uid, o->sid, o->pgid);
     dest  += r;
     reste -= r;
 
+    /*
+      session d'audit du noyau, posée par pam_loginuid à la connexion et héritée
+      par le shell : clé de corrélation avec audit.log (ses=), voir auditMerge.
+      Lue sur le process qui a lancé la session, le shim en moteur.
+     */
+    char ses[16], loginuid[16];
+    procLit(o->pid, "sessionid", ses, sizeof(ses));
+    procLit(o->pid, "loginuid", loginuid, sizeof(loginuid));
+    if (ses[0] && strcmp(ses, TTY_AUDIT_SES_INCONNUE) != 0) {
+        r = snprintf(dest, reste, "auditSession: %s\nauditLoginUid: %s\n", ses, loginuid);
+        dest  += r;
+        reste -= r;
+    }
+
     /* les noms d'executables */
-    r = snprintf(dest, reste, "argv0: %s\nchildShell: %s\n", argv0, childShell);
+    r = snprintf(dest, reste, "argv0: %s\nchildShell: %s\n", o->argv0, childShell);
+    if (r >= reste) r = reste - 1; /* tronqué : les chaînes viennent du shim en moteur */
     dest  += r;
     reste -= r;
 
@@ -154,16 +1123,17 @@ void ttyRecordStartMessage(int fd, char* argv0, char* childShell) {
     NULL };
 
     for (int i=0; vars[i]; i++) {
-        char* val = getenv(vars[i]);
+        char* val = envCherche(o->envp, vars[i]);
         if (val) {
             r = snprintf(dest, reste, "%s: %s\n", vars[i], val);
+            if (r >= reste) break;
             dest  += r;
             reste -= r;
         }
         if (reste <=0) break;
     }
 
-    ttyRecordWrite(fd, TTY_RECORD_START, (dest-buffer), buffer);
+    ttyRecordWrite(rec, TTY_RECORD_START, (dest-buffer), buffer);
 
 }
 
@@ -173,23 +1143,22 @@ void ttyRecordStartMessage(int fd, char* argv0, char* childShell) {
  * https://www.cs.uleth.ca/~holzmann/C/system/ttyraw.c
  ******************************************************************************/
 
-static struct termios orig_termios;  /* TERMinal I/O Structure */
-
-int tty_reset(int ttyfd) {
+/* orig_termios : réglages d'origine, gardés par la session pour tty_reset() */
+int tty_reset(int ttyfd, struct termios* orig_termios) {
     /* flush and reset */
-    if (tcsetattr(ttyfd,TCSAFLUSH,&orig_termios) < 0) return -1;
+    if (tcsetattr(ttyfd,TCSAFLUSH,orig_termios) < 0) return -1;
     return 0;
 }
 
-void tty_raw(int ttyfd) {
+int tty_raw(int ttyfd, struct termios* orig_termios) {
     struct termios raw;
 
-    if (tcgetattr(ttyfd,&orig_termios) <0) {
-        perror("Can't get pts initial parameters");
-        abort();        
+    if (tcgetattr(ttyfd,orig_termios) <0) {
+        journalErreur("Can't get pts initial parameters");
+        return -1;
     } 
 
-    raw = orig_termios;  /* copy original and then modify below */
+    raw = *orig_termios;  /* copy original and then modify below */
 
     /* input modes - clear indicated ones giving: no break, no CR to NL, 
        no parity check, no strip char, no start/stop output (sic) control */
@@ -214,9 +1183,10 @@ void tty_raw(int ttyfd) {
 
     /* put terminal in raw mode after flushing */
     if (tcsetattr(ttyfd,TCSAFLUSH,&raw) < 0) {
-        perror("Can't set pts in raw mode");
-        abort();
+        journalErreur("Can't set pts in raw mode");
+        return -1;
     }    
+    return 0;
 }
 
 
@@ -233,262 +1203,1480 @@ ioctl_tty(2) manpage
 SIGWINCH
 */
 
-static int redimensionnementAfaire = 1; /* sera fait lors de la première boucle de poll() */
-
-void sigwinchHandler (int sig, siginfo_t *info, void *ucontext)
-{
-    redimensionnementAfaire = 1;
-}
-
-void installeSigwinchHandler() {
-    struct sigaction act = { 0 };
-
-    act.sa_flags = SA_SIGINFO;
-    act.sa_sigaction = &sigwinchHandler;
+/*
+  SIGWINCH, et SIGCHLD quand pidfd_open() n'est pas disponible, sont bloqués puis
+  lus par signalfd() dans la boucle epoll : ils sont traités dès leur arrivée.
+  https://man7.org/linux/man-pages/man2/signalfd.2.html
+ */
+int installeSignalFd(bool avecSigchld) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGWINCH);
+    if (avecSigchld) sigaddset(&mask, SIGCHLD);
+
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+        journalErreur("sigprocmask");
+        exit(EXIT_FAILURE);
+    }
 
-    if (sigaction(SIGWINCH, &act, NULL) == -1) {
-        perror("sigaction");
+    int fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0) {
+        journalErreur("signalfd");
         exit(EXIT_FAILURE);
     }
+    return fd;
 }
 
 /******************************************************************************
- * Gestion du processus fils, polling, état du bastion
+ * Interception des caractères de contrôle envoyés par le client
+ * Le pts amont est en raw, c'est donc à nous de traduire ^C, ^Z, ^\ en signaux
+ * pour le groupe de process d'avant plan du shell fils (voir notes en fin de
+ * fichier). Chaque morceau reçu est parcouru par blocs de 16 octets (SSE2), et
+ * un même signal n'est envoyé qu'une fois par morceau, même si un collage en
+ * contient des centaines.
  ******************************************************************************/
-struct bastionState_s {
-    pid_t     childPid;         /* PID du shell lancé en tant qu'enfant */
-    int       childPollableFd;  /* pour inclure le polling du child avec celui du pts*/
-    char*     ptsName;
-    int       ptsMasterFd;
-    int       ptsSlaveFd;
-    int       ttyRecordFd;
-    size_t    bytesFromServer;
-    size_t    bytesFromClient;
-};
-
 
-int lanceFils(char* childShell, int argc, char* argv[]) {
-    int r, fd; /* utilisé à courte portée pour les valeurs de retour, mais à plusieurs endroits  */
-    struct bastionState_s state;
-    memset((void*)&state, 0, sizeof(state));
-    
-
-    /* Préparation du pts */
-    state.ptsMasterFd = open("/dev/ptmx", O_RDWR ); 
-       /* Est-ce utile/nécessaire ? O_NOCTTY If pathname refers to a terminal device—see tty(4)—it will not become the process's controlling terminal even if the process does not have one. 
-          O_DIRECT créé un EINVAL dans ce contexte...
-       */
-    if (state.ptsMasterFd <0) {
-        perror("Erreur sur open(ptmx)");
-        abort();  
-    }
-
-    char* s = ptsname(state.ptsMasterFd);
-    if (s == NULL) {
-        /* Cas d'erreur */
-        perror("Erreur sur ptsname()");
-        abort();
-    }
-    state.ptsName = strdup(s);
+#define INTERCEPT_MAX 8
 
-    /* lancement du sous process */
-    state.childPid = fork();
-    if (state.childPid == -1) {
-       /* Cas d'erreurs possibles d'après man : EAGAIN ENOMEM ENOSYS ERESTARTNOINTR */
-       perror("Erreur sur le fork()");
-       abort(); /* TODO à gérer mieux ! */
+struct interception_s {
+    int            nb;
+    unsigned char  octet[INTERCEPT_MAX];
+    int            signal[INTERCEPT_MAX];
+    unsigned char  table[256];      /* octet -> 1 + indice dans octet[], 0 si non intercepté */
+};
 
-    } else if (state.childPid == 0) {
-        /* Cas fils : débloquer, ouvrir et utiliser le pts slave */
-        r = grantpt(state.ptsMasterFd);
-        if (r == -1) {
-            perror("Erreur fatale sur grantpt() "); // serait capté dans le canal vers le parent
-            abort();
+static struct interception_s interception;
+
+int signalParNom(const char* nom) {
+    const struct { const char* nom; int sig; } signaux[] = {
+        { "INT", SIGINT }, { "TSTP", SIGTSTP }, { "QUIT", SIGQUIT },
+        { "HUP", SIGHUP }, { "TERM", SIGTERM }, { "KILL", SIGKILL },
+        { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 },
+        { NULL, 0 }
+    };
+    if (strncmp(nom, "SIG", 3) == 0) nom += 3;
+    for (int i=0; signaux[i].nom; i++) {
+        if (strcmp(nom, signaux[i].nom) == 0) return signaux[i].sig;
+    }
+    return 0;
+}
 
+/* Analyse une liste du type "03:INT,1a:TSTP,1c:QUIT" */
+void interceptionInit(const char* liste) {
+    memset(&interception, 0, sizeof(interception));
+
+    char* copie = strdup(liste);
+    char* reste = copie;
+    char* element;
+    while ((element = strsep(&reste, ",")) != NULL) {
+        if (*element == 0) continue;
+
+        char* nomSignal = strchr(element, ':');
+        char* fin;
+        long octet = strtol(element, &fin, 16);
+        int sig = nomSignal ? signalParNom(nomSignal+1) : 0;
+        if (nomSignal == NULL || fin != nomSignal || octet < 0 || octet > 255 || sig == 0) {
+            journal("Interception ignorée : %s", element);
+            continue;
         }
-        r = unlockpt(state.ptsMasterFd);
-        if (r == -1) {
-            perror("Erreur fatale sur unlockpt() "); // serait capté dans le canal vers le parent
-            abort();
+        if (interception.nb == INTERCEPT_MAX) {
+            journal("Trop d'interceptions, ignorée : %s", element);
+            continue;
         }
+        interception.octet[interception.nb]  = octet;
+        interception.signal[interception.nb] = sig;
+        interception.table[octet] = interception.nb + 1;
+        interception.nb++;
+    }
+    free(copie);
+}
 
-        /* Ferme les descripteurs standard */
-        close(0);
-        close(1);
-        close(2);
-        close(state.ptsMasterFd);
-
-        
-        /* Ouvre le pts à la place */
-        state.ptsSlaveFd=open(state.ptsName, O_RDWR);
-        dup2(state.ptsSlaveFd, 0);
-        dup2(state.ptsSlaveFd, 1);
-        dup2(state.ptsSlaveFd, 2);
-       
-        setsid();
-
- 
-        /* Et lance le process fils */
-        argv[0] = childShell;
-        execv(childShell, argv);
-        perror("Erreur sur execve()");  // serait capté dans le canal vers le parent
-        abort();
-
-    } else {
-        /* cas parent : utiliser le pts master et faire suivre les données en enregistrant */
-        state.childPollableFd = pidfd_open(state.childPid, 0);
+/* Renvoie un masque des interceptions présentes dans data : bit i pour interception.octet[i] */
+unsigned interceptionScan(const unsigned char* data, size_t len) {
+    unsigned masque = 0;
+    unsigned tout = (1u << interception.nb) - 1;
+    size_t i = 0;
 
-        printf("Le shell fils a le PID %d\n", state.childPid);
-        printf("Notre PID est %d\n", getpid() );
+    if (interception.nb == 0) return 0;
 
-        /* prépare l'enregistrement tty*/
-        state.ttyRecordFd = ttyRecordOpen();
-        ttyRecordStartMessage(state.ttyRecordFd, argv[0], childShell);
+#ifdef __SSE2__
+    __m128i cibles[INTERCEPT_MAX];
+    for (int k=0; k<interception.nb; k++) cibles[k] = _mm_set1_epi8(interception.octet[k]);
 
+    for (; i + 16 <= len; i += 16) {
+        __m128i bloc = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i egal = _mm_cmpeq_epi8(bloc, cibles[0]);
+        for (int k=1; k<interception.nb; k++) egal = _mm_or_si128(egal, _mm_cmpeq_epi8(bloc, cibles[k]));
 
-        /* Buffer principal, pour les transferts dans les deux sens, et autres. Courte portée */
-        void* buffer = malloc(BUFFERSIZE);
-        if (buffer == NULL) {
-            perror("Erreur sur malloc() ");
-            abort();
+        int bits = _mm_movemask_epi8(egal);
+        while (bits) {
+            int j = __builtin_ctz(bits);
+            masque |= 1u << (interception.table[data[i + j]] - 1);
+            bits &= bits - 1;
         }
+        if (masque == tout) return masque;
+    }
+#endif
 
-        ssize_t nlu;    /* Combien a été lu, donc à renvoyer*/
-        ssize_t necrit; /* valeur de retour des write(), mais on s'attend à ce que les buffers soient toujours intégralement ingérés */
-        bool encore = true;
-        int exitStatus=0;
+    for (; i < len; i++) {
+        if (interception.table[data[i]]) masque |= 1u << (interception.table[data[i]] - 1);
+    }
+    return masque;
+}
 
-        tty_raw(0);
 
-        installeSigwinchHandler(); /* captation du signal pour redimensionnement */
 
-        while (encore) {
+/******************************************************************************
+ * Relais : une file de sortie bornée par direction, descripteurs non bloquants
+ * Tant que la file d'une direction est pleine, sa source n'est plus lue : un
+ * client lent ne bloque que ce qui lui est destiné, jamais l'autre sens.
+ ******************************************************************************/
 
-            /* prépare la structure de poll() */
-            struct pollfd fds[3];
-            memset((void*) fds, 0, sizeof(fds));
-            fds[0].fd = state.childPollableFd;
-            fds[0].events = POLLIN;
+/*
+  Relais zéro-copie avec splice() et tee()
+  Les octets passent de la source vers un pipe, sont dupliqués par tee() dans un
+  second pipe pour l'enregistrement, puis poussés du premier pipe vers la
+  destination : ils ne sont jamais recopiés dans notre espace mémoire, sauf
+  pour l'enregistrement des petits morceaux. En mode splice, la file de sortie
+  est le pipe lui-même.
+  https://man7.org/linux/man-pages/man2/splice.2.html
+ */
+struct spliceRelay_s {
+    bool actif;           /* passe à false définitivement si le noyau refuse */
+    int  pipe[2];         /* source -> destination */
+    int  pipeRecord[2];   /* copie tee() vers l'enregistrement */
+};
+
+/* Une direction du relais */
+struct relayDirection_s {
+    char*   nom;          /* pour les messages */
+    int     in;           /* source */
+    int     out;          /* destination */
+    int     type;         /* TTY_RECORD_SERVER_TO_CLIENT ou TTY_RECORD_CLIENT_TO_SERVER */
+    int     sens;         /* SENS_xxx, pour les statistiques */
+    char*   data;         /* file circulaire des octets lus mais pas encore écrits */
+    char*   partage;      /* en moteur, tampon du worker où lire tant que la file est vide, sinon NULL */
+    size_t  capacity;
+    size_t  debut;        /* position du premier octet en attente */
+    size_t  used;         /* octets en attente, dans data ou dans le pipe en mode splice */
+    bool    eof;          /* la source est fermée */
+    bool    erreur;       /* la destination est fermée, ce qui arrive encore est jeté */
+    struct spliceRelay_s splice;
+    struct bastionStats_s* stats;
+};
+
+/* Le noyau ne sait pas faire splice() avec ce type de descripteur */
+bool spliceRefuse(int err) {
+    return err == EINVAL || err == ENOSYS || err == EOPNOTSUPP || err == ESPIPE;
+}
+
+void spliceRelayInit(struct spliceRelay_s* sr, size_t capacity) {
+    sr->actif = false;
+    if (!config.relaySplice) return;
+
+    if (pipe2(sr->pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+        journalErreur("pipe2() pour le relais splice");
+        return;
+    }
+    if (pipe2(sr->pipeRecord, O_CLOEXEC) < 0) {
+        journalErreur("pipe2() pour le relais splice");
+        close(sr->pipe[0]);
+        close(sr->pipe[1]);
+        return;
+    }
+    /* Même capacité que la file du chemin classique, tee() peut alors tout dupliquer */
+    fcntl(sr->pipe[1], F_SETPIPE_SZ, capacity);
+    fcntl(sr->pipeRecord[1], F_SETPIPE_SZ, capacity);
+    sr->actif = true;
+}
+
+void spliceRelayClose(struct spliceRelay_s* sr) {
+    if (!sr->actif) return;
+    close(sr->pipe[0]);
+    close(sr->pipe[1]);
+    close(sr->pipeRecord[0]);
+    close(sr->pipeRecord[1]);
+    sr->actif = false;
+}
+
+/* Abandon du mode splice : ce qui attend dans le pipe passe dans la file classique (vide à ce moment) */
+void spliceRelayAbandon(struct relayDirection_s* dir) {
+    size_t nlu = 0;
+    while (nlu < dir->used) {
+        ssize_t n = read(dir->splice.pipe[0], dir->data + nlu, dir->used - nlu);
+        if (n <= 0) break;
+        nlu += n;
+    }
+    dir->debut = 0;
+    dir->used  = nlu;
+    spliceRelayClose(&dir->splice);
+}
+
+/* Allocation de la file propre à la direction ; abort() si impossible */
+void relayDirectionAlloue(struct relayDirection_s* dir) {
+    if (dir->data) return;
+    dir->data = malloc(dir->capacity);
+    if (dir->data == NULL) {
+        journalErreur("Erreur sur malloc()");
+        abort();
+    }
+}
+
+/*
+  partage : NULL hors moteur, la file est allouée tout de suite. En moteur, le
+  tampon du worker : la file n'est allouée que quand la destination n'a pas tout
+  pris, et rendue dès qu'elle se vide. Une session au repos n'a pas de file.
+ */
+void relayDirectionInit(struct relayDirection_s* dir, char* nom, int in, int out, int type, struct bastionStats_s* stats, char* partage) {
+    memset(dir, 0, sizeof(*dir));
+    dir->nom      = nom;
+    dir->in       = in;
+    dir->out      = out;
+    dir->type     = type;
+    dir->sens     = type == TTY_RECORD_SERVER_TO_CLIENT ? SENS_SERVEUR_CLIENT : SENS_CLIENT_SERVEUR;
+    dir->capacity = config.relayBuffer;
+    dir->stats    = stats;
+    spliceRelayInit(&dir->splice, dir->capacity);
+    /* le mode splice a besoin de la file pour ses replis */
+    if (partage == NULL || dir->splice.actif) relayDirectionAlloue(dir);
+    else dir->partage = partage;
+}
+
+void relayDirectionClose(struct relayDirection_s* dir) {
+    spliceRelayClose(&dir->splice);
+    free(dir->data);
+    dir->data = NULL;
+}
+
+/* La source peut être lue s'il y a de la place dans la file (vide en mode splice, voir tee()) */
+bool relayPeutLire(struct relayDirection_s* dir) {
+    if (dir->eof) return false;
+    if (dir->splice.actif) return dir->used == 0;
+    return dir->used < dir->capacity;
+}
+
+bool relayAEcrire(struct relayDirection_s* dir) {
+    return dir->used > 0 && !dir->erreur;
+}
+
+/*
+  Ecrit autant que possible de la file vers la destination, sans bloquer.
+  La file reste allouée même vidée : voir relayWrite() et relayRendVide().
+ */
+void relayEcrit(struct relayDirection_s* dir) {
+    while (dir->used > 0 && !dir->erreur) {
+        ssize_t n;
+        if (dir->splice.actif) {
+            n = splice(dir->splice.pipe[0], NULL, dir->out, NULL, dir->used, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0 && spliceRefuse(errno)) {
+                journal("splice() vers la destination refusé (%s), retour au relais classique", strerror(errno));
+                spliceRelayAbandon(dir);
+                continue;
+            }
+        } else {
+            size_t premier = dir->capacity - dir->debut;
+            if (premier > dir->used) premier = dir->used;
+            struct iovec iov[2] = {
+                { dir->data + dir->debut, premier },
+                { dir->data,              dir->used - premier }
+            };
+            n = writev(dir->out, iov, iov[1].iov_len ? 2 : 1);
+        }
+
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { /* on attendra EPOLLOUT */
+                dir->stats->blockedWrites[dir->sens]++;
+                return;
+            }
+            /* EPIPE, EIO... : la destination a disparu */
+            journal("Ecriture impossible vers %s : %s", dir->nom, strerror(errno));
+            dir->erreur = true;
+            dir->used   = 0;
+            return;
+        }
+
+        if ((size_t)n < dir->used) dir->stats->shortWrites[dir->sens]++;
+        dir->used -= n;
+        if (!dir->splice.actif) dir->debut = (dir->debut + n) % dir->capacity;
+    }
+    if (dir->used == 0) dir->debut = 0; /* les lectures suivantes seront contiguës */
+}
+
+/*
+  En moteur, file propre vidée : rendue, la session revient au tampon du worker.
+  Après relayRead(), seulement une fois la partie visible exploitée : elle est
+  dans cette file.
+ */
+void relayRendVide(struct relayDirection_s* dir) {
+    if (dir->used == 0 && dir->partage && dir->data != dir->partage) {
+        free(dir->data);
+        dir->data = NULL;
+    }
+}
+
+void relayWrite(struct relayDirection_s* dir) {
+    relayEcrit(dir);
+    relayRendVide(dir);
+}
+
+/* Fin d'une lecture dans le tampon du worker : ce qui n'a pas pu être écrit part dans une file propre */
+void relayRendPartage(struct relayDirection_s* dir) {
+    dir->data = NULL;
+    if (dir->used == 0) return;
+    relayDirectionAlloue(dir);
+    memcpy(dir->data, dir->partage + dir->debut, dir->used); /* contigu : la lecture est partie de 0 */
+    dir->debut = 0;
+}
+
+/* Lecture par splice(), seulement quand le pipe est vide : tee() ne duplique ainsi que le nouveau morceau */
+ssize_t relayReadSplice(struct relayDirection_s* dir, struct ttyRecordBuffer_s* rec, bool besoinDonnees, size_t* visible) {
+    ssize_t n = splice(dir->in, NULL, dir->splice.pipe[1], NULL, dir->capacity, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n <= 0) return n;
+
+    ssize_t ncopie = tee(dir->splice.pipe[0], dir->splice.pipeRecord[1], n, 0);
+    if (ncopie != n) {
+        /* tee() refusé ou incomplet : ce morceau passe par notre mémoire, les suivants par le chemin classique */
+        journal("tee() refusé ou incomplet, retour au relais classique");
+        char poubelle[4096];
+        while (ncopie > 0) {
+            ssize_t r = read(dir->splice.pipeRecord[0], poubelle, ncopie > (ssize_t)sizeof(poubelle) ? sizeof(poubelle) : (size_t)ncopie);
+            if (r <= 0) break;
+            ncopie -= r;
+        }
+        dir->used = n;
+        spliceRelayAbandon(dir);
+        ttyRecordWrite(rec, dir->type, dir->used, dir->data);
+        *visible = dir->used;
+        return dir->used;
+    }
+
+    dir->used = n;
+    *visible = ttyRecordWriteFromPipe(rec, dir->type, dir->splice.pipeRecord[0], n, dir->data, besoinDonnees);
+    return n;
+}
+
+/*
+  Lecture d'un morceau de la source vers la file, enregistrement, puis tentative
+  d'écriture immédiate. Retourne le nombre d'octets lus, dont *nvisible sont
+  visibles en mémoire à partir de *visible (0 si tout est passé par splice).
+  La file n'est pas rendue même vidée : l'appelant lit encore *visible, puis
+  appelle relayRendVide().
+ */
+ssize_t relayRead(struct relayDirection_s* dir, struct ttyRecordBuffer_s* rec, bool besoinDonnees, char** visible, size_t* nvisible) {
+    ssize_t n = -1;
+    *visible  = dir->data;
+    *nvisible = 0;
+
+    bool classique = !dir->splice.actif;
+    if (dir->splice.actif) {
+        n = relayReadSplice(dir, rec, besoinDonnees, nvisible);
+        if (n < 0 && spliceRefuse(errno)) {
+            journal("splice() refusé (%s), retour au relais classique", strerror(errno));
+            spliceRelayClose(&dir->splice);
+            classique = true;
+        }
+    }
+
+    bool prete = classique && dir->data == NULL; /* en moteur, file vide : le tampon du worker sert de file */
+    if (classique) {
+        if (prete) dir->data = dir->partage;
+        /* lecture dans la partie libre contiguë de la file */
+        size_t fin = (dir->debut + dir->used) % dir->capacity;
+        size_t libre = (fin >= dir->debut && dir->used < dir->capacity) ? dir->capacity - fin : dir->debut - fin;
+        n = read(dir->in, dir->data + fin, libre);
+        if (n > 0) {
+            dir->used += n;
+            ttyRecordWrite(rec, dir->type, n, dir->data + fin);
+            *visible  = dir->data + fin;
+            *nvisible = n;
+        } else if (prete) {
+            dir->data = NULL;
+        }
+    }
+
+    if (n < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        /* EIO sur le pts master : plus personne côté esclave */
+        if (errno != EIO) journal("Lecture impossible depuis %s : %s", dir->nom, strerror(errno));
+        dir->eof = true;
+        return 0;
+    }
+    if (n == 0) {
+        dir->eof = true;
+        return 0;
+    }
+    statsHistogramme(dir->stats->reads[dir->sens], n);
+
+    if (dir->erreur) {
+        /* destination fermée : on enregistre mais on jette */
+        if (dir->splice.actif) spliceRelayAbandon(dir);
+        dir->used = 0;
+    }
+    relayEcrit(dir);
+    if (prete) relayRendPartage(dir);
+    return n;
+}
+
+
+
+/******************************************************************************
+ * Gestion du processus fils, boucle epoll, état du bastion
+ ******************************************************************************/
+
+#define EPOLL_STDIN   1
+#define EPOLL_STDOUT  2
+#define EPOLL_PTS     3
+#define EPOLL_CHILD   4
+#define EPOLL_SIGNAL  5
+#define EPOLL_SHIM    6   /* moteur : socket du shim de la session */
+#define EPOLL_WORKER  7   /* moteur : connexions confiées au worker */
+
+struct bastionState_s;
+
+/* Un descripteur surveillé par epoll, et les événements actuellement demandés */
+struct bastionFd_s {
+    int       fd;
+    int       role;       /* EPOLL_xxx */
+    uint32_t  events;     /* 0 = pas dans l'ensemble epoll */
+    struct bastionState_s* state; /* session à laquelle il appartient, NULL pour ceux du worker */
+};
+
+struct bastionState_s {
+    pid_t     childPid;         /* PID du shell lancé en tant qu'enfant */
+    int       childPollableFd;  /* pidfd du fils, -1 si le noyau ne le permet pas (SIGCHLD par signalfd à la place) */
+    bool      childExited;
+    int       exitStatus;
+    int       signalFd;
+    char      ptsName[64];
+    int       ptsMasterFd;
+    int       clientIn;                 /* stdin et stdout de la session : 0 et 1, ou reçus du shim */
+    int       clientOut;
+    struct termios termiosOrig;         /* réglages de clientIn à rétablir en sortie */
+    bool      redimensionnementAfaire;  /* SIGWINCH reçu (ou signalé par le shim) */
+    struct ttyRecordBuffer_s* ttyRecord;
+    size_t    bytesFromServer;
+    size_t    bytesFromClient;
+    struct bastionStats_s stats;
+    char      statsName[1100];          /* <enregistrement>.stats */
+    uint64_t  statsUs;                  /* dernière écriture de ce fichier */
+
+    int       epollFd;
+    struct bastionFd_s stdinFd, stdoutFd, ptsFd, childFd, signalFdW;
+    struct relayDirection_s serverToClient;   /* pts master -> notre stdout */
+    struct relayDirection_s clientToServer;   /* notre stdin -> pts master */
+    int       stdinFlags, stdoutFlags;        /* à restaurer en sortie */
+
+    /* moteur seulement */
+    int       shimFd;
+    struct bastionFd_s shimW;
+    pid_t     shimPid;
+    bool      demarre;                  /* message d'ouverture reçu, shell lancé */
+    bool      shimParti;                /* le shim a fermé sa connexion */
+    bool      relaisFini;               /* session terminée, reste à récupérer le shell */
+    bool      touchee;                  /* a eu un événement dans le tour en cours du worker */
+    uint64_t  activiteUs;               /* dernier événement, pour le battement de coeur */
+    size_t    indice;                   /* place dans le tableau des sessions du worker */
+};
+
+
+/* Ajoute, modifie ou retire un descripteur de l'ensemble epoll selon les événements voulus */
+void bastionWatch(struct bastionState_s* state, struct bastionFd_s* bfd, uint32_t events) {
+    if (events == bfd->events || bfd->fd < 0) return;
+
+    struct epoll_event ev = { 0 };
+    ev.events = events;
+    ev.data.ptr = bfd;
+
+    /* un descripteur sans intérêt est retiré : EPOLLHUP serait sinon signalé en boucle */
+    int op = (events == 0) ? EPOLL_CTL_DEL : (bfd->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD);
+    if (epoll_ctl(state->epollFd, op, bfd->fd, &ev) < 0) {
+        journalErreur("epoll_ctl()");
+        return;
+    }
+    bfd->events = events;
+}
+
+/* Recalcule ce qu'on attend de chaque descripteur, en fonction du remplissage des files */
+void bastionUpdateEvents(struct bastionState_s* state) {
+    struct relayDirection_s* s2c = &state->serverToClient;
+    struct relayDirection_s* c2s = &state->clientToServer;
+
+    bastionWatch(state, &state->stdinFd,  relayPeutLire(c2s) ? EPOLLIN : 0);
+    bastionWatch(state, &state->stdoutFd, relayAEcrire(s2c) ? EPOLLOUT : 0);
+    bastionWatch(state, &state->ptsFd,    (relayPeutLire(s2c) ? EPOLLIN : 0) | (relayAEcrire(c2s) ? EPOLLOUT : 0));
+}
+
+/* Le shell fils a-t-il terminé ? Appelé sur le pidfd ou sur SIGCHLD */
+void bastionChildCheck(struct bastionState_s* state) {
+    int wstatus;
+    if (state->childExited) return;
+    if (waitpid(state->childPid, &wstatus, WNOHANG) <= 0) return;
+
+    if (WIFEXITED(wstatus)) {
+        state->exitStatus = WEXITSTATUS(wstatus);
+    } else if (WIFSIGNALED(wstatus)) {
+        state->exitStatus = 128 + WTERMSIG(wstatus); /* comme le shell */
+    }
+    state->childExited = true;
+    bastionWatch(state, &state->childFd, 0);
+}
+
+/*
+  Groupe de process d'avant plan du pts. TIOCGPGRP accepté sur le master pour le
+  compte de l'esclave : pas besoin d'ouvrir le pts à chaque fois. Sans terminal de
+  contrôle (pas de groupe d'avant plan), le groupe du shell fils, leader de sa session.
+ */
+pid_t bastionForegroundPgrp(struct bastionState_s* state) {
+    pid_t pgid = tcgetpgrp(state->ptsMasterFd);
+    if (pgid <= 0) pgid = state->childPid;
+    return pgid;
+}
+
+/* Vrai si la discipline de ligne du pts envoie déjà elle-même un signal pour cet octet */
+bool bastionLigneSignale(const struct termios* t, unsigned char octet) {
+    if (!(t->c_lflag & ISIG)) return false;
+    const int cc[] = { VINTR, VQUIT, VSUSP };
+    for (int i=0; i<3; i++) {
+        if (t->c_cc[cc[i]] != _POSIX_VDISABLE && t->c_cc[cc[i]] == octet) return true;
+    }
+    return false;
+}
+
+/* Envoie les signaux correspondants aux caractères de contrôle trouvés, une seule fois chacun.
+   Le pts est le terminal de contrôle du shell : en mode ISIG (shell en mode ligne), le noyau
+   traduit déjà ^C ^Z ^\ et il ne faut pas doubler le signal ; en raw (éditeur, readline...)
+   ou pour les autres octets, c'est à nous. */
+void bastionIntercept(struct bastionState_s* state, const char* data, size_t len) {
+    unsigned masque = interceptionScan((const unsigned char*)data, len);
+    if (masque == 0) return;
+
+    struct termios t; /* TCGETS sur le master rend les réglages de l'esclave */
+    bool ligne = tcgetattr(state->ptsMasterFd, &t) == 0;
+    pid_t pgid = bastionForegroundPgrp(state);
+    unsigned long envoyes = 0; /* plusieurs octets peuvent donner le même signal */
+    for (int k=0; k<interception.nb; k++) {
+        int sig = interception.signal[k];
+        if (!(masque & (1u << k)) || (envoyes & (1ul << sig))) continue;
+        if (ligne && bastionLigneSignale(&t, interception.octet[k])) continue;
+        killpg(pgid, sig);
+        envoyes |= 1ul << sig;
+    }
+}
+
+/* Lit les signaux en attente sur le signalfd */
+void bastionSignals(struct bastionState_s* state) {
+    struct signalfd_siginfo si;
+    while (read(state->signalFd, &si, sizeof(si)) == sizeof(si)) {
+        if (si.ssi_signo == SIGWINCH) state->redimensionnementAfaire = true;
+        if (si.ssi_signo == SIGCHLD)  bastionChildCheck(state);
+    }
+}
+
+/* Compteurs de la session, une ligne "clé: valeur" chacun, comme les records START et EXIT */
+size_t bastionStatsFormat(struct bastionState_s* state, char* dest, size_t reste) {
+    size_t n = snprintf(dest, reste,
+        "bytesServerToClient: %zu\nbytesClientToServer: %zu\n"
+        "loops: %llu\nwakeups: %llu\ntimeouts: %llu\ninterrupted: %llu\nwaitUs: %llu\nbusyUs: %llu\n"
+        "shortWritesServerToClient: %llu\nshortWritesClientToServer: %llu\n"
+        "blockedWritesServerToClient: %llu\nblockedWritesClientToServer: %llu\n"
+        "records: %llu\nrecordBytes: %llu\nrecordFlushes: %llu\nrecordFlushMaxUs: %llu\n"
+        "recordSyncs: %llu\nrecordSyncMaxUs: %llu\n",
+        state->bytesFromServer, state->bytesFromClient,
+        (unsigned long long)state->stats.loops, (unsigned long long)state->stats.wakeups, (unsigned long long)state->stats.timeouts,
+        (unsigned long long)state->stats.interrupted, (unsigned long long)state->stats.waitUs, (unsigned long long)state->stats.busyUs,
+        (unsigned long long)state->stats.shortWrites[SENS_SERVEUR_CLIENT], (unsigned long long)state->stats.shortWrites[SENS_CLIENT_SERVEUR],
+        (unsigned long long)state->stats.blockedWrites[SENS_SERVEUR_CLIENT], (unsigned long long)state->stats.blockedWrites[SENS_CLIENT_SERVEUR],
+        (unsigned long long)state->ttyRecord->recno, (unsigned long long)statsLit(&state->ttyRecord->written),
+        (unsigned long long)statsLit(&state->stats.flushes), (unsigned long long)statsLit(&state->stats.flushMaxUs),
+        (unsigned long long)statsLit(&state->stats.syncs), (unsigned long long)statsLit(&state->stats.syncMaxUs));
+    if (n >= reste) return reste;
+    n += statsHistogrammeFormat(dest + n, reste - n, "readSizesServerToClient", state->stats.reads[SENS_SERVEUR_CLIENT]);
+    n += statsHistogrammeFormat(dest + n, reste - n, "readSizesClientToServer", state->stats.reads[SENS_CLIENT_SERVEUR]);
+    n += statsHistogrammeFormat(dest + n, reste - n, "recordFlushUs", state->stats.flushUs);
+    return n;
+}
+
+/* Réécrit <enregistrement>.stats si la période est écoulée : écrit à côté puis renommé, jamais lu à moitié */
+void bastionStatsFile(struct bastionState_s* state, uint64_t maintenant) {
+    if (config.statsMs <= 0 || state->statsName[0] == 0 || maintenant - state->statsUs < (uint64_t)config.statsMs * 1000) return;
+    state->statsUs = maintenant;
+
+    char buffer[2048];
+    char nomTmp[sizeof(state->statsName) + 4];
+    size_t n = bastionStatsFormat(state, buffer, sizeof(buffer));
+    snprintf(nomTmp, sizeof(nomTmp), "%s.tmp", state->statsName);
+    int fd = open(nomTmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd < 0) return;
+    bool ok = write(fd, buffer, n) == (ssize_t)n;
+    close(fd);
+    if (!ok || rename(nomTmp, state->statsName) < 0) unlink(nomTmp);
+}
+
+int setNonBlock(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        journalErreur("fcntl(O_NONBLOCK)");
+    }
+    return flags;
+}
+
+
+/*
+  Prépare le pts et lance le shell fils, entièrement ici : il ne reste au fils
+  qu'à ouvrir le pts. posix_spawn() : vfork() dans la glibc, sans copie de notre
+  espace mémoire. Le fils fait setsid() puis ouvre le pts, qui devient son
+  terminal de contrôle, et retrouve les signaux par défaut et un masque vide
+  quoi que sshd (ou le moteur) lui transmette. Le master est fermé à l'exec.
+  envp et cwdFd : environnement et répertoire courant du shell (cwdFd = -1 pour
+  garder le nôtre). Retourne -1 en cas d'échec, déjà journalisé.
+ */
+int bastionLance(struct bastionState_s* state, char* childShell, char* argv[], char** envp, int cwdFd) {
+    int r;
+
+    /* O_NOCTTY, le pts doit devenir le terminal de contrôle du fils, pas le nôtre */
+    state->ptsMasterFd = open("/dev/ptmx", O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (state->ptsMasterFd <0) {
+        journalErreur("Erreur sur open(ptmx)");
+        return -1;
+    }
+    if (grantpt(state->ptsMasterFd) == -1 || unlockpt(state->ptsMasterFd) == -1) {
+        journalErreur("Erreur sur grantpt()/unlockpt()");
+        close(state->ptsMasterFd);
+        return -1;
+    }
+    r = ptsname_r(state->ptsMasterFd, state->ptsName, sizeof(state->ptsName));
+    if (r != 0) {
+        errno = r;
+        journalErreur("Erreur sur ptsname_r()");
+        close(state->ptsMasterFd);
+        return -1;
+    }
+
+    /* taille du terminal posée avant le lancement : le premier prompt est déjà à la bonne taille */
+    struct winsize ws;
+    if (ioctl(state->clientIn, TIOCGWINSZ, &ws) == 0) ioctl(state->ptsMasterFd, TIOCSWINSZ, &ws);
+
+    posix_spawnattr_t attributs;
+    posix_spawn_file_actions_t actions;
+    sigset_t masque, defaut;
+    const int signauxDefaut[] = { SIGPIPE, SIGHUP, SIGINT, SIGQUIT, SIGTERM, SIGTSTP, SIGTTIN, SIGTTOU, SIGCHLD, SIGWINCH, 0 };
+
+    sigemptyset(&masque);
+    sigemptyset(&defaut);
+    for (int i=0; signauxDefaut[i]; i++) sigaddset(&defaut, signauxDefaut[i]);
+    posix_spawnattr_init(&attributs);
+    posix_spawnattr_setflags(&attributs, POSIX_SPAWN_SETSID | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+    posix_spawnattr_setsigmask(&attributs, &masque);
+    posix_spawnattr_setsigdefault(&attributs, &defaut);
+
+    posix_spawn_file_actions_init(&actions);
+    if (cwdFd >= 0) posix_spawn_file_actions_addfchdir_np(&actions, cwdFd);
+    posix_spawn_file_actions_addopen(&actions, 0, state->ptsName, O_RDWR, 0);
+    posix_spawn_file_actions_adddup2(&actions, 0, 1);
+    posix_spawn_file_actions_adddup2(&actions, 0, 2);
+
+    char* argv0 = argv[0];
+    argv[0] = childShell;
+    r = posix_spawn(&state->childPid, childShell, &actions, &attributs, argv, envp);
+    argv[0] = argv0;
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attributs);
+    if (r != 0) {
+        /* erreurs de l'exec comprises : la glibc les remonte ici */
+        errno = r;
+        journalErreur("Erreur sur posix_spawn()");
+        close(state->ptsMasterFd);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+  Shell lancé : suivi du fils, enregistrement et relais. partage : tampon de
+  lecture du worker en moteur, NULL sinon (voir relayDirectionInit()).
+ */
+void bastionPrepare(struct bastionState_s* state, struct ttyRecordOrigine_s* origine, char* childShell, char* partage) {
+    state->childPollableFd = bastionPidfdOpen(state->childPid);
+    if (state->childPollableFd < 0) {
+        journal("pidfd_open() indisponible (%s), suivi du fils par SIGCHLD", strerror(errno));
+    }
+
+    journal("Le shell fils a le PID %d", state->childPid);
+
+    /* prépare l'enregistrement tty*/
+    state->ttyRecord = ttyRecordOpen(&state->stats, origine->pid);
+    ttyRecordStartMessage(state->ttyRecord, origine, childShell);
+    /* pas de fichier de statistiques à côté d'un enregistrement qui n'est pas un fichier (/dev/null...) */
+    struct stat st;
+    if (fstat(state->ttyRecord->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        snprintf(state->statsName, sizeof(state->statsName), "%s.stats", ttyRecordFilename(state->ttyRecord));
+    }
+
+    relayDirectionInit(&state->serverToClient, "notre stdout", state->ptsMasterFd, state->clientOut, TTY_RECORD_SERVER_TO_CLIENT, &state->stats, partage);
+    relayDirectionInit(&state->clientToServer, "le pts master", state->clientIn, state->ptsMasterFd, TTY_RECORD_CLIENT_TO_SERVER, &state->stats, partage);
+
+    state->stdinFlags  = setNonBlock(state->clientIn);
+    state->stdoutFlags = setNonBlock(state->clientOut);
+    setNonBlock(state->ptsMasterFd);
+
+    state->stdinFd  = (struct bastionFd_s) { state->clientIn, EPOLL_STDIN, 0, state };
+    state->stdoutFd = (struct bastionFd_s) { state->clientOut, EPOLL_STDOUT, 0, state };
+    state->ptsFd    = (struct bastionFd_s) { state->ptsMasterFd, EPOLL_PTS, 0, state };
+    state->childFd  = (struct bastionFd_s) { state->childPollableFd, EPOLL_CHILD, 0, state };
+    bastionWatch(state, &state->childFd, EPOLLIN);
+}
+
+/* Traite un événement epoll sur un des descripteurs de la session */
+void bastionEvenement(struct bastionState_s* state, struct bastionFd_s* bfd, uint32_t ev) {
+    char* visible;
+    size_t nvisible;
+
+    switch (bfd->role) {
+        case EPOLL_CHILD:
+            /* Process enfant a eu qqch */
+            bastionChildCheck(state);
+            break;
+
+        case EPOLL_SIGNAL:
+            bastionSignals(state);
+            break;
+
+        case EPOLL_PTS:
+            if (ev & EPOLLOUT) relayWrite(&state->clientToServer);
+            if (ev & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                /* Données disponibles en lecture sur le pts master, à renvoyer sur notre stdout */
+                state->bytesFromServer += relayRead(&state->serverToClient, state->ttyRecord, false, &visible, &nvisible);
+                relayRendVide(&state->serverToClient);
+            }
+            break;
+
+        case EPOLL_STDOUT:
+            relayWrite(&state->serverToClient);
+            break;
+
+        case EPOLL_STDIN:
+            /* Données disponibles en lecture sur notre stdin, à renvoyer sur le pts master */
+            state->bytesFromClient += relayRead(&state->clientToServer, state->ttyRecord, true, &visible, &nvisible);
+
+            /* Gestion du Ctrl-C et autres caractères de contrôle : signal au groupe de process d'avant plan */
+            bastionIntercept(state, visible, nvisible);
+            relayRendVide(&state->clientToServer);
+            break;
+    }
+}
+
+/*
+  Après les événements d'un tour : fin de session à détecter, enregistrement,
+  statistiques et redimensionnement. Retourne false quand la session est finie.
+ */
+bool bastionSuite(struct bastionState_s* state, uint64_t maintenant) {
+    bool encore = true;
+    int r;
+
+    if (state->clientToServer.eof) {
+        /* sshd nous a fermé le stdin */
+        journal("sshd a fermé notre stdin");
+        encore = false;
+    }
 
-            fds[1].fd = state.ptsMasterFd;
-            fds[1].events = POLLIN; /* POLL_PRI permettrait peut-être de détecter la mort du fils */
+    if (state->serverToClient.eof && !relayAEcrire(&state->serverToClient)) {
+        /* le process enfant a fermé son pts, et tout ce qu'il a écrit est parti */
+        journal("Le process enfant a fermé son pts");
+        encore = false;
+    }
+
+    if (state->childExited && !state->serverToClient.eof) {
+        /* le shell est parti : on récupère ce qu'il a écrit avant, sans attendre
+           d'éventuels process restés en arrière plan sur le pts */
+        bool tari = false;
+        while (relayPeutLire(&state->serverToClient)) {
+            char* visible;
+            size_t nvisible;
+            ssize_t n = relayRead(&state->serverToClient, state->ttyRecord, false, &visible, &nvisible);
+            relayRendVide(&state->serverToClient);
+            state->bytesFromServer += n;
+            if (n == 0) {
+                tari = true;
+                break;
+            }
+        }
+        if (tari && !relayAEcrire(&state->serverToClient)) {
+            journal("Le shell fils a terminé");
+            encore = false;
+        }
+    }
 
-            fds[2].fd = 0; /* notre stdin */
-            fds[2].events = POLLIN;  
+    if (state->serverToClient.erreur) {
+        /* plus personne pour lire notre stdout */
+        encore = false;
+    }
 
-            r = poll(&fds[1], 2, 10000); /* timeout en ms */
-            
-            if (r == 0) {
-                /* Poll a retourné sur timeout : on log un truc vide, juste pour voir que tout fonctionne */
-                ttyRecordWrite(state.ttyRecordFd, TTY_RECORD_NONE, 0, NULL);
+    ttyRecordTick(state->ttyRecord);
+    bastionStatsFile(state, maintenant);
 
+    /* Gestion du redimensionnement */
+    if (state->redimensionnementAfaire) { /* flag levé via signal SIGWINCH*/
+        /* TIOCGWINSZ TIOCSWINSZ  ioctl_tty(2) manpage   https://www.man7.org/linux/man-pages/man2/TIOCGWINSZ.2const.html */
+        struct winsize ws;
+        r = ioctl(state->clientIn,  TIOCGWINSZ, &ws);
+        if (r == -1) {
+            journalErreur("ioctl() pour TIOCGWINSZ");
+        } else {
+            /* sur le master, pour le compte de l'esclave, comme TIOCGPGRP */
+            r = ioctl(state->ptsMasterFd, TIOCSWINSZ, &ws);
+            if (r == -1) {
+                journalErreur("Sur set window size TIOCSWINSZ");
             } else {
-                if (fds[0].revents & POLLIN) {                   
-                    /* Process enfant a eu qqch */
-
-                    int wstatus;
-                    waitpid(state.childPid, &wstatus, WNOHANG);
-                    if (WIFEXITED(wstatus)) {
-                        exitStatus = WEXITSTATUS(wstatus);
-                    } else {
-                        printf("poll() a déclenché sur le process fils, mais celui-ci n'a pas exit()é   wstatus=0x%x\n", wstatus);
-                    }
-                }
+                killpg(bastionForegroundPgrp(state), SIGWINCH);
+            }
+            uint8_t taille[TTY_RECORD_WINSIZE_LEN];
+            ttyRecordWinsizeEncode(taille, ws.ws_row, ws.ws_col);
+            ttyRecordWrite(state->ttyRecord, TTY_RECORD_WINSIZE, sizeof(taille), (char*)taille);
+        }
+        state->redimensionnementAfaire = false;
+    }
 
-                if (fds[1].revents & POLLIN) {
-                    /* Données disponibles en lecture sur le pts master, à renvoyer sur notre stdout */
-                    nlu = read(state.ptsMasterFd, buffer, BUFFERSIZE);
-                    necrit = write(1, buffer, nlu);
-                    state.bytesFromServer += nlu;
-                    if (nlu != necrit) {
-                        printf("Erreur, on a pas pu écrire autant qu'on voulait sur notre stdout nlu=%d necrit=%d\n", nlu, necrit);
-                    }
+    return encore;
+}
 
-                    ttyRecordWrite(state.ttyRecordFd, TTY_RECORD_SERVER_TO_CLIENT, nlu, buffer);
+/*
+  Fin de session : fermeture du relais et du pts master, record EXIT, fermeture
+  de l'enregistrement, terminal client rétabli. Le pidfd reste à fermer.
+ */
+void bastionTermine(struct bastionState_s* state) {
+    /* retirés explicitement : en moteur, le shim garde les mêmes fichiers ouverts */
+    bastionWatch(state, &state->stdinFd, 0);
+    bastionWatch(state, &state->stdoutFd, 0);
+    bastionWatch(state, &state->ptsFd, 0);
+    relayDirectionClose(&state->serverToClient);
+    relayDirectionClose(&state->clientToServer);
+    close(state->ptsMasterFd);
+    /* stdin et stdout partagent souvent le même fichier : l'ordre inverse rend l'état d'origine */
+    fcntl(state->clientOut, F_SETFL, state->stdoutFlags);
+    fcntl(state->clientIn, F_SETFL, state->stdinFlags);
+
+    char buffer[2048];
+    int r = snprintf(buffer, sizeof(buffer), "exitStatus: %d\n", state->exitStatus);
+    r += bastionStatsFormat(state, buffer + r, sizeof(buffer) - r - 1);
+    buffer[r] = 0;
+    ttyRecordWrite(state->ttyRecord, TTY_RECORD_EXIT, r+1, buffer);
+    ttyRecordClose(state->ttyRecord);
+    state->ttyRecord = NULL;
+    if (config.statsMs > 0 && state->statsName[0]) unlink(state->statsName);
+
+    tty_reset(state->clientIn, &state->termiosOrig);
+}
 
-                }
 
-                if (fds[2].revents & POLLIN) {
-                    /* Données disponibles en lecture sur notre stdin, à renvoyer sur le pts master */
-                    nlu = read(0, buffer, BUFFERSIZE);
-                    necrit = write(state.ptsMasterFd, buffer, nlu);
-                    state.bytesFromClient += nlu;
-                    if (nlu != necrit) {
-                        printf("Erreur, on a pas pu écrire autant qu'on voulait sur le pts master nlu=%d necrit=%d\n", nlu, necrit);
-                    }
-                    ttyRecordWrite(state.ttyRecordFd, TTY_RECORD_CLIENT_TO_SERVER, nlu, buffer);
-
-                    /* Gestion du Ctrl-C Si un caractère ETX End-of-Text \x03 est détecté, envoie SIGINT au groupe de process d'avant plan */
-                    char *c = buffer;
-                    for (int i=0; i<nlu; i++) {
-                        if (*c == 0x03) {
-                            fd = open(state.ptsName, O_PATH);
-                            pid_t fg_pgid = tcgetpgrp(fd); // getpgrp();
-                            close(fd);
-                            killpg(fg_pgid, SIGINT);
-                        }
-                        c++;
-                    }
-                }
+int lanceFils(char* childShell, int argc, char* argv[]) {
+    int r; /* utilisé à courte portée pour les valeurs de retour, mais à plusieurs endroits  */
+    struct bastionState_s state;
+    memset((void*)&state, 0, sizeof(state));
+    state.clientIn  = 0;
+    state.clientOut = 1;
+    state.shimFd    = -1;
+    state.redimensionnementAfaire = true; /* sera fait lors de la première boucle epoll */
 
-                if (fds[1].revents & POLLHUP) {
-                    /* le process enfant a fermé son pts */
-                    printf("Le process enfant a fermé son pts");
-                    encore = false;
-                }
+    if (tty_raw(0, &state.termiosOrig) < 0) abort();
+    if (bastionLance(&state, childShell, argv, environ, -1) < 0) abort();
+
+    /* les fermetures sont gérées par EPIPE plutôt que par le signal */
+    signal(SIGPIPE, SIG_IGN);
+
+    state.epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (state.epollFd < 0) {
+        journalErreur("Erreur sur epoll_create1()");
+        abort();
+    }
+
+    /* utiliser le pts master et faire suivre les données en enregistrant */
+    struct ttyRecordOrigine_s origine = { getpid(), getppid(), getsid(0), getpgid(0), getuid(), argv[0], environ };
+    bastionPrepare(&state, &origine, childShell, NULL);
+    recordEnCours = state.ttyRecord;
+    installeRecordSignalHandlers();
+
+    /* captation des signaux pour redimensionnement, et fin du fils sans pidfd */
+    state.signalFd  = installeSignalFd(state.childPollableFd < 0);
+    state.signalFdW = (struct bastionFd_s) { state.signalFd, EPOLL_SIGNAL, 0, &state };
+    bastionWatch(&state, &state.signalFdW, EPOLLIN);
+    bastionChildCheck(&state); /* un SIGCHLD arrivé avant le blocage serait perdu */
+
+    bool encore = true;
+    uint64_t tourUs = statsMaintenantUs();
+    while (encore) {
+
+        bastionUpdateEvents(&state);
+
+        /* timeout en ms : 10s pour le battement de coeur, moins si l'enregistrement a des données en attente */
+        struct epoll_event events[8];
+        int timeout = ttyRecordTimeout(state.ttyRecord);
+        bool heartbeat = (timeout < 0);
+        uint64_t attenteUs = statsMaintenantUs();
+        state.stats.busyUs += attenteUs - tourUs;
+        r = epoll_wait(state.epollFd, events, 8, heartbeat ? 10000 : timeout);
+        tourUs = statsMaintenantUs();
+        state.stats.waitUs += tourUs - attenteUs;
+        state.stats.loops++;
+        if (r > 0) state.stats.wakeups++;
+        else if (r == 0) state.stats.timeouts++;
+        else state.stats.interrupted++;
+
+        if (r < 0 && errno != EINTR) {
+            journalErreur("Erreur sur epoll_wait()");
+            abort();
+        }
+
+        if (r == 0) {
+            /* epoll_wait a retourné sur timeout : on log un truc vide, juste pour voir que tout fonctionne */
+            if (heartbeat) ttyRecordWrite(state.ttyRecord, TTY_RECORD_NONE, 0, NULL);
+        }
+
+        for (int i=0; i<r; i++) {
+            bastionEvenement(&state, events[i].data.ptr, events[i].events);
+        }
+
+        encore = bastionSuite(&state, tourUs);
+
+    } /* while (encore)*/
+
+    /* message de fin, fermeture pts master et enregistrement tty */
+    recordEnCours = NULL;
+    bastionTermine(&state);
+    close(state.epollFd);
+    close(state.signalFd);
+    if (state.childPollableFd >= 0) close(state.childPollableFd);
+    return state.exitStatus;
+}
+
+
+/******************************************************************************
+ * Moteur multi-sessions (honeypotSsh --engine)
+ * En ForceCommand, honeypotShim passe les descripteurs standard de sa session
+ * au moteur (voir ttyEngine.h) puis attend qu'elle se termine ; s'il ne joint
+ * pas le moteur, il lance honeypotSsh comme avant. Le thread principal ne fait
+ * qu'accepter les connexions et les répartir entre quelques workers : un thread,
+ * un ensemble epoll, un tampon de lecture commun, et des sessions qu'il mène
+ * seul de l'ouverture à la fin, sans verrou sur le chemin du relais. Une session
+ * au repos ne coûte que son état et ses descripteurs : ses files ne sont
+ * allouées que quand le client ou le shell n'avale pas ce qu'on lui écrit.
+ ******************************************************************************/
+
+#define ENGINE_WORKERS           0 /* threads workers, 0 = un par processeur en ligne */
+#define ENGINE_HEARTBEAT_MS  10000 /* record vide après ce délai sans activité, comme hors moteur */
+
+#define MOTEUR_ARRET_DOUX       -1 /* dans le tube d'un worker : plus de nouvelles sessions, finir les autres */
+#define MOTEUR_ARRET_IMMEDIAT   -2 /* terminer tout de suite les sessions en cours */
+
+struct moteurWorker_s {
+    pthread_t  thread;
+    int        epollFd;
+    int        tube[2];            /* connexions acceptées par le thread principal, un int chacune */
+    struct bastionFd_s tubeW;
+    char*      partage;            /* tampon de lecture commun aux sessions du worker */
+    uint8_t*   hello;              /* réception des messages d'ouverture */
+    struct bastionState_s** sessions;
+    size_t     nb;                 /* lu sans verrou par le thread principal, pour répartir */
+    size_t     capacite;
+    uint64_t   echeanceUs;         /* prochaine échéance (vidage, statistiques, battement) d'une de ses sessions */
+    bool       arret;
+    bool       arretImmediat;      /* second signal : sessions terminées à la fin du tour d'événements */
+};
+
+static __thread struct moteurWorker_s* workerCourant = NULL; /* pour le vidage depuis un handler de signal */
+
+/*
+ Signal fatal dans un worker : ses sessions sont vidées, il est arrêté dans le
+ handler et ne les touche plus. Celles des autres workers, qui tournent encore
+ jusqu'à la fin du processus, perdent ce qui attendait dans leur tampon.
+*/
+void moteurSignalVidage(void) {
+    struct moteurWorker_s* w = workerCourant;
+    if (w == NULL) return;
+    for (size_t i=0; i<w->nb; i++) ttyRecordSignalVidage(w->sessions[i]->ttyRecord);
+}
+
+static struct {
+    struct moteurWorker_s* workers;
+    int        nbWorkers;
+    int        actifs;             /* workers pas encore sortis */
+    uint64_t   sessions;           /* sessions prises en charge depuis le lancement */
+} moteur;
+
+void moteurEnvoie(struct bastionState_s* state, int type, uint32_t valeur) {
+    uint8_t m[TTY_ENGINE_MESSAGE_LEN];
+    ttyEngineMessageEncode(m, type, valeur);
+    if (send(state->shimFd, m, sizeof(m), MSG_NOSIGNAL | MSG_DONTWAIT) != sizeof(m)) {
+        journalErreur("Envoi au shim");
+    }
+}
+
+/* Nouvelle connexion d'un shim : la session attend son message d'ouverture */
+void moteurAjoute(struct moteurWorker_s* w, int fd) {
+    if (w->nb == w->capacite) {
+        size_t capacite = w->capacite ? 2 * w->capacite : 64;
+        struct bastionState_s** sessions = realloc(w->sessions, capacite * sizeof(*sessions));
+        if (sessions == NULL) {
+            journalErreur("Erreur sur malloc()");
+            close(fd);
+            return;
+        }
+        w->sessions = sessions;
+        w->capacite = capacite;
+    }
+    struct bastionState_s* state = calloc(1, sizeof(*state));
+    if (state == NULL) {
+        journalErreur("Erreur sur malloc()");
+        close(fd);
+        return;
+    }
+    state->epollFd         = w->epollFd;
+    state->shimFd          = fd;
+    state->shimW           = (struct bastionFd_s) { fd, EPOLL_SHIM, 0, state };
+    state->clientIn        = -1;
+    state->clientOut       = -1;
+    state->childPollableFd = -1;
+    state->activiteUs      = statsMaintenantUs();
+    state->indice          = w->nb;
+    w->sessions[w->nb] = state;
+    __atomic_store_n(&w->nb, w->nb + 1, __ATOMIC_RELAXED);
+    bastionWatch(state, &state->shimW, EPOLLIN);
+}
+
+/* Oubli de la session ; le code de sortie part au shim s'il attend encore */
+void moteurLibere(struct moteurWorker_s* w, struct bastionState_s* state) {
+    if (state->shimFd >= 0) {
+        if (state->demarre && !state->shimParti) moteurEnvoie(state, TTY_ENGINE_FIN, state->exitStatus);
+        bastionWatch(state, &state->shimW, 0);
+        close(state->shimFd);
+    }
+    bastionWatch(state, &state->childFd, 0);
+    if (state->childPollableFd >= 0) close(state->childPollableFd);
+
+    w->sessions[state->indice] = w->sessions[w->nb - 1];
+    w->sessions[state->indice]->indice = state->indice;
+    __atomic_store_n(&w->nb, w->nb - 1, __ATOMIC_RELAXED);
+    free(state);
+}
+
+/*
+  Message d'ouverture du shim : vérifications, lancement du shell dans son
+  répertoire et son environnement, puis comme hors moteur. Retourne 0 s'il
+  n'est pas encore arrivé, 1 si la session démarre, -1 si elle est refusée
+  (le shim lancera honeypotSsh lui-même).
+ */
+int moteurOuverture(struct moteurWorker_s* w, struct bastionState_s* state) {
+    int fds[TTY_ENGINE_FDS];
+    int nbFds = 0;
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * TTY_ENGINE_FDS)];
+        struct cmsghdr alignement;
+    } controle;
+    struct iovec iov = { w->hello, TTY_ENGINE_HELLO_MAX };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = controle.buf, .msg_controllen = sizeof(controle.buf) };
+
+    ssize_t n = recvmsg(state->shimFd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return 0;
+    for (struct cmsghdr* c = CMSG_FIRSTHDR(&msg); n > 0 && c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+        int nb = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i=0; i<nb; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+            if (nbFds < TTY_ENGINE_FDS) fds[nbFds++] = fd;
+            else close(fd);
+        }
+    }
+
+    struct ucred cred;
+    socklen_t lenCred = sizeof(cred);
+    struct ttyEngineHello_s h;
+    const char* refus = NULL;
+    if (n <= 0) refus = "connexion fermée";
+    else if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) refus = "message tronqué";
+    else if (nbFds != TTY_ENGINE_FDS) refus = "descripteurs manquants";
+    else if (getsockopt(state->shimFd, SOL_SOCKET, SO_PEERCRED, &cred, &lenCred) < 0 || cred.uid != getuid()) refus = "autre utilisateur";
+    else if (ttyEngineHelloDecode(w->hello, n, &h) < 0) refus = "message d'ouverture invalide";
+
+    char** tableau = NULL;
+    if (refus == NULL) {
+        /* argv puis envp, pointant dans le message */
+        tableau = malloc((h.argc + h.envc + 2) * sizeof(char*));
+        if (tableau == NULL) refus = "mémoire";
+    }
+    if (refus == NULL) {
+        char** argv = tableau;
+        char** envp = tableau + h.argc + 1;
+        char* p = h.chaines;
+        for (uint32_t i=0; i<h.argc; i++, p += strlen(p) + 1) argv[i] = p;
+        argv[h.argc] = NULL;
+        for (uint32_t i=0; i<h.envc; i++, p += strlen(p) + 1) envp[i] = p;
+        envp[h.envc] = NULL;
+        char* childShell = envCherche(envp, "SHELL");
+        if (childShell == NULL) childShell = "/bin/bash";
+
+        state->clientIn  = fds[0];
+        state->clientOut = fds[1];
+        state->redimensionnementAfaire = true;
+        if (tty_raw(state->clientIn, &state->termiosOrig) < 0) {
+            refus = "pas de terminal";
+        } else if (bastionLance(state, childShell, argv, envp, fds[3]) < 0) {
+            tty_reset(state->clientIn, &state->termiosOrig);
+            refus = "lancement du shell impossible";
+        } else {
+            struct ttyRecordOrigine_s origine = { cred.pid, h.ppid, h.sid, h.pgid, cred.uid, argv[0], envp };
+            state->shimPid = cred.pid;
+            bastionPrepare(state, &origine, childShell, w->partage);
+        }
+        free(tableau);
+    }
+
+    /* stderr et le répertoire courant ne servent plus, stdin et stdout si refus */
+    for (int i=0; i<nbFds; i++) {
+        if (refus || i >= 2) close(fds[i]);
+    }
+    if (refus) {
+        journal("Session refusée (%s)", refus);
+        if (n > 0) moteurEnvoie(state, TTY_ENGINE_REFUSE, 0);
+        state->clientIn = state->clientOut = -1;
+        return -1;
+    }
+    moteurEnvoie(state, TTY_ENGINE_ACCEPTE, 0);
+    state->demarre = true;
+    __atomic_add_fetch(&moteur.sessions, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/* Messages du shim d'une session en cours : changement de taille, ou départ */
+void moteurShim(struct bastionState_s* state) {
+    uint8_t m[TTY_ENGINE_MESSAGE_LEN];
+    while (true) {
+        ssize_t n = recv(state->shimFd, m, sizeof(m), MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            state->shimParti = true;
+            bastionWatch(state, &state->shimW, 0);
+            return;
+        }
+        uint32_t valeur;
+        if (ttyEngineMessageDecode(m, n, &valeur) == TTY_ENGINE_WINCH) state->redimensionnementAfaire = true;
+    }
+}
+
+/*
+  Fin du relais d'une session. Le shell, s'il tourne encore, a reçu SIGHUP par
+  la fermeture du master : la session n'est oubliée, et son code de sortie
+  envoyé au shim, qu'une fois qu'il a été récupéré sur son pidfd.
+ */
+void moteurFin(struct moteurWorker_s* w, struct bastionState_s* state) {
+    bastionTermine(state);
+    close(state->clientIn);
+    close(state->clientOut);
+    state->relaisFini = true;
+    if (state->childExited) moteurLibere(w, state);
+}
+
+/* Echéance (µs monotones) de la prochaine tâche périodique de la session */
+uint64_t moteurEcheance(struct bastionState_s* state, uint64_t maintenant) {
+    uint64_t e = state->activiteUs + ENGINE_HEARTBEAT_MS * 1000;
+    int t = ttyRecordTimeout(state->ttyRecord);
+    if (t >= 0 && maintenant + (uint64_t)t * 1000 < e) e = maintenant + (uint64_t)t * 1000;
+    if (config.statsMs > 0 && state->statsName[0] && state->statsUs + config.statsMs * 1000 < e) e = state->statsUs + config.statsMs * 1000;
+    return e;
+}
+
+/* Tâches périodiques de toutes les sessions du worker ; retourne la prochaine échéance */
+uint64_t moteurEcheances(struct moteurWorker_s* w, uint64_t maintenant) {
+    uint64_t prochaine = maintenant + ENGINE_HEARTBEAT_MS * 1000;
+    for (size_t i=0; i<w->nb; i++) {
+        struct bastionState_s* state = w->sessions[i];
+        if (!state->demarre || state->relaisFini) continue;
+        if (maintenant - state->activiteUs >= ENGINE_HEARTBEAT_MS * 1000) {
+            /* rien depuis longtemps : un record vide, juste pour voir que tout fonctionne */
+            if (state->ttyRecord->used == 0) ttyRecordWrite(state->ttyRecord, TTY_RECORD_NONE, 0, NULL);
+            state->stats.timeouts++;
+            state->activiteUs = maintenant;
+        }
+        ttyRecordTick(state->ttyRecord);
+        bastionStatsFile(state, maintenant);
+        uint64_t e = moteurEcheance(state, maintenant);
+        if (e < prochaine) prochaine = e;
+    }
+    return prochaine;
+}
+
+/*
+  Lecture du tube : connexions confiées par le thread principal, ou ordre
+  d'arrêt. L'arrêt immédiat est seulement noté : les événements suivants du
+  tour visent encore les sessions, moteurArreteTout() les termine ensuite.
+ */
+void moteurTube(struct moteurWorker_s* w) {
+    int fd;
+    while (read(w->tube[0], &fd, sizeof(fd)) == sizeof(fd)) {
+        if (fd >= 0) {
+            moteurAjoute(w, fd);
+            continue;
+        }
+        w->arret = true;
+        if (fd == MOTEUR_ARRET_IMMEDIAT) w->arretImmediat = true;
+    }
+}
+
+/* Arrêt immédiat : toutes les sessions du worker terminées et oubliées */
+void moteurArreteTout(struct moteurWorker_s* w) {
+    while (w->nb > 0) {
+        struct bastionState_s* state = w->sessions[w->nb - 1];
+        if (state->demarre && !state->relaisFini) {
+            bastionTermine(state);
+            close(state->clientIn);
+            close(state->clientOut);
+        }
+        moteurLibere(w, state);
+    }
+}
 
-                if (fds[2].revents & POLLHUP) {
-                    /* sshd nous a fermé le stdin */
-                    printf("sshd a fermé notre stdin");
-                    encore = false;
+void* moteurWorker(void* arg) {
+    struct moteurWorker_s* w = arg;
+    struct epoll_event events[64];
+    struct bastionState_s* touchees[64];
+
+    workerCourant = w;
+    while (!w->arret || w->nb > 0) {
+        uint64_t maintenant = statsMaintenantUs();
+        int timeout = w->echeanceUs > maintenant ? (w->echeanceUs - maintenant + 999) / 1000 : 0;
+        int r = epoll_wait(w->epollFd, events, 64, timeout);
+        if (r < 0 && errno != EINTR) {
+            journalErreur("Erreur sur epoll_wait()");
+            abort();
+        }
+        maintenant = statsMaintenantUs();
+
+        int nbTouchees = 0;
+        for (int i=0; i<r; i++) {
+            struct bastionFd_s* bfd = events[i].data.ptr;
+            if (bfd->role == EPOLL_WORKER) {
+                moteurTube(w);
+                continue;
+            }
+            struct bastionState_s* state = bfd->state;
+            if (bfd->role == EPOLL_SHIM && !state->demarre) {
+                /* seul descripteur surveillé de la session : elle peut être oubliée tout de suite */
+                if (moteurOuverture(w, state) < 0) {
+                    moteurLibere(w, state);
+                    continue;
                 }
+            } else if (bfd->role == EPOLL_SHIM) {
+                moteurShim(state);
+            } else {
+                bastionEvenement(state, bfd, events[i].events);
+            }
+            if (!state->touchee) {
+                state->touchee = true;
+                touchees[nbTouchees++] = state;
             }
+        }
 
-            /* Gestion du redimensionnement */
-            if (redimensionnementAfaire) { /* flag levé via signal SIGWINCH*/
-                /* TIOCGWINSZ TIOCSWINSZ  ioctl_tty(2) manpage   https://www.man7.org/linux/man-pages/man2/TIOCGWINSZ.2const.html */
-                struct winsize ws;
-                r = ioctl(0,  TIOCGWINSZ, &ws);
-                if (r == -1) {
-                    perror("ioctl() pour TIOCGWINSZ ");
-                } else {
-                    fd = open(state.ptsName, O_RDWR /*O_PATH ne suffit pas !*/ );
-                    if (fd < 0) {
-                        perror("open() du pts pour faire un TIOCSWINSZ");
-                    } else {
-                        r = ioctl(fd, TIOCSWINSZ, &ws);
-                        if (r == -1) {
-                            close(fd);
-                            perror("Sur set window size TIOCSWINSZ ");
-                        } else {
-                            pid_t fg_pgid = tcgetpgrp(fd); // getpgrp();
-                            close(fd);
-                            killpg(fg_pgid, SIGWINCH);
-                        }
-                    }
-                }
-                redimensionnementAfaire = 0;
+        /* une fois tous les événements du tour traités : aucun ne peut plus viser une session oubliée */
+        for (int i=0; i<nbTouchees; i++) {
+            struct bastionState_s* state = touchees[i];
+            state->touchee = false;
+            if (!state->demarre) continue;
+            if (state->relaisFini) {
+                if (state->childExited) moteurLibere(w, state);
+                continue;
             }
+            state->activiteUs = maintenant;
+            state->stats.loops++;
+            state->stats.wakeups++;
+            if (!bastionSuite(state, maintenant) || state->shimParti) {
+                moteurFin(w, state);
+                continue;
+            }
+            bastionUpdateEvents(state);
+            uint64_t e = moteurEcheance(state, maintenant);
+            if (e < w->echeanceUs) w->echeanceUs = e;
+            state->stats.busyUs += statsMaintenantUs() - maintenant;
+        }
+        if (w->arretImmediat) moteurArreteTout(w);
 
+        if (maintenant >= w->echeanceUs) w->echeanceUs = moteurEcheances(w, maintenant);
+    }
+    __atomic_sub_fetch(&moteur.actifs, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
 
-        } /* while (encore)*/
+/* Socket d'écoute, refusée si un autre moteur répond déjà */
+int moteurEcoute(const char* chemin) {
+    struct sockaddr_un adresse = { .sun_family = AF_UNIX };
+    if (strlen(chemin) >= sizeof(adresse.sun_path)) {
+        journal("Chemin de socket trop long : %s", chemin);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(adresse.sun_path, chemin);
 
-        /* message de fin, fermeture pts master et enregistrement tty */
-        close(state.ptsMasterFd);
-        r = snprintf(buffer, BUFFERSIZE-1, "exitStatus: %d\nbytesServerToClient: %lld\nbytesClientToServer: %lld", exitStatus, state.bytesFromServer, state.bytesFromClient);
-        ttyRecordWrite(state.ttyRecordFd, TTY_RECORD_EXIT, r+1, buffer);
-        close(state.ttyRecordFd);
-        free(buffer);
-        
-        tty_reset(0);
-        return exitStatus;
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        journalErreur("socket()");
+        abort();
+    }
+    int essai = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (essai >= 0 && connect(essai, (struct sockaddr*)&adresse, sizeof(adresse)) == 0) {
+        journal("Un moteur écoute déjà sur %s", chemin);
+        exit(EXIT_FAILURE);
+    }
+    if (essai >= 0) close(essai);
+    unlink(chemin);
 
-    } /* if (fork() == ) */
+    if (bind(fd, (struct sockaddr*)&adresse, sizeof(adresse)) < 0 || listen(fd, 128) < 0) {
+        journalErreur("bind() ou listen() de la socket du moteur");
+        journal("Erreur sur : %s", chemin);
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
 
-    /* Tous les cas de retour sont gérés plus haut */
-    abort();
+/* Confie une connexion au worker qui a le moins de sessions */
+void moteurRepartit(int fd) {
+    struct moteurWorker_s* choisi = &moteur.workers[0];
+    for (int i=1; i<moteur.nbWorkers; i++) {
+        if (__atomic_load_n(&moteur.workers[i].nb, __ATOMIC_RELAXED) < __atomic_load_n(&choisi->nb, __ATOMIC_RELAXED)) choisi = &moteur.workers[i];
+    }
+    if (write(choisi->tube[1], &fd, sizeof(fd)) != sizeof(fd)) {
+        journalErreur("write() vers un worker");
+        close(fd);
+    }
 }
 
+int moteurLance(const char* chemin, int nbWorkers) {
+    /* le suivi des shells repose sur pidfd : sans lui, les shims restent en mode classique */
+    int fd = bastionPidfdOpen(getpid());
+    if (fd < 0) {
+        journalErreur("pidfd_open(), nécessaire au moteur");
+        return EXIT_FAILURE;
+    }
+    close(fd);
+    if (nbWorkers <= 0) nbWorkers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nbWorkers <= 0) nbWorkers = 1;
+
+    /* bloqués avant la création des workers, qui en héritent : seul le signalfd les reçoit */
+    sigset_t masque;
+    sigemptyset(&masque);
+    sigaddset(&masque, SIGINT);
+    sigaddset(&masque, SIGTERM);
+    sigaddset(&masque, SIGHUP);
+    sigprocmask(SIG_BLOCK, &masque, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    installeRecordSignalHandlers();   /* signaux fatals ; les trois précédents restent au signalfd */
+    int signalFd = signalfd(-1, &masque, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    int ecoute  = moteurEcoute(chemin);
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd < 0 || signalFd < 0) {
+        journalErreur("epoll_create1() ou signalfd()");
+        abort();
+    }
+
+    moteur.nbWorkers = nbWorkers;
+    moteur.actifs    = nbWorkers;
+    moteur.workers   = calloc(nbWorkers, sizeof(struct moteurWorker_s));
+    for (int i=0; moteur.workers && i<nbWorkers; i++) {
+        struct moteurWorker_s* w = &moteur.workers[i];
+        w->epollFd = epoll_create1(EPOLL_CLOEXEC);
+        w->partage = malloc(config.relayBuffer);
+        w->hello   = malloc(TTY_ENGINE_HELLO_MAX);
+        w->tubeW   = (struct bastionFd_s) { -1, EPOLL_WORKER, EPOLLIN, NULL };
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &w->tubeW };
+        if (w->epollFd < 0 || w->partage == NULL || w->hello == NULL || pipe2(w->tube, O_CLOEXEC) < 0
+            || epoll_ctl(w->epollFd, EPOLL_CTL_ADD, w->tube[0], &ev) < 0) {
+            journalErreur("Préparation d'un worker du moteur");
+            abort();
+        }
+        w->tubeW.fd = w->tube[0];
+        setNonBlock(w->tube[0]);
+        if (pthread_create(&w->thread, NULL, moteurWorker, w) != 0) {
+            journalErreur("pthread_create() d'un worker du moteur");
+            abort();
+        }
+    }
+    if (moteur.workers == NULL) {
+        journalErreur("Erreur sur malloc()");
+        abort();
+    }
+
+    static int marqueEcoute, marqueSignal;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &marqueEcoute };
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, ecoute, &ev);
+    ev.data.ptr = &marqueSignal;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, signalFd, &ev);
+    journal("Moteur sur %s, %d workers", chemin, nbWorkers);
+
+    /* premier signal : plus de nouvelles sessions, les shims lanceront honeypotSsh ; les
+       sessions en cours vont à leur terme. Second signal : elles sont terminées tout de suite. */
+    int arrets = 0;
+    while (__atomic_load_n(&moteur.actifs, __ATOMIC_RELAXED) > 0) {
+        struct epoll_event evs[4];
+        int n = epoll_wait(epollFd, evs, 4, arrets ? 200 : -1);
+        if (n < 0 && errno != EINTR) {
+            journalErreur("epoll_wait()");
+            abort();
+        }
+        for (int i=0; i<n; i++) {
+            if (evs[i].data.ptr == &marqueEcoute) {
+                int client;
+                while ((client = accept4(ecoute, NULL, NULL, SOCK_CLOEXEC)) >= 0) moteurRepartit(client);
+                continue;
+            }
+            struct signalfd_siginfo si;
+            while (read(signalFd, &si, sizeof(si)) == sizeof(si)) {
+                int ordre = arrets++ ? MOTEUR_ARRET_IMMEDIAT : MOTEUR_ARRET_DOUX;
+                if (ordre == MOTEUR_ARRET_DOUX) {
+                    close(ecoute);
+                    unlink(chemin);
+                    journal("Arrêt du moteur demandé, fin des sessions en cours");
+                }
+                for (int k=0; k<nbWorkers; k++) {
+                    if (write(moteur.workers[k].tube[1], &ordre, sizeof(ordre)) != sizeof(ordre)) journalErreur("write() vers un worker");
+                }
+            }
+        }
+    }
+    for (int i=0; i<nbWorkers; i++) pthread_join(moteur.workers[i].thread, NULL);
+    journal("Arrêt du moteur : %llu sessions", (unsigned long long)moteur.sessions);
+    return EXIT_SUCCESS;
+}
+
+void moteurUsage(char* argv0) {
+    printf("%s --engine [options]       mène les sessions que lui passe honeypotShim\n", argv0);
+    printf("  --socket <chemin>       socket d'écoute (%s par défaut), à donner à honeypotShim par HONEYPOT_ENGINE\n", TTY_ENGINE_SOCKET);
+    printf("  --workers <n>           threads qui mènent les sessions (%d par défaut, 0 = un par processeur)\n", ENGINE_WORKERS);
+    exit(EXIT_FAILURE);
+}
+
+int moteurMain(int argc, char* argv[]) {
+    const struct option options[] = {
+        { "engine",  no_argument,       NULL, 'e' },
+        { "socket",  required_argument, NULL, 's' },
+        { "workers", required_argument, NULL, 'w' },
+        { NULL, 0, NULL, 0 }
+    };
+    const char* chemin = TTY_ENGINE_SOCKET;
+    int nbWorkers = ENGINE_WORKERS;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+            case 'e': break;
+            case 's': chemin = optarg; break;
+            case 'w': nbWorkers = strtol(optarg, NULL, 0); break;
+            default: moteurUsage(argv[0]);
+        }
+    }
+    if (optind != argc || nbWorkers < 0) moteurUsage(argv[0]);
+    return moteurLance(chemin, nbWorkers);
+}
+
+
 
 /******************************************************************************
  * Programme principal
@@ -497,6 +2685,12 @@ int main(int argc, char*argv[]) {
     char *childShell = getenv("SHELL");
     if (childShell == NULL) childShell = "/bin/bash";
 
+    configLoad();
+    interceptionInit(config.intercept);
+
+    /* le moteur seulement si demandé en premier argument : les autres vont au shell */
+    if (argc > 1 && strcmp(argv[1], "--engine") == 0) return moteurMain(argc, argv);
+
     int r = lanceFils(childShell, argc, argv); 
     return r;
 }
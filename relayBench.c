@@ -0,0 +1,451 @@
+/******************************************************************************
+ * Banc de mesure du relais de honeypotSsh
+ * Bertrand sept 2024
+ *
+ * Lance honeypotSsh sur un pty dont nous tenons le maître, comme le ferait
+ * sshd, avec pour shell fils ce même programme en mode --child : un écho
+ * octet par octet, et une salve de sortie à la demande. Pour chaque
+ * configuration (enregistrement, taille des tampons, compression, splice) :
+ *   - latence aller-retour d'une frappe jusqu'à son écho : p50, p99, p999
+ *   - débit d'une sortie en masse, en Mo/s
+ *   - temps cpu de honeypotSsh (tous ses threads) et appels read/write par Mo
+ *   - taille de l'enregistrement produit
+ * La configuration "direct" mesure le pty seul, sans honeypotSsh : c'est la
+ * référence, ses compteurs sont ceux du fils. "norecord" relaie mais
+ * enregistre dans /dev/null. Les appels comptés sont ceux que le noyau
+ * tient dans /proc/pid/io (famille read et write), pas epoll_wait() ni splice().
+ *
+ * Une ligne csv (ou un objet json) par configuration sur stdout, pour suivre
+ * les régressions de la boucle de lanceFils().
+ ******************************************************************************/
+
+
+/* sys */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <termios.h>
+#include <getopt.h>
+#include <limits.h>
+#include <dirent.h>
+
+
+/* libc */
+#include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+
+#define BANC_PRET        "relayBench-pret\n"   /* le fils est prêt, ce qui précède vient de honeypotSsh */
+#define BANC_SALVE       'F'                   /* demande de sortie en masse */
+#define BANC_FIN         'Q'
+#define BANC_FRAPPE      'x'
+#define BANC_TIMEOUT_MS  10000
+#define BANC_LIGNE       64                    /* la salve est faite de lignes de cette taille */
+
+#define FRAPPES_DEFAUT   2000
+#define SALVE_DEFAUT     (32 << 20)
+
+#define FORMAT_CSV 0
+#define FORMAT_JSON 1
+
+
+
+/******************************************************************************
+ * Shell fils scripté
+ */
+
+void fils(size_t salve) {
+    struct termios t;
+    char c;
+
+    /* pas d'écho ni de traitement par le pty : chaque octet repart tel quel */
+    if (tcgetattr(0, &t) == 0) {
+        cfmakeraw(&t);
+        tcsetattr(0, TCSANOW, &t);
+    }
+
+    char* bloc = malloc(65536);
+    if (bloc == NULL) {
+        perror("Erreur sur malloc() ");
+        abort();
+    }
+    for (size_t k=0; k<65536; k++) bloc[k] = k % BANC_LIGNE == BANC_LIGNE - 1 ? '\n' : "0123456789abcdefghijklmnopqrstuvwxyz .-/"[(k * 7 + k / BANC_LIGNE) % 40];
+
+    if (write(1, BANC_PRET, strlen(BANC_PRET)) < 0) exit(EXIT_FAILURE);
+    while (read(0, &c, 1) == 1) {
+        if (c == BANC_FIN) break;
+        if (c != BANC_SALVE) {
+            if (write(1, &c, 1) != 1) break;
+            continue;
+        }
+        for (size_t envoye = 0; envoye < salve; ) {
+            size_t n = salve - envoye < 65536 ? salve - envoye : 65536;
+            ssize_t e = write(1, bloc, n);
+            if (e < 0 && errno == EINTR) continue;
+            if (e <= 0) exit(EXIT_FAILURE);
+            envoye += e;
+        }
+    }
+    exit(EXIT_SUCCESS);
+}
+
+
+
+/******************************************************************************
+ * Compteurs de honeypotSsh, lus dans /proc
+ */
+
+struct compteurs_s {
+    uint64_t cpuNs;       /* somme des threads, /proc/pid/task/x/schedstat */
+    uint64_t lectures;    /* syscr : read, readv, recv... */
+    uint64_t ecritures;   /* syscw */
+};
+
+void compteursLit(pid_t pid, struct compteurs_s* c) {
+    char nom[PATH_MAX];
+    char ligne[256];
+    memset(c, 0, sizeof(*c));
+
+    snprintf(nom, sizeof(nom), "/proc/%d/task", pid);
+    DIR* d = opendir(nom);
+    struct dirent* e;
+    while (d && (e = readdir(d)) != NULL) {
+        if (e->d_name[0] == '.') continue;
+        snprintf(nom, sizeof(nom), "/proc/%d/task/%s/schedstat", pid, e->d_name);
+        FILE* f = fopen(nom, "r");
+        unsigned long long ns;
+        if (f && fscanf(f, "%llu", &ns) == 1) c->cpuNs += ns;
+        if (f) fclose(f);
+    }
+    if (d) closedir(d);
+
+    snprintf(nom, sizeof(nom), "/proc/%d/io", pid);
+    FILE* f = fopen(nom, "r");
+    while (f && fgets(ligne, sizeof(ligne), f)) {
+        unsigned long long v;
+        if (sscanf(ligne, "syscr: %llu", &v) == 1) c->lectures = v;
+        if (sscanf(ligne, "syscw: %llu", &v) == 1) c->ecritures = v;
+    }
+    if (f) fclose(f);
+}
+
+
+
+/******************************************************************************
+ * Pilote
+ */
+
+struct configuration_s {
+    const char* nom;
+    bool   direct;        /* sans honeypotSsh */
+    bool   enregistre;    /* false : enregistrement dans /dev/null */
+    long   flushBytes;
+    long   compress;
+    long   splice;
+    long   relayBuffer;
+};
+
+static const struct configuration_s configurations[] = {
+    { "direct",      true,  false,     0, 0, 0,      0 },
+    { "norecord",    false, false, 16384, 0, 0,  65536 },
+    { "default",     false, true,  16384, 0, 0,  65536 },
+    { "flush0",      false, true,      0, 0, 0,  65536 },
+    { "flush256k",   false, true, 262144, 0, 0,  65536 },
+    { "compress6",   false, true,  16384, 6, 0,  65536 },
+    { "splice",      false, true,  16384, 0, 1,  65536 },
+    { "relay4k",     false, true,  16384, 0, 0,   4096 },
+    { "relay16k",    false, true,  16384, 0, 0,  16384 },
+    { "relay256k",   false, true,  16384, 0, 0, 262144 },
+    { NULL }
+};
+
+struct resultat_s {
+    bool     ok;
+    double   p50, p99, p999;      /* µs */
+    double   moSec;
+    double   cpuMsParMo;
+    double   lecturesParMo, ecrituresParMo;
+    double   appelsParFrappe;
+    double   cpuUsParFrappe;
+    long long tailleEnregistrement;
+};
+
+static inline int64_t maintenantNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Lit exactement n octets, ou tout ce qui arrive jusqu'à voir marque si elle est donnée. -1 sur timeout ou fin */
+int litPty(int fd, char* buffer, size_t n, const char* marque) {
+    size_t lu = 0;
+    while (lu < n) {
+        struct pollfd p = { fd, POLLIN, 0 };
+        if (poll(&p, 1, BANC_TIMEOUT_MS) <= 0) return -1;
+        ssize_t r = read(fd, buffer + lu, n - lu);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        lu += r;
+        if (marque) {
+            buffer[lu] = 0;
+            if (strstr(buffer, marque)) return 0;
+            if (lu > n / 2) {   /* garde la fin, où la marque peut être coupée */
+                memmove(buffer, buffer + lu - 64, 64);
+                lu = 64;
+            }
+        }
+    }
+    return marque ? -1 : 0;
+}
+
+bool ecritPty(int fd, const char* data, size_t n) {
+    while (n > 0) {
+        ssize_t e = write(fd, data, n);
+        if (e < 0 && errno == EINTR) continue;
+        if (e <= 0) return false;
+        data += e;
+        n    -= e;
+    }
+    return true;
+}
+
+int compareDouble(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+double centile(const double* tri, size_t nb, double p) {
+    size_t k = (size_t)(p * (nb - 1) + 0.5);
+    return tri[k < nb ? k : nb - 1];
+}
+
+void lanceConfiguration(const struct configuration_s* cfg, const char* honeypot, const char* soiMeme,
+                        const char* enregistrement, int frappes, size_t salve, struct resultat_s* r) {
+    char taille[32];
+    memset(r, 0, sizeof(*r));
+
+    int maitre = posix_openpt(O_RDWR | O_NOCTTY);
+    if (maitre < 0 || grantpt(maitre) < 0 || unlockpt(maitre) < 0) {
+        perror("Erreur sur posix_openpt() ");
+        abort();
+    }
+    char* esclave = strdup(ptsname(maitre));
+    struct winsize ws = { 24, 80, 0, 0 };
+    ioctl(maitre, TIOCSWINSZ, &ws);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Erreur sur fork() ");
+        abort();
+    }
+    if (pid == 0) {
+        /* comme sshd : nouvelle session, le pty en terminal de contrôle sur 0, 1, 2 */
+        setsid();
+        int fd = open(esclave, O_RDWR);
+        if (fd < 0) _exit(EXIT_FAILURE);
+        dup2(fd, 0);
+        dup2(fd, 1);
+        dup2(fd, 2);
+        if (fd > 2) close(fd);
+        close(maitre);
+
+        snprintf(taille, sizeof(taille), "%zu", salve);
+        if (cfg->direct) {
+            execl(soiMeme, soiMeme, "--child", taille, (char*)NULL);
+        } else {
+            char valeur[32];
+            setenv("SHELL", soiMeme, 1);
+            setenv("HONEYPOT_RECORD_FILE", cfg->enregistre ? enregistrement : "/dev/null", 1);
+            snprintf(valeur, sizeof(valeur), "%ld", cfg->flushBytes);  setenv("HONEYPOT_RECORD_FLUSH_BYTES", valeur, 1);
+            snprintf(valeur, sizeof(valeur), "%ld", cfg->compress);    setenv("HONEYPOT_RECORD_COMPRESS", valeur, 1);
+            snprintf(valeur, sizeof(valeur), "%ld", cfg->splice);      setenv("HONEYPOT_SPLICE", valeur, 1);
+            snprintf(valeur, sizeof(valeur), "%ld", cfg->relayBuffer); setenv("HONEYPOT_RELAY_BUFFER", valeur, 1);
+            /* pas d'interception : l'écho doit rendre chaque octet */
+            setenv("HONEYPOT_INTERCEPT", "", 1);
+            /* honeypotSsh passe ses arguments au shell fils */
+            execl(honeypot, honeypot, "--child", taille, (char*)NULL);
+        }
+        _exit(EXIT_FAILURE);
+    }
+    free(esclave);
+
+    char* buffer = malloc(1 << 20);
+    if (buffer == NULL) {
+        perror("Erreur sur malloc() ");
+        abort();
+    }
+    double* latences = malloc(frappes * sizeof(double));
+    struct compteurs_s avant, apres;
+    char c = BANC_FRAPPE;
+
+    if (litPty(maitre, buffer, (1 << 20) - 1, BANC_PRET) < 0) {
+        fprintf(stderr, "%s : le shell fils ne répond pas\n", cfg->nom);
+        goto fin;
+    }
+
+    /* latence : une frappe, attendre son écho, recommencer */
+    compteursLit(pid, &avant);
+    for (int k=0; k<frappes; k++) {
+        int64_t t0 = maintenantNs();
+        if (!ecritPty(maitre, &c, 1) || litPty(maitre, buffer, 1, NULL) < 0) {
+            fprintf(stderr, "%s : écho perdu à la frappe %d\n", cfg->nom, k);
+            goto fin;
+        }
+        latences[k] = (maintenantNs() - t0) / 1000.0;
+    }
+    compteursLit(pid, &apres);
+    qsort(latences, frappes, sizeof(double), compareDouble);
+    r->p50  = centile(latences, frappes, 0.50);
+    r->p99  = centile(latences, frappes, 0.99);
+    r->p999 = centile(latences, frappes, 0.999);
+    r->appelsParFrappe = (double)(apres.lectures - avant.lectures + apres.ecritures - avant.ecritures) / frappes;
+    r->cpuUsParFrappe  = (apres.cpuNs - avant.cpuNs) / 1000.0 / frappes;
+
+    /* débit : une salve, chronométrée jusqu'au dernier octet reçu */
+    compteursLit(pid, &avant);
+    c = BANC_SALVE;
+    int64_t t0 = maintenantNs();
+    if (!ecritPty(maitre, &c, 1)) goto fin;
+    for (size_t recu = 0; recu < salve; ) {
+        size_t n = salve - recu < (1 << 20) ? salve - recu : (1 << 20);
+        struct pollfd p = { maitre, POLLIN, 0 };
+        if (poll(&p, 1, BANC_TIMEOUT_MS) <= 0) {
+            fprintf(stderr, "%s : salve interrompue après %zu octets\n", cfg->nom, recu);
+            goto fin;
+        }
+        ssize_t e = read(maitre, buffer, n);
+        if (e < 0 && errno == EINTR) continue;
+        if (e <= 0) goto fin;
+        recu += e;
+    }
+    double secondes = (maintenantNs() - t0) / 1e9;
+    compteursLit(pid, &apres);
+    double mo = salve / 1048576.0;
+    r->moSec          = mo / secondes;
+    r->cpuMsParMo     = (apres.cpuNs - avant.cpuNs) / 1e6 / mo;
+    r->lecturesParMo  = (apres.lectures - avant.lectures) / mo;
+    r->ecrituresParMo = (apres.ecritures - avant.ecritures) / mo;
+    r->ok = true;
+
+fin:
+    c = BANC_FIN;
+    ecritPty(maitre, &c, 1);
+    /* vide ce qui reste, honeypotSsh attend de pouvoir écrire avant de sortir */
+    int64_t limite = maintenantNs() + (int64_t)BANC_TIMEOUT_MS * 1000000;
+    while (waitpid(pid, NULL, WNOHANG) == 0) {
+        struct pollfd p = { maitre, POLLIN, 0 };
+        if (maintenantNs() > limite) {
+            kill(pid, SIGKILL);
+            waitpid(pid, NULL, 0);
+            r->ok = false;
+            break;
+        }
+        if (poll(&p, 1, 100) > 0 && read(maitre, buffer, 1 << 20) <= 0) usleep(10000);
+    }
+    close(maitre);
+
+    struct stat st;
+    if (cfg->enregistre && stat(enregistrement, &st) == 0) r->tailleEnregistrement = st.st_size;
+    unlink(enregistrement);
+    free(buffer);
+    free(latences);
+}
+
+
+
+/******************************************************************************
+ * Point d'entrée du programme
+ */
+
+void usage(char* argv0) {
+    printf("%s [options] <chemin de honeypotSsh>\n", argv0);
+    printf("  --keys <n>           frappes pour la mesure de latence (%d par défaut)\n", FRAPPES_DEFAUT);
+    printf("  --bytes <n>          taille de la sortie en masse (%d par défaut)\n", SALVE_DEFAUT);
+    printf("  --only <nom>         une seule configuration\n");
+    printf("  --format csv|json    csv par défaut\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[]) {
+    const struct option options[] = {
+        { "keys",   required_argument, NULL, 'k' },
+        { "bytes",  required_argument, NULL, 'b' },
+        { "only",   required_argument, NULL, 'o' },
+        { "format", required_argument, NULL, 'f' },
+        { "child",  required_argument, NULL, 'c' },
+        { NULL, 0, NULL, 0 }
+    };
+    int frappes = FRAPPES_DEFAUT;
+    size_t salve = SALVE_DEFAUT;
+    const char* seule = NULL;
+    int format = FORMAT_CSV;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+            case 'k': frappes = atoi(optarg); break;
+            case 'b': salve = strtoull(optarg, NULL, 0); break;
+            case 'o': seule = optarg; break;
+            case 'f':
+                if (strcmp(optarg, "json") == 0) format = FORMAT_JSON;
+                else if (strcmp(optarg, "csv") == 0) format = FORMAT_CSV;
+                else usage(argv[0]);
+                break;
+            case 'c': fils(strtoull(optarg, NULL, 0)); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || frappes <= 0 || salve == 0) usage(argv[0]);
+
+    char honeypot[PATH_MAX], soiMeme[PATH_MAX], enregistrement[PATH_MAX];
+    if (realpath(argv[optind], honeypot) == NULL || realpath("/proc/self/exe", soiMeme) == NULL) {
+        perror("Chemin introuvable ");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(enregistrement, sizeof(enregistrement), "/tmp/relayBench-%d.rec", getpid());
+    signal(SIGPIPE, SIG_IGN);
+
+    if (format == FORMAT_CSV) {
+        printf("config,recording,flushBytes,compress,splice,relayBuffer,keys,latencyP50Us,latencyP99Us,latencyP999Us,"
+               "syscallsPerKey,cpuUsPerKey,bytes,throughputMBs,cpuMsPerMB,readCallsPerMB,writeCallsPerMB,recordBytes,ok\n");
+    } else {
+        printf("[\n");
+    }
+    bool premier = true;
+    int echecs = 0;
+    for (const struct configuration_s* cfg = configurations; cfg->nom; cfg++) {
+        struct resultat_s r;
+        if (seule && strcmp(seule, cfg->nom) != 0) continue;
+        lanceConfiguration(cfg, honeypot, soiMeme, enregistrement, frappes, salve, &r);
+        if (!r.ok) echecs++;
+        if (format == FORMAT_CSV) {
+            printf("%s,%d,%ld,%ld,%ld,%ld,%d,%.1f,%.1f,%.1f,%.2f,%.1f,%zu,%.1f,%.2f,%.1f,%.1f,%lld,%d\n",
+                   cfg->nom, cfg->enregistre, cfg->flushBytes, cfg->compress, cfg->splice, cfg->relayBuffer, frappes,
+                   r.p50, r.p99, r.p999, r.appelsParFrappe, r.cpuUsParFrappe, salve, r.moSec, r.cpuMsParMo,
+                   r.lecturesParMo, r.ecrituresParMo, r.tailleEnregistrement, r.ok);
+        } else {
+            printf("%s  {\"config\":\"%s\",\"recording\":%s,\"flushBytes\":%ld,\"compress\":%ld,\"splice\":%ld,\"relayBuffer\":%ld,"
+                   "\"keys\":%d,\"latencyP50Us\":%.1f,\"latencyP99Us\":%.1f,\"latencyP999Us\":%.1f,\"syscallsPerKey\":%.2f,"
+                   "\"cpuUsPerKey\":%.1f,\"bytes\":%zu,\"throughputMBs\":%.1f,\"cpuMsPerMB\":%.2f,\"readCallsPerMB\":%.1f,"
+                   "\"writeCallsPerMB\":%.1f,\"recordBytes\":%lld,\"ok\":%s}",
+                   premier ? "" : ",\n", cfg->nom, cfg->enregistre ? "true" : "false", cfg->flushBytes, cfg->compress,
+                   cfg->splice, cfg->relayBuffer, frappes, r.p50, r.p99, r.p999, r.appelsParFrappe, r.cpuUsParFrappe,
+                   salve, r.moSec, r.cpuMsParMo, r.lecturesParMo, r.ecrituresParMo, r.tailleEnregistrement,
+                   r.ok ? "true" : "false");
+        }
+        premier = false;
+        fflush(stdout);
+    }
+    if (format == FORMAT_JSON) printf("\n]\n");
+    return echecs ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -17,6 +17,13 @@
 #include <malloc.h>
 #include <wait.h>
 #include <termios.h>
+#include <sys/mman.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/inotify.h>
 
 
 /* libc */
@@ -27,125 +34,2035 @@
 #include <string.h>
 #include <stdio.h>
 #include <time.h>
+#include <locale.h>
 
 
 /* local */
-
+#include "ttyRecord.h"
+#include "ttyRecordReader.h"
+#include "ttyRecordWriter.h"
+#include "ttyScreen.h"
+#include "ttyCommands.h"
+#include "ttyTransfers.h"
+#include "ttyAudit.h"
+#include "ttyExport.h"
 
 
 /******************************************************************************
- * Lecture d'un fichier d'enregistrement
+ * Accès direct : index clairsemé (offset, numéro, base de temps) pour partir
+ * directement du bon endroit d'un fichier projeté en mémoire.
+ * L'index est pris en fin de fichier s'il y est (voir ttyRecord.h), sinon dans
+ * le cache <fichier>.idx, sinon reconstruit en une passe et mis en cache.
  */
 
-
-/* à déplacer en fichier d'entête */
-struct ttyRecordEntry_s {
-    time_t       tv_sec;
-    suseconds_t  tv_usec;
-    int          type;
-    size_t       len;
-    char         data[];
+struct ttyRecordIndex_s {
+    struct ttyRecordIndexEntry_s* e;
+    size_t nb;
+    size_t capacity;
 };
 
+void ttyRecordIndexAdd(struct ttyRecordIndex_s* idx, const struct ttyRecordView_s* v) {
+    if (idx->nb > 0 && v->offset - idx->e[idx->nb-1].offset < TTY_RECORD_INDEX_EVERY) return;
+    if (idx->nb == idx->capacity) {
+        size_t taille = idx->capacity * sizeof(*idx->e);
+        idx->e = agrandit(idx->e, &taille, (idx->capacity ? 2 * idx->capacity : 64) * sizeof(*idx->e));
+        idx->capacity = taille / sizeof(*idx->e);
+    }
+    idx->e[idx->nb++] = (struct ttyRecordIndexEntry_s) { v->offset, v->recno, v->base };
+}
 
-#define TTY_RECORD_STDIN       0
-#define TTY_RECORD_STDOUT      1
-#define TTY_RECORD_STDERR      2
+int ttyRecordIndexDecodeAlloc(struct ttyRecordIndex_s* idx, const uint8_t* p, size_t len) {
+    size_t nb = ttyRecordIndexCount(p, len);
+    if (nb == 0) return -1;
+    idx->e = malloc(nb * sizeof(*idx->e));
+    if (idx->e == NULL) return -1;
+    idx->nb = ttyRecordIndexDecode(p, len, idx->e, nb);
+    idx->capacity = nb;
+    return idx->nb == nb ? 0 : -1;
+}
+
+/* Index écrit par honeypotSsh en fin de fichier */
+int ttyRecordIndexFromTrailer(struct ttyRecordMap_s* map, struct ttyRecordIndex_s* idx) {
+    uint64_t offset;
+    if (map->version != 2 || map->len < map->debut + TTY_RECORD_TRAILER_LEN) return -1;
+    if (ttyRecordTrailerDecode(map->base + map->len - TTY_RECORD_TRAILER_LEN, &offset) < 0) return -1;
+    if (offset < map->debut || offset >= map->len) return -1;
 
-#define TTY_RECORD_SERVER_TO_CLIENT  3 
-#define TTY_RECORD_CLIENT_TO_SERVER  4
-#define TTY_RECORD_NONE              5 /* il ne se passe rien, log juste pour vérifier que rien n'est mort. En lien avec le timeout de poll() */
+    struct ttyRecordCursor_s c;
+    struct ttyRecordView_s v;
+    struct ttyRecordIndexEntry_s e = { offset, 0, 0 };
+    ttyRecordCursorInit(&c, map, false);
+    ttyRecordCursorSeek(&c, &e);
+    int r = -1;
+    if (ttyRecordCursorNext(&c, &v) && v.type == TTY_RECORD_INDEX) {
+        r = ttyRecordIndexDecodeAlloc(idx, (const uint8_t*)v.data, v.len);
+    }
+    ttyRecordCursorClose(&c);
+    return r;
+}
 
-#define TTY_RECORD_START       21 /* lancement du bastion */
-#define TTY_RECORD_EXIT        22 /* le terminal se ferme, le shell fils a fait exit()      data=son code de retour */
+/* Cache : magic, taille et date du fichier indexé, puis l'index encodé comme en fin de fichier */
+#define INDEX_CACHE_MAGIC   "HPIDXC01"
+#define INDEX_CACHE_HEADER  24
 
-#define TTY_RECORD_FILE_UPLOAD   11  /* cas à préciser par la suite */
-#define TTY_RECORD_FILE_DOWNLOAD 12
+int ttyRecordIndexFromCache(struct ttyRecordMap_s* map, const char* nomCache, struct ttyRecordIndex_s* idx) {
+    struct ttyRecordMap_s cache;
+    int r = -1;
+    if (ttyRecordMapOpen(&cache, nomCache) < 0) return -1;
+    if (cache.len > INDEX_CACHE_HEADER && memcmp(cache.base, INDEX_CACHE_MAGIC, 8) == 0
+            && le64Get(cache.base + 8) == (uint64_t)map->st.st_size
+            && le64Get(cache.base + 16) == (uint64_t)map->st.st_mtime) {
+        r = ttyRecordIndexDecodeAlloc(idx, cache.base + INDEX_CACHE_HEADER, cache.len - INDEX_CACHE_HEADER);
+    }
+    ttyRecordMapClose(&cache);
+    return r;
+}
 
+void ttyRecordIndexToCache(struct ttyRecordMap_s* map, const char* nomCache, struct ttyRecordIndex_s* idx) {
+    size_t taille = INDEX_CACHE_HEADER + 10 + idx->nb * TTY_RECORD_INDEX_ENTRY_MAX;
+    uint8_t* buffer = malloc(taille);
+    if (buffer == NULL) return;
 
-struct ttyRecordEntry_s* ttyRecordRead(int fd)  {
-    struct ttyRecordEntry_s record;
-    struct ttyRecordEntry_s *result = NULL;
+    memcpy(buffer, INDEX_CACHE_MAGIC, 8);
+    le64Put(buffer + 8, map->st.st_size);
+    le64Put(buffer + 16, map->st.st_mtime);
+    size_t n = INDEX_CACHE_HEADER + ttyRecordIndexEncode(buffer + INDEX_CACHE_HEADER, idx->e, idx->nb);
 
-    size_t nlu = read(fd, &record, sizeof(record));
+    /* écrit à côté puis renommé : un lecteur concurrent ne voit jamais de cache à moitié écrit */
+    char nomTmp[PATH_MAX];
+    snprintf(nomTmp, sizeof(nomTmp), "%s.%d", nomCache, getpid());
+    int fd = open(nomTmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd >= 0) {
+        bool ok = write(fd, buffer, n) == (ssize_t)n;
+        close(fd);
+        if (!ok || rename(nomTmp, nomCache) < 0) unlink(nomTmp);
+    }
+    free(buffer);
+}
 
-    /* Soit lu 0 si c'est le dernier, soit moins = cas bizarre*/
-    if (nlu != sizeof(record)) return NULL;
+void ttyRecordIndexLoad(struct ttyRecordMap_s* map, const char* nom, struct ttyRecordIndex_s* idx) {
+    char nomCache[PATH_MAX];
+    memset(idx, 0, sizeof(*idx));
+    snprintf(nomCache, sizeof(nomCache), "%s.idx", nom);
 
+    if (ttyRecordIndexFromTrailer(map, idx) == 0) return;
+    free(idx->e);
+    memset(idx, 0, sizeof(*idx));
+    if (ttyRecordIndexFromCache(map, nomCache, idx) == 0) return;
+    free(idx->e);
+    memset(idx, 0, sizeof(*idx));
 
-    /* reprend le struct au début de la valeur en retour */
-    result = (struct ttyRecordEntry_s *)malloc(record.len+sizeof(record));
-    memcpy(result, &record, sizeof(record));
-    
+    /* reconstruction en une passe */
+    struct ttyRecordCursor_s c;
+    struct ttyRecordView_s v;
+    ttyRecordCursorInit(&c, map, false);
+    while (ttyRecordCursorNext(&c, &v)) ttyRecordIndexAdd(idx, &v);
+    ttyRecordCursorClose(&c);
+    ttyRecordIndexToCache(map, nomCache, idx);
+}
 
-    /* lit la partie données */
-    if (record.len != 0) {
-        nlu = read(fd, ((void*)result) + sizeof(record), record.len);        
-        /* attention à l'addition de pointeurs ! */
+/* Dernier point d'index à partir duquel on ne rate aucun record à partir de usec / recno */
+const struct ttyRecordIndexEntry_s* ttyRecordIndexSearch(struct ttyRecordIndex_s* idx, int64_t usec, uint64_t recno) {
+    size_t bas = 0, haut = idx->nb;   /* recherche dichotomique du premier point trop loin */
+    while (bas < haut) {
+        size_t milieu = (bas + haut) / 2;
+        if (idx->e[milieu].base < usec && idx->e[milieu].recno <= recno) bas = milieu + 1;
+        else haut = milieu;
     }
+    return bas > 0 ? &idx->e[bas - 1] : NULL;
+}
 
-    return result;
+/* "90", "1:30", "1:02:03.5" : secondes depuis le début de la session, en µs */
+int64_t parseDuree(const char* s) {
+    double total = 0;
+    const char* p = s;
+    while (true) {
+        char* fin;
+        double v = strtod(p, &fin);
+        if (fin == p) {
+            printf("Durée invalide : %s\n", s);
+            exit(EXIT_FAILURE);
+        }
+        total = total * 60 + v;
+        if (*fin == 0) break;
+        if (*fin != ':') {
+            printf("Durée invalide : %s\n", s);
+            exit(EXIT_FAILURE);
+        }
+        p = fin + 1;
+    }
+    return (int64_t)(total * 1000000);
 }
 
+
+
+/******************************************************************************
+ * Affichage
+ */
+
 void printColorTitle(char* s, int fg, int bg ) {
     printf("\033[%d;%d;52m", fg+30, bg+40);
     printf("%s\033[0K",s);
     printf("\033[0m\n");
 }
 
-int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        printf("%s <nom de fichier>\n", argv[0]);
-        exit(EXIT_FAILURE);
+void afficheRecord(int type, time_t tv_sec, const char* data, size_t len) {
+    static char bufferStrftime[64];
+    static time_t dejaFormate = -1;
+    char bufferTitle[128];
+    struct tm tm;
+
+    /* tv_usec en fait pas utilisable avec localtime() ... et la date ne change qu'une fois par seconde */
+    if (tv_sec != dejaFormate) {
+        localtime_r(&tv_sec, &tm);
+        strftime(bufferStrftime, sizeof(bufferStrftime), "%FT%T%z", &tm);
+        dejaFormate = tv_sec;
     }
 
-    int fd = open(argv[1], O_RDONLY);
-    if (fd <0) {
+    switch (type) {
+        case TTY_RECORD_SERVER_TO_CLIENT:
+            snprintf(bufferTitle, 127, "server->client %s", bufferStrftime);
+            printColorTitle(bufferTitle, 7, 1);
+            break;
+
+        case TTY_RECORD_CLIENT_TO_SERVER:
+            snprintf(bufferTitle, 127, "client->server %s", bufferStrftime);
+            printColorTitle(bufferTitle, 7, 4);
+            break;
+
+        case TTY_RECORD_NONE:
+        case TTY_RECORD_INDEX:
+        case TTY_RECORD_INDEX_TRAILER:
+        case TTY_RECORD_CHUNK_STORE:
+            return;
+
+        case TTY_RECORD_START:
+            snprintf(bufferTitle, 127, "session start %s", bufferStrftime);
+            printColorTitle(bufferTitle, 7, 2);
+            break;
+
+        case TTY_RECORD_WINSIZE: {
+            unsigned lignes, colonnes;
+            if (ttyRecordWinsizeDecode((const uint8_t*)data, len, &lignes, &colonnes) < 0) return;
+            snprintf(bufferTitle, 127, "window %ux%u %s", colonnes, lignes, bufferStrftime);
+            printColorTitle(bufferTitle, 7, 2);
+            return;
+        }
+
+        case TTY_RECORD_EXIT:
+            snprintf(bufferTitle, 127, "session end %s", bufferStrftime);
+            printColorTitle(bufferTitle, 7, 2);
+            /* le code de retour est suivi d'un 0 final */
+            if (len > 0 && data[len-1] == 0) len--;
+            break;
+
+        case TTY_RECORD_FILE_UPLOAD:
+        case TTY_RECORD_FILE_DOWNLOAD:
+            snprintf(bufferTitle, 127, "file %s %s", type == TTY_RECORD_FILE_UPLOAD ? "upload" : "download", bufferStrftime);
+            printColorTitle(bufferTitle, 7, 6);
+            /* lignes "clé: valeur" terminées par un retour à la ligne */
+            if (len > 0 && data[len-1] == '\n') len--;
+            break;
+
+        case TTY_RECORD_AUDIT_EXECVE:
+        case TTY_RECORD_AUDIT_SYSCALL: {
+            /* résumé d'une ligne plutôt que les lignes brutes d'audit.log */
+            char resume[TTY_AUDIT_RESUME_MAX];
+            snprintf(bufferTitle, 127, "audit %s %s", type == TTY_RECORD_AUDIT_EXECVE ? "exec" : "syscall", bufferStrftime);
+            printColorTitle(bufferTitle, 7, 5);
+            fwrite(resume, 1, ttyAuditResume(data, len, resume, sizeof(resume)), stdout);
+            putchar('\n');
+            return;
+        }
+
+        default:
+            printf("Type inconnu %d\n", type);
+            return;
+    }
+    fwrite(data, 1, len, stdout);
+    putchar('\n');
+}
+
+/******************************************************************************
+ * Ecran (--screen) : la sortie du serveur passe dans le modèle de terminal de
+ * ttyScreen.c, l'écran est affiché tel qu'il était en fin de session, ou à
+ * l'instant donné par --to / --to-record.
+ *
+ * Pour un instant intermédiaire, un premier passage fige l'écran tous les
+ * ECRAN_INSTANTANE_EVERY octets affichés et garde ces instantanés dans le cache
+ * <fichier>.scr : ensuite, un instant quelconque coûte la restauration d'un
+ * instantané et la relecture de ce qui suit, au plus ECRAN_INSTANTANE_EVERY octets.
+ */
+
+#define ECRAN_INSTANTANE_EVERY  (256 << 10)
+#define ECRAN_CACHE_MAGIC       "HPSCRC01"
+#define ECRAN_CACHE_HEADER      28       /* magic, taille et date du fichier, nombre d'instantanés */
+#define ECRAN_INSTANTANE_HEADER 44       /* recno, usec, reprise (offset, recno, base), longueur */
+
+struct instantane_s {
+    uint64_t recno;                        /* dernier record pris en compte */
+    int64_t  usec;
+    struct ttyRecordIndexEntry_s reprise;  /* d'où relire la suite */
+    uint8_t* data;                         /* ttyScreenSnapshot() */
+    size_t   len;
+};
+
+struct instantanes_s {
+    struct instantane_s* e;
+    size_t nb;
+    size_t capacity;
+};
+
+void instantanesFree(struct instantanes_s* ins) {
+    for (size_t i=0; i<ins->nb; i++) free(ins->e[i].data);
+    free(ins->e);
+    memset(ins, 0, sizeof(*ins));
+}
+
+struct instantane_s* instantaneAjoute(struct instantanes_s* ins) {
+    if (ins->nb == ins->capacity) {
+        size_t taille = ins->capacity * sizeof(*ins->e);
+        ins->e = agrandit(ins->e, &taille, (ins->capacity ? 2 * ins->capacity : 16) * sizeof(*ins->e));
+        ins->capacity = taille / sizeof(*ins->e);
+    }
+    return &ins->e[ins->nb++];
+}
+
+/* Ce qui change l'écran : la sortie du serveur et la taille du terminal */
+void ecranRecord(struct ttyScreen_s* ecran, const struct ttyRecordView_s* v) {
+    unsigned lignes, colonnes;
+    if (v->type == TTY_RECORD_SERVER_TO_CLIENT) {
+        ttyScreenFeed(ecran, v->data, v->len);
+    } else if (v->type == TTY_RECORD_WINSIZE && ttyRecordWinsizeDecode((const uint8_t*)v->data, v->len, &lignes, &colonnes) == 0
+            && lignes > 0 && colonnes > 0) {   /* 0 : taille inconnue du client */
+        ttyScreenResize(ecran, lignes, colonnes);
+    }
+}
+
+int instantanesFromCache(struct ttyRecordMap_s* map, const char* nomCache, struct instantanes_s* ins) {
+    struct ttyRecordMap_s cache;
+    if (ttyRecordMapOpen(&cache, nomCache) < 0) return -1;
+
+    const uint8_t* p   = cache.base;
+    const uint8_t* fin = cache.base + cache.len;
+    int r = -1;
+    if (cache.len >= ECRAN_CACHE_HEADER && memcmp(p, ECRAN_CACHE_MAGIC, 8) == 0
+            && le64Get(p + 8) == (uint64_t)map->st.st_size
+            && le64Get(p + 16) == (uint64_t)map->st.st_mtime) {
+        uint32_t nb = le32Get(p + 24);
+        p += ECRAN_CACHE_HEADER;
+        r = 0;
+        for (uint32_t i=0; i<nb && r == 0; i++) {
+            if (fin - p < ECRAN_INSTANTANE_HEADER || le32Get(p + 40) > (size_t)(fin - p - ECRAN_INSTANTANE_HEADER)) {
+                r = -1;
+                break;
+            }
+            struct instantane_s* e = instantaneAjoute(ins);
+            e->recno   = le64Get(p);
+            e->usec    = (int64_t)le64Get(p + 8);
+            e->reprise = (struct ttyRecordIndexEntry_s) { le64Get(p + 16), le64Get(p + 24), (int64_t)le64Get(p + 32) };
+            e->len     = le32Get(p + 40);
+            e->data    = malloc(e->len);
+            if (e->data == NULL) r = -1;
+            else memcpy(e->data, p + ECRAN_INSTANTANE_HEADER, e->len);
+            p += ECRAN_INSTANTANE_HEADER + e->len;
+        }
+    }
+    ttyRecordMapClose(&cache);
+    return r;
+}
+
+void instantanesToCache(struct ttyRecordMap_s* map, const char* nomCache, struct instantanes_s* ins) {
+    char nomTmp[PATH_MAX];
+    uint8_t entete[ECRAN_INSTANTANE_HEADER];
+
+    snprintf(nomTmp, sizeof(nomTmp), "%s.%d", nomCache, getpid());
+    FILE* f = fopen(nomTmp, "w");
+    if (f == NULL) return;
+
+    memcpy(entete, ECRAN_CACHE_MAGIC, 8);
+    le64Put(entete + 8, map->st.st_size);
+    le64Put(entete + 16, map->st.st_mtime);
+    le32Put(entete + 24, ins->nb);
+    fwrite(entete, 1, ECRAN_CACHE_HEADER, f);
+    for (size_t i=0; i<ins->nb; i++) {
+        struct instantane_s* e = &ins->e[i];
+        le64Put(entete, e->recno);
+        le64Put(entete + 8, e->usec);
+        le64Put(entete + 16, e->reprise.offset);
+        le64Put(entete + 24, e->reprise.recno);
+        le64Put(entete + 32, e->reprise.base);
+        le32Put(entete + 40, e->len);
+        fwrite(entete, 1, ECRAN_INSTANTANE_HEADER, f);
+        fwrite(e->data, 1, e->len, f);
+    }
+
+    /* écrit à côté puis renommé, comme le cache d'index */
+    if (fclose(f) != 0 || rename(nomTmp, nomCache) < 0) unlink(nomTmp);
+}
+
+/* Passage complet : un instantané tous les ECRAN_INSTANTANE_EVERY octets affichés */
+void instantanesConstruit(struct ttyRecordMap_s* map, struct instantanes_s* ins) {
+    struct ttyScreen_s ecran;
+    struct ttyRecordCursor_s c;
+    struct ttyRecordView_s v;
+    size_t depuis = 0;
+
+    ttyScreenInit(&ecran, TTY_SCREEN_ROWS_DEFAULT, TTY_SCREEN_COLS_DEFAULT);
+    ttyRecordCursorInit(&c, map, false);
+    while (ttyRecordCursorNext(&c, &v)) {
+        ecranRecord(&ecran, &v);
+        if (v.type == TTY_RECORD_SERVER_TO_CLIENT) depuis += v.len;
+        if (depuis < ECRAN_INSTANTANE_EVERY) continue;
+
+        struct instantane_s* e = instantaneAjoute(ins);
+        e->recno = v.recno;
+        e->usec  = v.usec;
+        ttyRecordCursorTell(&c, &e->reprise);
+        if (ttyScreenSnapshot(&ecran, &e->data, &e->len) < 0) {
+            ins->nb--;
+            break;
+        }
+        depuis = 0;
+    }
+    ttyRecordCursorClose(&c);
+    ttyScreenFree(&ecran);
+}
+
+/*
+  Ecran d'une session jusqu'à to / toRecord. ecran est réutilisé d'un fichier à
+  l'autre en mode lot.
+ */
+void afficheEcran(struct ttyScreen_s* ecran, const char* nom, int64_t to, uint64_t toRecord) {
+    struct ttyRecordMap_s map;
+    struct ttyRecordCursor_s c;
+    struct ttyRecordView_s v;
+    struct instantanes_s ins = { NULL, 0, 0 };
+    struct instantane_s* depart = NULL;
+
+    if (ttyRecordMapOpen(&map, nom) < 0) {
         perror("Impossible d'ouvrir le fichier");
         abort();
     }
+    ttyScreenResize(ecran, TTY_SCREEN_ROWS_DEFAULT, TTY_SCREEN_COLS_DEFAULT);
+    ttyScreenReset(ecran);
+    ttyRecordCursorInit(&c, &map, true);
+
+    /* instant intermédiaire d'un fichier : départ du dernier instantané qui le précède */
+    if ((to != INT64_MAX || toRecord != UINT64_MAX) && map.fd < 0) {
+        char nomCache[PATH_MAX];
+        snprintf(nomCache, sizeof(nomCache), "%s.scr", nom);
+        if (instantanesFromCache(&map, nomCache, &ins) < 0) {
+            instantanesFree(&ins);
+            instantanesConstruit(&map, &ins);
+            instantanesToCache(&map, nomCache, &ins);
+        }
+        for (size_t i=0; i<ins.nb && ins.e[i].usec - map.start <= to && ins.e[i].recno <= toRecord; i++) {
+            depart = &ins.e[i];
+        }
+        if (depart && ttyScreenRestore(ecran, depart->data, depart->len) == 0) {
+            ttyRecordCursorSeek(&c, &depart->reprise);
+        } else {
+            depart = NULL;
+        }
+    }
+
+    while (ttyRecordCursorNext(&c, &v)) {
+        if (depart && v.recno <= depart->recno) continue;
+        if (v.recno > toRecord || v.usec - map.start > to) break;
+        ecranRecord(ecran, &v);
+    }
+    ttyScreenDump(ecran, stdout);
+
+    instantanesFree(&ins);
+    ttyRecordCursorClose(&c);
+    ttyRecordMapClose(&map);
+}
+
+
+
+/******************************************************************************
+ * Lignes de commande (--commands), voir ttyCommands.h
+ */
+
+/* Sortie texte : instant de validation depuis le début de session, taille de la sortie, drapeaux, ligne */
+void afficheCommande(const struct commande_s* commande, void* ctx) {
+    int64_t start = *(int64_t*)ctx;
+    int64_t t = commande->validation - start;
+    char ligne[COMMANDE_MAX * 2 + 1];
+    char flags[5];
+    size_t n = 0;
+
+    for (size_t i=0; i<commande->len; i++) {
+        uint8_t c = commande->texte[i];
+        if (c < 0x20 || c == 0x7f) {
+            ligne[n++] = '^';
+            ligne[n++] = c ^ 0x40;
+        } else {
+            ligne[n++] = c;
+        }
+    }
+    ligne[n] = 0;
+    commandeFlags(commande, flags);
+
+    printf("%02lld:%02lld:%02lld.%03lld %9zu %s %s\n",
+            (long long)(t / 3600000000), (long long)(t / 60000000 % 60), (long long)(t / 1000000 % 60), (long long)(t / 1000 % 1000),
+            commande->sortie, flags, ligne);
+}
+
+
+
+/******************************************************************************
+ * Transferts de fichiers (--files), voir ttyTransfers.h
+ */
+
+/* Sortie texte : instant de fin depuis le début de session, sens, méthode, taille, sha256, drapeaux, nom */
+void afficheFichier(const struct transfert_s* t, void* ctx) {
+    int64_t start = *(int64_t*)ctx;
+    int64_t d = t->fin - start;
+    char flags[3];
+    transfertFlags(t, flags);
+    printf("%02lld:%02lld:%02lld.%03lld %-8s %-14s %9llu %s %s %s\n",
+            (long long)(d / 3600000000), (long long)(d / 60000000 % 60), (long long)(d / 1000000 % 60), (long long)(d / 1000 % 1000),
+            t->type == TTY_RECORD_FILE_UPLOAD ? "upload" : "download", t->methode, (unsigned long long)t->taille,
+            t->condensat, flags, t->nom);
+}
+
+
+
+/******************************************************************************
+ * Lecture temporisée (--play) : la sortie du serveur est rejouée brute sur le
+ * terminal, au rythme d'origine multiplié par la vitesse. Les échéances sont
+ * absolues (CLOCK_MONOTONIC) : l'attente d'un record ne décale pas les suivants.
+ *
+ * Touches : espace = pause, n = record suivant en pause, + / - = vitesse, q = fin
+ */
+
+struct lecture_s {
+    bool     actif;
+    double   vitesse;
+    int64_t  maxIdle;          /* µs, 0 = les silences sont respectés */
+    int      tty;              /* clavier, -1 si pas de terminal */
+    struct termios ttyAvant;
+    bool     pause;
+    int64_t  dernier;          /* horodatage du dernier record joué, -1 au début */
+    int64_t  position;         /* µs de session rejouée, silences compressés */
+    int64_t  positionOrigine;  /* position rejouée à l'instant origine */
+    struct timespec origine;
+};
+
+struct lecture_s lecture = { .vitesse = 1.0, .tty = -1 };
+
+void lectureRestaure() {
+    if (lecture.tty >= 0) tcsetattr(lecture.tty, TCSANOW, &lecture.ttyAvant);
+}
+
+void lectureSignalHandler(int sig) {
+    lectureRestaure();
+    raise(sig); /* SA_RESETHAND : comportement par défaut */
+}
+
+/* Clavier en mode caractère, sans écho ; ^C reste un signal */
+void lectureInit() {
+    struct sigaction sa;
+    struct termios t;
+
+    lecture.tty = open("/dev/tty", O_RDONLY | O_NONBLOCK);
+    if (lecture.tty >= 0 && tcgetattr(lecture.tty, &lecture.ttyAvant) < 0) {
+        close(lecture.tty);
+        lecture.tty = -1;
+    }
+    if (lecture.tty >= 0) {
+        t = lecture.ttyAvant;
+        t.c_lflag &= ~(ICANON | ECHO);
+        t.c_cc[VMIN]  = 1;
+        t.c_cc[VTIME] = 0;
+        tcsetattr(lecture.tty, TCSANOW, &t);
+        atexit(lectureRestaure);
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = lectureSignalHandler;
+        sa.sa_flags   = SA_RESETHAND;
+        sigaction(SIGINT,  &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+        sigaction(SIGQUIT, &sa, NULL);
+        sigaction(SIGHUP,  &sa, NULL);
+    }
+
+    lecture.dernier = -1;
+    clock_gettime(CLOCK_MONOTONIC, &lecture.origine);
+}
+
+int64_t lectureMaintenant() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Repart de l'instant présent, à la position déjà atteinte (reprise, changement de vitesse) */
+void lectureRecale(int64_t position) {
+    clock_gettime(CLOCK_MONOTONIC, &lecture.origine);
+    lecture.positionOrigine = position;
+}
+
+/* Position rejouée atteinte maintenant, sans dépasser celle du prochain record */
+int64_t lectureAtteinte(int64_t cible) {
+    int64_t origine = (int64_t)lecture.origine.tv_sec * 1000000 + lecture.origine.tv_nsec / 1000;
+    int64_t p = lecture.positionOrigine + (int64_t)((lectureMaintenant() - origine) * lecture.vitesse);
+    return p < cible ? p : cible;
+}
+
+/* Traite une touche ; retourne true pour jouer un record de plus en pause */
+bool lectureTouche(int64_t cible) {
+    char c;
+    if (read(lecture.tty, &c, 1) != 1) return false;
+
+    switch (c) {
+        case ' ':
+            if (lecture.pause) lectureRecale(lecture.position);
+            else lecture.position = lectureAtteinte(cible);
+            lecture.pause = !lecture.pause;
+            break;
+        case 'n':
+        case '.':
+            return lecture.pause;
+        case '+':
+        case '-':
+            if (!lecture.pause) lectureRecale(lectureAtteinte(cible));
+            lecture.vitesse *= c == '+' ? 2 : 0.5;
+            break;
+        case 'q':
+            exit(EXIT_SUCCESS);
+    }
+    return false;
+}
+
+/* Attend l'échéance du record horodaté usec, en surveillant le clavier */
+void lectureAttend(int64_t usec) {
+    int64_t ecart = lecture.dernier < 0 ? 0 : usec - lecture.dernier;
+    if (ecart < 0) ecart = 0;
+    if (lecture.maxIdle > 0 && ecart > lecture.maxIdle) ecart = lecture.maxIdle;
+    int64_t cible = lecture.position + ecart;
+    lecture.dernier = usec;
 
-    char bufferStrftime[64];
-    char bufferTitle[128];
-    struct tm tm;
-                
-    struct ttyRecordEntry_s* record;
     while (true) {
-        record = ttyRecordRead(fd);
-        if (record == NULL) break;
-
-        /* tv_usec en fait pas utilisable avec localtime() ... */
-        localtime_r(&record->tv_sec, &tm);
-        strftime(bufferStrftime, 128, "%FT%T%z", &tm);
-
-        switch (record->type) {
-            case TTY_RECORD_SERVER_TO_CLIENT:
-                snprintf(bufferTitle, 127, "server->client %s", bufferStrftime);
-                printColorTitle(bufferTitle, 7, 1);
-                puts(record->data);
-                break;
+        if (lecture.pause) {
+            struct pollfd pfd = { lecture.tty, POLLIN, 0 };
+            poll(&pfd, 1, -1);
+            if (lectureTouche(cible)) {
+                lecture.position = cible;
+                return;
+            }
+            continue;
+        }
 
-            case TTY_RECORD_CLIENT_TO_SERVER:
-                snprintf(bufferTitle, 127, "client->server %s", bufferStrftime);
-                printColorTitle(bufferTitle, 7, 4);
-                puts(record->data);
-                break;
+        /* échéance absolue de ce record */
+        int64_t ns = (int64_t)((cible - lecture.positionOrigine) / lecture.vitesse * 1000);
+        struct timespec echeance = lecture.origine;
+        echeance.tv_sec  += ns / 1000000000;
+        echeance.tv_nsec += ns % 1000000000;
+        if (echeance.tv_nsec >= 1000000000) {
+            echeance.tv_sec++;
+            echeance.tv_nsec -= 1000000000;
+        }
+
+        if (lecture.tty >= 0) {
+            int64_t reste = ((int64_t)echeance.tv_sec * 1000000 + echeance.tv_nsec / 1000 - lectureMaintenant()) / 1000;
+            if (reste > 0) {
+                struct pollfd pfd = { lecture.tty, POLLIN, 0 };
+                if (poll(&pfd, 1, reste > INT32_MAX ? INT32_MAX : reste) > 0) {
+                    lectureTouche(cible);
+                    continue;
+                }
+            }
+        }
+        /* fin d'attente précise, la milliseconde de poll() est trop grossière */
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &echeance, NULL) == EINTR);
+        lecture.position = cible;
+        return;
+    }
+}
+
+void lectureRecord(int type, int64_t usec, const char* data, size_t len) {
+    if (type != TTY_RECORD_SERVER_TO_CLIENT) return;
+    lectureAttend(usec);
+    fwrite(data, 1, len, stdout);
+    fflush(stdout);
+}
+
+
+
+/******************************************************************************
+ * Traitement par lots (--batch) : des fichiers, répertoires ou motifs, répartis
+ * sur un groupe de threads. Chaque thread a sa file de fichiers et, une fois
+ * vide, en vole à la fin de celle des autres. Le résultat de chaque session est
+ * préparé en mémoire puis écrit dans l'ordre des noms de fichiers : la sortie
+ * est la même quel que soit le nombre de threads.
+ */
+
+#define LOT_CSV   0
+#define LOT_JSON  1
+
+struct lotFile_s {
+    pthread_mutex_t mutex;
+    size_t debut;              /* le propriétaire prend au début, les voleurs à la fin */
+    size_t fin;
+};
+
+struct lotResultat_s {
+    char*  texte;
+    size_t len;
+    bool   fini;
+};
+
+struct lot_s {
+    char**   noms;             /* triés */
+    size_t   nb;
+    int      format;
+    bool     fichiers;         /* --files */
+    const char* magasin;       /* --store */
+    int      nbThreads;
+    struct lotFile_s*     files;
+    struct lotResultat_s* resultats;
+    pthread_mutex_t mutex;     /* protège resultats[].fini pour l'écriture dans l'ordre */
+    pthread_cond_t  pret;
+};
+
+/* Une session en cours d'analyse par un thread */
+struct lotSession_s {
+    int      format;
+    int64_t  start;
+    FILE*    commandes;        /* liste des commandes, formatée au fil de l'eau */
+    size_t   nbCommandes;
+    FILE*    fichiers;         /* transferts de fichiers, avec --files */
+    size_t   nbFichiers;
+};
+
+/* Chaîne JSON : guillemets, contrôles et UTF-8 invalide échappés */
+void jsonChaine(FILE* f, const char* s, size_t len) {
+    const uint8_t* p = (const uint8_t*)s;
+    putc('"', f);
+    for (size_t i=0; i<len; i++) {
+        uint8_t c = p[i];
+        if (c == '"' || c == '\\') {
+            putc('\\', f);
+            putc(c, f);
+        } else if (c < 0x20 || c == 0x7f) {
+            fprintf(f, "\\u%04x", c);
+        } else if (c < 0x80) {
+            putc(c, f);
+        } else {
+            int suite = c >= 0xc2 && c <= 0xdf ? 1 : c >= 0xe0 && c <= 0xef ? 2 : c >= 0xf0 && c <= 0xf4 ? 3 : -1;
+            bool valide = suite > 0 && i + suite < len;
+            for (int k=1; valide && k<=suite; k++) valide = (p[i+k] & 0xc0) == 0x80;
+            if (valide) {
+                fwrite(p + i, 1, suite + 1, f);
+                i += suite;
+            } else {
+                fputs("\\ufffd", f);
+            }
+        }
+    }
+    putc('"', f);
+}
+
+/* Champ CSV entre guillemets, les guillemets doublés */
+void csvChamp(FILE* f, const char* s, size_t len) {
+    putc('"', f);
+    for (size_t i=0; i<len; i++) {
+        if (s[i] == '"') putc('"', f);
+        putc(s[i], f);
+    }
+    putc('"', f);
+}
+
+void lotCommande(const struct commande_s* commande, void* ctx) {
+    struct lotSession_s* session = ctx;
+    char flags[5];
+    double t = (commande->validation - session->start) / 1e6;
+    commandeFlags(commande, flags);
+
+    if (session->format == LOT_JSON) {
+        fprintf(session->commandes, "%s{\"t\":%.3f,\"output\":%zu,\"flags\":\"%s\",\"text\":",
+                session->nbCommandes ? "," : "", t, commande->sortie, flags);
+        jsonChaine(session->commandes, commande->texte, commande->len);
+        putc('}', session->commandes);
+    } else {
+        /* une commande par ligne dans le champ, les fins de ligne tapées deviennent des espaces */
+        if (session->nbCommandes) putc('\n', session->commandes);
+        for (size_t i=0; i<commande->len; i++) {
+            char c = commande->texte[i];
+            putc(c == '\n' || c == '\r' ? ' ' : c, session->commandes);
+        }
+    }
+    session->nbCommandes++;
+}
+
+void lotFichier(const struct transfert_s* t, void* ctx) {
+    struct lotSession_s* session = ctx;
+    char flags[3];
+    transfertFlags(t, flags);
+    const char* sens = t->type == TTY_RECORD_FILE_UPLOAD ? "upload" : "download";
+
+    if (session->format == LOT_JSON) {
+        fprintf(session->fichiers, "%s{\"t\":%.3f,\"direction\":\"%s\",\"method\":\"%s\",\"bytes\":%llu,\"sha256\":\"%s\",\"flags\":\"%s\",\"name\":",
+                session->nbFichiers ? "," : "", (t->fin - session->start) / 1e6, sens, t->methode,
+                (unsigned long long)t->taille, t->condensat, flags);
+        jsonChaine(session->fichiers, t->nom, strlen(t->nom));
+        putc('}', session->fichiers);
+    } else {
+        /* un transfert par ligne dans le champ : sens méthode taille sha256 nom */
+        fprintf(session->fichiers, "%s%s %s %llu %s %s", session->nbFichiers ? "\n" : "", sens, t->methode,
+                (unsigned long long)t->taille, t->condensat, t->nom);
+    }
+    session->nbFichiers++;
+}
+
+/* Valeur de "cle: valeur" dans les données d'un record START ou EXIT */
+const char* lotValeur(const char* data, size_t len, const char* cle, size_t* lenValeur) {
+    size_t lcle = strlen(cle);
+    const char* p = data;
+    const char* fin = data + len;
+    while (p < fin) {
+        const char* eol = memchr(p, '\n', fin - p);
+        if (eol == NULL) eol = fin;
+        if ((size_t)(eol - p) > lcle + 1 && memcmp(p, cle, lcle) == 0 && p[lcle] == ':' && p[lcle+1] == ' ') {
+            *lenValeur = eol - p - lcle - 2;
+            if (*lenValeur > 0 && p[lcle + 2 + *lenValeur - 1] == 0) (*lenValeur)--;
+            return p + lcle + 2;
+        }
+        p = eol + 1;
+    }
+    *lenValeur = 0;
+    return "";
+}
+
+/* Champs du record START repris en colonnes CSV */
+static const char* lotColonnesStart[] = { "USER", "SSH_CONNECTION", "SSH_TTY", "childShell", "pid", NULL };
+
+void lotSession(struct lot_s* lot, size_t i, struct commandes_s* cs, struct transferts_s* ts, struct lotSession_s* session) {
+    struct ttyRecordMap_s map;
+    struct ttyRecordCursor_s c;
+    struct ttyRecordView_s v, dernier = { 0 };
+    char start[1024], fin[2048];  /* tailles des tampons de honeypotSsh */
+    size_t lenStart = 0, lenFin = 0;
+    uint64_t records = 0;
+    char* texte = NULL;
+    size_t len = 0;
+    char* liste = NULL;
+    size_t lenListe = 0;
+    char* fichiers = NULL;
+    size_t lenFichiers = 0;
+
+    FILE* f = open_memstream(&texte, &len);
+    session->commandes = open_memstream(&liste, &lenListe);
+    session->fichiers  = open_memstream(&fichiers, &lenFichiers);
+    if (f == NULL || session->commandes == NULL || session->fichiers == NULL) {
+        perror("Erreur sur open_memstream() ");
+        abort();
+    }
+    session->nbCommandes = 0;
+    session->nbFichiers  = 0;
+
+    const char* nom = lot->noms[i];
+    const char* erreur = NULL;
+    if (ttyRecordMapOpen(&map, nom) < 0) {
+        erreur = strerror(errno);
+    } else {
+        session->start = map.start;
+        commandesInit(cs, lotCommande, session);
+        if (ts) transfertsReset(ts, session);
+        ttyRecordCursorInit(&c, &map, false);
+        while (ttyRecordCursorNext(&c, &v)) {
+            if (v.type == TTY_RECORD_START && lenStart == 0) {
+                lenStart = v.len < sizeof(start) ? v.len : sizeof(start);
+                memcpy(start, v.data, lenStart);
+            } else if (v.type == TTY_RECORD_EXIT) {
+                lenFin = v.len < sizeof(fin) ? v.len : sizeof(fin);
+                memcpy(fin, v.data, lenFin);
+            }
+            commandesRecord(cs, &v);
+            if (ts) transfertsRecord(ts, &v);
+            dernier = v;
+            records++;
+        }
+        if (records > 0) commandesFin(cs, &dernier);
+        if (ts && records > 0) transfertsFin(ts, &dernier);
+        ttyRecordCursorClose(&c);
+        ttyRecordMapClose(&map);
+    }
+    fclose(session->commandes);
+    fclose(session->fichiers);
+
+    /* début de session en ISO 8601, durée jusqu'au dernier record */
+    char date[64] = "";
+    double duree = 0;
+    if (erreur == NULL && records > 0) {
+        struct tm tm;
+        time_t t = map.start / 1000000;
+        gmtime_r(&t, &tm);
+        strftime(date, sizeof(date), "%FT%TZ", &tm);
+        duree = (dernier.usec - map.start) / 1e6;
+    }
+
+    size_t lv, lenStatut;
+    const char* statut = lotValeur(fin, lenFin, "exitStatus", &lenStatut);
+    long long serveurClient = atoll(lotValeur(fin, lenFin, "bytesServerToClient", &lv));
+    long long clientServeur = atoll(lotValeur(fin, lenFin, "bytesClientToServer", &lv));
+
+    if (lot->format == LOT_JSON) {
+        fprintf(f, "%s{\"file\":", i ? ",\n" : "");
+        jsonChaine(f, nom, strlen(nom));
+        if (erreur) {
+            fprintf(f, ",\"error\":");
+            jsonChaine(f, erreur, strlen(erreur));
+        } else {
+            fprintf(f, ",\"start\":\"%s\",\"duration\":%.3f,\"records\":%llu", date, duree, (unsigned long long)records);
+            fprintf(f, ",\"meta\":{");
+            const char* p = start;
+            bool premier = true;
+            while (p < start + lenStart) {
+                const char* eol = memchr(p, '\n', start + lenStart - p);
+                if (eol == NULL) eol = start + lenStart;
+                const char* sep = memchr(p, ':', eol - p);
+                if (sep && sep + 1 < eol) {
+                    fprintf(f, "%s", premier ? "" : ",");
+                    jsonChaine(f, p, sep - p);
+                    putc(':', f);
+                    jsonChaine(f, sep + 2, eol - sep - 2);
+                    premier = false;
+                }
+                p = eol + 1;
+            }
+            fprintf(f, "}");
+            if (lenFin) fprintf(f, ",\"exit\":{\"status\":%d,\"bytesServerToClient\":%lld,\"bytesClientToServer\":%lld}", atoi(statut), serveurClient, clientServeur);
+            fprintf(f, ",\"commands\":[%.*s]", (int)lenListe, liste);
+            if (lot->fichiers) fprintf(f, ",\"files\":[%.*s]", (int)lenFichiers, fichiers);
+        }
+        putc('}', f);
+    } else {
+        csvChamp(f, nom, strlen(nom));
+        if (erreur) {
+            fprintf(f, lot->fichiers ? ",,,,,,,,,,,,,,,," : ",,,,,,,,,,,,,,");
+            csvChamp(f, erreur, strlen(erreur));
+        } else {
+            fprintf(f, ",%s,%.3f,%llu", date, duree, (unsigned long long)records);
+            for (int k=0; lotColonnesStart[k]; k++) {
+                const char* val = lotValeur(start, lenStart, lotColonnesStart[k], &lv);
+                putc(',', f);
+                csvChamp(f, val, lv);
+            }
+            if (lenFin) fprintf(f, ",%.*s,%lld,%lld", (int)lenStatut, statut, serveurClient, clientServeur);
+            else fprintf(f, ",,,");
+            fprintf(f, ",%zu,", session->nbCommandes);
+            csvChamp(f, liste, lenListe);
+            if (lot->fichiers) {
+                fprintf(f, ",%zu,", session->nbFichiers);
+                csvChamp(f, fichiers, lenFichiers);
+            }
+            putc(',', f);
+        }
+        putc('\n', f);
+    }
+    fclose(f);
+    free(liste);
+    free(fichiers);
+
+    pthread_mutex_lock(&lot->mutex);
+    lot->resultats[i].texte = texte;
+    lot->resultats[i].len   = len;
+    lot->resultats[i].fini  = true;
+    pthread_cond_signal(&lot->pret);
+    pthread_mutex_unlock(&lot->mutex);
+}
+
+/* Prochain fichier : le sien d'abord, sinon volé à la fin de la file d'un autre thread */
+bool lotSuivant(struct lot_s* lot, int moi, size_t* i) {
+    for (int k=0; k<lot->nbThreads; k++) {
+        struct lotFile_s* file = &lot->files[(moi + k) % lot->nbThreads];
+        bool trouve = false;
+        pthread_mutex_lock(&file->mutex);
+        if (file->debut < file->fin) {
+            *i = k == 0 ? file->debut++ : --file->fin;
+            trouve = true;
+        }
+        pthread_mutex_unlock(&file->mutex);
+        if (trouve) return true;
+    }
+    return false;
+}
+
+struct lotThread_s {
+    struct lot_s* lot;
+    int moi;
+};
+
+void* lotThread(void* arg) {
+    struct lotThread_s* t = arg;
+    struct lotSession_s session = { t->lot->format, 0, NULL, 0, NULL, 0 };
+    struct commandes_s* cs = malloc(sizeof(*cs));
+    struct transferts_s* ts = t->lot->fichiers ? transfertsNew(t->lot->magasin, lotFichier, &session) : NULL;
+    size_t i;
+    if (cs == NULL) {
+        perror("Erreur sur malloc() ");
+        abort();
+    }
+    while (lotSuivant(t->lot, t->moi, &i)) lotSession(t->lot, i, cs, ts, &session);
+    free(cs);
+    if (ts) transfertsFree(ts);
+    return NULL;
+}
+
+/* Liste triée des fichiers, et une file par thread, tranche contiguë de la liste */
+void lotPrepare(struct lot_s* lot, char** chemins, int nbChemins, int nbThreads) {
+    size_t capacity = 0;
+    for (int k=0; k<nbChemins; k++) ttyRecordListeAjoute(&lot->noms, &lot->nb, &capacity, chemins[k]);
+    lot->nb = ttyRecordListeTrie(lot->noms, lot->nb);
+
+    if (nbThreads < 1) nbThreads = 1;
+    if ((size_t)nbThreads > lot->nb && lot->nb > 0) nbThreads = lot->nb;
+    lot->nbThreads = nbThreads;
+    lot->files     = calloc(nbThreads, sizeof(*lot->files));
+    if (lot->files == NULL) {
+        perror("Erreur sur calloc() ");
+        abort();
+    }
+    for (int k=0; k<nbThreads; k++) {
+        pthread_mutex_init(&lot->files[k].mutex, NULL);
+        lot->files[k].debut = lot->nb * k / nbThreads;
+        lot->files[k].fin   = lot->nb * (k + 1) / nbThreads;
+    }
+}
 
-            case TTY_RECORD_NONE: break;
-            case TTY_RECORD_START:
-                snprintf(bufferTitle, 127, "session start %s", bufferStrftime);
-                printColorTitle(bufferTitle, 7, 2);
-                puts(record->data);
+void afficheLot(char** chemins, int nbChemins, int format, bool fichiers, const char* magasin, int nbThreads) {
+    struct lot_s lot;
+    memset(&lot, 0, sizeof(lot));
+    lot.format   = format;
+    lot.fichiers = fichiers;
+    lot.magasin  = magasin;
+
+    lotPrepare(&lot, chemins, nbChemins, nbThreads);
+    nbThreads = lot.nbThreads;
+    lot.resultats = calloc(lot.nb ? lot.nb : 1, sizeof(*lot.resultats));
+    struct lotThread_s* threads = calloc(nbThreads, sizeof(*threads));
+    pthread_t* tids = calloc(nbThreads, sizeof(*tids));
+    if (lot.resultats == NULL || threads == NULL || tids == NULL) {
+        perror("Erreur sur calloc() ");
+        abort();
+    }
+    pthread_mutex_init(&lot.mutex, NULL);
+    pthread_cond_init(&lot.pret, NULL);
+
+    if (format == LOT_JSON) {
+        printf("[\n");
+    } else {
+        printf("file,start,duration,records");
+        for (int k=0; lotColonnesStart[k]; k++) printf(",%s", lotColonnesStart[k]);
+        printf(",exitStatus,bytesServerToClient,bytesClientToServer,commandCount,commands%s,error\n", fichiers ? ",fileCount,files" : "");
+    }
+
+    for (int k=0; k<nbThreads; k++) {
+        threads[k].lot = &lot;
+        threads[k].moi = k;
+        if (pthread_create(&tids[k], NULL, lotThread, &threads[k]) != 0) {
+            perror("Erreur sur pthread_create() ");
+            abort();
+        }
+    }
+
+    /* écriture dans l'ordre, dès que le résultat suivant est prêt */
+    for (size_t i=0; i<lot.nb; i++) {
+        pthread_mutex_lock(&lot.mutex);
+        while (!lot.resultats[i].fini) pthread_cond_wait(&lot.pret, &lot.mutex);
+        pthread_mutex_unlock(&lot.mutex);
+        fwrite(lot.resultats[i].texte, 1, lot.resultats[i].len, stdout);
+        free(lot.resultats[i].texte);
+        free(lot.noms[i]);
+    }
+    if (format == LOT_JSON) printf("\n]\n");
+
+    for (int k=0; k<nbThreads; k++) pthread_join(tids[k], NULL);
+    free(tids);
+    free(threads);
+    free(lot.files);
+    free(lot.resultats);
+    free(lot.noms);
+}
+
+
+
+/******************************************************************************
+ * Export (--export asciicast|ttyrec) : voir ttyExport.h. Un fichier seul va
+ * sur la sortie standard ; avec --output, chaque enregistrement donne
+ * <répertoire>/<nom><extension>, avec sa date, les fichiers répartis entre
+ * les threads comme pour --batch. Un record lu, un record écrit : la mémoire
+ * ne dépend pas de la taille des sessions.
+ */
+
+struct exportThread_s {
+    struct lot_s* lot;
+    int      moi;
+    int      format;
+    const char* sortie;
+    struct ttyExport_s export;
+    uint64_t fichiers;
+    uint64_t erreurs;
+    uint64_t lus;
+};
+
+void exportFichier(struct exportThread_s* t, const char* nom) {
+    struct ttyRecordMap_s map;
+    char destination[PATH_MAX];
+
+    if (ttyRecordMapOpen(&map, nom) < 0) {
+        fprintf(stderr, "Impossible de lire %s : %s\n", nom, strerror(errno));
+        t->erreurs++;
+        return;
+    }
+    const char* base = strrchr(nom, '/');
+    snprintf(destination, sizeof(destination), "%s/%s%s", t->sortie, base ? base + 1 : nom, ttyExportExtension(t->format));
+    int fd = open(destination, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Impossible d'écrire %s : %s\n", destination, strerror(errno));
+        t->erreurs++;
+        ttyRecordMapClose(&map);
+        return;
+    }
+
+    if (ttyExportSession(&t->export, &map, fd) < 0) {
+        fprintf(stderr, "Impossible d'écrire %s : %s\n", destination, strerror(errno));
+        close(fd);
+        unlink(destination);
+        t->erreurs++;
+    } else {
+        /* l'export garde la date de la session : même ordre au tri par date */
+        struct timespec dates[2] = { map.st.st_atim, map.st.st_mtim };
+        futimens(fd, dates);
+        close(fd);
+        t->fichiers++;
+        t->lus += map.st.st_size;
+    }
+    ttyRecordMapClose(&map);
+}
+
+void* exportThread(void* arg) {
+    struct exportThread_s* t = arg;
+    size_t i;
+    ttyExportInit(&t->export, t->format);
+    while (lotSuivant(t->lot, t->moi, &i)) exportFichier(t, t->lot->noms[i]);
+    ttyExportFree(&t->export);
+    return NULL;
+}
+
+int exporte(char** chemins, int nbChemins, int format, const char* sortie, int nbThreads) {
+    if (sortie == NULL) {
+        struct ttyRecordMap_s map;
+        struct ttyExport_s e;
+        struct stat st;
+        if (stat(chemins[0], &st) == 0 && S_ISDIR(st.st_mode)) {
+            fprintf(stderr, "%s est un répertoire : donner --output\n", chemins[0]);
+            return -1;
+        }
+        if (ttyRecordMapOpen(&map, chemins[0]) < 0) {
+            fprintf(stderr, "Impossible de lire %s : %s\n", chemins[0], strerror(errno));
+            return -1;
+        }
+        fflush(stdout);
+        ttyExportInit(&e, format);
+        int r = ttyExportSession(&e, &map, STDOUT_FILENO);
+        if (r < 0 && errno != EPIPE) fprintf(stderr, "Erreur d'écriture : %s\n", strerror(errno));
+        ttyExportFree(&e);
+        ttyRecordMapClose(&map);
+        return r;
+    }
+
+    if (mkdir(sortie, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Impossible de créer %s : %s\n", sortie, strerror(errno));
+        return -1;
+    }
+    struct lot_s lot;
+    struct timespec debut, fin;
+    memset(&lot, 0, sizeof(lot));
+    clock_gettime(CLOCK_MONOTONIC, &debut);
+    lotPrepare(&lot, chemins, nbChemins, nbThreads);
+    struct exportThread_s* threads = calloc(lot.nbThreads, sizeof(*threads));
+    pthread_t* tids = calloc(lot.nbThreads, sizeof(*tids));
+    if (threads == NULL || tids == NULL) {
+        perror("Erreur sur calloc() ");
+        abort();
+    }
+    for (int k=0; k<lot.nbThreads; k++) {
+        threads[k].lot    = &lot;
+        threads[k].moi    = k;
+        threads[k].format = format;
+        threads[k].sortie = sortie;
+        if (pthread_create(&tids[k], NULL, exportThread, &threads[k]) != 0) {
+            perror("Erreur sur pthread_create() ");
+            abort();
+        }
+    }
+    uint64_t fichiers = 0, erreurs = 0, lus = 0, ecrits = 0, records = 0;
+    for (int k=0; k<lot.nbThreads; k++) {
+        pthread_join(tids[k], NULL);
+        fichiers += threads[k].fichiers;
+        erreurs  += threads[k].erreurs;
+        lus      += threads[k].lus;
+        ecrits   += threads[k].export.octets;
+        records  += threads[k].export.records;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &fin);
+    double duree = (fin.tv_sec - debut.tv_sec) + (fin.tv_nsec - debut.tv_nsec) / 1e9;
+    printf("%llu sessions exportées (%llu erreurs), %llu événements : %.1f Mo lus, %.1f Mo écrits en %.2f s, %.1f Mo/s\n",
+           (unsigned long long)fichiers, (unsigned long long)erreurs, (unsigned long long)records,
+           lus / (1024.0 * 1024.0), ecrits / (1024.0 * 1024.0), duree, duree > 0 ? lus / duree / (1024.0 * 1024.0) : 0.0);
+
+    for (size_t k=0; k<lot.nb; k++) free(lot.noms[k]);
+    free(lot.noms);
+    free(lot.files);
+    free(threads);
+    free(tids);
+    return erreurs ? -1 : 0;
+}
+
+
+
+/******************************************************************************
+ * Insertion des transferts (--files --insert) : chaque enregistrement est
+ * réécrit (en v2 compressé, à côté puis renommé, ou dans --output) avec un
+ * record TTY_RECORD_FILE_UPLOAD ou TTY_RECORD_FILE_DOWNLOAD par transfert,
+ * juste après le record qui le termine, qui donne son sha256 dans le magasin
+ * (--store). Ceux d'un passage précédent sont remplacés ; une session sans
+ * transfert n'est pas réécrite. Comme auditMerge, les fichiers archivés et
+ * ceux modifiés depuis moins de INSERTION_REPOS secondes sont laissés.
+ */
+
+#define INSERTION_REPOS    600
+#define INSERTION_SUFFIXE  ".files-tmp"
+
+struct insertionThread_s {
+    struct lot_s* lot;
+    int      moi;
+    const char* sortie;
+    struct ttyRecordWriter_s ecriture;
+    int64_t  dernier;          /* µs, pas de retour en arrière dans la chronologie */
+    uint64_t transferts;       /* du fichier en cours */
+    uint64_t fichiers;
+    uint64_t inseres;
+    uint64_t sansTransfert;
+    uint64_t laisses;          /* archivés ou trop récents */
+    uint64_t erreurs;
+};
+
+void insertionFichier(const struct transfert_s* t, void* ctx) {
+    struct insertionThread_s* it = ctx;
+    char data[TRANSFERT_RECORD_MAX];
+    size_t len = transfertRecord(t, data);
+    int64_t usec = t->fin > it->dernier ? t->fin : it->dernier;
+    ttyRecordWriterRecord(&it->ecriture, t->type, usec, data, len);
+    it->dernier = usec;
+    it->transferts++;
+}
+
+/* Réécrit l'enregistrement dans fd ; retourne le nombre de records de transfert qu'il avait déjà */
+uint64_t insertionRecords(struct insertionThread_s* it, struct transferts_s* ts, struct ttyRecordMap_s* map, int fd) {
+    struct ttyRecordCursor_s c;
+    struct ttyRecordView_s v, dernier = { 0 };
+    uint64_t deja = 0;
+
+    it->dernier    = map->start;
+    it->transferts = 0;
+    transfertsReset(ts, it);
+    ttyRecordWriterOpen(&it->ecriture, fd, 0, map->start);
+    ttyRecordCursorInit(&c, map, false);
+    while (ttyRecordCursorNext(&c, &v)) {
+        /* nouvel index en fin de fichier, transferts d'un passage précédent remplacés */
+        if (v.type == TTY_RECORD_INDEX || v.type == TTY_RECORD_INDEX_TRAILER) continue;
+        if (v.type == TTY_RECORD_FILE_UPLOAD || v.type == TTY_RECORD_FILE_DOWNLOAD) {
+            deja++;
+            continue;
+        }
+        ttyRecordWriterRecord(&it->ecriture, v.type, v.usec, v.data, v.len);
+        if (v.usec > it->dernier) it->dernier = v.usec;
+        transfertsRecord(ts, &v);
+        dernier = v;
+    }
+    ttyRecordCursorClose(&c);
+    transfertsFin(ts, &dernier);
+    return deja;
+}
+
+void insertionSession(struct insertionThread_s* it, struct transferts_s* ts, const char* nom) {
+    struct ttyRecordMap_s map;
+    char destination[PATH_MAX], tmp[PATH_MAX];
+
+    if (ttyRecordMapOpen(&map, nom) < 0) {
+        fprintf(stderr, "Impossible de lire %s : %s\n", nom, strerror(errno));
+        it->erreurs++;
+        return;
+    }
+    if ((map.version >= 2 && (map.flags & TTY_RECORD_FLAG_CHUNKS)) || map.st.st_mtime > time(NULL) - INSERTION_REPOS) {
+        it->laisses++;
+        ttyRecordMapClose(&map);
+        return;
+    }
+
+    const char* base = strrchr(nom, '/');
+    int n = it->sortie ? snprintf(destination, sizeof(destination), "%s/%s", it->sortie, base ? base + 1 : nom)
+                       : snprintf(destination, sizeof(destination), "%s", nom);
+    int m = snprintf(tmp, sizeof(tmp), "%s%s", destination, INSERTION_SUFFIXE);
+    if (n < 0 || (size_t)n >= sizeof(destination) || m < 0 || (size_t)m >= sizeof(tmp)) {
+        fprintf(stderr, "Nom trop long : %s\n", nom);
+        it->erreurs++;
+        ttyRecordMapClose(&map);
+        return;
+    }
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, map.st.st_mode & 07777);
+    if (fd < 0) {
+        fprintf(stderr, "Impossible d'écrire %s : %s\n", tmp, strerror(errno));
+        it->erreurs++;
+        ttyRecordMapClose(&map);
+        return;
+    }
+
+    uint64_t deja = insertionRecords(it, ts, &map, fd);
+    int r = ttyRecordWriterClose(&it->ecriture);
+    /* l'original garde sa date : les sessions restent triées de même */
+    struct timespec dates[2] = { map.st.st_atim, map.st.st_mtim };
+    if (r == 0) futimens(fd, dates);
+    close(fd);
+
+    /* pas d'écrasement d'un fichier qui a changé depuis sa lecture */
+    struct stat st;
+    if (r == 0 && it->transferts == 0 && deja == 0) {
+        unlink(tmp);
+        it->sansTransfert++;
+    } else if (r == 0 && !it->sortie && (stat(nom, &st) < 0 || st.st_size != map.st.st_size || st.st_mtim.tv_sec != map.st.st_mtim.tv_sec || st.st_mtim.tv_nsec != map.st.st_mtim.tv_nsec)) {
+        fprintf(stderr, "%s a changé pendant la lecture, laissé tel quel\n", nom);
+        unlink(tmp);
+        it->erreurs++;
+    } else if (r < 0 || rename(tmp, destination) < 0) {
+        fprintf(stderr, "Impossible d'écrire %s : %s\n", r < 0 ? tmp : destination, strerror(errno));
+        unlink(tmp);
+        it->erreurs++;
+    } else {
+        it->fichiers++;
+        it->inseres += it->transferts;
+    }
+    ttyRecordMapClose(&map);
+}
+
+void* insertionThread(void* arg) {
+    struct insertionThread_s* it = arg;
+    struct transferts_s* ts = transfertsNew(it->lot->magasin, insertionFichier, it);
+    size_t i;
+    while (lotSuivant(it->lot, it->moi, &i)) insertionSession(it, ts, it->lot->noms[i]);
+    transfertsFree(ts);
+    ttyRecordWriterFree(&it->ecriture);
+    return NULL;
+}
+
+int insereTransferts(char** chemins, int nbChemins, const char* magasin, const char* sortie, int nbThreads) {
+    if (sortie && mkdir(sortie, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Impossible de créer %s : %s\n", sortie, strerror(errno));
+        return -1;
+    }
+    struct lot_s lot;
+    memset(&lot, 0, sizeof(lot));
+    lot.magasin = magasin;
+    lotPrepare(&lot, chemins, nbChemins, nbThreads);
+    struct insertionThread_s* threads = calloc(lot.nbThreads, sizeof(*threads));
+    pthread_t* tids = calloc(lot.nbThreads, sizeof(*tids));
+    if (threads == NULL || tids == NULL) {
+        perror("Erreur sur calloc() ");
+        abort();
+    }
+    for (int k=0; k<lot.nbThreads; k++) {
+        threads[k].lot    = &lot;
+        threads[k].moi    = k;
+        threads[k].sortie = sortie;
+        if (pthread_create(&tids[k], NULL, insertionThread, &threads[k]) != 0) {
+            perror("Erreur sur pthread_create() ");
+            abort();
+        }
+    }
+    uint64_t fichiers = 0, inseres = 0, sansTransfert = 0, laisses = 0, erreurs = 0;
+    for (int k=0; k<lot.nbThreads; k++) {
+        pthread_join(tids[k], NULL);
+        fichiers      += threads[k].fichiers;
+        inseres       += threads[k].inseres;
+        sansTransfert += threads[k].sansTransfert;
+        laisses       += threads[k].laisses;
+        erreurs       += threads[k].erreurs;
+    }
+    printf("%llu fichiers complétés, %llu transferts insérés (%llu sans transfert, %llu archivés ou trop récents, %llu erreurs)\n",
+           (unsigned long long)fichiers, (unsigned long long)inseres, (unsigned long long)sansTransfert,
+           (unsigned long long)laisses, (unsigned long long)erreurs);
+
+    for (size_t k=0; k<lot.nb; k++) free(lot.noms[k]);
+    free(lot.noms);
+    free(lot.files);
+    free(threads);
+    free(tids);
+    return erreurs ? -1 : 0;
+}
+
+
+
+/******************************************************************************
+ * Vérification (--verify) et réparation (--repair) : un passage séquentiel sur
+ * le fichier projeté, sans décompression ni affichage. En trames, le crc de
+ * chaque trame est vérifié et une zone abîmée est sautée jusqu'au magic suivant,
+ * comme à la lecture. Sans trames, rien ne permet de se resynchroniser : le
+ * premier record invalide marque le début de la fin abîmée.
+ * --repair tronque le fichier après la dernière trame ou le dernier record
+ * valide : les zones abîmées au milieu restent, la lecture les saute déjà.
+ */
+
+struct verification_s {
+    uint64_t records;         /* records lus (hors trames compressées, non décodées) */
+    uint64_t trames;
+    uint64_t tramesAbimees;   /* zones abîmées suivies d'une trame valide */
+    uint64_t octetsAbimes;
+    uint64_t dernierRecno;    /* numéro du premier record de la dernière trame valide */
+    size_t   bon;             /* fin de la dernière trame ou du dernier record valide */
+    size_t   indexOffset;     /* offset du record d'index, ou de sa trame, 0 si absent */
+    size_t   trailerOffset;   /* offset donné par le trailer, 0 si absent */
+};
+
+static bool verificationTypeConnu(int type) {
+    return type <= TTY_RECORD_NONE || type == TTY_RECORD_FILE_UPLOAD || type == TTY_RECORD_FILE_DOWNLOAD
+        || (type >= TTY_RECORD_START && type <= TTY_RECORD_WINSIZE) || (type >= TTY_RECORD_INDEX && type <= TTY_RECORD_CHUNKED)
+        || type == TTY_RECORD_AUDIT_EXECVE || type == TTY_RECORD_AUDIT_SYSCALL;
+}
+
+/* Records v2 consécutifs de p à p+len ; retourne le nombre d'octets valides */
+size_t verificationRecords(struct verification_s* vf, const uint8_t* p, size_t len, size_t unite) {
+    size_t pos = 0;
+    while (pos < len) {
+        int type;
+        uint64_t lenData;
+        int64_t delta;
+        size_t n = ttyRecordHeaderDecode(p + pos, len - pos, &type, &lenData, &delta);
+        if (n == 0 || !verificationTypeConnu(type) || lenData > len - pos - n) break;
+        if (type == TTY_RECORD_INDEX) vf->indexOffset = unite ? unite : pos;
+        if (type == TTY_RECORD_INDEX_TRAILER) {
+            uint64_t offset;
+            if (pos + n + lenData == len && ttyRecordTrailerDecode(p + pos, &offset) == 0) vf->trailerOffset = offset;
+        }
+        vf->records++;
+        pos += n + lenData;
+    }
+    return pos;
+}
+
+void verificationTrames(struct ttyRecordMap_s* map, struct verification_s* vf) {
+    size_t pos = map->debut;
+    size_t ignores = 0;
+
+    while (true) {
+        struct ttyRecordFrameHeader_s h;
+        size_t n = ttyRecordMapDispo(map, pos, TTY_RECORD_FRAME_HEADER_LEN);
+        if (n == 0) break;
+        if (ttyRecordFrameHeaderDecode(ttyRecordMapPtr(map, pos), n, &h) == 0) {
+            size_t total = TTY_RECORD_FRAME_HEADER_LEN + h.clen;
+            if (ttyRecordMapDispo(map, pos, total) == total) {
+                const uint8_t* data = ttyRecordMapPtr(map, pos) + TTY_RECORD_FRAME_HEADER_LEN;
+                bool ok = crc32(0, data, h.clen) == h.crc;
+                if (ok && h.method == TTY_RECORD_FRAME_STORED) {
+                    struct verification_s essai = *vf;
+                    ok = verificationRecords(&essai, data, h.clen, pos) == h.clen;
+                    if (ok) *vf = essai;
+                }
+                if (ok) {
+                    if (ignores) {
+                        vf->tramesAbimees++;
+                        vf->octetsAbimes += ignores;
+                        ignores = 0;
+                    }
+                    vf->trames++;
+                    vf->dernierRecno = h.recno;
+                    pos += total;
+                    vf->bon = pos;
+                    continue;
+                }
+            }
+        }
+        /* pas une trame valide : magic suivant */
+        n = ttyRecordMapDispo(map, pos + 1, FLUX_BUFFER);
+        const uint8_t* p = ttyRecordMapPtr(map, pos + 1);
+        const uint8_t* suivant = n ? memmem(p, n, TTY_RECORD_FRAME_MAGIC, TTY_RECORD_FRAME_MAGIC_LEN) : NULL;
+        size_t saut = suivant ? (size_t)(suivant - p) + 1 : (n > TTY_RECORD_FRAME_MAGIC_LEN ? n - TTY_RECORD_FRAME_MAGIC_LEN + 1 : n + 1);
+        ignores += saut;
+        pos += saut;
+    }
+}
+
+void verificationV1(struct ttyRecordMap_s* map, struct verification_s* vf) {
+    struct ttyRecordEntry_s record;
+    size_t pos = 0;
+    while (ttyRecordMapDispo(map, pos, sizeof(record)) == sizeof(record)) {
+        memcpy(&record, ttyRecordMapPtr(map, pos), sizeof(record));
+        if (record.len > FLUX_RECORD_MAX
+                || ttyRecordMapDispo(map, pos, sizeof(record) + record.len) < sizeof(record) + record.len) break;
+        vf->records++;
+        pos += sizeof(record) + record.len;
+        vf->bon = pos;
+    }
+}
+
+/* Records v2 sans trames, lus par morceaux pour ne pas tout garder en mémoire si c'est un tube */
+void verificationV2(struct ttyRecordMap_s* map, struct verification_s* vf) {
+    size_t pos = map->debut;
+    vf->bon = pos;
+    while (true) {
+        size_t dispo = ttyRecordMapDispo(map, pos, TTY_RECORD_HEADER_MAX);
+        int type;
+        uint64_t len;
+        int64_t delta;
+        size_t n = ttyRecordHeaderDecode(ttyRecordMapPtr(map, pos), dispo, &type, &len, &delta);
+        if (n == 0 || !verificationTypeConnu(type) || len > FLUX_RECORD_MAX || ttyRecordMapDispo(map, pos, n + len) < n + len) break;
+        if (type == TTY_RECORD_INDEX) vf->indexOffset = pos;
+        if (type == TTY_RECORD_INDEX_TRAILER) {
+            uint64_t offset;
+            if (ttyRecordTrailerDecode(ttyRecordMapPtr(map, pos), &offset) == 0) vf->trailerOffset = offset;
+        }
+        vf->records++;
+        pos += n + len;
+        vf->bon = pos;
+    }
+}
+
+/* Retourne 0 si le fichier est intact, 1 s'il est abîmé (ou l'était avant --repair), -1 s'il est illisible */
+int verifie(const char* nom, bool repare) {
+    struct ttyRecordMap_s map;
+    struct verification_s vf;
+    memset(&vf, 0, sizeof(vf));
+
+    if (ttyRecordMapOpen(&map, nom) < 0) {
+        printf("%s : %s\n", nom, strerror(errno));
+        return -1;
+    }
+    const char* format;
+    if (map.version == 1) {
+        format = "v1";
+        verificationV1(&map, &vf);
+    } else if (map.flags & TTY_RECORD_FLAG_FRAMES) {
+        format = map.flags & TTY_RECORD_FLAG_DEFLATE ? "v2 compressé" : "v2 avec crc";
+        vf.bon = map.debut;
+        verificationTrames(&map, &vf);
+    } else {
+        format = "v2";
+        verificationV2(&map, &vf);
+    }
+    /* taille totale : pour un tube, ce qui a été lu */
+    size_t taille = map.fd >= 0 ? map.decalage + map.len : map.len;
+    size_t fin = taille > vf.bon ? taille - vf.bon : 0;
+    bool index = vf.indexOffset && vf.trailerOffset == vf.indexOffset && fin == 0;
+
+    printf("%s : %s", nom, format);
+    if (!(map.flags & TTY_RECORD_FLAG_DEFLATE)) printf(", %llu records", (unsigned long long)vf.records);
+    if (map.flags & TTY_RECORD_FLAG_FRAMES) printf(", %llu trames (dernière à partir du record %llu)", (unsigned long long)vf.trames, (unsigned long long)vf.dernierRecno);
+    printf(", %s\n", map.version == 1 ? "sans index" : index ? "index présent" : "sans index (session interrompue)");
+    if (vf.tramesAbimees) printf("  %llu zones abîmées, %llu octets, sautées à la lecture\n", (unsigned long long)vf.tramesAbimees, (unsigned long long)vf.octetsAbimes);
+    if (fin) printf("  fin abîmée ou tronquée : %zu octets après l'offset %zu\n", fin, vf.bon);
+    bool abime = vf.tramesAbimees || fin;
+    if (!abime) printf("  intact\n");
+    ttyRecordMapClose(&map);
+
+    if (repare && fin) {
+        if (map.fd >= 0 || truncate(nom, vf.bon) < 0) {
+            printf("  réparation impossible : %s\n", map.fd >= 0 ? "pas un fichier" : strerror(errno));
+            return -1;
+        }
+        printf("  tronqué à %zu octets\n", vf.bon);
+    }
+    return abime ? 1 : 0;
+}
+
+
+
+/******************************************************************************
+ * Suivi en direct (--follow) : des sessions encore en cours d'écriture, lues
+ * au fil de l'eau. inotify signale chaque écriture dans les répertoires
+ * surveillés, sans attente active : la lecture reprend là où elle s'était
+ * arrêtée, un record ou une trame incomplets sont relus en entier à l'écriture
+ * suivante. Un fichier donné seul est affiché depuis le début ; avec un
+ * répertoire ou un motif, les sessions qui apparaissent sont affichées depuis
+ * leur début, celles déjà en cours à partir de maintenant, celles terminées
+ * (trailer d'index présent) ignorées. Une session se termine à son record de
+ * fin ; quand plusieurs sont suivies, "==> nom <==" précède ce qui change de
+ * session.
+ */
+
+struct suivi_s {
+    char*    nom;
+    struct ttyRecordMap_s map;
+    struct ttyRecordCursor_s c;
+    bool     ouvert;               /* entête lu, map et curseur prêts */
+    bool     muet;                 /* déjà en cours au lancement : rattrape sans afficher */
+    bool     termine;              /* gardé pour ne pas le reprendre pour une nouvelle session */
+    struct commandes_s* cs;
+    struct ttyRecordView_s dernier;
+};
+
+struct veille_s {
+    int      wd;
+    char*    repertoire;
+    char*    motif;                /* fnmatch() sur le nom dans le répertoire, NULL = tout */
+};
+
+struct suivis_s {
+    int      inotify;
+    struct veille_s* veilles;
+    size_t   nbVeilles;
+    struct suivi_s** e;
+    size_t   nb;
+    size_t   capacity;
+    size_t   actifs;               /* ni terminés ni supprimés */
+    bool     plusieurs;            /* en-têtes "==> nom <==" */
+    bool     commandes;
+    const struct suivi_s* courant; /* dernière session affichée */
+};
+
+void suiviEntete(struct suivis_s* sv, const struct suivi_s* s) {
+    if (!sv->plusieurs || sv->courant == s) return;
+    printf("\n==> %s <==\n", s->nom);
+    sv->courant = s;
+}
+
+struct suiviCommande_s {
+    struct suivis_s* sv;
+    struct suivi_s*  s;
+};
+
+void suiviCommande(const struct commande_s* commande, void* ctx) {
+    struct suiviCommande_s* sc = ctx;
+    suiviEntete(sc->sv, sc->s);
+    afficheCommande(commande, &sc->s->map.start);
+}
+
+/* Session terminée : trailer d'index à la fin du fichier */
+bool suiviTermine(const char* chemin) {
+    uint8_t trailer[TTY_RECORD_TRAILER_LEN];
+    uint64_t offset;
+    struct stat st;
+    int fd = open(chemin, O_RDONLY);
+    if (fd < 0) return true;
+    bool termine = fstat(fd, &st) == 0 && st.st_size >= TTY_RECORD_TRAILER_LEN
+        && pread(fd, trailer, sizeof(trailer), st.st_size - TTY_RECORD_TRAILER_LEN) == sizeof(trailer)
+        && ttyRecordTrailerDecode(trailer, &offset) == 0;
+    close(fd);
+    return termine;
+}
+
+struct suivi_s* suiviCherche(struct suivis_s* sv, const char* chemin) {
+    for (size_t i=0; i<sv->nb; i++) {
+        if (strcmp(sv->e[i]->nom, chemin) == 0) return sv->e[i];
+    }
+    return NULL;
+}
+
+struct suivi_s* suiviAjoute(struct suivis_s* sv, const char* chemin, bool muet, bool termine) {
+    struct suivi_s* s = calloc(1, sizeof(struct suivi_s));
+    if (s == NULL || (s->nom = strdup(chemin)) == NULL) {
+        perror("Erreur sur malloc() ");
+        abort();
+    }
+    s->muet    = muet;
+    s->termine = termine;
+    if (!termine) sv->actifs++;
+    if (sv->nb == sv->capacity) {
+        size_t taille = sv->capacity * sizeof(*sv->e);
+        sv->e = agrandit(sv->e, &taille, (sv->capacity ? 2 * sv->capacity : 64) * sizeof(*sv->e));
+        sv->capacity = taille / sizeof(*sv->e);
+    }
+    sv->e[sv->nb++] = s;
+    return s;
+}
+
+/* Libère la lecture ; la session reste connue tant que son fichier existe */
+void suiviFerme(struct suivis_s* sv, struct suivi_s* s) {
+    if (s->cs) {
+        struct suiviCommande_s sc = { sv, s };
+        s->cs->ctx = &sc;
+        commandesFin(s->cs, &s->dernier);
+        free(s->cs);
+        s->cs = NULL;
+    }
+    if (s->ouvert) {
+        ttyRecordCursorClose(&s->c);
+        ttyRecordMapClose(&s->map);
+        s->ouvert = false;
+    }
+    if (!s->termine) sv->actifs--;
+    s->termine = true;
+}
+
+/* Lit tout ce qui est arrivé, l'affiche sauf en rattrapage */
+void suiviLit(struct suivis_s* sv, struct suivi_s* s) {
+    if (s->termine) return;
+    if (!s->ouvert) {
+        /* l'entête de fichier n'est peut-être pas encore écrit : rien ne distinguerait un v2 d'un v1 */
+        struct stat st;
+        if (stat(s->nom, &st) < 0 || st.st_size < TTY_RECORD_FILE_HEADER_LEN) return;
+        if (ttyRecordMapOpenSuivi(&s->map, s->nom) < 0) {
+            printf("Impossible de suivre %s : %s\n", s->nom, strerror(errno));
+            suiviFerme(sv, s);
+            return;
+        }
+        ttyRecordCursorInit(&s->c, &s->map, false);
+        s->ouvert = true;
+        if (sv->commandes) {
+            s->cs = malloc(sizeof(*s->cs));
+            if (s->cs == NULL) {
+                perror("Erreur sur malloc() ");
+                abort();
+            }
+            commandesInit(s->cs, suiviCommande, NULL);
+        }
+    }
+
+    struct suiviCommande_s sc = { sv, s };
+    struct ttyRecordView_s v;
+    ttyRecordMapReprise(&s->map);
+    while (ttyRecordCursorNext(&s->c, &v)) {
+        if (s->cs) {
+            s->cs->ctx = &sc;
+            if (!s->muet) commandesRecord(s->cs, &v);
+        } else if (!s->muet && lecture.actif) {
+            if (v.type == TTY_RECORD_SERVER_TO_CLIENT) {
+                suiviEntete(sv, s);
+                fwrite(v.data, 1, v.len, stdout);
+            }
+        } else if (!s->muet) {
+            suiviEntete(sv, s);
+            afficheRecord(v.type, v.usec / 1000000, v.data, v.len);
+        }
+        s->dernier = v;
+        s->dernier.data = NULL;
+        s->dernier.len  = 0;
+        if (v.type == TTY_RECORD_EXIT || v.type == TTY_RECORD_INDEX_TRAILER) {
+            suiviFerme(sv, s);
+            return;
+        }
+    }
+    s->muet = false;
+}
+
+void suiviVeille(struct suivis_s* sv, const char* repertoire, const char* motif) {
+    int wd = inotify_add_watch(sv->inotify, repertoire, IN_CREATE | IN_MOVED_TO | IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM);
+    if (wd < 0) {
+        fprintf(stderr, "Impossible de surveiller %s : %s\n", repertoire, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    size_t taille = sv->nbVeilles * sizeof(*sv->veilles);
+    sv->veilles = agrandit(sv->veilles, &taille, (sv->nbVeilles + 1) * sizeof(*sv->veilles));
+    sv->veilles[sv->nbVeilles++] = (struct veille_s) { wd, strdup(repertoire), motif ? strdup(motif) : NULL };
+}
+
+/* Un fichier, un répertoire, ou un motif sur les noms d'un répertoire ; le fichier peut ne pas exister encore */
+void suiviArgument(struct suivis_s* sv, const char* chemin) {
+    struct stat st;
+    char repertoire[PATH_MAX];
+    const char* motif;
+
+    if (stat(chemin, &st) == 0 && S_ISDIR(st.st_mode)) {
+        snprintf(repertoire, sizeof(repertoire), "%s", chemin);
+        motif = NULL;
+    } else {
+        const char* barre = strrchr(chemin, '/');
+        if (barre == NULL) snprintf(repertoire, sizeof(repertoire), ".");
+        else if (barre == chemin) snprintf(repertoire, sizeof(repertoire), "/");
+        else snprintf(repertoire, sizeof(repertoire), "%.*s", (int)(barre - chemin), chemin);
+        motif = barre ? barre + 1 : chemin;
+        if (*motif == 0) motif = NULL;
+    }
+    /* la veille d'abord : un fichier créé pendant le parcours n'est pas perdu */
+    suiviVeille(sv, repertoire, motif);
+
+    DIR* d = opendir(repertoire);
+    struct dirent* e;
+    if (d == NULL) return;
+    while ((e = readdir(d)) != NULL) {
+        if (ttyRecordIgnore(e->d_name) || (motif && fnmatch(motif, e->d_name, 0) != 0)) continue;
+        char sous[PATH_MAX];
+        int n = snprintf(sous, sizeof(sous), "%s/%s", repertoire, e->d_name);
+        if (n < 0 || (size_t)n >= sizeof(sous)) {
+            fprintf(stderr, "Nom trop long : %s/%s\n", repertoire, e->d_name);
+            continue;
+        }
+        if (stat(sous, &st) < 0 || !S_ISREG(st.st_mode) || suiviCherche(sv, sous)) continue;
+        /* un fichier nommé seul est suivi depuis le début, même terminé */
+        if (!sv->plusieurs) suiviAjoute(sv, sous, false, false);
+        else if (suiviTermine(sous)) suiviAjoute(sv, sous, true, true);
+        else suiviAjoute(sv, sous, true, false);
+    }
+    closedir(d);
+}
+
+void suit(char** chemins, int nbChemins, bool commandes) {
+    struct suivis_s sv;
+    struct stat st;
+    memset(&sv, 0, sizeof(sv));
+    sv.commandes = commandes;
+    sv.plusieurs = nbChemins > 1 || stat(chemins[0], &st) < 0 || !S_ISREG(st.st_mode);
+    sv.inotify   = inotify_init1(IN_CLOEXEC);
+    if (sv.inotify < 0) {
+        perror("inotify_init1()");
+        exit(EXIT_FAILURE);
+    }
+    for (int i=0; i<nbChemins; i++) suiviArgument(&sv, chemins[i]);
+    for (size_t i=0; i<sv.nb; i++) suiviLit(&sv, sv.e[i]);
+    fflush(stdout);
+
+    /* un fichier seul : jusqu'à la fin de sa session ; sinon jusqu'à ce qu'on nous arrête */
+    char evenements[64 * (sizeof(struct inotify_event) + NAME_MAX + 1)] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (sv.plusieurs || sv.actifs > 0) {
+        ssize_t n = read(sv.inotify, evenements, sizeof(evenements));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            perror("read() sur inotify");
+            exit(EXIT_FAILURE);
+        }
+        for (char* p = evenements; p < evenements + n; ) {
+            struct inotify_event* ev = (struct inotify_event*)p;
+            p += sizeof(struct inotify_event) + ev->len;
+            if (ev->len == 0 || ttyRecordIgnore(ev->name)) continue;
+
+            for (size_t i=0; i<sv.nbVeilles; i++) {
+                struct veille_s* w = &sv.veilles[i];
+                if (w->wd != ev->wd || (w->motif && fnmatch(w->motif, ev->name, 0) != 0)) continue;
+                char chemin[PATH_MAX];
+                snprintf(chemin, sizeof(chemin), "%s/%s", w->repertoire, ev->name);
+                struct suivi_s* s = suiviCherche(&sv, chemin);
+
+                if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                    /* le nom est libre : une nouvelle session pourra le reprendre */
+                    if (s && !s->termine) suiviFerme(&sv, s);
+                    if (s) s->nom[0] = 0;
+                } else if (s == NULL) {
+                    suiviLit(&sv, suiviAjoute(&sv, chemin, false, false));
+                } else {
+                    suiviLit(&sv, s);
+                }
                 break;
+            }
+        }
+        fflush(stdout);
+    }
+    close(sv.inotify);
+}
+
 
-            case TTY_RECORD_EXIT:
-                snprintf(bufferTitle, 127, "session end %s", bufferStrftime);
-                printColorTitle(bufferTitle, 7, 2);
-                puts(record->data);
+
+void usage(char* argv0) {
+    printf("%s [options] <nom de fichier, ou - pour stdin>\n", argv0);
+    printf("  --from <durée>       à partir de ce moment de la session ([[hh:]mm:]ss)\n");
+    printf("  --to <durée>         jusqu'à ce moment de la session\n");
+    printf("  --from-record <n>    à partir du record numéro n\n");
+    printf("  --to-record <n>      jusqu'au record numéro n\n");
+    printf("  --screen             affiche l'écran en fin de session, ou à l'instant --to / --to-record ;\n");
+    printf("                       plusieurs fichiers peuvent être donnés\n");
+    printf("  --commands           une ligne par commande validée : instant, taille de la sortie qui suit,\n");
+    printf("                       drapeaux (m masquée, a annulée, i incertaine, t tronquée), texte\n");
+    printf("  --files              une ligne par fichier transféré (echo|base64 -d, heredoc, échappements, zmodem,\n");
+    printf("                       sortie de base64) : instant, sens, méthode, taille, sha256, drapeaux\n");
+    printf("                       (n nouveau dans le magasin, i incomplet), nom ; avec --batch une colonne de plus\n");
+    printf("  --store <répertoire> range le contenu des fichiers transférés sous leur sha256, une fois chacun\n");
+    printf("  --insert             avec --files, fichiers, répertoires ou motifs : réécrit chaque enregistrement\n");
+    printf("                       avec un record par transfert (sha256, taille, méthode, nom), en place ou\n");
+    printf("                       dans --output (threads : --jobs)\n");
+    printf("  --batch              analyse de fichiers, répertoires ou motifs : une ligne (csv) ou un objet (json)\n");
+    printf("                       par session, dans l'ordre des noms de fichiers\n");
+    printf("  --format csv|json    format de --batch (csv par défaut)\n");
+    printf("  --jobs <n>           nombre de threads de --batch (un par processeur par défaut)\n");
+    printf("  --verify             vérifie les fichiers donnés : crc des trames, records, fin tronquée, index\n");
+    printf("  --repair             comme --verify, et tronque après la dernière trame ou le dernier record valide\n");
+    printf("  --follow             suit des sessions en cours : un fichier depuis son début, ou les fichiers\n");
+    printf("                       d'un répertoire ou d'un motif à mesure qu'ils apparaissent et grandissent ;\n");
+    printf("                       avec --commands les commandes, avec --play la sortie brute du serveur\n");
+    printf("  --export asciicast|ttyrec  convertit pour asciinema ou ttyplay, sur la sortie standard ;\n");
+    printf("                       avec --output, fichiers, répertoires ou motifs, un fichier exporté chacun\n");
+    printf("  --output <répertoire> où --export écrit <nom>.cast ou <nom>.ttyrec, --insert les enregistrements\n");
+    printf("  --play               rejoue la sortie du serveur au rythme d'origine\n");
+    printf("  --speed <facteur>    vitesse de lecture (--play)\n");
+    printf("  --max-idle <durée>   silences raccourcis à cette durée (--play)\n");
+    exit(EXIT_FAILURE);
+}
+
+/* Affichage de la session, ou d'une partie en partant du point d'index le plus proche */
+void afficheSession(const char* nom, int64_t from, int64_t to, uint64_t fromRecord, uint64_t toRecord, bool commandes, bool fichiers, const char* magasin) {
+    struct ttyRecordMap_s map;
+    struct ttyRecordIndex_s idx = { NULL, 0, 0 };
+    struct ttyRecordCursor_s c;
+    struct ttyRecordView_s v;
+
+    if (ttyRecordMapOpen(&map, nom) < 0) {
+        perror("Impossible d'ouvrir le fichier");
+        abort();
+    }
+
+    ttyRecordCursorInit(&c, &map, true);
+    if ((from > 0 || fromRecord > 0) && map.fd < 0) {
+        ttyRecordIndexLoad(&map, nom, &idx);
+        const struct ttyRecordIndexEntry_s* e = ttyRecordIndexSearch(&idx, map.start + from, fromRecord);
+        if (e) ttyRecordCursorSeek(&c, e);
+    }
+
+    struct commandes_s* cs = NULL;
+    struct ttyRecordView_s dernier = { 0 };
+    if (commandes) {
+        cs = malloc(sizeof(*cs));
+        if (cs == NULL) {
+            perror("Erreur sur malloc() ");
+            abort();
+        }
+        commandesInit(cs, afficheCommande, &map.start);
+    }
+    struct transferts_s* ts = fichiers ? transfertsNew(magasin, afficheFichier, &map.start) : NULL;
+
+    while (ttyRecordCursorNext(&c, &v)) {
+        if (v.recno > toRecord || v.usec - map.start > to) break;
+        if (v.recno < fromRecord || v.usec - map.start < from) continue;
+        if (ts) transfertsRecord(ts, &v);
+        if (cs) commandesRecord(cs, &v);
+        else if (ts) ;
+        else if (lecture.actif) lectureRecord(v.type, v.usec, v.data, v.len);
+        else afficheRecord(v.type, v.usec / 1000000, v.data, v.len);
+        dernier = v;
+    }
+    if (cs) {
+        commandesFin(cs, &dernier);
+        free(cs);
+    }
+    if (ts) {
+        transfertsFin(ts, &dernier);
+        transfertsFree(ts);
+    }
+
+    ttyRecordCursorClose(&c);
+    free(idx.e);
+    ttyRecordMapClose(&map);
+}
+
+int main(int argc, char* argv[]) {
+    const struct option options[] = {
+        { "from",        required_argument, NULL, 'f' },
+        { "to",          required_argument, NULL, 't' },
+        { "from-record", required_argument, NULL, 'F' },
+        { "to-record",   required_argument, NULL, 'T' },
+        { "play",        no_argument,       NULL, 'p' },
+        { "screen",      no_argument,       NULL, 'e' },
+        { "commands",    no_argument,       NULL, 'c' },
+        { "files",       no_argument,       NULL, 'x' },
+        { "store",       required_argument, NULL, 'm' },
+        { "batch",       no_argument,       NULL, 'b' },
+        { "format",      required_argument, NULL, 'o' },
+        { "jobs",        required_argument, NULL, 'j' },
+        { "speed",       required_argument, NULL, 's' },
+        { "max-idle",    required_argument, NULL, 'i' },
+        { "verify",      no_argument,       NULL, 'v' },
+        { "repair",      no_argument,       NULL, 'r' },
+        { "follow",      no_argument,       NULL, 'w' },
+        { "export",      required_argument, NULL, 'a' },
+        { "output",      required_argument, NULL, 'd' },
+        { "insert",      no_argument,       NULL, 'n' },
+        { NULL, 0, NULL, 0 }
+    };
+    int64_t from = 0, to = INT64_MAX;
+    uint64_t fromRecord = 0, toRecord = UINT64_MAX;
+    bool ecran = false;
+    bool commandes = false;
+    bool fichiers = false;
+    const char* magasin = NULL;
+    bool lot = false;
+    bool verification = false, reparation = false;
+    bool suivi = false;
+    bool insertion = false;
+    int export = -1;
+    const char* sortie = NULL;
+    int format = LOT_CSV;
+    int nbThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+            case 'f': from = parseDuree(optarg); break;
+            case 't': to   = parseDuree(optarg); break;
+            case 'F': fromRecord = strtoull(optarg, NULL, 0); break;
+            case 'T': toRecord   = strtoull(optarg, NULL, 0); break;
+            case 'p': lecture.actif   = true; break;
+            case 'e': ecran = true; break;
+            case 'c': commandes = true; break;
+            case 'x': fichiers = true; break;
+            case 'm': magasin = optarg; fichiers = true; break;
+            case 'b': lot = true; break;
+            case 'v': verification = true; break;
+            case 'r': verification = reparation = true; break;
+            case 'w': suivi = true; break;
+            case 'n': insertion = fichiers = true; break;
+            case 'a':
+                if (strcmp(optarg, "asciicast") == 0) export = TTY_EXPORT_ASCIICAST;
+                else if (strcmp(optarg, "ttyrec") == 0) export = TTY_EXPORT_TTYREC;
+                else usage(argv[0]);
                 break;
+            case 'd': sortie = optarg; break;
+            case 'o':
+                if (strcmp(optarg, "json") == 0) format = LOT_JSON;
+                else if (strcmp(optarg, "csv") == 0) format = LOT_CSV;
+                else usage(argv[0]);
+                break;
+            case 'j': nbThreads = atoi(optarg); break;
+            case 's': lecture.vitesse = strtod(optarg, NULL); break;
+            case 'i': lecture.maxIdle = parseDuree(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind == argc || (optind != argc - 1 && !ecran && !lot && !verification && !suivi && !insertion && !(export >= 0 && sortie)) || !(lecture.vitesse > 0)) usage(argv[0]);
+    if (lecture.actif && !suivi) lectureInit();
 
-            default: printf("Type inconnu %d\n", record->type);
+    /* sortie par gros blocs, les records s'enchaînent sans attendre */
+    setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+
+    if (suivi) {
+        suit(argv + optind, argc - optind, commandes);
+        return 0;
+    }
+
+    if (export >= 0) {
+        return exporte(argv + optind, argc - optind, export, sortie, nbThreads) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if (insertion) {
+        return insereTransferts(argv + optind, argc - optind, magasin, sortie, nbThreads) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if (verification) {
+        int pire = 0;
+        for (int i=optind; i<argc; i++) {
+            int r = verifie(argv[i], reparation);
+            if (r < 0 || (r > pire && pire >= 0)) pire = r;
         }
-        free(record);
+        return pire == 0 ? EXIT_SUCCESS : (pire < 0 ? 2 : EXIT_FAILURE);
     }
-}
\ No newline at end of file
+
+    if (lot) {
+        afficheLot(argv + optind, argc - optind, format, fichiers, magasin, nbThreads);
+        return 0;
+    }
+
+    if (ecran) {
+        /* la sortie du serveur est décodée en UTF-8 quelle que soit la locale, wcwidth() doit suivre */
+        setlocale(LC_CTYPE, "C.UTF-8");
+        struct ttyScreen_s s;
+        ttyScreenInit(&s, TTY_SCREEN_ROWS_DEFAULT, TTY_SCREEN_COLS_DEFAULT);
+        for (int i=optind; i<argc; i++) {
+            if (argc - optind > 1) printf("==> %s <==\n", argv[i]);
+            afficheEcran(&s, argv[i], to, toRecord);
+        }
+        ttyScreenFree(&s);
+        return 0;
+    }
+    afficheSession(argv[optind], from, to, fromRecord, toRecord, commandes, fichiers, magasin);
+    return 0;
+}
@@ -0,0 +1,850 @@
+/******************************************************************************
+ * Recherche plein texte dans l'archive des enregistrements
+ * Bertrand sept 2024
+ *
+ * search --add indexe des fichiers, répertoires ou motifs : les lignes de
+ * commande reconstituées (comme replay --commands) et les lignes de la sortie
+ * du serveur, séquences d'échappement retirées. Chaque passage écrit un
+ * segment immuable dans le répertoire d'index et note dans le manifeste les
+ * fichiers couverts, avec leur taille et leur date : un fichier inchangé n'est
+ * pas relu au passage suivant, un fichier qui a grandi est réindexé et son
+ * ancienne version ignorée.
+ *
+ * Segment (entiers petit boutistes) :
+ *   entête     SEGMENT_HEADER_LEN octets
+ *     magic    8 octets  "HPSRCH01"
+ *     nbSessions, nbLignes, nbTrigrammes, réservé   4 octets chacun
+ *     offsets des sections sessions, lignes, textes, dictionnaire, listes, fin   8 octets chacun
+ *   sessions   taille 8, mtime 8, longueur du nom 4, nom
+ *   lignes     SEGMENT_LIGNE_LEN octets chacune : recno 8, offset 8, offset du texte 8,
+ *              session 4, longueur du texte 2, type 1 ('c' commande, 'o' sortie), réservé 1
+ *   textes     les lignes, chacune suivie d'un 0
+ *   dictionnaire  trié, SEGMENT_DICO_LEN octets par trigramme : trigramme 4, nombre 4, offset de sa liste 8
+ *   listes     pour chaque trigramme, numéros des lignes qui le contiennent,
+ *              croissants, en varints des écarts
+ *
+ * Une recherche cherche dans chaque segment les trigrammes du texte demandé,
+ * croise leurs listes en partant de la plus courte, puis vérifie les lignes
+ * restantes. Les trigrammes sont en minuscules ascii, ce qui sert aussi la
+ * recherche sans casse.
+ ******************************************************************************/
+
+
+/* sys */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <limits.h>
+#include <dirent.h>
+#include <glob.h>
+
+
+/* libc */
+#include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+
+
+/* local */
+#include "ttyRecord.h"
+#include "ttyRecordReader.h"
+#include "ttyCommands.h"
+
+
+#define INDEX_DEFAUT         "/tmp/honeypotIndex"
+#define MANIFESTE            "manifest"
+
+#define SEGMENT_MAGIC        "HPSRCH01"
+#define SEGMENT_HEADER_LEN   72
+#define SEGMENT_LIGNE_LEN    32
+#define SEGMENT_DICO_LEN     16
+#define SEGMENT_PAIRES_MAX   (16 << 20)   /* trigrammes en attente avant d'écrire un segment, 8 octets chacun */
+
+#define LIGNE_MAX            4096         /* au-delà, une ligne de sortie est coupée */
+
+
+
+/******************************************************************************
+ * Manifeste : une ligne "segment taille mtime chemin" par fichier indexé, la
+ * dernière pour un chemin donné fait foi
+ */
+
+struct manifesteEntree_s {
+    char*    chemin;
+    uint32_t segment;
+    uint64_t taille;
+    int64_t  mtime;
+    size_t   ordre;       /* rang dans le fichier, pour garder la dernière */
+};
+
+struct manifeste_s {
+    struct manifesteEntree_s* e;
+    size_t nb;
+    size_t capacity;
+};
+
+int manifesteCompare(const void* a, const void* b) {
+    const struct manifesteEntree_s* x = a;
+    const struct manifesteEntree_s* y = b;
+    int r = strcmp(x->chemin, y->chemin);
+    if (r) return r;
+    return x->ordre < y->ordre ? -1 : x->ordre > y->ordre;
+}
+
+void manifesteLoad(const char* repertoire, struct manifeste_s* m) {
+    char nom[PATH_MAX];
+    char* ligne = NULL;
+    size_t capacity = 0;
+    memset(m, 0, sizeof(*m));
+
+    snprintf(nom, sizeof(nom), "%s/%s", repertoire, MANIFESTE);
+    FILE* f = fopen(nom, "r");
+    if (f == NULL) return;
+
+    ssize_t n;
+    while ((n = getline(&ligne, &capacity, f)) > 0) {
+        struct manifesteEntree_s e;
+        unsigned long long taille;
+        long long mtime;
+        int debut;
+        if (ligne[n-1] == '\n') ligne[n-1] = 0;
+        if (sscanf(ligne, "%u %llu %lld %n", &e.segment, &taille, &mtime, &debut) != 3) continue;
+        e.taille = taille;
+        e.mtime  = mtime;
+        e.chemin = strdup(ligne + debut);
+        e.ordre  = m->nb;
+        if (m->nb == m->capacity) {
+            size_t octets = m->capacity * sizeof(e);
+            m->e = agrandit(m->e, &octets, (m->capacity ? 2 * m->capacity : 256) * sizeof(e));
+            m->capacity = octets / sizeof(e);
+        }
+        m->e[m->nb++] = e;
+    }
+    free(ligne);
+    fclose(f);
+
+    /* une entrée par chemin, la plus récente */
+    qsort(m->e, m->nb, sizeof(*m->e), manifesteCompare);
+    size_t uniques = 0;
+    for (size_t k=0; k<m->nb; k++) {
+        if (uniques > 0 && strcmp(m->e[uniques-1].chemin, m->e[k].chemin) == 0) {
+            free(m->e[uniques-1].chemin);
+            m->e[uniques-1] = m->e[k];
+        } else {
+            m->e[uniques++] = m->e[k];
+        }
+    }
+    m->nb = uniques;
+}
+
+const struct manifesteEntree_s* manifesteCherche(const struct manifeste_s* m, const char* chemin) {
+    size_t bas = 0, haut = m->nb;
+    while (bas < haut) {
+        size_t milieu = (bas + haut) / 2;
+        int r = strcmp(m->e[milieu].chemin, chemin);
+        if (r == 0) return &m->e[milieu];
+        if (r < 0) bas = milieu + 1;
+        else haut = milieu;
+    }
+    return NULL;
+}
+
+void manifesteFree(struct manifeste_s* m) {
+    for (size_t k=0; k<m->nb; k++) free(m->e[k].chemin);
+    free(m->e);
+}
+
+
+
+/******************************************************************************
+ * Construction d'un segment
+ */
+
+struct segment_s {
+    uint8_t*  sessions;
+    size_t    sessionsLen, sessionsCapacity;
+    uint32_t  nbSessions;
+    uint8_t*  lignes;
+    size_t    lignesLen, lignesCapacity;
+    uint32_t  nbLignes;
+    char*     textes;
+    size_t    textesLen, textesCapacity;
+    uint64_t* paires;           /* trigramme << 32 | numéro de ligne */
+    size_t    nbPaires, pairesCapacity;
+    char*     manifeste;        /* lignes à ajouter au manifeste une fois le segment écrit */
+    size_t    manifesteLen, manifesteCapacity;
+
+    /* ligne de sortie en cours */
+    char      sortie[LIGNE_MAX];
+    size_t    sortieLen;
+    uint64_t  sortieRecno;
+    size_t    sortieOffset;
+    int       etat;
+};
+
+enum { SORTIE_NORMAL, SORTIE_ESC, SORTIE_CSI, SORTIE_CHAINE, SORTIE_CHAINE_ESC, SORTIE_CHARSET };
+
+static inline uint32_t trigramme(const char* p) {
+    return (uint32_t)tolower((unsigned char)p[0]) << 16 | (uint32_t)tolower((unsigned char)p[1]) << 8 | (uint32_t)tolower((unsigned char)p[2]);
+}
+
+void segmentLigne(struct segment_s* seg, char type, uint64_t recno, size_t offset, const char* texte, size_t len) {
+    while (len > 0 && texte[len-1] == ' ') len--;
+    while (len > 0 && texte[0] == ' ') {
+        texte++;
+        len--;
+    }
+    if (len == 0) return;
+
+    uint32_t numero = seg->nbLignes++;
+    if (seg->lignesLen + SEGMENT_LIGNE_LEN > seg->lignesCapacity) seg->lignes = agrandit(seg->lignes, &seg->lignesCapacity, 2 * (seg->lignesLen + SEGMENT_LIGNE_LEN));
+    uint8_t* l = seg->lignes + seg->lignesLen;
+    seg->lignesLen += SEGMENT_LIGNE_LEN;
+    le64Put(l, recno);
+    le64Put(l + 8, offset);
+    le64Put(l + 16, seg->textesLen);
+    le32Put(l + 24, seg->nbSessions - 1);
+    l[28] = (uint8_t)len;
+    l[29] = (uint8_t)(len >> 8);
+    l[30] = type;
+    l[31] = 0;
+
+    if (seg->textesLen + len + 1 > seg->textesCapacity) seg->textes = agrandit(seg->textes, &seg->textesCapacity, 2 * (seg->textesLen + len + 1));
+    char* t = seg->textes + seg->textesLen;
+    for (size_t k=0; k<len; k++) t[k] = texte[k] ? texte[k] : ' ';
+    t[len] = 0;
+    seg->textesLen += len + 1;
+
+    if (len < 3) return;
+    size_t voulu = (seg->nbPaires + len) * sizeof(uint64_t);
+    if (voulu > seg->pairesCapacity) seg->paires = agrandit(seg->paires, &seg->pairesCapacity, 2 * voulu);
+    for (size_t k=0; k+3<=len; k++) seg->paires[seg->nbPaires++] = (uint64_t)trigramme(t + k) << 32 | numero;
+}
+
+void segmentSortieLigne(struct segment_s* seg) {
+    segmentLigne(seg, 'o', seg->sortieRecno, seg->sortieOffset, seg->sortie, seg->sortieLen);
+    seg->sortieLen = 0;
+}
+
+/* Sortie du serveur : texte affiché, séquences d'échappement et caractères de contrôle retirés */
+void segmentSortie(struct segment_s* seg, const struct ttyRecordView_s* v) {
+    for (size_t k=0; k<v->len; k++) {
+        unsigned char c = v->data[k];
+        switch (seg->etat) {
+            case SORTIE_NORMAL:
+                if (c == 0x1b) seg->etat = SORTIE_ESC;
+                else if (c == '\n') segmentSortieLigne(seg);
+                else if (c == '\b') { if (seg->sortieLen > 0) seg->sortieLen--; }
+                else if (c == '\t' || c >= 0x20) {
+                    if (c == 0x7f) break;
+                    if (seg->sortieLen == 0) {
+                        seg->sortieRecno  = v->recno;
+                        seg->sortieOffset = v->offset;
+                    }
+                    seg->sortie[seg->sortieLen++] = c == '\t' ? ' ' : c;
+                    if (seg->sortieLen == LIGNE_MAX) segmentSortieLigne(seg);
+                }
+                break;
+            case SORTIE_ESC:
+                if (c == '[') seg->etat = SORTIE_CSI;
+                else if (c == ']' || c == 'P' || c == '_' || c == '^' || c == 'X') seg->etat = SORTIE_CHAINE;
+                else if (c == '(' || c == ')' || c == '#' || c == '%') seg->etat = SORTIE_CHARSET;
+                else seg->etat = SORTIE_NORMAL;
+                break;
+            case SORTIE_CSI:
+                if (c >= 0x40 && c <= 0x7e) seg->etat = SORTIE_NORMAL;
+                break;
+            case SORTIE_CHAINE:
+                if (c == 0x07) seg->etat = SORTIE_NORMAL;
+                else if (c == 0x1b) seg->etat = SORTIE_CHAINE_ESC;
+                break;
+            case SORTIE_CHAINE_ESC:
+                seg->etat = c == '\\' ? SORTIE_NORMAL : SORTIE_CHAINE;
+                break;
+            case SORTIE_CHARSET:
+                seg->etat = SORTIE_NORMAL;
+                break;
+        }
+    }
+}
+
+void segmentCommande(const struct commande_s* commande, void* ctx) {
+    segmentLigne(ctx, 'c', commande->recno, commande->offset, commande->texte, commande->len);
+}
+
+/* Ajoute une session au segment, retourne le nombre de lignes indexées */
+int segmentSession(struct segment_s* seg, const char* chemin, uint32_t numero) {
+    struct ttyRecordMap_s map;
+    struct ttyRecordCursor_s c;
+    struct ttyRecordView_s v;
+    struct ttyRecordView_s dernier = { 0 };
+    struct commandes_s cs;
+
+    if (ttyRecordMapOpen(&map, chemin) < 0) {
+        fprintf(stderr, "Impossible d'ouvrir %s : %s\n", chemin, strerror(errno));
+        return -1;
+    }
+
+    size_t len = strlen(chemin);
+    size_t voulu = seg->sessionsLen + 20 + len;
+    if (voulu > seg->sessionsCapacity) seg->sessions = agrandit(seg->sessions, &seg->sessionsCapacity, 2 * voulu);
+    uint8_t* s = seg->sessions + seg->sessionsLen;
+    le64Put(s, map.st.st_size);
+    le64Put(s + 8, map.st.st_mtime);
+    le32Put(s + 16, len);
+    memcpy(s + 20, chemin, len);
+    seg->sessionsLen += 20 + len;
+    seg->nbSessions++;
+
+    uint32_t avant = seg->nbLignes;
+    seg->sortieLen = 0;
+    seg->etat = SORTIE_NORMAL;
+    commandesInit(&cs, segmentCommande, seg);
+    ttyRecordCursorInit(&c, &map, false);
+    while (ttyRecordCursorNext(&c, &v)) {
+        commandesRecord(&cs, &v);
+        if (v.type == TTY_RECORD_SERVER_TO_CLIENT) segmentSortie(seg, &v);
+        dernier = v;
+    }
+    commandesFin(&cs, &dernier);
+    segmentSortieLigne(seg);
+    ttyRecordCursorClose(&c);
+
+    voulu = seg->manifesteLen + len + 64;
+    if (voulu > seg->manifesteCapacity) seg->manifeste = agrandit(seg->manifeste, &seg->manifesteCapacity, 2 * voulu);
+    seg->manifesteLen += sprintf(seg->manifeste + seg->manifesteLen, "%u %llu %lld %s\n", numero,
+                                 (unsigned long long)map.st.st_size, (long long)map.st.st_mtime, chemin);
+    ttyRecordMapClose(&map);
+    return seg->nbLignes - avant;
+}
+
+int paireCompare(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+bool ecritTout(int fd, const void* p, size_t n) {
+    while (n > 0) {
+        ssize_t e = write(fd, p, n);
+        if (e < 0 && errno == EINTR) continue;
+        if (e <= 0) return false;
+        p  = (const char*)p + e;
+        n -= e;
+    }
+    return true;
+}
+
+/* Ecrit le segment sous son nom définitif puis complète le manifeste, et vide seg pour la suite */
+int segmentEcrit(struct segment_s* seg, const char* repertoire, uint32_t numero) {
+    /* trigramme puis numéro de ligne : chaque liste est triée, les doublons d'une même ligne sont côte à côte */
+    qsort(seg->paires, seg->nbPaires, sizeof(uint64_t), paireCompare);
+
+    uint8_t* dico = NULL;
+    uint8_t* listes = NULL;
+    size_t dicoCapacity = 0, listesCapacity = 0, dicoLen = 0, listesLen = 0;
+    uint32_t nbTrigrammes = 0;
+    for (size_t k=0; k<seg->nbPaires; ) {
+        uint32_t t = seg->paires[k] >> 32;
+        uint32_t precedent = 0, nb = 0;
+        size_t debut = listesLen;
+        for (; k<seg->nbPaires && seg->paires[k] >> 32 == t; k++) {
+            uint32_t l = (uint32_t)seg->paires[k];
+            if (nb > 0 && l == precedent) continue;
+            if (listesLen + 10 > listesCapacity) listes = agrandit(listes, &listesCapacity, 2 * listesCapacity + 4096);
+            listesLen += varintPut(listes + listesLen, nb == 0 ? l : l - precedent);
+            precedent = l;
+            nb++;
+        }
+        if (dicoLen + SEGMENT_DICO_LEN > dicoCapacity) dico = agrandit(dico, &dicoCapacity, 2 * dicoCapacity + 4096);
+        le32Put(dico + dicoLen, t);
+        le32Put(dico + dicoLen + 4, nb);
+        le64Put(dico + dicoLen + 8, debut);
+        dicoLen += SEGMENT_DICO_LEN;
+        nbTrigrammes++;
+    }
+
+    uint8_t h[SEGMENT_HEADER_LEN];
+    uint64_t offset = SEGMENT_HEADER_LEN;
+    memset(h, 0, sizeof(h));
+    memcpy(h, SEGMENT_MAGIC, 8);
+    le32Put(h + 8, seg->nbSessions);
+    le32Put(h + 12, seg->nbLignes);
+    le32Put(h + 16, nbTrigrammes);
+    le64Put(h + 24, offset); offset += seg->sessionsLen;
+    le64Put(h + 32, offset); offset += seg->lignesLen;
+    le64Put(h + 40, offset); offset += seg->textesLen;
+    le64Put(h + 48, offset); offset += dicoLen;
+    le64Put(h + 56, offset); offset += listesLen;
+    le64Put(h + 64, offset);
+
+    char nom[PATH_MAX], nomTmp[PATH_MAX];
+    int n = snprintf(nom, sizeof(nom), "%s/seg-%06u", repertoire, numero);
+    int l = snprintf(nomTmp, sizeof(nomTmp), "%s.%d", nom, getpid());
+    if (n < 0 || (size_t)n >= sizeof(nom) || l < 0 || (size_t)l >= sizeof(nomTmp)) {
+        fprintf(stderr, "Nom trop long : %s\n", repertoire);
+        free(dico);
+        free(listes);
+        return -1;
+    }
+    int fd = open(nomTmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    bool ok = fd >= 0
+        && ecritTout(fd, h, sizeof(h))
+        && ecritTout(fd, seg->sessions, seg->sessionsLen)
+        && ecritTout(fd, seg->lignes, seg->lignesLen)
+        && ecritTout(fd, seg->textes, seg->textesLen)
+        && ecritTout(fd, dico, dicoLen)
+        && ecritTout(fd, listes, listesLen)
+        && fdatasync(fd) == 0;
+    if (fd >= 0) close(fd);
+    free(dico);
+    free(listes);
+    if (!ok || rename(nomTmp, nom) < 0) {
+        perror("Erreur d'écriture du segment ");
+        unlink(nomTmp);
+        return -1;
+    }
+
+    /* le segment n'est visible qu'une fois cité dans le manifeste */
+    snprintf(nom, sizeof(nom), "%s/%s", repertoire, MANIFESTE);
+    fd = open(nom, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    ok = fd >= 0 && ecritTout(fd, seg->manifeste, seg->manifesteLen);
+    if (fd >= 0) close(fd);
+    if (!ok) {
+        perror("Erreur d'écriture du manifeste ");
+        return -1;
+    }
+
+    printf("seg-%06u : %u sessions, %u lignes, %u trigrammes, %llu octets\n", numero,
+           seg->nbSessions, seg->nbLignes, nbTrigrammes, (unsigned long long)offset);
+    seg->sessionsLen = seg->lignesLen = seg->textesLen = seg->nbPaires = seg->manifesteLen = 0;
+    seg->nbSessions = seg->nbLignes = 0;
+    return 0;
+}
+
+/* Numéro du prochain segment : un de plus que le plus grand présent, cité ou non dans le manifeste */
+uint32_t segmentSuivant(const char* repertoire) {
+    uint32_t max = 0;
+    DIR* d = opendir(repertoire);
+    struct dirent* e;
+    if (d == NULL) return 1;
+    while ((e = readdir(d)) != NULL) {
+        unsigned n;
+        if (sscanf(e->d_name, "seg-%u", &n) == 1 && n > max) max = n;
+    }
+    closedir(d);
+    return max + 1;
+}
+
+
+
+/******************************************************************************
+ * Ajout de fichiers
+ */
+
+struct ajout_s {
+    char**   noms;
+    size_t   nb;
+    size_t   capacity;
+    dev_t    indexDev;    /* le répertoire d'index n'est pas parcouru */
+    ino_t    indexIno;
+};
+
+void ajoutChemin(struct ajout_s* a, const char* chemin) {
+    struct stat st;
+
+    if (stat(chemin, &st) < 0) {
+        glob_t g;
+        if (strpbrk(chemin, "*?[") && glob(chemin, 0, NULL, &g) == 0) {
+            for (size_t k=0; k<g.gl_pathc; k++) ajoutChemin(a, g.gl_pathv[k]);
+            globfree(&g);
+        } else {
+            fprintf(stderr, "Impossible de lire %s : %s\n", chemin, strerror(errno));
+        }
+        return;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        if (st.st_dev == a->indexDev && st.st_ino == a->indexIno) return;
+        DIR* d = opendir(chemin);
+        struct dirent* e;
+        if (d == NULL) {
+            fprintf(stderr, "Impossible de lire %s : %s\n", chemin, strerror(errno));
+            return;
+        }
+        while ((e = readdir(d)) != NULL) {
+            if (ttyRecordIgnore(e->d_name)) continue;
+            char sous[PATH_MAX];
+            snprintf(sous, sizeof(sous), "%s/%s", chemin, e->d_name);
+            ajoutChemin(a, sous);
+        }
+        closedir(d);
+        return;
+    }
+
+    if (!S_ISREG(st.st_mode)) return;
+    if (a->nb == a->capacity) {
+        size_t taille = a->capacity * sizeof(char*);
+        a->noms = agrandit(a->noms, &taille, (a->capacity ? 2 * a->capacity : 256) * sizeof(char*));
+        a->capacity = taille / sizeof(char*);
+    }
+    /* chemin absolu : le manifeste doit reconnaître le fichier quel que soit le répertoire courant */
+    char* absolu = realpath(chemin, NULL);
+    a->noms[a->nb++] = absolu ? absolu : strdup(chemin);
+}
+
+int nomCompare(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+void indexeFichiers(const char* repertoire, char** chemins, int nbChemins) {
+    struct ajout_s a;
+    struct manifeste_s m;
+    struct segment_s seg;
+    struct stat st;
+
+    if (mkdir(repertoire, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) < 0 && errno != EEXIST) {
+        perror("Impossible de créer le répertoire d'index ");
+        exit(EXIT_FAILURE);
+    }
+    memset(&a, 0, sizeof(a));
+    if (stat(repertoire, &st) == 0) {
+        a.indexDev = st.st_dev;
+        a.indexIno = st.st_ino;
+    }
+    for (int k=0; k<nbChemins; k++) ajoutChemin(&a, chemins[k]);
+    qsort(a.noms, a.nb, sizeof(char*), nomCompare);
+
+    manifesteLoad(repertoire, &m);
+    memset(&seg, 0, sizeof(seg));
+    uint32_t numero = segmentSuivant(repertoire);
+    size_t indexes = 0, inchanges = 0;
+
+    for (size_t k=0; k<a.nb; k++) {
+        if (k > 0 && strcmp(a.noms[k], a.noms[k-1]) == 0) continue;
+        const struct manifesteEntree_s* e = manifesteCherche(&m, a.noms[k]);
+        if (e && stat(a.noms[k], &st) == 0 && (uint64_t)st.st_size == e->taille && st.st_mtime == e->mtime) {
+            inchanges++;
+            continue;
+        }
+        if (segmentSession(&seg, a.noms[k], numero) < 0) continue;
+        indexes++;
+
+        /* une session n'est jamais coupée entre deux segments */
+        if (seg.nbPaires >= SEGMENT_PAIRES_MAX) {
+            if (segmentEcrit(&seg, repertoire, numero) < 0) exit(EXIT_FAILURE);
+            numero++;
+        }
+    }
+    if (seg.nbSessions > 0 && segmentEcrit(&seg, repertoire, numero) < 0) exit(EXIT_FAILURE);
+    printf("%zu fichiers indexés, %zu inchangés\n", indexes, inchanges);
+
+    for (size_t k=0; k<a.nb; k++) free(a.noms[k]);
+    free(a.noms);
+    manifesteFree(&m);
+    free(seg.sessions);
+    free(seg.lignes);
+    free(seg.textes);
+    free(seg.paires);
+    free(seg.manifeste);
+}
+
+
+
+/******************************************************************************
+ * Recherche
+ */
+
+struct segmentLu_s {
+    const uint8_t* base;
+    size_t   len;
+    uint32_t nbSessions, nbLignes, nbTrigrammes;
+    const uint8_t* lignes;
+    const char*    textes;
+    const uint8_t* dico;
+    const uint8_t* listes;
+    size_t   listesLen;
+    const char** chemins;       /* NULL pour une session remplacée depuis */
+};
+
+struct recherche_s {
+    const char* motif;
+    size_t   len;
+    bool     casse;             /* false : sans tenir compte de la casse */
+    bool     sessions;          /* seulement les noms de sessions */
+    bool     commandes;         /* seulement les lignes de commande */
+    size_t   trouves;
+};
+
+int segmentOuvre(struct segmentLu_s* s, const char* nom, uint32_t numero, const struct manifeste_s* m) {
+    memset(s, 0, sizeof(*s));
+    int fd = open(nom, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < SEGMENT_HEADER_LEN) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    s->len = st.st_size;
+    s->base = mmap(NULL, s->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (s->base == MAP_FAILED) return -1;
+
+    const uint8_t* h = s->base;
+    uint64_t off[6];
+    for (int k=0; k<6; k++) off[k] = le64Get(h + 24 + 8*k);
+    s->nbSessions   = le32Get(h + 8);
+    s->nbLignes     = le32Get(h + 12);
+    s->nbTrigrammes = le32Get(h + 16);
+    bool ok = memcmp(h, SEGMENT_MAGIC, 8) == 0 && off[5] == s->len;
+    for (int k=0; k<5 && ok; k++) ok = off[k] <= off[k+1];
+    ok = ok && off[2] - off[1] == (uint64_t)s->nbLignes * SEGMENT_LIGNE_LEN
+            && off[4] - off[3] == (uint64_t)s->nbTrigrammes * SEGMENT_DICO_LEN;
+    if (!ok) {
+        fprintf(stderr, "Segment abîmé ignoré : %s\n", nom);
+        munmap((void*)s->base, s->len);
+        return -1;
+    }
+    s->lignes    = s->base + off[1];
+    s->textes    = (const char*)s->base + off[2];
+    s->dico      = s->base + off[3];
+    s->listes    = s->base + off[4];
+    s->listesLen = off[5] - off[4];
+
+    /* sessions : seules comptent celles dont le manifeste désigne ce segment */
+    s->chemins = calloc(s->nbSessions, sizeof(char*));
+    const uint8_t* p = s->base + off[0];
+    for (uint32_t k=0; k<s->nbSessions; k++) {
+        if (p + 20 > s->base + off[1]) break;
+        uint32_t len = le32Get(p + 16);
+        if (p + 20 + len > s->base + off[1]) break;
+        char* chemin = strndup((const char*)p + 20, len);
+        const struct manifesteEntree_s* e = manifesteCherche(m, chemin);
+        if (e && e->segment == numero) s->chemins[k] = e->chemin;
+        free(chemin);
+        p += 20 + len;
+    }
+    return 0;
+}
+
+void segmentFerme(struct segmentLu_s* s) {
+    free(s->chemins);
+    munmap((void*)s->base, s->len);
+}
+
+/* Liste d'un trigramme : position dans les listes et nombre de lignes, 0 s'il est absent */
+uint32_t segmentListe(const struct segmentLu_s* s, uint32_t t, size_t* debut) {
+    size_t bas = 0, haut = s->nbTrigrammes;
+    while (bas < haut) {
+        size_t milieu = (bas + haut) / 2;
+        uint32_t x = le32Get(s->dico + milieu * SEGMENT_DICO_LEN);
+        if (x == t) {
+            *debut = le64Get(s->dico + milieu * SEGMENT_DICO_LEN + 8);
+            return *debut < s->listesLen ? le32Get(s->dico + milieu * SEGMENT_DICO_LEN + 4) : 0;
+        }
+        if (x < t) bas = milieu + 1;
+        else haut = milieu;
+    }
+    return 0;
+}
+
+/* Ne garde de candidats que ceux présents dans la liste, retourne le nouveau nombre */
+uint32_t segmentCroise(const struct segmentLu_s* s, size_t debut, uint32_t nb, uint32_t* candidats, uint32_t nbCandidats) {
+    const uint8_t* p = s->listes + debut;
+    size_t reste = s->listesLen - debut;
+    uint32_t garde = 0, k = 0, ligne = 0;
+    for (uint32_t i=0; i<nb && k<nbCandidats; i++) {
+        uint64_t ecart;
+        size_t n = varintGet(p, reste, &ecart);
+        if (n == 0) break;
+        p += n;
+        reste -= n;
+        ligne = i == 0 ? (uint32_t)ecart : ligne + (uint32_t)ecart;
+        while (k < nbCandidats && candidats[k] < ligne) k++;
+        if (k < nbCandidats && candidats[k] == ligne) candidats[garde++] = candidats[k++];
+    }
+    return garde;
+}
+
+uint32_t segmentDecode(const struct segmentLu_s* s, size_t debut, uint32_t nb, uint32_t* lignes) {
+    const uint8_t* p = s->listes + debut;
+    size_t reste = s->listesLen - debut;
+    uint32_t ligne = 0, i;
+    for (i=0; i<nb; i++) {
+        uint64_t ecart;
+        size_t n = varintGet(p, reste, &ecart);
+        if (n == 0) break;
+        p += n;
+        reste -= n;
+        ligne = i == 0 ? (uint32_t)ecart : ligne + (uint32_t)ecart;
+        lignes[i] = ligne;
+    }
+    return i;
+}
+
+void rechercheLigne(struct recherche_s* r, const struct segmentLu_s* s, uint32_t numero, const char** derniere) {
+    const uint8_t* l = s->lignes + (size_t)numero * SEGMENT_LIGNE_LEN;
+    uint32_t session = le32Get(l + 24);
+    uint64_t texte   = le64Get(l + 16);
+    size_t   len     = l[28] | (size_t)l[29] << 8;
+    char     type    = l[30];
+
+    if (session >= s->nbSessions || s->chemins[session] == NULL) return;
+    if (r->commandes && type != 'c') return;
+    if (texte + len >= (uint64_t)((const char*)s->dico - s->textes)) return;
+    const char* t = s->textes + texte;
+    if (r->casse ? memmem(t, len, r->motif, r->len) == NULL : strcasestr(t, r->motif) == NULL) return;
+
+    r->trouves++;
+    if (r->sessions) {
+        if (*derniere != s->chemins[session]) printf("%s\n", s->chemins[session]);
+    } else {
+        printf("%s\t%llu\t%llu\t%c\t%.*s\n", s->chemins[session], (unsigned long long)le64Get(l), (unsigned long long)le64Get(l + 8), type, (int)len, t);
+    }
+    *derniere = s->chemins[session];
+}
+
+void rechercheSegment(struct recherche_s* r, const struct segmentLu_s* s) {
+    const char* derniere = NULL;
+
+    if (r->len < 3) {
+        /* pas de trigramme : toutes les lignes sont candidates */
+        for (uint32_t k=0; k<s->nbLignes; k++) rechercheLigne(r, s, k, &derniere);
+        return;
+    }
+
+    /* trigrammes du motif, du plus rare au plus fréquent */
+    size_t nbT = r->len - 2;
+    uint32_t* nb = malloc(nbT * sizeof(uint32_t));
+    size_t* debut = malloc(nbT * sizeof(size_t));
+    size_t plusRare = 0;
+    for (size_t k=0; k<nbT; k++) {
+        nb[k] = segmentListe(s, trigramme(r->motif + k), &debut[k]);
+        if (nb[k] == 0) {
+            free(nb);
+            free(debut);
+            return;
+        }
+        if (nb[k] < nb[plusRare]) plusRare = k;
+    }
+
+    uint32_t* candidats = malloc(nb[plusRare] * sizeof(uint32_t));
+    uint32_t nbCandidats = segmentDecode(s, debut[plusRare], nb[plusRare], candidats);
+    for (size_t k=0; k<nbT && nbCandidats > 0; k++) {
+        if (k != plusRare) nbCandidats = segmentCroise(s, debut[k], nb[k], candidats, nbCandidats);
+    }
+    for (uint32_t k=0; k<nbCandidats; k++) {
+        if (candidats[k] < s->nbLignes) rechercheLigne(r, s, candidats[k], &derniere);
+    }
+
+    free(candidats);
+    free(nb);
+    free(debut);
+}
+
+int segmentNomCompare(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+void recherche(const char* repertoire, struct recherche_s* r) {
+    struct manifeste_s m;
+    uint32_t* numeros = NULL;
+    size_t nb = 0, capacity = 0;
+
+    manifesteLoad(repertoire, &m);
+    DIR* d = opendir(repertoire);
+    struct dirent* e;
+    if (d == NULL) {
+        fprintf(stderr, "Impossible de lire l'index %s : %s\n", repertoire, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    while ((e = readdir(d)) != NULL) {
+        unsigned n;
+        int fin = 0;
+        if (sscanf(e->d_name, "seg-%u%n", &n, &fin) != 1 || e->d_name[fin] != 0) continue;
+        if ((nb + 1) * sizeof(uint32_t) > capacity) numeros = agrandit(numeros, &capacity, 2 * capacity + 64 * sizeof(uint32_t));
+        numeros[nb++] = n;
+    }
+    closedir(d);
+    qsort(numeros, nb, sizeof(uint32_t), segmentNomCompare);
+
+    for (size_t k=0; k<nb; k++) {
+        struct segmentLu_s s;
+        char nom[PATH_MAX];
+        snprintf(nom, sizeof(nom), "%s/seg-%06u", repertoire, numeros[k]);
+        if (segmentOuvre(&s, nom, numeros[k], &m) < 0) continue;
+        rechercheSegment(r, &s);
+        segmentFerme(&s);
+    }
+
+    free(numeros);
+    manifesteFree(&m);
+}
+
+
+
+/******************************************************************************
+ * Point d'entrée du programme
+ */
+
+void usage(char* argv0) {
+    printf("%s [options] --add <fichiers, répertoires ou motifs>\n", argv0);
+    printf("%s [options] <texte>\n", argv0);
+    printf("  --index <répertoire>  répertoire de l'index (%s par défaut)\n", INDEX_DEFAUT);
+    printf("  --add                 indexe les enregistrements nouveaux ou modifiés\n");
+    printf("  --ignore-case         recherche sans tenir compte de la casse (ascii)\n");
+    printf("  --sessions            seulement les noms des sessions qui contiennent le texte\n");
+    printf("  --commands            seulement les lignes de commande, pas la sortie\n");
+    printf("Chaque résultat : fichier, record, offset du record (ou de sa trame), type (c commande, o sortie), ligne\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[]) {
+    const struct option options[] = {
+        { "index",       required_argument, NULL, 'x' },
+        { "add",         no_argument,       NULL, 'a' },
+        { "ignore-case", no_argument,       NULL, 'i' },
+        { "sessions",    no_argument,       NULL, 'l' },
+        { "commands",    no_argument,       NULL, 'c' },
+        { NULL, 0, NULL, 0 }
+    };
+    const char* repertoire = INDEX_DEFAUT;
+    bool ajout = false;
+    struct recherche_s r;
+    int opt;
+
+    memset(&r, 0, sizeof(r));
+    r.casse = true;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+            case 'x': repertoire = optarg; break;
+            case 'a': ajout = true; break;
+            case 'i': r.casse = false; break;
+            case 'l': r.sessions = true; break;
+            case 'c': r.commandes = true; break;
+            default: usage(argv[0]);
+        }
+    }
+
+    static char tampon[1 << 16];
+    setvbuf(stdout, tampon, _IOFBF, sizeof(tampon));
+
+    if (ajout) {
+        if (optind >= argc) usage(argv[0]);
+        indexeFichiers(repertoire, argv + optind, argc - optind);
+        return EXIT_SUCCESS;
+    }
+
+    if (optind != argc - 1 || argv[optind][0] == 0) usage(argv[0]);
+    r.motif = argv[optind];
+    r.len   = strlen(r.motif);
+    recherche(repertoire, &r);
+    return r.trouves > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
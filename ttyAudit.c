@@ -0,0 +1,206 @@
+/******************************************************************************
+ * Evénements d'audit du noyau, voir ttyAudit.h
+ * Bertrand sept 2024
+ ******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "ttyAudit.h"
+
+
+
+/******************************************************************************
+ * Lignes et champs
+ */
+
+/* Entier décimal en p[*i..len), avance *i ; -1 s'il n'y a pas de chiffre */
+static int64_t ttyAuditNombre(const char* p, size_t len, size_t* i) {
+    size_t debut = *i;
+    int64_t v = 0;
+    while (*i < len && p[*i] >= '0' && p[*i] <= '9') v = v * 10 + (p[(*i)++] - '0');
+    return *i > debut ? v : -1;
+}
+
+int ttyAuditLigne(const char* p, size_t len, struct ttyAuditLigne_s* l) {
+    static const char msg[] = " msg=audit(";
+    size_t i;
+
+    /* ligne brute d'auditd, ou passée par un relais syslog qui préfixe la sienne */
+    const char* t = len >= 5 && memcmp(p, "type=", 5) == 0 ? p : memmem(p, len, "type=", 5);
+    if (t == NULL) return -1;
+    i = t - p + 5;
+    l->type = p + i;
+    while (i < len && p[i] != ' ') i++;
+    l->typeLen = p + i - l->type;
+    if (len - i < sizeof(msg) - 1 || memcmp(p + i, msg, sizeof(msg) - 1) != 0) return -1;
+    i += sizeof(msg) - 1;
+
+    /* msg=audit(secondes.millisecondes:série): */
+    int64_t sec = ttyAuditNombre(p, len, &i);
+    if (sec < 0 || i >= len || p[i++] != '.') return -1;
+    size_t debutMs = i;
+    int64_t ms = ttyAuditNombre(p, len, &i);
+    if (ms < 0 || i - debutMs != 3 || i >= len || p[i++] != ':') return -1;
+    int64_t serie = ttyAuditNombre(p, len, &i);
+    if (serie < 0 || len - i < 2 || p[i] != ')' || p[i+1] != ':') return -1;
+    i += 2;
+    if (i < len && p[i] == ' ') i++;
+
+    l->usec      = sec * 1000000 + ms * 1000;
+    l->serie     = serie;
+    l->champs    = p + i;
+    l->champsLen = len - i;
+    return 0;
+}
+
+const char* ttyAuditChamp(const char* champs, size_t len, const char* nom, size_t* valLen) {
+    size_t n = strlen(nom);
+    const char* fin = champs + len;
+
+    for (const char* p = champs; p < fin; ) {
+        const char* q = memmem(p, fin - p, nom, n);
+        if (q == NULL) return NULL;
+        /* nom entier : en début de champs ou après une espace, suivi de '=' */
+        if ((q == champs || q[-1] == ' ') && q + n < fin && q[n] == '=') {
+            const char* v = q + n + 1;
+            const char* e = v;
+            if (e < fin && *e == '"') {
+                e = memchr(e + 1, '"', fin - e - 1);
+                e = e ? e + 1 : fin;
+            } else {
+                while (e < fin && *e != ' ' && *e != 0x1d) e++;   /* 0x1d : début des champs ENRICHED */
+            }
+            *valLen = e - v;
+            return v;
+        }
+        p = q + n;
+    }
+    return NULL;
+}
+
+static int ttyAuditHex(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+size_t ttyAuditValeur(const char* val, size_t len, bool encodable, char* out, size_t max) {
+    size_t n = 0;
+
+    if (len >= 2 && val[0] == '"' && val[len-1] == '"') {
+        n = len - 2 < max ? len - 2 : max;
+        memcpy(out, val + 1, n);
+        return n;
+    }
+    /* hexadécimal : le noyau l'emploie pour une chaîne dès qu'un caractère serait ambigu */
+    bool hex = encodable && len > 0 && len % 2 == 0;
+    for (size_t i=0; hex && i<len; i++) hex = ttyAuditHex(val[i]) >= 0;
+    if (!hex) {
+        n = len < max ? len : max;
+        memcpy(out, val, n);
+        return n;
+    }
+    for (size_t i=0; i+1<len && n<max; i+=2) {
+        char c = (char)(ttyAuditHex(val[i]) << 4 | ttyAuditHex(val[i+1]));
+        out[n++] = c ? c : ' ';   /* proctitle : arguments séparés par des 0 */
+    }
+    return n;
+}
+
+
+
+/******************************************************************************
+ * Résumé pour l'affichage
+ */
+
+struct ttyAuditSortie_s {
+    char*  out;
+    size_t max;
+    size_t n;
+};
+
+static void ttyAuditAjoute(struct ttyAuditSortie_s* s, const char* p, size_t len) {
+    if (len > s->max - s->n) len = s->max - s->n;
+    memcpy(s->out + s->n, p, len);
+    s->n += len;
+}
+
+/* " nom valeur" si le champ est présent ; encodable : chaîne, peut-être en hexadécimal */
+static void ttyAuditAjouteChamp(struct ttyAuditSortie_s* s, const struct ttyAuditLigne_s* l, const char* nom, bool encodable) {
+    char valeur[TTY_AUDIT_RESUME_MAX];
+    size_t len;
+    const char* v = ttyAuditChamp(l->champs, l->champsLen, nom, &len);
+    if (v == NULL) return;
+    ttyAuditAjoute(s, " ", 1);
+    ttyAuditAjoute(s, nom, strlen(nom));
+    ttyAuditAjoute(s, " ", 1);
+    ttyAuditAjoute(s, valeur, ttyAuditValeur(v, len, encodable, valeur, sizeof(valeur)));
+}
+
+/* Arguments d'une ligne EXECVE : a0= a1= ..., ou a1_len= a1[0]= a1[1]= pour un argument découpé */
+static void ttyAuditArguments(struct ttyAuditSortie_s* s, const struct ttyAuditLigne_s* l) {
+    char nom[48], valeur[TTY_AUDIT_RESUME_MAX];
+    size_t len;
+    const char* v = ttyAuditChamp(l->champs, l->champsLen, "argc", &len);
+    long argc = v ? strtol(v, NULL, 10) : 0;
+
+    for (long a=0; a<argc && s->n < s->max; a++) {
+        if (a > 0) ttyAuditAjoute(s, " ", 1);
+        snprintf(nom, sizeof(nom), "a%ld", a);
+        if ((v = ttyAuditChamp(l->champs, l->champsLen, nom, &len)) != NULL) {
+            ttyAuditAjoute(s, valeur, ttyAuditValeur(v, len, true, valeur, sizeof(valeur)));
+            continue;
+        }
+        for (int k=0; ; k++) {
+            snprintf(nom, sizeof(nom), "a%ld[%d]", a, k);
+            if ((v = ttyAuditChamp(l->champs, l->champsLen, nom, &len)) == NULL) break;
+            ttyAuditAjoute(s, valeur, ttyAuditValeur(v, len, true, valeur, sizeof(valeur)));
+        }
+    }
+}
+
+size_t ttyAuditResume(const char* data, size_t len, char* out, size_t max) {
+    struct ttyAuditSortie_s s = { out, max, 0 };
+    struct ttyAuditLigne_s syscall = { 0 }, execve = { 0 }, cwd = { 0 };
+    bool aSyscall = false, aExecve = false, aCwd = false;
+
+    for (size_t i=0; i<len; ) {
+        const char* fin = memchr(data + i, '\n', len - i);
+        size_t l = fin ? (size_t)(fin - (data + i)) : len - i;
+        struct ttyAuditLigne_s ligne;
+        if (ttyAuditLigne(data + i, l, &ligne) == 0) {
+            if (!aSyscall && ttyAuditType(&ligne, "SYSCALL")) { syscall = ligne; aSyscall = true; }
+            if (!aExecve && ttyAuditType(&ligne, "EXECVE"))   { execve = ligne;  aExecve = true; }
+            if (!aCwd && ttyAuditType(&ligne, "CWD"))         { cwd = ligne;     aCwd = true; }
+        }
+        i += l + 1;
+    }
+
+    if (aSyscall) {
+        ttyAuditAjouteChamp(&s, &syscall, "pid", false);
+        ttyAuditAjouteChamp(&s, &syscall, "ppid", false);
+        ttyAuditAjouteChamp(&s, &syscall, "uid", false);
+        if (!aExecve) {
+            ttyAuditAjouteChamp(&s, &syscall, "syscall", false);
+            ttyAuditAjouteChamp(&s, &syscall, "exit", false);
+            ttyAuditAjouteChamp(&s, &syscall, "exe", true);
+        }
+    }
+    if (aCwd) ttyAuditAjouteChamp(&s, &cwd, "cwd", true);
+    if (aExecve) {
+        ttyAuditAjoute(&s, " : ", 3);
+        ttyAuditArguments(&s, &execve);
+    }
+    /* sans espace de tête */
+    if (s.n > 0 && out[0] == ' ') {
+        memmove(out, out + 1, s.n - 1);
+        s.n--;
+    }
+    return s.n;
+}
@@ -0,0 +1,58 @@
+/******************************************************************************
+ * Evénements d'audit du noyau (auditd), partagé par auditMerge qui les range
+ * dans les enregistrements et replay qui les affiche
+ * Bertrand sept 2024
+ *
+ * Une ligne d'audit.log :
+ *   type=SYSCALL msg=audit(1697520000.123:456): arch=c000003e syscall=59 success=yes exit=0 ... ppid=1 pid=2 auid=1000 uid=0 ... ses=3 comm="ls" exe="/usr/bin/ls" key=(null)
+ *   type=EXECVE msg=audit(1697520000.123:456): argc=2 a0="ls" a1=2D6C61
+ *   type=CWD msg=audit(1697520000.123:456): cwd="/root"
+ *   type=EOE msg=audit(1697520000.123:456):
+ * Les lignes d'un même événement partagent son horodatage et son numéro de
+ * série (456), mais seule la ligne SYSCALL porte la session d'audit (ses=),
+ * celle que honeypotSsh note dans son record START (auditSession). Une valeur
+ * est entre guillemets, ou en hexadécimal si elle contient des espaces ou des
+ * caractères spéciaux ; un argument trop long est découpé en a1_len=, a1[0]=...
+ *
+ * Records TTY_RECORD_AUDIT_EXECVE et TTY_RECORD_AUDIT_SYSCALL : les lignes de
+ * l'événement telles quelles, dans l'ordre du journal, séparées par '\n',
+ * sans la ligne EOE.
+ ******************************************************************************/
+#ifndef TTYAUDIT_H
+#define TTYAUDIT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+
+
+#define TTY_AUDIT_RESUME_MAX  4096   /* résumé d'un événement pour l'affichage */
+
+struct ttyAuditLigne_s {
+    const char* type;        /* SYSCALL, EXECVE, CWD... */
+    size_t      typeLen;
+    int64_t     usec;        /* µs depuis l'epoch */
+    uint64_t    serie;
+    const char* champs;      /* après "): " */
+    size_t      champsLen;
+};
+
+/* Entête d'une ligne d'audit.log, sans sa fin de ligne ; -1 si ce n'en est pas une */
+int ttyAuditLigne(const char* p, size_t len, struct ttyAuditLigne_s* l);
+
+static inline bool ttyAuditType(const struct ttyAuditLigne_s* l, const char* type) {
+    size_t n = strlen(type);
+    return l->typeLen == n && memcmp(l->type, type, n) == 0;
+}
+
+/* Valeur brute du champ nom=, guillemets compris ; NULL s'il est absent */
+const char* ttyAuditChamp(const char* champs, size_t len, const char* nom, size_t* valLen);
+
+/* Valeur décodée : guillemets retirés, et pour une chaîne (encodable) hexadécimal décodé ; retourne la longueur écrite dans out */
+size_t ttyAuditValeur(const char* val, size_t len, bool encodable, char* out, size_t max);
+
+/* Résumé lisible d'un record TTY_RECORD_AUDIT_xxx : pid, ppid, uid, répertoire, ligne de commande ou appel système */
+size_t ttyAuditResume(const char* data, size_t len, char* out, size_t max);
+
+#endif
@@ -0,0 +1,87 @@
+/******************************************************************************
+ * Magasin de morceaux des enregistrements archivés, partagé par archive (qui
+ * l'écrit) et ttyRecordReader (qui le lit)
+ * Bertrand sept 2024
+ *
+ * Les robots rejouent les mêmes scripts : d'une session à l'autre la sortie du
+ * serveur (uname -a, /proc/cpuinfo, bannières) est presque toujours la même.
+ * archive découpe les données des records SERVER_TO_CLIENT en morceaux définis
+ * par leur contenu (hachage glissant, voir archive.c) : une même sortie donne
+ * les mêmes morceaux, même décalée ou entourée d'autre chose. Chaque
+ * morceau distinct est rangé une seule fois dans le paquet du magasin ;
+ * l'enregistrement réécrit n'en garde que les références.
+ *
+ * Magasin : un répertoire
+ *   chunks.pack  entête TTY_CHUNKS_HEADER_LEN octets
+ *                  magic     8 octets  "HPCHUNKS"
+ *                  version   1 octet   1
+ *                  réservé   7 octets  à 0
+ *                  clé      16 octets  du hachage des morceaux, tirée à la création
+ *                puis les morceaux, en ajout seul, chacun :
+ *                  len       4 octets  petit boutiste
+ *                  hash     16 octets  SipHash-2-4 128 bits des données, avec la clé
+ *                  données   len octets
+ *   chunks.idx   pour archive seulement : les morceaux du paquet, relus au lieu
+ *                du paquet entier au passage suivant
+ *                  magic     8 octets  "HPCHKIDX"
+ *                  couvert   8 octets  taille du paquet qu'il décrit
+ *                  nombre    8 octets
+ *                  entrées   TTY_CHUNKS_INDEX_ENTRY_LEN octets : hash 16, offset 8, len 4, réservé 4
+ *
+ * Enregistrement archivé : v2 en trames, flag TTY_RECORD_FLAG_CHUNKS. Son premier
+ * record TTY_RECORD_CHUNK_STORE donne le chemin du magasin, un record
+ * TTY_RECORD_CHUNKED remplace un record SERVER_TO_CLIENT :
+ *        taille    varint    des données d'origine
+ *      puis pour chaque morceau
+ *        offset    varint    des données du morceau dans le paquet
+ *        len       varint
+ * Le lecteur rend à la place le record SERVER_TO_CLIENT d'origine.
+ ******************************************************************************/
+#ifndef TTYCHUNKS_H
+#define TTYCHUNKS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "ttyRecord.h"
+
+
+#define TTY_CHUNKS_PACK              "chunks.pack"
+#define TTY_CHUNKS_INDEX             "chunks.idx"
+#define TTY_CHUNKS_MAGIC             "HPCHUNKS"
+#define TTY_CHUNKS_VERSION           1
+#define TTY_CHUNKS_HEADER_LEN        32
+#define TTY_CHUNKS_KEY_LEN           16
+#define TTY_CHUNKS_HASH_LEN          16
+#define TTY_CHUNKS_ENTRY_LEN         20          /* len, hash : entête d'un morceau dans le paquet */
+#define TTY_CHUNKS_LEN_MAX           (1 << 20)   /* au delà, un morceau est considéré comme abîmé */
+
+#define TTY_CHUNKS_INDEX_MAGIC       "HPCHKIDX"
+#define TTY_CHUNKS_INDEX_HEADER_LEN  24
+#define TTY_CHUNKS_INDEX_ENTRY_LEN   32
+
+#define TTY_CHUNKS_ENV               "HONEYPOT_CHUNKS"   /* magasin à lire à la place de celui noté dans l'enregistrement */
+
+
+static inline void ttyChunksHeaderEncode(uint8_t* out, const uint8_t* cle) {
+    memset(out, 0, TTY_CHUNKS_HEADER_LEN);
+    memcpy(out, TTY_CHUNKS_MAGIC, 8);
+    out[8] = TTY_CHUNKS_VERSION;
+    memcpy(out + 16, cle, TTY_CHUNKS_KEY_LEN);
+}
+
+/* Retourne 0 et la clé si c'est un entête de paquet valide */
+static inline int ttyChunksHeaderDecode(const uint8_t* in, size_t avail, uint8_t* cle) {
+    if (avail < TTY_CHUNKS_HEADER_LEN || memcmp(in, TTY_CHUNKS_MAGIC, 8) != 0 || in[8] != TTY_CHUNKS_VERSION) return -1;
+    memcpy(cle, in + 16, TTY_CHUNKS_KEY_LEN);
+    return 0;
+}
+
+/* Données d'un record TTY_RECORD_CHUNKED : taille, puis les références ajoutées une à une */
+static inline size_t ttyChunksRefEncode(uint8_t* out, uint64_t offset, uint64_t len) {
+    size_t n = varintPut(out, offset);
+    return n + varintPut(out + n, len);
+}
+
+#endif
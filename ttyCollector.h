@@ -0,0 +1,142 @@
+/******************************************************************************
+ * Collecteur d'enregistrements : protocole entre honeypotSsh et collector, et
+ * format du stockage, partagés par les deux.
+ * Bertrand sept 2024
+ *
+ * Connexion : socket unix SOCK_SEQPACKET, une par session.
+ *      Premier message, TTY_COLLECTOR_HELLO_LEN octets puis le nom :
+ *        magic     4 octets  "HPCL"
+ *        version   1 octet   1
+ *        réservé   3 octets  à 0
+ *        pid       4 octets  petit boutiste
+ *        start     8 octets  µs depuis l'epoch
+ *        nom       le reste  nom que l'enregistrement aurait eu en local
+ *      Messages suivants : les octets du fichier d'enregistrement tels quels
+ *      (entête de fichier, records ou trames, index), coupés en messages d'au
+ *      plus TTY_COLLECTOR_MESSAGE_MAX octets. Leur concaténation est exactement
+ *      le fichier local : collector --extract le restitue, replay le lit.
+ *      Fin de connexion = fin de session.
+ *
+ * Stockage, dans un répertoire :
+ *      seg-NNNNNN  segments en ajout seul, ouverts chacun par un nouveau lancement
+ *                  du collecteur ou quand le précédent dépasse sa taille. Après le
+ *                  magic "HPCOLSEG", une suite de morceaux :
+ *        magic     4 octets  "HPCK"
+ *        type      1 octet   TTY_COLLECTOR_CHUNK_xxx
+ *        réservé   3 octets
+ *        len       4 octets  taille des données
+ *        session   8 octets  identifiant de session
+ *        crc       4 octets  crc32 des données
+ *        données   len octets
+ *                  Chaque vidage groupé écrit au plus un morceau par session, les
+ *                  segments se relisent seuls même sans index.
+ *      index       entrées de TTY_COLLECTOR_INDEX_LEN octets, ajoutées après chaque
+ *                  vidage, dans l'ordre du flux de chaque session :
+ *                  session (8), segment (4), len (4), offset des données (8)
+ *      sessions    journal texte, une ligne par ouverture et par fermeture :
+ *                  "open <session> <start µs> <pid> <nom>", "close <session> <octets>"
+ ******************************************************************************/
+#ifndef TTYCOLLECTOR_H
+#define TTYCOLLECTOR_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "ttyRecord.h"
+
+
+#define TTY_COLLECTOR_SOCKET        "/tmp/honeypotCollector.sock"  /* défaut de collector, à donner à HONEYPOT_COLLECTOR */
+#define TTY_COLLECTOR_MAGIC         "HPCL"
+#define TTY_COLLECTOR_VERSION       1
+#define TTY_COLLECTOR_HELLO_LEN     20
+#define TTY_COLLECTOR_NAME_MAX      1024
+#define TTY_COLLECTOR_MESSAGE_MAX   65536   /* sous le tampon d'émission par défaut d'une socket unix */
+
+#define TTY_COLLECTOR_SEGMENT_MAGIC "HPCOLSEG"
+#define TTY_COLLECTOR_SEGMENT_MAGIC_LEN 8
+#define TTY_COLLECTOR_CHUNK_MAGIC   "HPCK"
+#define TTY_COLLECTOR_CHUNK_LEN     24
+#define TTY_COLLECTOR_CHUNK_DATA    0       /* octets de l'enregistrement */
+#define TTY_COLLECTOR_CHUNK_OPEN    1       /* données = message d'ouverture reçu */
+#define TTY_COLLECTOR_CHUNK_CLOSE   2       /* sans données */
+#define TTY_COLLECTOR_INDEX_LEN     24
+
+struct ttyCollectorHello_s {
+    uint32_t  pid;
+    int64_t   start;
+    char      nom[TTY_COLLECTOR_NAME_MAX + 1];
+};
+
+struct ttyCollectorChunk_s {
+    int       type;
+    uint32_t  len;
+    uint64_t  session;
+    uint32_t  crc;
+};
+
+struct ttyCollectorIndexEntry_s {
+    uint64_t  session;
+    uint32_t  segment;
+    uint32_t  len;
+    uint64_t  offset;
+};
+
+
+/* Retourne la taille du message d'ouverture */
+static inline size_t ttyCollectorHelloEncode(uint8_t* out, uint32_t pid, int64_t start, const char* nom) {
+    size_t len = strlen(nom);
+    if (len > TTY_COLLECTOR_NAME_MAX) len = TTY_COLLECTOR_NAME_MAX;
+    memcpy(out, TTY_COLLECTOR_MAGIC, 4);
+    out[4] = TTY_COLLECTOR_VERSION;
+    memset(out + 5, 0, 3);
+    le32Put(out + 8, pid);
+    le64Put(out + 12, start);
+    memcpy(out + TTY_COLLECTOR_HELLO_LEN, nom, len);
+    return TTY_COLLECTOR_HELLO_LEN + len;
+}
+
+static inline int ttyCollectorHelloDecode(const uint8_t* in, size_t len, struct ttyCollectorHello_s* h) {
+    if (len < TTY_COLLECTOR_HELLO_LEN || len > TTY_COLLECTOR_HELLO_LEN + TTY_COLLECTOR_NAME_MAX) return -1;
+    if (memcmp(in, TTY_COLLECTOR_MAGIC, 4) != 0 || in[4] != TTY_COLLECTOR_VERSION) return -1;
+    h->pid   = le32Get(in + 8);
+    h->start = (int64_t)le64Get(in + 12);
+    len -= TTY_COLLECTOR_HELLO_LEN;
+    memcpy(h->nom, in + TTY_COLLECTOR_HELLO_LEN, len);
+    h->nom[len] = 0;
+    return 0;
+}
+
+static inline void ttyCollectorChunkEncode(uint8_t* out, const struct ttyCollectorChunk_s* c) {
+    memcpy(out, TTY_COLLECTOR_CHUNK_MAGIC, 4);
+    out[4] = c->type;
+    memset(out + 5, 0, 3);
+    le32Put(out + 8, c->len);
+    le64Put(out + 12, c->session);
+    le32Put(out + 20, c->crc);
+}
+
+static inline int ttyCollectorChunkDecode(const uint8_t* in, struct ttyCollectorChunk_s* c) {
+    if (memcmp(in, TTY_COLLECTOR_CHUNK_MAGIC, 4) != 0) return -1;
+    c->type    = in[4];
+    c->len     = le32Get(in + 8);
+    c->session = le64Get(in + 12);
+    c->crc     = le32Get(in + 20);
+    return 0;
+}
+
+static inline void ttyCollectorIndexEncode(uint8_t* out, const struct ttyCollectorIndexEntry_s* e) {
+    le64Put(out, e->session);
+    le32Put(out + 8, e->segment);
+    le32Put(out + 12, e->len);
+    le64Put(out + 16, e->offset);
+}
+
+static inline void ttyCollectorIndexDecode(const uint8_t* in, struct ttyCollectorIndexEntry_s* e) {
+    e->session = le64Get(in);
+    e->segment = le32Get(in + 8);
+    e->len     = le32Get(in + 12);
+    e->offset  = le64Get(in + 16);
+}
+
+#endif
@@ -0,0 +1,285 @@
+/******************************************************************************
+ * Lignes de commande, voir ttyCommands.h
+ * Bertrand sept 2024
+ ******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "ttyCommands.h"
+
+
+
+/******************************************************************************
+ * Edition de la ligne
+ */
+
+void commandesInit(struct commandes_s* cs, void (*emet)(const struct commande_s*, void*), void* ctx) {
+    memset(cs, 0, sizeof(*cs));
+    cs->emet = emet;
+    cs->ctx  = ctx;
+}
+
+static void commandeInsere(struct commandes_s* cs, char c) {
+    struct commande_s* l = &cs->courante;
+    if (l->len == COMMANDE_MAX) {
+        l->flags |= COMMANDE_TRONQUEE;
+        return;
+    }
+    memmove(l->texte + cs->curseur + 1, l->texte + cs->curseur, l->len - cs->curseur);
+    l->texte[cs->curseur++] = c;
+    l->len++;
+}
+
+static void commandeRemplace(struct commandes_s* cs, char c) {
+    struct commande_s* l = &cs->courante;
+    if (cs->curseur < l->len) l->texte[cs->curseur++] = c;
+    else commandeInsere(cs, c);
+}
+
+/* Supprime n octets à partir de debut */
+static void commandeSupprime(struct commandes_s* cs, size_t debut, size_t n) {
+    struct commande_s* l = &cs->courante;
+    if (debut >= l->len) return;
+    if (n > l->len - debut) n = l->len - debut;
+    memmove(l->texte + debut, l->texte + debut + n, l->len - debut - n);
+    l->len -= n;
+    if (cs->curseur > debut + n) cs->curseur -= n;
+    else if (cs->curseur > debut) cs->curseur = debut;
+}
+
+/* Caractère UTF-8 précédent ou suivant le curseur */
+static size_t commandeGauche(struct commandes_s* cs, size_t pos) {
+    if (pos == 0) return 0;
+    do pos--; while (pos > 0 && (cs->courante.texte[pos] & 0xc0) == 0x80);
+    return pos;
+}
+
+static size_t commandeDroite(struct commandes_s* cs, size_t pos) {
+    if (pos >= cs->courante.len) return cs->courante.len;
+    do pos++; while (pos < cs->courante.len && (cs->courante.texte[pos] & 0xc0) == 0x80);
+    return pos;
+}
+
+static void commandesEmetPrecedente(struct commandes_s* cs) {
+    if (cs->precedenteValide) cs->emet(&cs->precedente, cs->ctx);
+    cs->precedenteValide = false;
+    cs->precedenteEcho = false;
+}
+
+/*
+ Ligne collée ou envoyée par un script : le texte et l'Entrée arrivent dans le
+ même record, l'écho ne peut venir qu'après la validation. Le premier record du
+ serveur tranche : s'il ne commence pas à renvoyer la ligne, elle est masquée.
+ Sans sortie avant la frappe suivante, rien ne permet de conclure : pas de drapeau.
+*/
+static void commandeEchoValidee(struct commandes_s* cs, const struct ttyRecordView_s* v) {
+    struct commande_s* p = &cs->precedente;
+    size_t n = p->len < 4 ? p->len : 4;
+    if (n > v->len) n = v->len;
+    if (n > 0 && memmem(v->data, v->len, p->texte, n) == NULL) p->flags |= COMMANDE_MASQUEE;
+    cs->precedenteEcho = false;
+}
+
+static void commandeValide(struct commandes_s* cs, const struct ttyRecordView_s* v, int flags) {
+    struct commande_s* l = &cs->courante;
+    if (l->len == 0) {   /* Entrée ou ^C sur une ligne vide */
+        cs->curseur = cs->frappes = cs->echos = 0;
+        cs->enCours = false;
+        l->flags = 0;
+        return;
+    }
+
+    l->validation = v->usec;
+    l->recno      = v->recno;
+    l->offset     = v->offset;
+    l->sortie     = 0;
+    l->flags     |= flags;
+
+    commandesEmetPrecedente(cs);
+    memcpy(&cs->precedente, l, offsetof(struct commande_s, texte) + l->len);
+    cs->precedenteValide = true;
+    cs->precedenteEcho   = cs->frappes > 0 && cs->echos == 0;
+
+    l->len = l->flags = 0;
+    cs->curseur = cs->frappes = cs->echos = 0;
+    cs->enCours = false;
+    cs->attendu = 0;
+}
+
+/* Touche spéciale complète dans cs->touche : ESC [ ... ou ESC O x */
+static void commandeTouche(struct commandes_s* cs) {
+    char final = cs->touche[cs->toucheLen - 1];
+    int  param = atoi(cs->touche + 2);
+    size_t len = cs->courante.len;
+
+    switch (final) {
+        case 'A':   /* haut, bas : historique */
+        case 'B':
+            cs->modeEcho = ECHO_HISTORIQUE;
+            cs->courante.flags |= COMMANDE_INCERTAINE;
+            break;
+        case 'C': cs->curseur = commandeDroite(cs, cs->curseur); break;
+        case 'D': cs->curseur = commandeGauche(cs, cs->curseur); break;
+        case 'H': cs->curseur = 0; break;
+        case 'F': cs->curseur = len; break;
+        case '~':
+            if (param == 1 || param == 7) cs->curseur = 0;
+            else if (param == 4 || param == 8) cs->curseur = len;
+            else if (param == 3) commandeSupprime(cs, cs->curseur, commandeDroite(cs, cs->curseur) - cs->curseur);
+            break;
+    }
+}
+
+/* Frappes du client */
+static void commandesClavier(struct commandes_s* cs, const struct ttyRecordView_s* v) {
+    struct commande_s* l = &cs->courante;
+
+    for (size_t i=0; i<v->len; i++) {
+        uint8_t c = v->data[i];
+
+        if (!cs->enCours && c != '\r' && c != '\n') {
+            /* première frappe : la sortie de la commande précédente est terminée */
+            commandesEmetPrecedente(cs);
+            cs->enCours = true;
+            l->debut = v->usec;
+        }
+
+        if (cs->toucheLen > 0) {
+            if (cs->toucheLen < (int)sizeof(cs->touche) - 1) cs->touche[cs->toucheLen++] = c;
+            cs->touche[cs->toucheLen] = 0;
+            bool fini = cs->toucheLen == 2 ? (c != '[' && c != 'O') : (c >= 0x40 && c <= 0x7e);
+            if (fini) {
+                if (cs->toucheLen > 2) commandeTouche(cs);
+                cs->toucheLen = 0;
+            }
+            continue;
+        }
+
+        cs->modeEcho = ECHO_AUCUN;
+        switch (c) {
+            case '\r':
+            case '\n':
+                commandeValide(cs, v, 0);
+                break;
+            case 0x03:   /* ^C */
+                commandeValide(cs, v, COMMANDE_ANNULEE);
+                break;
+            case 0x7f:   /* effacement arrière */
+            case 0x08:
+                commandeSupprime(cs, commandeGauche(cs, cs->curseur), cs->curseur - commandeGauche(cs, cs->curseur));
+                break;
+            case 0x04:   /* ^D */
+                commandeSupprime(cs, cs->curseur, commandeDroite(cs, cs->curseur) - cs->curseur);
+                break;
+            case 0x01: cs->curseur = 0; break;                                  /* ^A */
+            case 0x05: cs->curseur = l->len; break;                             /* ^E */
+            case 0x02: cs->curseur = commandeGauche(cs, cs->curseur); break;    /* ^B */
+            case 0x06: cs->curseur = commandeDroite(cs, cs->curseur); break;    /* ^F */
+            case 0x0b: commandeSupprime(cs, cs->curseur, l->len - cs->curseur); break;  /* ^K */
+            case 0x15: commandeSupprime(cs, 0, cs->curseur); break;            /* ^U */
+            case 0x17: {                                                        /* ^W */
+                size_t debut = cs->curseur;
+                while (debut > 0 && l->texte[debut - 1] == ' ') debut--;
+                while (debut > 0 && l->texte[debut - 1] != ' ') debut--;
+                commandeSupprime(cs, debut, cs->curseur - debut);
+                break;
+            }
+            case 0x09:   /* tabulation : ce qui est complété n'apparaît que dans l'écho */
+                cs->modeEcho = ECHO_COMPLETION;
+                break;
+            case 0x12:   /* ^R, ^P, ^N : recherche et historique */
+            case 0x10:
+            case 0x0e:
+                cs->modeEcho = ECHO_HISTORIQUE;
+                l->flags |= COMMANDE_INCERTAINE;
+                break;
+            case 0x1b:
+                cs->touche[0] = c;
+                cs->toucheLen = 1;
+                break;
+            default:
+                if (c >= 0x20) {
+                    commandeInsere(cs, c);
+                    cs->frappes++;
+                    cs->attendu = c;
+                }
+        }
+    }
+}
+
+/* Sortie du serveur : écho des frappes, ou sortie de la commande validée */
+static void commandesEcho(struct commandes_s* cs, const struct ttyRecordView_s* v) {
+    if (!cs->enCours) {
+        if (cs->precedenteEcho) commandeEchoValidee(cs, v);
+        if (cs->precedenteValide) cs->precedente.sortie += v->len;
+        return;
+    }
+
+    if (cs->attendu && v->len > 0 && memchr(v->data, cs->attendu, v->len)) cs->echos++;
+    cs->attendu = 0;
+
+    for (size_t i=0; i<v->len && cs->modeEcho != ECHO_AUCUN; i++) {
+        uint8_t c = v->data[i];
+
+        if (cs->sequenceLen > 0) {
+            if (cs->sequenceLen < (int)sizeof(cs->sequence) - 1) cs->sequence[cs->sequenceLen++] = c;
+            cs->sequence[cs->sequenceLen] = 0;
+            if (cs->sequenceLen > 2 && c >= 0x40 && c <= 0x7e) {
+                /* l'écho redessine la ligne : déplacements et effacement de fin de ligne */
+                int n = atoi(cs->sequence + 2);
+                if (n == 0) n = 1;
+                if (c == 'K') commandeSupprime(cs, cs->curseur, cs->courante.len - cs->curseur);
+                else if (c == 'C') while (n-- > 0) cs->curseur = commandeDroite(cs, cs->curseur);
+                else if (c == 'D') while (n-- > 0) cs->curseur = commandeGauche(cs, cs->curseur);
+                else if (c == 'P') while (n-- > 0) commandeSupprime(cs, cs->curseur, commandeDroite(cs, cs->curseur) - cs->curseur);
+                cs->sequenceLen = 0;
+            } else if (cs->sequenceLen == 2 && c != '[') {
+                cs->sequenceLen = 0;
+            }
+            continue;
+        }
+
+        if (c == 0x1b) {
+            cs->sequence[0] = c;
+            cs->sequenceLen = 1;
+        } else if (c == 0x08) {
+            cs->curseur = commandeGauche(cs, cs->curseur);
+        } else if (c == '\r' || c == '\n') {
+            /* liste de candidats, ou ligne redessinée avec l'invite : on ne suit plus */
+            cs->courante.flags |= COMMANDE_INCERTAINE;
+            cs->modeEcho = ECHO_AUCUN;
+        } else if (c >= 0x20) {
+            if (cs->modeEcho == ECHO_COMPLETION) commandeInsere(cs, c);
+            else commandeRemplace(cs, c);
+        }
+    }
+}
+
+/* Etage de traitement : reçoit tous les records dans l'ordre */
+void commandesRecord(struct commandes_s* cs, const struct ttyRecordView_s* v) {
+    if (v->type == TTY_RECORD_CLIENT_TO_SERVER) commandesClavier(cs, v);
+    else if (v->type == TTY_RECORD_SERVER_TO_CLIENT) commandesEcho(cs, v);
+}
+
+/* Fin de session : la dernière ligne validée, puis celle en cours si elle n'est pas vide */
+void commandesFin(struct commandes_s* cs, const struct ttyRecordView_s* dernier) {
+    commandesEmetPrecedente(cs);
+    if (cs->enCours) {
+        commandeValide(cs, dernier, 0);
+        commandesEmetPrecedente(cs);
+    }
+}
+
+/* Drapeaux lisibles : 4 lettres ou tirets, dans l'ordre m a i t */
+void commandeFlags(const struct commande_s* commande, char flags[5]) {
+    flags[0] = commande->flags & COMMANDE_MASQUEE    ? 'm' : '-';
+    flags[1] = commande->flags & COMMANDE_ANNULEE    ? 'a' : '-';
+    flags[2] = commande->flags & COMMANDE_INCERTAINE ? 'i' : '-';
+    flags[3] = commande->flags & COMMANDE_TRONQUEE   ? 't' : '-';
+    flags[4] = 0;
+}
@@ -0,0 +1,76 @@
+/******************************************************************************
+ * Lignes de commande : les frappes du client et leur écho par le serveur sont
+ * des records séparés, un par octet ou presque. Cet étage les fusionne en une
+ * passe et en mémoire constante : la ligne est reconstituée à partir des
+ * frappes (effacement, déplacements, ^U, ^W...), complétée par l'écho quand
+ * seule la sortie du serveur dit ce qui a été inséré (tabulation, historique),
+ * puis émise une fois validée, avec la taille de la sortie qui suit.
+ *
+ * L'émission d'une ligne attend la première frappe de la suivante (ou la fin de
+ * session) : c'est là que la taille de sa sortie est connue.
+ * Bertrand sept 2024
+ ******************************************************************************/
+#ifndef TTYCOMMANDS_H
+#define TTYCOMMANDS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "ttyRecordReader.h"
+
+
+#define COMMANDE_MAX 4096
+
+#define COMMANDE_MASQUEE     1   /* aucune frappe renvoyée en écho, ni après la validation : mot de passe probable */
+#define COMMANDE_ANNULEE     2   /* abandonnée par ^C */
+#define COMMANDE_INCERTAINE  4   /* complétion ou historique, reconstituée depuis l'écho */
+#define COMMANDE_TRONQUEE    8   /* plus longue que COMMANDE_MAX */
+
+struct commande_s {
+    int64_t  debut;        /* µs, première frappe */
+    int64_t  validation;   /* µs, Entrée (ou ^C) */
+    uint64_t recno;        /* record de la validation */
+    size_t   offset;       /* son offset dans le fichier (ou celui de sa trame) */
+    size_t   sortie;       /* octets affichés après la validation, jusqu'à la frappe suivante */
+    int      flags;        /* COMMANDE_xxx */
+    size_t   len;
+    char     texte[COMMANDE_MAX];
+};
+
+enum { ECHO_AUCUN, ECHO_COMPLETION, ECHO_HISTORIQUE };
+
+struct commandes_s {
+    struct commande_s  courante;     /* en cours de frappe */
+    struct commande_s  precedente;   /* validée, sortie en cours de comptage */
+    bool     precedenteValide;
+    bool     precedenteEcho;         /* pas d'écho pendant la frappe : masquage décidé par la sortie qui suit */
+    bool     enCours;                /* au moins une frappe dans la ligne courante */
+    size_t   curseur;
+    unsigned frappes;                /* caractères imprimables tapés */
+    unsigned echos;                  /* dont renvoyés par le serveur */
+    char     attendu;                /* dernier caractère tapé, pas encore vu en écho */
+
+    /* séquence d'échappement en cours, côté clavier et côté écho */
+    char     touche[16];
+    int      toucheLen;
+    char     sequence[16];
+    int      sequenceLen;
+    int      modeEcho;               /* ECHO_xxx : ce que l'écho doit apporter à la ligne */
+
+    void   (*emet)(const struct commande_s* commande, void* ctx);
+    void*    ctx;
+};
+
+void commandesInit(struct commandes_s* cs, void (*emet)(const struct commande_s*, void*), void* ctx);
+
+/* Etage de traitement : reçoit tous les records dans l'ordre */
+void commandesRecord(struct commandes_s* cs, const struct ttyRecordView_s* v);
+
+/* Fin de session : la dernière ligne validée, puis celle en cours si elle n'est pas vide */
+void commandesFin(struct commandes_s* cs, const struct ttyRecordView_s* dernier);
+
+/* Drapeaux lisibles : 4 lettres ou tirets, dans l'ordre m a i t */
+void commandeFlags(const struct commande_s* commande, char flags[5]);
+
+#endif
@@ -0,0 +1,103 @@
+/******************************************************************************
+ * Moteur multi-sessions : protocole entre honeypotShim et honeypotSsh --engine
+ * Bertrand sept 2024
+ *
+ * Connexion : socket unix SOCK_SEQPACKET, une par session. Le moteur n'accepte
+ * que les shims de son propre uid (SO_PEERCRED), qui donne aussi leur pid.
+ *      Premier message, shim -> moteur, TTY_ENGINE_HELLO_LEN octets puis les chaînes :
+ *        magic     4 octets  "HPEN"
+ *        version   1 octet   1
+ *        réservé   3 octets  à 0
+ *        ppid      4 octets  petit boutiste, sshd
+ *        sid       4 octets
+ *        pgid      4 octets
+ *        argc      4 octets
+ *        envc      4 octets
+ *        chaînes   argc arguments puis envc variables "NOM=valeur", terminés par 0
+ *      accompagné en SCM_RIGHTS de TTY_ENGINE_FDS descripteurs : stdin, stdout,
+ *      stderr, et le répertoire courant (O_PATH) où lancer le shell.
+ *      Messages suivants, TTY_ENGINE_MESSAGE_LEN octets dans les deux sens :
+ *        type      1 octet   TTY_ENGINE_xxx
+ *        réservé   3 octets
+ *        valeur    4 octets  petit boutiste
+ *      moteur -> shim : ACCEPTE (session prise en charge) ou REFUSE (le shim lance
+ *      honeypotSsh lui-même), puis FIN avec le code de sortie du shell.
+ *      shim -> moteur : WINCH quand la taille de son terminal change.
+ *      Fin de connexion côté shim = fin de session.
+ ******************************************************************************/
+#ifndef TTYENGINE_H
+#define TTYENGINE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "ttyRecord.h"
+
+
+#define TTY_ENGINE_SOCKET        "/tmp/honeypotEngine.sock"  /* défaut du moteur et du shim (HONEYPOT_ENGINE) */
+#define TTY_ENGINE_MAGIC         "HPEN"
+#define TTY_ENGINE_VERSION       1
+#define TTY_ENGINE_HELLO_LEN     28
+#define TTY_ENGINE_HELLO_MAX     65536   /* entête et chaînes ; au delà, le shim lance honeypotSsh lui-même */
+#define TTY_ENGINE_FDS           4
+#define TTY_ENGINE_MESSAGE_LEN   8
+
+#define TTY_ENGINE_ACCEPTE       1
+#define TTY_ENGINE_REFUSE        2
+#define TTY_ENGINE_FIN           3
+#define TTY_ENGINE_WINCH         4
+
+struct ttyEngineHello_s {
+    uint32_t  ppid;
+    uint32_t  sid;
+    uint32_t  pgid;
+    uint32_t  argc;
+    uint32_t  envc;
+    char*     chaines;   /* argc + envc chaînes consécutives, dans le message */
+};
+
+
+static inline void ttyEngineHelloEncode(uint8_t* out, uint32_t ppid, uint32_t sid, uint32_t pgid, uint32_t argc, uint32_t envc) {
+    memcpy(out, TTY_ENGINE_MAGIC, 4);
+    out[4] = TTY_ENGINE_VERSION;
+    memset(out + 5, 0, 3);
+    le32Put(out + 8,  ppid);
+    le32Put(out + 12, sid);
+    le32Put(out + 16, pgid);
+    le32Put(out + 20, argc);
+    le32Put(out + 24, envc);
+}
+
+/* Vérifie aussi que les argc + envc chaînes sont toutes dans le message */
+static inline int ttyEngineHelloDecode(uint8_t* in, size_t len, struct ttyEngineHello_s* h) {
+    if (len < TTY_ENGINE_HELLO_LEN || len > TTY_ENGINE_HELLO_MAX) return -1;
+    if (memcmp(in, TTY_ENGINE_MAGIC, 4) != 0 || in[4] != TTY_ENGINE_VERSION) return -1;
+    h->ppid    = le32Get(in + 8);
+    h->sid     = le32Get(in + 12);
+    h->pgid    = le32Get(in + 16);
+    h->argc    = le32Get(in + 20);
+    h->envc    = le32Get(in + 24);
+    h->chaines = (char*)in + TTY_ENGINE_HELLO_LEN;
+    if (h->argc == 0 || h->argc > len || h->envc > len) return -1;
+
+    size_t nb = 0;
+    for (size_t i = TTY_ENGINE_HELLO_LEN; i < len; i++) {
+        if (in[i] == 0) nb++;
+    }
+    return (nb == h->argc + h->envc && in[len-1] == 0) ? 0 : -1;
+}
+
+static inline void ttyEngineMessageEncode(uint8_t* out, int type, uint32_t valeur) {
+    out[0] = type;
+    memset(out + 1, 0, 3);
+    le32Put(out + 4, valeur);
+}
+
+static inline int ttyEngineMessageDecode(const uint8_t* in, size_t len, uint32_t* valeur) {
+    if (len != TTY_ENGINE_MESSAGE_LEN) return -1;
+    *valeur = le32Get(in + 4);
+    return in[0];
+}
+
+#endif
@@ -0,0 +1,414 @@
+/******************************************************************************
+ * Export asciicast v2 et ttyrec, voir ttyExport.h
+ * Bertrand sept 2024
+ ******************************************************************************/
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#ifdef __SSE2__
+#include <emmintrin.h>       /* recherche vectorisée des caractères à échapper */
+#endif
+
+#include "ttyRecord.h"
+#include "ttyExport.h"
+
+
+#define EXPORT_VALEUR_MAX  256   /* valeur reprise du record START dans l'entête asciicast */
+
+
+
+/******************************************************************************
+ * Sortie tamponnée
+ */
+
+static void exportVide(struct ttyExport_s* e) {
+    size_t fait = 0;
+    while (fait < e->len && !e->erreur) {
+        ssize_t r = write(e->fd, e->tampon + fait, e->len - fait);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) e->erreur = true;
+        else fait += r;
+    }
+    e->octets += fait;
+    e->len = 0;
+}
+
+/* Au moins n octets libres dans le tampon */
+static inline void exportPlace(struct ttyExport_s* e, size_t n) {
+    if (TTY_EXPORT_TAMPON - e->len < n) exportVide(e);
+}
+
+static void exportEcrit(struct ttyExport_s* e, const void* p, size_t n) {
+    if (n > TTY_EXPORT_TAMPON / 2) {
+        /* gros record : écrit directement plutôt que recopié */
+        exportVide(e);
+        size_t fait = 0;
+        while (fait < n && !e->erreur) {
+            ssize_t r = write(e->fd, (const uint8_t*)p + fait, n - fait);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) e->erreur = true;
+            else fait += r;
+        }
+        e->octets += fait;
+        return;
+    }
+    exportPlace(e, n);
+    memcpy(e->tampon + e->len, p, n);
+    e->len += n;
+}
+
+static inline void exportOctet(struct ttyExport_s* e, uint8_t c) {
+    e->tampon[e->len++] = c;
+}
+
+/* Entier décimal, sans passer par printf : un appel par événement */
+static void exportEntier(struct ttyExport_s* e, uint64_t v, int chiffres) {
+    char tmp[24];
+    int n = 0;
+    do {
+        tmp[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v || n < chiffres);
+    while (n) exportOctet(e, tmp[--n]);
+}
+
+
+
+/******************************************************************************
+ * Chaînes JSON
+ */
+
+/* Séquence UTF-8 en p : sa longueur si elle est complète et valide, 0 si elle est coupée par la fin, -1 si invalide */
+static int utf8Sequence(const uint8_t* p, size_t len) {
+    uint8_t c = p[0];
+    int suite = c >= 0xc2 && c <= 0xdf ? 1 : c >= 0xe0 && c <= 0xef ? 2 : c >= 0xf0 && c <= 0xf4 ? 3 : -1;
+    if (suite < 0) return -1;
+    for (int k=1; k<=suite; k++) {
+        if ((size_t)k >= len) return 0;
+        if ((p[k] & 0xc0) != 0x80) return -1;
+    }
+    return suite + 1;
+}
+
+/* Un caractère à échapper, ou une séquence UTF-8 ; retourne les octets consommés, 0 si la séquence est coupée par la fin */
+static size_t jsonSpecial(struct ttyExport_s* e, const uint8_t* p, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    uint8_t c = p[0];
+
+    if (c >= 0x80) {
+        int n = utf8Sequence(p, len);
+        if (n == 0) return 0;
+        if (n > 0) {
+            memcpy(e->tampon + e->len, p, n);
+            e->len += n;
+            return n;
+        }
+        memcpy(e->tampon + e->len, "\\ufffd", 6);
+        e->len += 6;
+        return 1;
+    }
+
+    exportOctet(e, '\\');
+    switch (c) {
+        case '"':  exportOctet(e, '"');  break;
+        case '\\': exportOctet(e, '\\'); break;
+        case '\n': exportOctet(e, 'n');  break;
+        case '\r': exportOctet(e, 'r');  break;
+        case '\t': exportOctet(e, 't');  break;
+        case '\b': exportOctet(e, 'b');  break;
+        case '\f': exportOctet(e, 'f');  break;
+        default:
+            memcpy(e->tampon + e->len, "u00", 3);
+            e->len += 3;
+            exportOctet(e, hex[c >> 4]);
+            exportOctet(e, hex[c & 15]);
+    }
+    return 1;
+}
+
+/*
+ Contenu d'une chaîne JSON. Les octets ordinaires sont recopiés par blocs de
+ 16 : une comparaison vectorielle repère les contrôles, '"', '\' et DEL, et les
+ octets >= 0x80 (négatifs en comparaison signée, donc pris avec les contrôles),
+ seuls à passer par jsonSpecial(). Un caractère UTF-8 coupé par la fin du
+ record est gardé dans reste et recollé au record suivant du même sens.
+ */
+static void jsonEchappe(struct ttyExport_s* e, int sens, const uint8_t* p, size_t len) {
+    size_t i = 0;
+
+    if (e->resteLen[sens] > 0) {
+        uint8_t tmp[8];
+        size_t r = e->resteLen[sens];
+        size_t k = len < 4 ? len : 4;
+        memcpy(tmp, e->reste[sens], r);
+        memcpy(tmp + r, p, k);
+        int n = utf8Sequence(tmp, r + k);
+        exportPlace(e, 8);
+        if (n == 0) {
+            /* toujours incomplet : tout le record rejoint le reste */
+            memcpy(e->reste[sens] + r, p, len);
+            e->resteLen[sens] += len;
+            return;
+        }
+        if (n > 0) {
+            memcpy(e->tampon + e->len, tmp, n);
+            e->len += n;
+            i = n - r;
+        } else {
+            memcpy(e->tampon + e->len, "\\ufffd", 6);
+            e->len += 6;
+        }
+        e->resteLen[sens] = 0;
+    }
+
+#ifdef __SSE2__
+    const __m128i espace    = _mm_set1_epi8(0x20);
+    const __m128i guillemet = _mm_set1_epi8('"');
+    const __m128i barre     = _mm_set1_epi8('\\');
+    const __m128i del       = _mm_set1_epi8(0x7f);
+
+    while (i + 16 <= len) {
+        exportPlace(e, 16);
+        __m128i bloc = _mm_loadu_si128((const __m128i*)(p + i));
+        __m128i special = _mm_or_si128(_mm_cmplt_epi8(bloc, espace),
+                          _mm_or_si128(_mm_cmpeq_epi8(bloc, guillemet),
+                          _mm_or_si128(_mm_cmpeq_epi8(bloc, barre), _mm_cmpeq_epi8(bloc, del))));
+        int bits = _mm_movemask_epi8(special);
+        if (bits == 0) {
+            _mm_storeu_si128((__m128i*)(e->tampon + e->len), bloc);
+            e->len += 16;
+            i += 16;
+            continue;
+        }
+        /* les octets ordinaires avant le premier spécial, puis lui */
+        int j = __builtin_ctz(bits);
+        memcpy(e->tampon + e->len, p + i, j);
+        e->len += j;
+        i += j;
+        exportPlace(e, 8);
+        size_t n = jsonSpecial(e, p + i, len - i);
+        if (n == 0) break;
+        i += n;
+    }
+#endif
+
+    while (i < len) {
+        exportPlace(e, 8);
+        uint8_t c = p[i];
+        if (c >= 0x20 && c != '"' && c != '\\' && c != 0x7f && c < 0x80) {
+            exportOctet(e, c);
+            i++;
+            continue;
+        }
+        size_t n = jsonSpecial(e, p + i, len - i);
+        if (n == 0) break;
+        i += n;
+    }
+
+    /* caractère coupé par la fin du record */
+    if (i < len) {
+        memcpy(e->reste[sens], p + i, len - i);
+        e->resteLen[sens] = len - i;
+    }
+}
+
+static void jsonChaineCourte(struct ttyExport_s* e, const char* s, size_t len) {
+    exportPlace(e, 2);
+    exportOctet(e, '"');
+    jsonEchappe(e, 0, (const uint8_t*)s, len);
+    e->resteLen[0] = 0;
+    exportPlace(e, 1);
+    exportOctet(e, '"');
+}
+
+
+
+/******************************************************************************
+ * asciicast v2
+ */
+
+/* Valeur d'une ligne "cle: valeur" du record START, copiée dans out */
+static void exportValeurStart(const struct ttyRecordView_s* v, const char* cle, char* out) {
+    size_t lcle = strlen(cle);
+    const char* p = v->data;
+    const char* fin = v->data + v->len;
+    while (p < fin) {
+        const char* eol = memchr(p, '\n', fin - p);
+        if (eol == NULL) eol = fin;
+        if ((size_t)(eol - p) > lcle + 1 && memcmp(p, cle, lcle) == 0 && p[lcle] == ':' && p[lcle+1] == ' ') {
+            size_t n = eol - p - lcle - 2;
+            if (n >= EXPORT_VALEUR_MAX) n = EXPORT_VALEUR_MAX - 1;
+            memcpy(out, p + lcle + 2, n);
+            out[n] = 0;
+            return;
+        }
+        p = eol + 1;
+    }
+}
+
+/* [t, "code", "...données */
+static void asciicastDebut(struct ttyExport_s* e, int64_t usec, char code) {
+    if (usec < 0) usec = 0;
+    exportPlace(e, 48);
+    exportOctet(e, '[');
+    exportEntier(e, usec / 1000000, 1);
+    exportOctet(e, '.');
+    exportEntier(e, usec % 1000000, 6);
+    memcpy(e->tampon + e->len, ", \"", 3);
+    e->len += 3;
+    exportOctet(e, code);
+    memcpy(e->tampon + e->len, "\", \"", 4);
+    e->len += 4;
+}
+
+static void asciicastFin(struct ttyExport_s* e) {
+    exportPlace(e, 3);
+    memcpy(e->tampon + e->len, "\"]\n", 3);
+    e->len += 3;
+    e->records++;
+}
+
+/* Entête : taille du terminal et shell, pris au début de l'enregistrement */
+static void asciicastEntete(struct ttyExport_s* e, struct ttyRecordMap_s* map, unsigned* lignes, unsigned* colonnes) {
+    struct ttyRecordCursor_s c;
+    struct ttyRecordView_s v;
+    char shell[EXPORT_VALEUR_MAX] = "";
+    char buffer[128];
+
+    *lignes   = TTY_EXPORT_LIGNES;
+    *colonnes = TTY_EXPORT_COLONNES;
+    ttyRecordCursorInit(&c, map, false);
+    while (ttyRecordCursorNext(&c, &v)) {
+        if (v.type == TTY_RECORD_START) {
+            exportValeurStart(&v, "SHELL", shell);
+            exportValeurStart(&v, "childShell", shell);
+        } else if (v.type == TTY_RECORD_WINSIZE) {
+            unsigned l, k;
+            if (ttyRecordWinsizeDecode((const uint8_t*)v.data, v.len, &l, &k) == 0 && l > 0 && k > 0) {
+                *lignes   = l;
+                *colonnes = k;
+            }
+            break;
+        } else if (v.type == TTY_RECORD_SERVER_TO_CLIENT || v.type == TTY_RECORD_CLIENT_TO_SERVER) {
+            break;
+        }
+    }
+    ttyRecordCursorClose(&c);
+
+    snprintf(buffer, sizeof(buffer), "{\"version\": 2, \"width\": %u, \"height\": %u, \"timestamp\": %lld, \"env\": {",
+             *colonnes, *lignes, (long long)(map->start / 1000000));
+    exportEcrit(e, buffer, strlen(buffer));
+    if (shell[0]) {
+        exportEcrit(e, "\"SHELL\": ", 9);
+        jsonChaineCourte(e, shell, strlen(shell));
+    }
+    exportEcrit(e, "}}\n", 3);
+}
+
+static void asciicastSession(struct ttyExport_s* e, struct ttyRecordMap_s* map) {
+    struct ttyRecordCursor_s c;
+    struct ttyRecordView_s v;
+    unsigned lignes, colonnes;
+
+    asciicastEntete(e, map, &lignes, &colonnes);
+    ttyRecordCursorInit(&c, map, false);
+    while (ttyRecordCursorNext(&c, &v) && !e->erreur) {
+        int64_t t = v.usec - map->start;
+        switch (v.type) {
+            case TTY_RECORD_SERVER_TO_CLIENT:
+            case TTY_RECORD_CLIENT_TO_SERVER: {
+                int sens = v.type == TTY_RECORD_SERVER_TO_CLIENT ? 0 : 1;
+                asciicastDebut(e, t, sens == 0 ? 'o' : 'i');
+                jsonEchappe(e, sens, (const uint8_t*)v.data, v.len);
+                asciicastFin(e);
+                break;
+            }
+
+            case TTY_RECORD_WINSIZE: {
+                unsigned l, k;
+                if (ttyRecordWinsizeDecode((const uint8_t*)v.data, v.len, &l, &k) < 0 || l == 0 || k == 0) break;
+                if (l == lignes && k == colonnes) break;
+                lignes   = l;
+                colonnes = k;
+                asciicastDebut(e, t, 'r');
+                exportPlace(e, 24);
+                exportEntier(e, colonnes, 1);
+                exportOctet(e, 'x');
+                exportEntier(e, lignes, 1);
+                asciicastFin(e);
+                break;
+            }
+
+            default:
+                break;
+        }
+    }
+    ttyRecordCursorClose(&c);
+}
+
+
+
+/******************************************************************************
+ * ttyrec
+ */
+
+static void ttyrecSession(struct ttyExport_s* e, struct ttyRecordMap_s* map) {
+    struct ttyRecordCursor_s c;
+    struct ttyRecordView_s v;
+
+    ttyRecordCursorInit(&c, map, false);
+    while (ttyRecordCursorNext(&c, &v) && !e->erreur) {
+        if (v.type != TTY_RECORD_SERVER_TO_CLIENT || v.len == 0) continue;
+        uint8_t entete[12];
+        le32Put(entete,     (uint32_t)(v.usec / 1000000));
+        le32Put(entete + 4, (uint32_t)(v.usec % 1000000));
+        le32Put(entete + 8, (uint32_t)v.len);
+        exportEcrit(e, entete, sizeof(entete));
+        exportEcrit(e, v.data, v.len);
+        e->records++;
+    }
+    ttyRecordCursorClose(&c);
+}
+
+
+
+/******************************************************************************
+ * Session
+ */
+
+void ttyExportInit(struct ttyExport_s* e, int format) {
+    memset(e, 0, sizeof(*e));
+    e->format = format;
+    e->tampon = malloc(TTY_EXPORT_TAMPON);
+    if (e->tampon == NULL) {
+        perror("Erreur sur malloc() ");
+        abort();
+    }
+}
+
+int ttyExportSession(struct ttyExport_s* e, struct ttyRecordMap_s* map, int fd) {
+    e->fd = fd;
+    e->erreur = false;
+    e->len = 0;
+    e->resteLen[0] = e->resteLen[1] = 0;
+
+    if (e->format == TTY_EXPORT_TTYREC) ttyrecSession(e, map);
+    else asciicastSession(e, map);
+    exportVide(e);
+    return e->erreur ? -1 : 0;
+}
+
+void ttyExportFree(struct ttyExport_s* e) {
+    free(e->tampon);
+    e->tampon = NULL;
+}
+
+const char* ttyExportExtension(int format) {
+    return format == TTY_EXPORT_TTYREC ? ".ttyrec" : ".cast";
+}
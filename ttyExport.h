@@ -0,0 +1,65 @@
+/******************************************************************************
+ * Export des enregistrements vers les formats des lecteurs courants
+ * Bertrand sept 2024
+ *
+ * asciicast v2 (asciinema) : une ligne d'entête JSON, puis un événement par
+ * ligne, [secondes depuis le début, code, "données"] :
+ *   {"version": 2, "width": 80, "height": 24, "timestamp": 1726000000, "env": {"SHELL": "/bin/sh"}}
+ *   [0.248213, "o", "$ "]            sortie du serveur
+ *   [1.503177, "i", "ls\r"]          frappe du client
+ *   [2.000412, "r", "120x40"]        changement de taille (SIGWINCH)
+ * La taille de l'entête est celle du premier record WINSIZE, s'il précède la
+ * première sortie (80x24 sinon). Les données sont des chaînes JSON : UTF-8
+ * invalide remplacé par U+FFFD, un caractère coupé entre deux records recollé.
+ *
+ * ttyrec (ttyrec, ttyplay, ipbt...) : pour chaque record de sortie du serveur,
+ * secondes et microsecondes de l'horodatage absolu puis longueur, en entiers
+ * 32 bits petit-boutistes, suivis des données. Pas de taille de terminal.
+ *
+ * Au fil de l'eau : un record lu, un record écrit dans un tampon de
+ * TTY_EXPORT_TAMPON octets vidé par write(). La mémoire ne dépend pas de la
+ * taille de la session.
+ ******************************************************************************/
+#ifndef TTYEXPORT_H
+#define TTYEXPORT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "ttyRecordReader.h"
+
+
+#define TTY_EXPORT_ASCIICAST  0
+#define TTY_EXPORT_TTYREC     1
+
+#define TTY_EXPORT_TAMPON     (1 << 20)
+#define TTY_EXPORT_LIGNES     24     /* taille sans record WINSIZE au début */
+#define TTY_EXPORT_COLONNES   80
+
+struct ttyExport_s {
+    int      format;
+    int      fd;
+    bool     erreur;          /* une écriture a échoué, errno gardé */
+    uint8_t* tampon;
+    size_t   len;
+
+    /* asciicast : début de caractère UTF-8 en fin du record précédent, par sens */
+    uint8_t  reste[2][4];
+    size_t   resteLen[2];
+
+    uint64_t records;         /* exportés */
+    uint64_t octets;          /* écrits */
+};
+
+void ttyExportInit(struct ttyExport_s* e, int format);
+
+/* Exporte la session vers fd ; -1 si une écriture a échoué. Le tampon resert d'une session à l'autre */
+int  ttyExportSession(struct ttyExport_s* e, struct ttyRecordMap_s* map, int fd);
+
+void ttyExportFree(struct ttyExport_s* e);
+
+/* Extension des fichiers produits pour ce format */
+const char* ttyExportExtension(int format);
+
+#endif
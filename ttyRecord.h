@@ -0,0 +1,341 @@
+/******************************************************************************
+ * Format des fichiers d'enregistrement tty, partagé par honeypotSsh et replay
+ * Bertrand sept 2024
+ *
+ * v1 : suite brute de struct ttyRecordEntry_s, 32 octets d'entête par record,
+ *      sans magic ni version. Toujours relu par replay.
+ *
+ * v2 : un entête de fichier de TTY_RECORD_FILE_HEADER_LEN octets
+ *        magic     8 octets  "HPTTYREC"
+ *        version   1 octet   2
+ *        flags     1 octet
+ *        réservé   6 octets  à 0
+ *        start     8 octets  µs depuis l'epoch, petit boutiste
+ *      puis pour chaque record
+ *        type      1 octet   TTY_RECORD_xxx
+ *        len       varint
+ *        delta     varint zigzag, µs depuis le record précédent (depuis start pour le premier)
+ *        data      len octets
+ *      Une frappe clavier tient ainsi en 6 ou 7 octets au lieu de 33.
+ *
+ * v2 compressé (flag TTY_RECORD_FLAG_DEFLATE) : après l'entête de fichier, une
+ *      suite de trames, chacune décodable seule :
+ *        magic     4 octets  "HPFR"
+ *        méthode   1 octet   0 = stockée telle quelle, 1 = deflate (zlib)
+ *        réservé   3 octets
+ *        clen      4 octets  taille des données de la trame
+ *        ulen      4 octets  taille une fois décompressées
+ *        start     8 octets  µs, base du delta du premier record de la trame
+ *        recno     8 octets  numéro du premier record de la trame
+ *        crc       4 octets  crc32 des données de la trame
+ *        hcrc      4 octets  crc32 des 36 octets précédents
+ *        données   clen octets : des records v2, jamais coupés entre deux trames
+ *      Une session interrompue laisse toutes ses trames complètes lisibles, et un
+ *      lecteur peut partir du milieu du fichier en cherchant le magic suivant.
+ *
+ * v2 avec crc (flag TTY_RECORD_FLAG_CRC) : mêmes trames, toutes stockées sans
+ *      compression, une par écriture du tampon d'enregistrement. Le crc permet
+ *      de reconnaître une fin déchirée ou une zone abîmée, et de la sauter.
+ *
+ * v2 archivé (flag TTY_RECORD_FLAG_CHUNKS, avec TTY_RECORD_FLAG_DEFLATE) : réécrit
+ *      par archive, la sortie du serveur est rangée dans un magasin de morceaux
+ *      partagé entre les sessions, voir ttyChunks.h.
+ *
+ * Index (v2) : à la fermeture, un record TTY_RECORD_INDEX donne pour des points
+ *      espacés d'au moins TTY_RECORD_INDEX_EVERY octets l'offset d'un record (ou
+ *      d'une trame), son numéro et la base de son delta. Il est suivi d'un record
+ *      TTY_RECORD_INDEX_TRAILER de taille fixe, les TTY_RECORD_TRAILER_LEN derniers
+ *      octets du fichier, qui donne l'offset de l'index. En mode compressé, index
+ *      et trailer sont dans une dernière trame stockée sans compression.
+ *      Un lecteur séquentiel les voit comme des records ordinaires.
+ ******************************************************************************/
+#ifndef TTYRECORD_H
+#define TTYRECORD_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <zlib.h>            /* crc32(), compression des trames */
+
+
+#define TTY_RECORD_STDIN       0
+#define TTY_RECORD_STDOUT      1
+#define TTY_RECORD_STDERR      2
+
+#define TTY_RECORD_SERVER_TO_CLIENT  3
+#define TTY_RECORD_CLIENT_TO_SERVER  4
+#define TTY_RECORD_NONE              5 /* il ne se passe rien, log juste pour vérifier que rien n'est mort. En lien avec le timeout de poll() */
+
+#define TTY_RECORD_START       21 /* lancement du bastion */
+#define TTY_RECORD_EXIT        22 /* le terminal se ferme, le shell fils a fait exit()      data=son code de retour */
+#define TTY_RECORD_WINSIZE     23 /* taille du terminal client, au début puis à chaque changement    data=lignes, colonnes */
+
+#define TTY_RECORD_FILE_UPLOAD   11  /* fichier déposé par le client, ajouté par replay --files --insert   data=sha256, taille, méthode, nom : voir ttyTransfers.h */
+#define TTY_RECORD_FILE_DOWNLOAD 12  /* fichier récupéré par le client, idem */
+
+#define TTY_RECORD_INDEX         30  /* index clairsemé écrit à la fermeture, voir plus bas */
+#define TTY_RECORD_INDEX_TRAILER 31  /* tout dernier record : offset de l'index */
+
+#define TTY_RECORD_CHUNK_STORE   32  /* v2 archivé, premier record : chemin du magasin de morceaux */
+#define TTY_RECORD_CHUNKED       33  /* record SERVER_TO_CLIENT dont les données sont dans le magasin, voir ttyChunks.h */
+
+#define TTY_RECORD_AUDIT_EXECVE  40  /* ajoutés par auditMerge : événement d'audit du noyau de la session, voir ttyAudit.h   data=ses lignes d'audit.log */
+#define TTY_RECORD_AUDIT_SYSCALL 41  /* idem, appel système audité autre qu'un execve */
+
+#define TTY_AUDIT_SES_INCONNUE   "4294967295"   /* /proc/<pid>/sessionid hors de toute session d'audit */
+
+
+/* v1 */
+struct ttyRecordEntry_s {
+    time_t       tv_sec;
+    suseconds_t  tv_usec;
+    int          type;
+    size_t       len;
+    char         data[];
+};
+
+
+#define TTY_RECORD_MAGIC            "HPTTYREC"
+#define TTY_RECORD_MAGIC_LEN        8
+#define TTY_RECORD_VERSION          2
+#define TTY_RECORD_FILE_HEADER_LEN  24
+#define TTY_RECORD_HEADER_MAX       21   /* type + 2 varints de 10 octets au plus */
+
+#define TTY_RECORD_FLAG_DEFLATE     1    /* flags de l'entête de fichier : trames compressées */
+#define TTY_RECORD_FLAG_CRC         2    /* trames stockées, pour leur crc */
+#define TTY_RECORD_FLAG_FRAMES      (TTY_RECORD_FLAG_DEFLATE | TTY_RECORD_FLAG_CRC)   /* l'un ou l'autre : fichier en trames */
+#define TTY_RECORD_FLAG_CHUNKS      4    /* archivé : sortie du serveur dans un magasin de morceaux */
+
+#define TTY_RECORD_FRAME_MAGIC      "HPFR"
+#define TTY_RECORD_FRAME_MAGIC_LEN  4
+#define TTY_RECORD_FRAME_HEADER_LEN 40
+#define TTY_RECORD_FRAME_STORED     0
+#define TTY_RECORD_FRAME_DEFLATE    1
+#define TTY_RECORD_FRAME_MAX        (16 << 20)  /* au delà, une trame est considérée comme corrompue */
+
+struct ttyRecordFrameHeader_s {
+    int       method;
+    uint32_t  clen;
+    uint32_t  ulen;
+    int64_t   start;
+    uint64_t  recno;
+    uint32_t  crc;
+};
+
+struct ttyRecordFileHeader_s {
+    int      version;
+    int      flags;
+    int64_t  start;       /* µs depuis l'epoch */
+};
+
+
+#define TTY_RECORD_INDEX_EVERY      65536        /* un point d'index au plus tous les 64 Kio */
+#define TTY_RECORD_TRAILER_MAGIC    "HPTTYIDX"
+#define TTY_RECORD_TRAILER_LEN      19           /* type, len=16, delta=0, magic, offset */
+#define TTY_RECORD_INDEX_ENTRY_MAX  30           /* 3 varints */
+
+#define TTY_RECORD_WINSIZE_LEN      4            /* lignes, colonnes : 2 octets petit boutiste chacun */
+
+struct ttyRecordIndexEntry_s {
+    uint64_t  offset;     /* début d'un record, ou de la trame qui le contient */
+    uint64_t  recno;      /* numéro de ce record, ou du premier record de la trame */
+    int64_t   base;       /* µs, base du delta de ce record : horodatage du précédent */
+};
+
+
+static inline int64_t timevalUsec(const struct timeval* tv) {
+    return (int64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+/* Entiers de longueur variable, 7 bits par octet, bit de poids fort = suite */
+static inline size_t varintPut(uint8_t* p, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    p[n++] = (uint8_t)v;
+    return n;
+}
+
+/* Retourne le nombre d'octets consommés, 0 si incomplet ou invalide */
+static inline size_t varintGet(const uint8_t* p, size_t avail, uint64_t* v) {
+    uint64_t r = 0;
+    for (size_t n = 0; n < avail && n < 10; n++) {
+        r |= (uint64_t)(p[n] & 0x7f) << (7 * n);
+        if (!(p[n] & 0x80)) {
+            *v = r;
+            return n + 1;
+        }
+    }
+    return 0;
+}
+
+/* Les deltas peuvent être négatifs si l'horloge recule : codage zigzag */
+static inline uint64_t zigzag(int64_t v)    { return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63); }
+static inline int64_t  unzigzag(uint64_t v) { return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+
+static inline void le64Put(uint8_t* p, uint64_t v) {
+    for (int i=0; i<8; i++) p[i] = (uint8_t)(v >> (8*i));
+}
+
+static inline uint64_t le64Get(const uint8_t* p) {
+    uint64_t v = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(&v, p, 8);   /* un seul chargement : la boucle n'est pas fusionnée en -O2, et archive hache ainsi chaque octet */
+#else
+    for (int i=0; i<8; i++) v |= (uint64_t)p[i] << (8*i);
+#endif
+    return v;
+}
+
+static inline void le32Put(uint8_t* p, uint32_t v) {
+    for (int i=0; i<4; i++) p[i] = (uint8_t)(v >> (8*i));
+}
+
+static inline uint32_t le32Get(const uint8_t* p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline void ttyRecordFileHeaderEncode(uint8_t* out, const struct ttyRecordFileHeader_s* h) {
+    memset(out, 0, TTY_RECORD_FILE_HEADER_LEN);
+    memcpy(out, TTY_RECORD_MAGIC, TTY_RECORD_MAGIC_LEN);
+    out[8] = (uint8_t)h->version;
+    out[9] = (uint8_t)h->flags;
+    le64Put(out + 16, (uint64_t)h->start);
+}
+
+/* Retourne 0 si c'est un entête v2 ou plus, -1 sinon (fichier v1, ou trop court) */
+static inline int ttyRecordFileHeaderDecode(const uint8_t* in, size_t avail, struct ttyRecordFileHeader_s* h) {
+    if (avail < TTY_RECORD_FILE_HEADER_LEN) return -1;
+    if (memcmp(in, TTY_RECORD_MAGIC, TTY_RECORD_MAGIC_LEN) != 0) return -1;
+    h->version = in[8];
+    h->flags   = in[9];
+    h->start   = (int64_t)le64Get(in + 16);
+    return 0;
+}
+
+/* Entête de trame, crc des données à fournir dans h->crc. Utilisable depuis un handler de signal */
+static inline void ttyRecordFrameHeaderEncode(uint8_t* out, const struct ttyRecordFrameHeader_s* h) {
+    memset(out, 0, TTY_RECORD_FRAME_HEADER_LEN);
+    memcpy(out, TTY_RECORD_FRAME_MAGIC, TTY_RECORD_FRAME_MAGIC_LEN);
+    out[4] = (uint8_t)h->method;
+    le32Put(out + 8,  h->clen);
+    le32Put(out + 12, h->ulen);
+    le64Put(out + 16, (uint64_t)h->start);
+    le64Put(out + 24, h->recno);
+    le32Put(out + 32, h->crc);
+    le32Put(out + 36, crc32(0, out, 36));
+}
+
+/* Retourne 0 si c'est un entête de trame valide, -1 sinon */
+static inline int ttyRecordFrameHeaderDecode(const uint8_t* in, size_t avail, struct ttyRecordFrameHeader_s* h) {
+    if (avail < TTY_RECORD_FRAME_HEADER_LEN) return -1;
+    if (memcmp(in, TTY_RECORD_FRAME_MAGIC, TTY_RECORD_FRAME_MAGIC_LEN) != 0) return -1;
+    if (le32Get(in + 36) != crc32(0, in, 36)) return -1;
+    h->method = in[4];
+    h->clen   = le32Get(in + 8);
+    h->ulen   = le32Get(in + 12);
+    h->start  = (int64_t)le64Get(in + 16);
+    h->recno  = le64Get(in + 24);
+    h->crc    = le32Get(in + 32);
+    if (h->method > TTY_RECORD_FRAME_DEFLATE || h->clen > TTY_RECORD_FRAME_MAX || h->ulen > TTY_RECORD_FRAME_MAX) return -1;
+    /* trame stockée : les données sont copiées dans un tampon de ulen octets */
+    if (h->method == TTY_RECORD_FRAME_STORED && h->clen != h->ulen) return -1;
+    return 0;
+}
+
+static inline size_t ttyRecordHeaderEncode(uint8_t* out, int type, uint64_t len, int64_t delta) {
+    size_t n = 0;
+    out[n++] = (uint8_t)type;
+    n += varintPut(out + n, len);
+    n += varintPut(out + n, zigzag(delta));
+    return n;
+}
+
+/* Retourne la taille de l'entête de record, 0 s'il est incomplet ou invalide */
+static inline size_t ttyRecordHeaderDecode(const uint8_t* in, size_t avail, int* type, uint64_t* len, int64_t* delta) {
+    uint64_t v;
+    size_t n = 1, m;
+    if (avail < 3) return 0;
+    *type = in[0];
+    if ((m = varintGet(in + n, avail - n, len)) == 0) return 0;
+    n += m;
+    if ((m = varintGet(in + n, avail - n, &v)) == 0) return 0;
+    *delta = unzigzag(v);
+    return n + m;
+}
+
+/* Index : nombre de points, puis pour chacun les écarts avec le précédent */
+static inline size_t ttyRecordIndexEncode(uint8_t* out, const struct ttyRecordIndexEntry_s* e, size_t nb) {
+    struct ttyRecordIndexEntry_s prec = { 0, 0, 0 };
+    size_t n = varintPut(out, nb);
+    for (size_t i=0; i<nb; i++) {
+        n += varintPut(out + n, e[i].offset - prec.offset);
+        n += varintPut(out + n, e[i].recno - prec.recno);
+        n += varintPut(out + n, zigzag(e[i].base - prec.base));
+        prec = e[i];
+    }
+    return n;
+}
+
+/* Nombre de points de l'index, 0 s'il est invalide */
+static inline size_t ttyRecordIndexCount(const uint8_t* in, size_t avail) {
+    uint64_t nb;
+    if (varintGet(in, avail, &nb) == 0 || nb > avail) return 0;
+    return nb;
+}
+
+/* Décode au plus max points dans e, retourne le nombre décodé */
+static inline size_t ttyRecordIndexDecode(const uint8_t* in, size_t avail, struct ttyRecordIndexEntry_s* e, size_t max) {
+    struct ttyRecordIndexEntry_s prec = { 0, 0, 0 };
+    uint64_t nb, v1, v2, v3;
+    size_t n = varintGet(in, avail, &nb), m, i;
+    if (n == 0) return 0;
+    for (i=0; i<nb && i<max; i++) {
+        if ((m = varintGet(in + n, avail - n, &v1)) == 0) break;
+        n += m;
+        if ((m = varintGet(in + n, avail - n, &v2)) == 0) break;
+        n += m;
+        if ((m = varintGet(in + n, avail - n, &v3)) == 0) break;
+        n += m;
+        e[i].offset = prec.offset + v1;
+        e[i].recno  = prec.recno + v2;
+        e[i].base   = prec.base + unzigzag(v3);
+        prec = e[i];
+    }
+    return i;
+}
+
+static inline void ttyRecordTrailerEncode(uint8_t* out, uint64_t indexOffset) {
+    size_t n = ttyRecordHeaderEncode(out, TTY_RECORD_INDEX_TRAILER, 16, 0);
+    memcpy(out + n, TTY_RECORD_TRAILER_MAGIC, 8);
+    le64Put(out + n + 8, indexOffset);
+}
+
+/* Retourne 0 et l'offset de l'index si in pointe sur un trailer valide */
+static inline int ttyRecordTrailerDecode(const uint8_t* in, uint64_t* indexOffset) {
+    if (in[0] != TTY_RECORD_INDEX_TRAILER || in[1] != 16 || in[2] != 0) return -1;
+    if (memcmp(in + 3, TTY_RECORD_TRAILER_MAGIC, 8) != 0) return -1;
+    *indexOffset = le64Get(in + 11);
+    return 0;
+}
+
+/* Données d'un record TTY_RECORD_WINSIZE */
+static inline void ttyRecordWinsizeEncode(uint8_t* out, unsigned lignes, unsigned colonnes) {
+    out[0] = lignes & 0xff;
+    out[1] = lignes >> 8;
+    out[2] = colonnes & 0xff;
+    out[3] = colonnes >> 8;
+}
+
+static inline int ttyRecordWinsizeDecode(const uint8_t* in, size_t len, unsigned* lignes, unsigned* colonnes) {
+    if (len < TTY_RECORD_WINSIZE_LEN) return -1;
+    *lignes   = in[0] | in[1] << 8;
+    *colonnes = in[2] | in[3] << 8;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,471 @@
+/******************************************************************************
+ * Lecture d'un fichier d'enregistrement, voir ttyRecordReader.h
+ * Bertrand sept 2024
+ ******************************************************************************/
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <glob.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "ttyRecordReader.h"
+#include "ttyChunks.h"
+
+
+
+/******************************************************************************
+ * Projection et tampon glissant
+ */
+
+void* agrandit(void* p, size_t* capacity, size_t voulu) {
+    if (voulu <= *capacity) return p;
+    p = realloc(p, voulu);
+    if (p == NULL) {
+        perror("Erreur sur realloc() ");
+        abort();
+    }
+    *capacity = voulu;
+    return p;
+}
+
+/* Fichiers posés à côté des enregistrements : un fichier sans entête serait pris pour un v1 */
+bool ttyRecordIgnore(const char* nom) {
+    static const char* suffixes[] = {
+        ".idx", ".scr",             /* caches de replay */
+        ".cast", ".ttyrec",         /* replay --export */
+    };
+    static const char* morceaux[] = {
+        ".stats",                   /* statistiques de honeypotSsh, et leur fichier temporaire */
+        ".archive-tmp",             /* archive, auditMerge et replay --insert en cours d'écriture */
+        ".audit-tmp",
+        ".files-tmp",
+    };
+    size_t l = strlen(nom);
+
+    if (nom[0] == '.') return true;
+    for (size_t k=0; k<sizeof(suffixes)/sizeof(suffixes[0]); k++) {
+        size_t s = strlen(suffixes[k]);
+        if (l > s && strcmp(nom + l - s, suffixes[k]) == 0) return true;
+    }
+    for (size_t k=0; k<sizeof(morceaux)/sizeof(morceaux[0]); k++) {
+        if (strstr(nom, morceaux[k])) return true;
+    }
+    return false;
+}
+
+/* Un fichier nommé est pris tel quel, ceux d'un répertoire ou d'un motif passent par ttyRecordIgnore() */
+void ttyRecordListeAjoute(char*** noms, size_t* nb, size_t* capacity, const char* chemin) {
+    struct stat st;
+
+    if (stat(chemin, &st) < 0) {
+        glob_t g;
+        if (strpbrk(chemin, "*?[") && glob(chemin, 0, NULL, &g) == 0) {
+            for (size_t k=0; k<g.gl_pathc; k++) {
+                const char* base = strrchr(g.gl_pathv[k], '/');
+                if (!ttyRecordIgnore(base ? base + 1 : g.gl_pathv[k])) ttyRecordListeAjoute(noms, nb, capacity, g.gl_pathv[k]);
+            }
+            globfree(&g);
+        } else {
+            fprintf(stderr, "Impossible de lire %s : %s\n", chemin, strerror(errno));
+        }
+        return;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        DIR* d = opendir(chemin);
+        struct dirent* e;
+        if (d == NULL) {
+            fprintf(stderr, "Impossible de lire %s : %s\n", chemin, strerror(errno));
+            return;
+        }
+        while ((e = readdir(d)) != NULL) {
+            if (ttyRecordIgnore(e->d_name)) continue;
+            char sous[PATH_MAX];
+            snprintf(sous, sizeof(sous), "%s/%s", chemin, e->d_name);
+            ttyRecordListeAjoute(noms, nb, capacity, sous);
+        }
+        closedir(d);
+        return;
+    }
+
+    if (!S_ISREG(st.st_mode)) return;
+    if (*nb == *capacity) {
+        size_t taille = *capacity * sizeof(char*);
+        *noms = agrandit(*noms, &taille, (*capacity ? 2 * *capacity : 256) * sizeof(char*));
+        *capacity = taille / sizeof(char*);
+    }
+    (*noms)[(*nb)++] = strdup(chemin);
+}
+
+static int ttyRecordListeCompare(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+size_t ttyRecordListeTrie(char** noms, size_t nb) {
+    size_t uniques = 0;
+
+    if (nb == 0) return 0;
+    qsort(noms, nb, sizeof(char*), ttyRecordListeCompare);
+    for (size_t k=0; k<nb; k++) {
+        if (uniques > 0 && strcmp(noms[uniques-1], noms[k]) == 0) free(noms[k]);
+        else noms[uniques++] = noms[k];
+    }
+    return uniques;
+}
+
+/* Tube : oublie ce qui précède pos, et complète le tampon pour avoir voulu octets si possible */
+void ttyRecordMapFill(struct ttyRecordMap_s* map, size_t pos, size_t voulu) {
+    uint8_t* buffer = (uint8_t*)map->base;
+
+    if (pos > map->decalage) {
+        size_t oublie = pos - map->decalage;
+        if (oublie > map->len) oublie = map->len;
+        memmove(buffer, buffer + oublie, map->len - oublie);
+        map->len      -= oublie;
+        map->decalage += oublie;
+    }
+    buffer = agrandit(buffer, &map->capacity, voulu > map->bloc ? voulu : map->bloc);
+    map->base = buffer;
+
+    ssize_t nlu;
+    do {
+        nlu = read(map->fd, buffer + map->len, map->capacity - map->len);
+    } while (nlu < 0 && errno == EINTR);
+    if (nlu < 0) perror("Erreur de lecture ");
+    if (nlu <= 0) map->fin = true;
+    else map->len += nlu;
+}
+
+/* Rend accessibles jusqu'à voulu octets à partir de pos, retourne combien le sont */
+size_t ttyRecordMapDispo(struct ttyRecordMap_s* map, size_t pos, size_t voulu) {
+    if (map->fd >= 0 && voulu > FLUX_RECORD_MAX) voulu = FLUX_RECORD_MAX;
+    while (map->decalage + map->len < pos + voulu && map->fd >= 0 && !map->fin) {
+        ttyRecordMapFill(map, pos, voulu);
+    }
+    if (pos < map->decalage || pos >= map->decalage + map->len) return 0;
+    size_t dispo = map->decalage + map->len - pos;
+    return dispo < voulu ? dispo : voulu;
+}
+
+/* Archivé : le premier record donne le magasin, lu ici pour qu'un lecteur qui part de l'index le connaisse */
+static void ttyRecordChunksMagasin(struct ttyRecordMap_s* map) {
+    struct ttyRecordCursor_s c;
+    struct ttyRecordView_s v;
+    const char* env = getenv(TTY_CHUNKS_ENV);
+    ttyRecordCursorInit(&c, map, false);
+    if (env && env[0]) map->magasin = strdup(env);
+    else if (ttyRecordCursorNext(&c, &v) && v.type == TTY_RECORD_CHUNK_STORE) map->magasin = strndup(v.data, v.len);
+    ttyRecordCursorClose(&c);
+}
+
+/*
+  Un fichier ordinaire est projeté en entier, sauf s'il est suivi pendant son
+  écriture : il est alors lu par read() comme un tube, par blocs plus petits
+  (un par session suivie), et ttyRecordMapReprise() permet d'aller au-delà de
+  la fin déjà atteinte.
+ */
+static int ttyRecordMapOuvre(struct ttyRecordMap_s* map, const char* nom, bool suivi) {
+    struct ttyRecordFileHeader_s h;
+    memset(map, 0, sizeof(*map));
+    map->fd = -1;
+    map->bloc = suivi ? FLUX_SUIVI : FLUX_BUFFER;
+
+    int fd = strcmp(nom, "-") == 0 ? dup(STDIN_FILENO) : open(nom, O_RDONLY);
+    if (fd < 0) return -1;
+    if (fstat(fd, &map->st) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    if (S_ISREG(map->st.st_mode) && !suivi) {
+        map->len = map->st.st_size;
+        map->fin = true;
+        if (map->len > 0) {
+            map->base = mmap(NULL, map->len, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map->base == MAP_FAILED) {
+                close(fd);
+                return -1;
+            }
+            madvise((void*)map->base, map->len, MADV_SEQUENTIAL);
+        }
+        close(fd);
+    } else {
+        map->fd = fd;
+    }
+
+    size_t n = ttyRecordMapDispo(map, 0, TTY_RECORD_FILE_HEADER_LEN);
+    if (ttyRecordFileHeaderDecode(ttyRecordMapPtr(map, 0), n, &h) == 0) {
+        if (h.version != TTY_RECORD_VERSION) {
+            printf("Version de fichier non supportée : %d\n", h.version);
+            errno = EINVAL;
+            return -1;
+        }
+        map->version = 2;
+        map->flags   = h.flags;
+        map->start   = h.start;
+        map->debut   = TTY_RECORD_FILE_HEADER_LEN;
+        if (map->flags & TTY_RECORD_FLAG_CHUNKS) ttyRecordChunksMagasin(map);
+    } else {
+        /* pas d'entête : v1, les records commencent au début du fichier */
+        struct ttyRecordEntry_s premier;
+        map->version = 1;
+        if (ttyRecordMapDispo(map, 0, sizeof(premier)) == sizeof(premier)) {
+            memcpy(&premier, ttyRecordMapPtr(map, 0), sizeof(premier));
+            map->start = (int64_t)premier.tv_sec * 1000000 + premier.tv_usec;
+        }
+    }
+    return 0;
+}
+
+int ttyRecordMapOpen(struct ttyRecordMap_s* map, const char* nom) {
+    return ttyRecordMapOuvre(map, nom, false);
+}
+
+int ttyRecordMapOpenSuivi(struct ttyRecordMap_s* map, const char* nom) {
+    return ttyRecordMapOuvre(map, nom, true);
+}
+
+void ttyRecordMapClose(struct ttyRecordMap_s* map) {
+    if (map->fd >= 0) {
+        close(map->fd);
+        free((void*)map->base);
+    } else if (map->len > 0) {
+        munmap((void*)map->base, map->len);
+    }
+    if (map->paquetLen > 0) munmap((void*)map->paquet, map->paquetLen);
+    free(map->magasin);
+}
+
+void ttyRecordCursorSeek(struct ttyRecordCursor_s* c, const struct ttyRecordIndexEntry_s* e) {
+    c->pos      = e->offset;
+    c->last     = e->base;
+    c->recno    = e->recno;
+    c->trameLen = c->tramePos = 0;
+}
+
+void ttyRecordCursorInit(struct ttyRecordCursor_s* c, struct ttyRecordMap_s* map, bool signale) {
+    struct ttyRecordIndexEntry_s debut = { map->debut, 0, map->start };
+    memset(c, 0, sizeof(*c));
+    c->map     = map;
+    c->signale = signale;
+    ttyRecordCursorSeek(c, &debut);
+}
+
+/* Point d'où relire le record suivant ; en mode compressé, début de la trame en cours, à sauter jusqu'à c->recno */
+void ttyRecordCursorTell(const struct ttyRecordCursor_s* c, struct ttyRecordIndexEntry_s* e) {
+    if (c->trameLen > 0) {
+        *e = (struct ttyRecordIndexEntry_s) { c->trameOffset, c->trameRecno, c->trameStart };
+    } else {
+        *e = (struct ttyRecordIndexEntry_s) { c->pos, c->recno, c->last };
+    }
+}
+
+void ttyRecordCursorClose(struct ttyRecordCursor_s* c) {
+    free(c->trame);
+    free(c->morceaux);
+}
+
+
+
+/******************************************************************************
+ * Fichiers archivés : références au magasin de morceaux
+ */
+
+/* Projette le paquet, ou le reprojette s'il a grandi depuis ; retourne -1 s'il est illisible */
+static int ttyRecordChunksProjette(struct ttyRecordMap_s* map) {
+    char nom[PATH_MAX];
+    struct stat st;
+    uint8_t cle[TTY_CHUNKS_KEY_LEN];
+
+    if (map->paquetErreur) return -1;
+    snprintf(nom, sizeof(nom), "%s/%s", map->magasin ? map->magasin : ".", TTY_CHUNKS_PACK);
+    int fd = open(nom, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0 && fstat(fd, &st) == 0 && (size_t)st.st_size > map->paquetLen) {
+        const uint8_t* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED) {
+            if (map->paquetLen > 0) munmap((void*)map->paquet, map->paquetLen);
+            map->paquet    = p;
+            map->paquetLen = st.st_size;
+        }
+    }
+    if (fd >= 0) close(fd);
+    if (map->paquetLen == 0 || ttyChunksHeaderDecode(map->paquet, map->paquetLen, cle) < 0) {
+        fprintf(stderr, "Magasin de morceaux illisible : %s\n", nom);
+        map->paquetErreur = true;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+  Remplace la vue d'un record TTY_RECORD_CHUNKED par les données d'origine,
+  recopiées morceau par morceau. Si le magasin manque ou si une référence est
+  fausse, le record reste TTY_RECORD_CHUNKED.
+ */
+static void ttyRecordChunksResout(struct ttyRecordCursor_s* c, struct ttyRecordView_s* v) {
+    struct ttyRecordMap_s* map = c->map;
+    const uint8_t* p = (const uint8_t*)v->data;
+    size_t n = v->len, lu, len = 0;
+    uint64_t total, offset, l;
+
+    if ((lu = varintGet(p, n, &total)) == 0 || total > FLUX_RECORD_MAX) return;
+    if (map->paquetLen == 0 && ttyRecordChunksProjette(map) < 0) return;
+    c->morceaux = agrandit(c->morceaux, &c->morceauxCapacity, total ? total : 1);
+
+    for (size_t i = lu; i < n; ) {
+        if ((lu = varintGet(p + i, n - i, &offset)) == 0) return;
+        i += lu;
+        if ((lu = varintGet(p + i, n - i, &l)) == 0) return;
+        i += lu;
+        if (l > total - len) return;
+        if ((offset > map->paquetLen || l > map->paquetLen - offset) && ttyRecordChunksProjette(map) < 0) return;
+        if (offset > map->paquetLen || l > map->paquetLen - offset) {
+            if (c->signale) printf("Référence hors du magasin de morceaux (record %llu)\n", (unsigned long long)v->recno);
+            return;
+        }
+        memcpy(c->morceaux + len, map->paquet + offset, l);
+        len += l;
+    }
+    if (len != total) return;
+    v->type = TTY_RECORD_SERVER_TO_CLIENT;
+    v->data = (const char*)c->morceaux;
+    v->len  = len;
+}
+
+/*
+  Charge et décompresse la trame qui commence à c->pos. Une trame abîmée (crc,
+  données tronquées, deflate invalide) est sautée en cherchant le magic suivant.
+  Retourne -1 à la fin du fichier.
+ */
+int ttyRecordCursorFrame(struct ttyRecordCursor_s* c) {
+    struct ttyRecordMap_s* map = c->map;
+    struct ttyRecordFrameHeader_s h;
+    size_t ignores = 0;
+
+    while (true) {
+        size_t n = ttyRecordMapDispo(map, c->pos, TTY_RECORD_FRAME_HEADER_LEN);
+        if (n < TTY_RECORD_FRAME_HEADER_LEN) {
+            if (c->signale && n + ignores) printf("Fin de fichier tronquée, %zu octets ignorés\n", n + ignores);
+            return -1;
+        }
+
+        if (ttyRecordFrameHeaderDecode(ttyRecordMapPtr(map, c->pos), n, &h) == 0) {
+            size_t total = TTY_RECORD_FRAME_HEADER_LEN + h.clen;
+            if (ttyRecordMapDispo(map, c->pos, total) < total) {
+                if (c->signale) printf("Trame tronquée en fin de fichier (record %llu et suivants)\n", (unsigned long long)h.recno);
+                return -1;
+            }
+
+            const uint8_t* comp = ttyRecordMapPtr(map, c->pos) + TTY_RECORD_FRAME_HEADER_LEN;
+            c->trame = agrandit(c->trame, &c->trameCapacity, h.ulen);
+            uLongf ulen = h.ulen;
+            bool ok = crc32(0, comp, h.clen) == h.crc;
+            if (ok && h.method == TTY_RECORD_FRAME_STORED) {
+                memcpy(c->trame, comp, h.clen);
+                ulen = h.clen;
+            } else if (ok) {
+                ok = uncompress(c->trame, &ulen, comp, h.clen) == Z_OK;
+            }
+
+            if (ok) {
+                if (c->signale && ignores) printf("%zu octets abîmés ignorés avant le record %llu\n", ignores, (unsigned long long)h.recno);
+                c->trameOffset = c->pos;
+                c->trameRecno  = h.recno;
+                c->trameStart  = h.start;
+                c->trameLen    = ulen;
+                c->tramePos    = 0;
+                c->last        = h.start;
+                c->recno       = h.recno;
+                c->pos        += total;
+                return 0;
+            }
+            if (c->signale) printf("Trame abîmée (record %llu et suivants), recherche de la suivante\n", (unsigned long long)h.recno);
+        }
+
+        /* pas une trame valide : recherche du magic suivant dans ce qui est disponible */
+        n = ttyRecordMapDispo(map, c->pos + 1, FLUX_BUFFER);
+        const uint8_t* p = ttyRecordMapPtr(map, c->pos + 1);
+        const uint8_t* suivant = n ? memmem(p, n, TTY_RECORD_FRAME_MAGIC, TTY_RECORD_FRAME_MAGIC_LEN) : NULL;
+        size_t saut = suivant ? (size_t)(suivant - p) + 1 : (n > TTY_RECORD_FRAME_MAGIC_LEN ? n - TTY_RECORD_FRAME_MAGIC_LEN + 1 : n + 1);
+        ignores += saut;
+        c->pos  += saut;
+    }
+}
+
+/* Record suivant : 1, ou 0 à la fin (ou sur un record tronqué) */
+int ttyRecordCursorNext(struct ttyRecordCursor_s* c, struct ttyRecordView_s* v) {
+    struct ttyRecordMap_s* map = c->map;
+    uint64_t len;
+    int64_t delta;
+    size_t n;
+
+    if (map->version == 1) {
+        struct ttyRecordEntry_s record;
+        n = ttyRecordMapDispo(map, c->pos, sizeof(record));
+        if (n < sizeof(record)) {
+            /* Soit lu 0 si c'est le dernier, soit moins = cas bizarre*/
+            if (c->signale && n != 0) printf("Enregistrement tronqué en fin de fichier\n");
+            return 0;
+        }
+        memcpy(&record, ttyRecordMapPtr(map, c->pos), sizeof(record));
+        if (record.len > SIZE_MAX - sizeof(record) || ttyRecordMapDispo(map, c->pos, sizeof(record) + record.len) < sizeof(record) + record.len) {
+            if (c->signale) printf("Enregistrement tronqué en fin de fichier\n");
+            return 0;
+        }
+        v->type   = record.type;
+        v->base   = c->last;
+        v->usec   = (int64_t)record.tv_sec * 1000000 + record.tv_usec;
+        v->offset = c->pos;
+        v->data   = (const char*)ttyRecordMapPtr(map, c->pos) + sizeof(record);
+        v->len    = record.len;
+        c->pos   += sizeof(record) + record.len;
+
+    } else if (map->flags & TTY_RECORD_FLAG_FRAMES) {
+        while (c->tramePos >= c->trameLen) {
+            if (ttyRecordCursorFrame(c) < 0) return 0;
+        }
+        n = ttyRecordHeaderDecode(c->trame + c->tramePos, c->trameLen - c->tramePos, &v->type, &len, &delta);
+        if (n == 0 || len > c->trameLen - c->tramePos - n) {
+            if (c->signale) printf("Record invalide dans une trame, passage à la suivante\n");
+            c->tramePos = c->trameLen;
+            return ttyRecordCursorNext(c, v);
+        }
+        v->base   = c->last;
+        v->usec   = c->last + delta;
+        v->offset = c->trameOffset;
+        v->data   = (const char*)c->trame + c->tramePos + n;
+        v->len    = len;
+        c->tramePos += n + len;
+
+    } else {
+        size_t dispo = ttyRecordMapDispo(map, c->pos, TTY_RECORD_HEADER_MAX);
+        if (dispo == 0) return 0;
+        n = ttyRecordHeaderDecode(ttyRecordMapPtr(map, c->pos), dispo, &v->type, &len, &delta);
+        if (n == 0 || len > SIZE_MAX - n || ttyRecordMapDispo(map, c->pos, n + len) < n + len) {
+            if (c->signale) printf("Enregistrement tronqué en fin de fichier\n");
+            return 0;
+        }
+        v->base   = c->last;
+        v->usec   = c->last + delta;
+        v->offset = c->pos;
+        v->data   = (const char*)ttyRecordMapPtr(map, c->pos) + n;
+        v->len    = len;
+        c->pos   += n + len;
+    }
+
+    c->last  = v->usec;
+    v->recno = c->recno++;
+    if (v->type == TTY_RECORD_CHUNKED) ttyRecordChunksResout(c, v);
+    return 1;
+}
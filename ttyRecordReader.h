@@ -0,0 +1,118 @@
+/******************************************************************************
+ * Lecture d'un fichier d'enregistrement, partagée par replay et les outils
+ * d'archive.
+ *
+ * Le fichier est projeté en mémoire par mmap() ; un tube ou stdin ("-") est lu
+ * par grands blocs dans un tampon glissant. Dans les deux cas les records sont
+ * rendus comme des vues (pointeur + longueur) sur le tampon, sans allocation
+ * ni copie par record, et sans jamais lire au-delà des données présentes.
+ *
+ * Format des records : voir ttyRecord.h, v1 et v2 sont lus. Dans un fichier
+ * archivé, les records TTY_RECORD_CHUNKED sont rendus comme les records
+ * SERVER_TO_CLIENT d'origine, reconstitués depuis le magasin de morceaux
+ * (projeté lui aussi) : voir ttyChunks.h.
+ * Bertrand sept 2024
+ ******************************************************************************/
+#ifndef TTYRECORDREADER_H
+#define TTYRECORDREADER_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "ttyRecord.h"
+
+
+#define FLUX_BUFFER      (1 << 20)     /* lecture par blocs des tubes */
+#define FLUX_RECORD_MAX  (64 << 20)    /* au-delà, un record lu d'un tube est considéré comme abîmé */
+#define FLUX_SUIVI       (64 << 10)    /* lecture par blocs d'un fichier suivi pendant son écriture */
+
+struct ttyRecordMap_s {
+    const uint8_t* base;  /* données accessibles : [decalage, decalage+len) du fichier */
+    size_t   len;
+    size_t   decalage;
+    int      fd;          /* -1 si le fichier est projeté en entier */
+    size_t   capacity;
+    size_t   bloc;        /* taille minimale d'une lecture */
+    bool     fin;
+    int      version;
+    int      flags;
+    int64_t  start;       /* µs, début de session (v1 : premier record) */
+    size_t   debut;       /* offset du premier record ou de la première trame */
+    struct stat st;
+
+    /* fichier archivé : magasin de morceaux, ouvert au premier record qui y renvoie */
+    char*    magasin;
+    const uint8_t* paquet;
+    size_t   paquetLen;
+    bool     paquetErreur;
+};
+
+struct ttyRecordCursor_s {
+    struct ttyRecordMap_s* map;
+    size_t   pos;         /* prochain record (ou prochaine trame) dans le fichier */
+    int64_t  last;        /* µs, horodatage du record précédent */
+    uint64_t recno;       /* numéro du prochain record */
+    bool     signale;     /* affiche les troncatures et trames abîmées */
+
+    /* v2 compressé : trame en cours */
+    size_t   trameOffset;
+    uint64_t trameRecno;
+    int64_t  trameStart;
+    uint8_t* trame;
+    size_t   trameLen;
+    size_t   tramePos;
+    size_t   trameCapacity;
+
+    /* fichier archivé : données reconstituées du record en cours */
+    uint8_t* morceaux;
+    size_t   morceauxCapacity;
+};
+
+/* Un record, vu directement dans le fichier ou dans la trame décompressée. Valable jusqu'au record suivant */
+struct ttyRecordView_s {
+    int         type;
+    int64_t     usec;     /* horodatage absolu */
+    int64_t     base;     /* horodatage du record précédent */
+    uint64_t    recno;
+    size_t      offset;   /* offset du record, ou de sa trame en mode compressé */
+    const char* data;
+    size_t      len;
+};
+
+/* realloc() qui ne rend jamais NULL, la capacité ne fait que croître */
+void* agrandit(void* p, size_t* capacity, size_t voulu);
+
+/* Nom de fichier qui n'est pas un enregistrement : caches, statistiques, exports, fichiers en cours d'écriture */
+bool ttyRecordIgnore(const char* nom);
+
+/* Ajoute un fichier, ou le contenu d'un répertoire (récursivement), ou ce que désigne un motif */
+void   ttyRecordListeAjoute(char*** noms, size_t* nb, size_t* capacity, const char* chemin);
+/* Trie la liste et libère les doublons, un même fichier désigné deux fois n'y reste qu'une fois ; retourne le nouveau nombre */
+size_t ttyRecordListeTrie(char** noms, size_t nb);
+
+void   ttyRecordMapFill(struct ttyRecordMap_s* map, size_t pos, size_t voulu);
+size_t ttyRecordMapDispo(struct ttyRecordMap_s* map, size_t pos, size_t voulu);
+int    ttyRecordMapOpen(struct ttyRecordMap_s* map, const char* nom);
+int    ttyRecordMapOpenSuivi(struct ttyRecordMap_s* map, const char* nom);
+void   ttyRecordMapClose(struct ttyRecordMap_s* map);
+
+/* Fichier suivi : la fin atteinte n'est peut-être plus la fin, la prochaine lecture ira voir */
+static inline void ttyRecordMapReprise(struct ttyRecordMap_s* map) {
+    if (map->fd >= 0) map->fin = false;
+}
+
+static inline const uint8_t* ttyRecordMapPtr(struct ttyRecordMap_s* map, size_t pos) {
+    return map->base + (pos - map->decalage);
+}
+
+void ttyRecordCursorInit(struct ttyRecordCursor_s* c, struct ttyRecordMap_s* map, bool signale);
+void ttyRecordCursorSeek(struct ttyRecordCursor_s* c, const struct ttyRecordIndexEntry_s* e);
+void ttyRecordCursorTell(const struct ttyRecordCursor_s* c, struct ttyRecordIndexEntry_s* e);
+void ttyRecordCursorClose(struct ttyRecordCursor_s* c);
+int  ttyRecordCursorFrame(struct ttyRecordCursor_s* c);
+int  ttyRecordCursorNext(struct ttyRecordCursor_s* c, struct ttyRecordView_s* v);
+
+#endif
@@ -0,0 +1,116 @@
+/******************************************************************************
+ * Réécriture d'un fichier d'enregistrement, voir ttyRecordWriter.h
+ * Bertrand sept 2024
+ ******************************************************************************/
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ttyRecordWriter.h"
+#include "ttyRecordReader.h"   /* agrandit() */
+
+
+
+
+static void ttyRecordWriterEcrit(struct ttyRecordWriter_s* w, const void* p, size_t len) {
+    while (len > 0 && !w->erreur) {
+        ssize_t n = write(w->fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            w->erreur = true;
+            return;
+        }
+        p = (const uint8_t*)p + n;
+        len -= n;
+        w->written += n;
+    }
+}
+
+static void ttyRecordWriterEcritTrame(struct ttyRecordWriter_s* w, int method, const uint8_t* data, size_t clen, size_t ulen, int64_t start, uint64_t recno) {
+    struct ttyRecordFrameHeader_s h = { method, clen, ulen, start, recno, crc32(0, data, clen) };
+    uint8_t entete[TTY_RECORD_FRAME_HEADER_LEN];
+    ttyRecordFrameHeaderEncode(entete, &h);
+    ttyRecordWriterEcrit(w, entete, sizeof(entete));
+    ttyRecordWriterEcrit(w, data, clen);
+}
+
+/* Compresse et écrit les records en attente ; un point d'index au début de la trame s'il est assez loin du précédent */
+static void ttyRecordWriterTrame(struct ttyRecordWriter_s* w) {
+    if (w->trameLen == 0) return;
+
+    if (w->indexNb == 0 || w->written - w->index[w->indexNb-1].offset >= TTY_RECORD_INDEX_EVERY) {
+        size_t taille = w->indexCapacity * sizeof(*w->index);
+        w->index = agrandit(w->index, &taille, (w->indexNb + 1) * sizeof(*w->index));
+        w->indexCapacity = taille / sizeof(*w->index);
+        w->index[w->indexNb++] = (struct ttyRecordIndexEntry_s) { w->written, w->trameRecno, w->trameStart };
+    }
+
+    uLongf clen = compressBound(w->trameLen);
+    w->comp = agrandit(w->comp, &w->compCapacity, clen);
+    if (compress2(w->comp, &clen, w->trame, w->trameLen, TTY_RECORD_WRITER_DEFLATE) == Z_OK && clen < w->trameLen) {
+        ttyRecordWriterEcritTrame(w, TTY_RECORD_FRAME_DEFLATE, w->comp, clen, w->trameLen, w->trameStart, w->trameRecno);
+    } else {
+        ttyRecordWriterEcritTrame(w, TTY_RECORD_FRAME_STORED, w->trame, w->trameLen, w->trameLen, w->trameStart, w->trameRecno);
+    }
+    w->trameLen = 0;
+}
+
+void ttyRecordWriterOpen(struct ttyRecordWriter_s* w, int fd, int flags, int64_t start) {
+    struct ttyRecordFileHeader_s h = { TTY_RECORD_VERSION, TTY_RECORD_FLAG_DEFLATE | flags, start };
+    uint8_t entete[TTY_RECORD_FILE_HEADER_LEN];
+
+    w->fd       = fd;
+    w->written  = 0;
+    w->erreur   = false;
+    w->last     = start;
+    w->recno    = 0;
+    w->trameLen = 0;
+    w->indexNb  = 0;
+    ttyRecordFileHeaderEncode(entete, &h);
+    ttyRecordWriterEcrit(w, entete, sizeof(entete));
+}
+
+void ttyRecordWriterRecord(struct ttyRecordWriter_s* w, int type, int64_t usec, const void* data, size_t len) {
+    if (w->trameLen == 0) {
+        w->trameStart = w->last;
+        w->trameRecno = w->recno;
+    }
+    w->trame = agrandit(w->trame, &w->trameCapacity, w->trameLen + TTY_RECORD_HEADER_MAX + len);
+    w->trameLen += ttyRecordHeaderEncode(w->trame + w->trameLen, type, len, usec - w->last);
+    memcpy(w->trame + w->trameLen, data, len);
+    w->trameLen += len;
+    w->last = usec;
+    w->recno++;
+    if (w->trameLen >= TTY_RECORD_WRITER_TRAME) ttyRecordWriterTrame(w);
+}
+
+/* Index et trailer dans une trame stockée, comme ttyRecordWriteIndex() de honeypotSsh */
+int ttyRecordWriterClose(struct ttyRecordWriter_s* w) {
+    ttyRecordWriterTrame(w);
+
+    size_t taille = TTY_RECORD_HEADER_MAX + 10 + w->indexNb * TTY_RECORD_INDEX_ENTRY_MAX + TTY_RECORD_TRAILER_LEN;
+    w->trame = agrandit(w->trame, &w->trameCapacity, 2 * taille);
+    uint8_t* payload = w->trame + taille;
+    size_t lenPayload = ttyRecordIndexEncode(payload, w->index, w->indexNb);
+    size_t n = ttyRecordHeaderEncode(w->trame, TTY_RECORD_INDEX, lenPayload, 0);
+    memcpy(w->trame + n, payload, lenPayload);
+    n += lenPayload;
+    ttyRecordTrailerEncode(w->trame + n, w->written);
+    n += TTY_RECORD_TRAILER_LEN;
+    ttyRecordWriterEcritTrame(w, TTY_RECORD_FRAME_STORED, w->trame, n, n, w->last, w->recno);
+
+    if (!w->erreur && fdatasync(w->fd) < 0) w->erreur = true;
+    return w->erreur ? -1 : 0;
+}
+
+void ttyRecordWriterFree(struct ttyRecordWriter_s* w) {
+    free(w->trame);
+    free(w->comp);
+    free(w->index);
+}
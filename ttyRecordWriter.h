@@ -0,0 +1,58 @@
+/******************************************************************************
+ * Réécriture d'un fichier d'enregistrement, pour les outils qui en produisent
+ * une nouvelle version à partir d'un fichier existant (archive, auditMerge).
+ *
+ * Toujours du v2 compressé : les records sont groupés en trames d'environ
+ * TTY_RECORD_WRITER_TRAME octets compressées par deflate (stockées telles
+ * quelles si deflate ne gagne rien), puis à la fermeture l'index et son
+ * trailer dans une dernière trame stockée. Le fichier se relit donc comme
+ * ceux de honeypotSsh avec HONEYPOT_RECORD_COMPRESS. Format : voir ttyRecord.h.
+ *
+ * Contrairement à honeypotSsh, pas de thread compresseur ni de repli : le
+ * fichier est écrit d'un bloc, et l'appelant le jette en cas d'erreur.
+ * Bertrand sept 2024
+ ******************************************************************************/
+#ifndef TTYRECORDWRITER_H
+#define TTYRECORDWRITER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "ttyRecord.h"
+
+
+#define TTY_RECORD_WRITER_TRAME    (256 << 10)   /* records par trame compressée */
+#define TTY_RECORD_WRITER_DEFLATE  6
+
+struct ttyRecordWriter_s {
+    int      fd;
+    uint64_t written;
+    bool     erreur;
+    int64_t  last;        /* µs, base du delta du prochain record */
+    uint64_t recno;
+
+    uint8_t* trame;       /* records en attente de compression */
+    size_t   trameLen;
+    size_t   trameCapacity;
+    int64_t  trameStart;
+    uint64_t trameRecno;
+    uint8_t* comp;
+    size_t   compCapacity;
+
+    struct ttyRecordIndexEntry_s* index;
+    size_t   indexNb;
+    size_t   indexCapacity;
+};
+
+/* Entête de fichier ; flags en plus de TTY_RECORD_FLAG_DEFLATE. La structure peut resservir pour un autre fichier */
+void ttyRecordWriterOpen(struct ttyRecordWriter_s* w, int fd, int flags, int64_t start);
+
+void ttyRecordWriterRecord(struct ttyRecordWriter_s* w, int type, int64_t usec, const void* data, size_t len);
+
+/* Dernière trame, index et trailer, puis fdatasync() ; -1 si une écriture a échoué. Ne ferme pas fd */
+int  ttyRecordWriterClose(struct ttyRecordWriter_s* w);
+
+void ttyRecordWriterFree(struct ttyRecordWriter_s* w);
+
+#endif
@@ -0,0 +1,789 @@
+/******************************************************************************
+ * Modèle d'écran VT100 / xterm, voir ttyScreen.h
+ * Bertrand sept 2024
+ ******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <wchar.h>
+#include <zlib.h>            /* compression des instantanés */
+
+#include "ttyScreen.h"
+
+
+
+/******************************************************************************
+ * Grille
+ */
+
+enum {
+    ETAT_NORMAL = 0,
+    ETAT_ESC,
+    ETAT_CSI,
+    ETAT_CHAINE,          /* OSC, DCS, PM, APC : ignorés jusqu'à BEL ou ST */
+    ETAT_CHAINE_ESC,
+    ETAT_CHARSET,         /* ESC ( x, ESC ) x, ESC % x */
+    ETAT_DIESE            /* ESC # x */
+};
+
+/* jeu graphique DEC, de 0x5f à 0x7e */
+static const uint16_t decGraphique[32] = {
+    0x00a0, 0x25c6, 0x2592, 0x2409, 0x240c, 0x240d, 0x240a, 0x00b0,
+    0x00b1, 0x2424, 0x240b, 0x2518, 0x2510, 0x250c, 0x2514, 0x253c,
+    0x23ba, 0x23bb, 0x2500, 0x23bc, 0x23bd, 0x251c, 0x2524, 0x2534,
+    0x252c, 0x2502, 0x2264, 0x2265, 0x03c0, 0x2260, 0x00a3, 0x00b7
+};
+
+static inline struct ttyCell_s* cellule(struct ttyScreen_s* s, int y, int x) {
+    return &s->grille[(size_t)s->ordre[y] * s->cols + x];
+}
+
+/* Cellule effacée : couleur de fond courante, comme xterm (bce) */
+static inline struct ttyCell_s vide(const struct ttyScreen_s* s) {
+    struct ttyCell_s c = { ' ', TTY_ATTR_FG_DEFAULT | (s->pinceau.attr & TTY_ATTR_BG_DEFAULT), 0, s->pinceau.bg };
+    return c;
+}
+
+static void efface(struct ttyScreen_s* s, int y, int x, int n) {
+    struct ttyCell_s v = vide(s);
+    struct ttyCell_s* c = cellule(s, y, x);
+    if (n > s->cols - x) n = s->cols - x;
+    for (int i=0; i<n; i++) c[i] = v;
+}
+
+static void effaceGrille(struct ttyScreen_s* s, struct ttyCell_s* grille) {
+    struct ttyCell_s v = vide(s);
+    size_t n = (size_t)s->rows * s->cols;
+    for (size_t i=0; i<n; i++) grille[i] = v;
+}
+
+/* Fait monter les lignes haut..bas de n, des lignes vides apparaissent en bas. Seul l'ordre des rangées change */
+static void defileHaut(struct ttyScreen_s* s, int haut, int bas, int n) {
+    int sorties[TTY_SCREEN_MAX];
+    if (n > bas - haut + 1) n = bas - haut + 1;
+    if (n <= 0) return;
+    memcpy(sorties, &s->ordre[haut], n * sizeof(int));
+    memmove(&s->ordre[haut], &s->ordre[haut + n], (bas - haut + 1 - n) * sizeof(int));
+    memcpy(&s->ordre[bas - n + 1], sorties, n * sizeof(int));
+    for (int y=bas-n+1; y<=bas; y++) efface(s, y, 0, s->cols);
+}
+
+static void defileBas(struct ttyScreen_s* s, int haut, int bas, int n) {
+    int sorties[TTY_SCREEN_MAX];
+    if (n > bas - haut + 1) n = bas - haut + 1;
+    if (n <= 0) return;
+    memcpy(sorties, &s->ordre[bas - n + 1], n * sizeof(int));
+    memmove(&s->ordre[haut + n], &s->ordre[haut], (bas - haut + 1 - n) * sizeof(int));
+    memcpy(&s->ordre[haut], sorties, n * sizeof(int));
+    for (int y=haut; y<haut+n; y++) efface(s, y, 0, s->cols);
+}
+
+static void nouvelleLigne(struct ttyScreen_s* s) {
+    if (s->y == s->bas) defileHaut(s, s->haut, s->bas, 1);
+    else if (s->y < s->rows - 1) s->y++;
+}
+
+static void ligneInverse(struct ttyScreen_s* s) {
+    if (s->y == s->haut) defileBas(s, s->haut, s->bas, 1);
+    else if (s->y > 0) s->y--;
+}
+
+static void placeCurseur(struct ttyScreen_s* s, int y, int x) {
+    int min = s->origine ? s->haut : 0;
+    int max = s->origine ? s->bas : s->rows - 1;
+    y += min;
+    s->y = y < min ? min : y > max ? max : y;
+    s->x = x < 0 ? 0 : x >= s->cols ? s->cols - 1 : x;
+    s->wrapPending = false;
+}
+
+static void sauveCurseur(struct ttyScreen_s* s) {
+    s->sauveX       = s->x;
+    s->sauveY       = s->y;
+    s->sauvePinceau = s->pinceau;
+    s->sauveOrigine = s->origine;
+    s->sauveGActif  = s->gActif;
+}
+
+static void restaureCurseur(struct ttyScreen_s* s) {
+    s->x       = s->sauveX < s->cols ? s->sauveX : s->cols - 1;
+    s->y       = s->sauveY < s->rows ? s->sauveY : s->rows - 1;
+    s->pinceau = s->sauvePinceau;
+    s->origine = s->sauveOrigine;
+    s->gActif  = s->sauveGActif;
+    s->wrapPending = false;
+}
+
+static void basculeAlternatif(struct ttyScreen_s* s, bool alterne) {
+    if (alterne == s->alterne) return;
+    s->alterne = alterne;
+    s->grille  = alterne ? s->alternatif : s->principal;
+    s->ordre   = alterne ? s->ordreAlternatif : s->ordrePrincipal;
+    if (alterne) effaceGrille(s, s->alternatif);
+}
+
+static void tabsDefaut(struct ttyScreen_s* s) {
+    for (int x=0; x<s->cols; x++) s->tabs[x] = x % 8 == 0 && x > 0;
+}
+
+static void allocation(struct ttyScreen_s* s, int rows, int cols) {
+    size_t n = (size_t)rows * cols;
+    s->principal  = calloc(n, sizeof(struct ttyCell_s));
+    s->alternatif = calloc(n, sizeof(struct ttyCell_s));
+    s->tabs       = calloc(cols, 1);
+    s->ordrePrincipal  = calloc(rows, sizeof(int));
+    s->ordreAlternatif = calloc(rows, sizeof(int));
+    if (s->principal == NULL || s->alternatif == NULL || s->tabs == NULL || s->ordrePrincipal == NULL || s->ordreAlternatif == NULL) {
+        perror("Erreur sur calloc() ");
+        abort();
+    }
+    for (int y=0; y<rows; y++) s->ordrePrincipal[y] = s->ordreAlternatif[y] = y;
+    s->rows   = rows;
+    s->cols   = cols;
+    s->grille = s->alterne ? s->alternatif : s->principal;
+    s->ordre  = s->alterne ? s->ordreAlternatif : s->ordrePrincipal;
+}
+
+static int borne(int v) {
+    return v < 1 ? 1 : v > TTY_SCREEN_MAX ? TTY_SCREEN_MAX : v;
+}
+
+void ttyScreenInit(struct ttyScreen_s* s, int rows, int cols) {
+    memset(s, 0, sizeof(*s));
+    allocation(s, borne(rows), borne(cols));
+    ttyScreenReset(s);
+}
+
+void ttyScreenFree(struct ttyScreen_s* s) {
+    free(s->principal);
+    free(s->alternatif);
+    free(s->tabs);
+    free(s->ordrePrincipal);
+    free(s->ordreAlternatif);
+}
+
+/* RIS : tout revient à l'état initial, taille comprise inchangée */
+void ttyScreenReset(struct ttyScreen_s* s) {
+    s->alterne = false;
+    s->grille  = s->principal;
+    s->ordre   = s->ordrePrincipal;
+    s->pinceau = (struct ttyCell_s) { ' ', TTY_ATTR_FG_DEFAULT | TTY_ATTR_BG_DEFAULT, 0, 0 };
+    s->x = s->y = 0;
+    s->wrapPending    = false;
+    s->haut           = 0;
+    s->bas            = s->rows - 1;
+    s->autowrap       = true;
+    s->origine        = false;
+    s->insertion      = false;
+    s->curseurVisible = true;
+    s->g[0] = s->g[1] = 'B';
+    s->gActif    = 0;
+    s->etat      = ETAT_NORMAL;
+    s->utf8Reste = 0;
+    s->dernier   = ' ';
+    effaceGrille(s, s->principal);
+    effaceGrille(s, s->alternatif);
+    tabsDefaut(s);
+    sauveCurseur(s);
+}
+
+/* Comme xterm : le texte reste en haut à gauche, et remonte si le curseur sortirait par le bas */
+void ttyScreenResize(struct ttyScreen_s* s, int rows, int cols) {
+    rows = borne(rows);
+    cols = borne(cols);
+    if (rows == s->rows && cols == s->cols) return;
+
+    struct ttyScreen_s ancien = *s;
+    int decalage = s->y >= rows ? s->y - rows + 1 : 0;
+    allocation(s, rows, cols);
+
+    struct ttyCell_s* grilles[2][2] = { { ancien.principal, s->principal }, { ancien.alternatif, s->alternatif } };
+    int* ordres[2] = { ancien.ordrePrincipal, ancien.ordreAlternatif };
+    for (int g=0; g<2; g++) {
+        effaceGrille(s, grilles[g][1]);
+        for (int y=0; y<rows && y + decalage < ancien.rows; y++) {
+            int n = cols < ancien.cols ? cols : ancien.cols;
+            memcpy(&grilles[g][1][(size_t)y * cols], &grilles[g][0][(size_t)ordres[g][y + decalage] * ancien.cols], n * sizeof(struct ttyCell_s));
+        }
+    }
+    ttyScreenFree(&ancien);
+
+    tabsDefaut(s);
+    s->y -= decalage;
+    if (s->x >= cols) s->x = cols - 1;
+    s->haut = 0;
+    s->bas  = rows - 1;
+    s->wrapPending = false;
+    if (s->sauveY >= rows) s->sauveY = rows - 1;
+}
+
+
+
+/******************************************************************************
+ * Caractères affichables
+ */
+
+static void affiche(struct ttyScreen_s* s, uint32_t c) {
+    int largeur = 1;
+    if (c >= 0x300) {
+        largeur = wcwidth(c);
+        if (largeur == 0) return;   /* diacritiques combinants : ignorés */
+        if (largeur < 0) largeur = 1;
+    }
+    if (s->g[s->gActif] == '0' && c >= 0x5f && c <= 0x7e) c = decGraphique[c - 0x5f];
+    s->dernier = c;
+
+    if (s->wrapPending && s->autowrap) {
+        s->x = 0;
+        nouvelleLigne(s);
+    }
+    s->wrapPending = false;
+    if (largeur == 2 && s->x == s->cols - 1) {
+        if (s->cols < 2) largeur = 1;
+        else if (s->autowrap) {
+            efface(s, s->y, s->x, 1);
+            s->x = 0;
+            nouvelleLigne(s);
+        } else s->x--;
+    }
+
+    struct ttyCell_s* ligne = cellule(s, s->y, 0);
+    if (s->insertion) {
+        memmove(&ligne[s->x + largeur], &ligne[s->x], (s->cols - s->x - largeur) * sizeof(struct ttyCell_s));
+    }
+    /* on écrase la moitié d'un caractère large : l'autre moitié devient un blanc */
+    if (ligne[s->x].attr & TTY_ATTR_WIDE_SUITE && s->x > 0) ligne[s->x - 1].c = ' ';
+    if (s->x + largeur < s->cols && ligne[s->x + largeur].attr & TTY_ATTR_WIDE_SUITE) {
+        ligne[s->x + largeur].c = ' ';
+        ligne[s->x + largeur].attr &= ~TTY_ATTR_WIDE_SUITE;
+    }
+
+    ligne[s->x]   = s->pinceau;
+    ligne[s->x].c = c;
+    if (largeur == 2) {
+        ligne[s->x + 1] = s->pinceau;
+        ligne[s->x + 1].c = 0;
+        ligne[s->x + 1].attr |= TTY_ATTR_WIDE_SUITE;
+    }
+
+    s->x += largeur;
+    if (s->x >= s->cols) {
+        s->x = s->cols - 1;
+        s->wrapPending = true;
+    }
+}
+
+static void controle(struct ttyScreen_s* s, uint8_t c) {
+    switch (c) {
+        case 0x08:   /* BS */
+            if (s->x > 0) s->x--;
+            s->wrapPending = false;
+            break;
+        case 0x09:   /* HT */
+            while (s->x < s->cols - 1 && !s->tabs[++s->x]);
+            break;
+        case 0x0a:   /* LF, VT, FF */
+        case 0x0b:
+        case 0x0c:
+            nouvelleLigne(s);
+            s->wrapPending = false;
+            break;
+        case 0x0d:   /* CR */
+            s->x = 0;
+            s->wrapPending = false;
+            break;
+        case 0x0e:   /* SO, SI */
+            s->gActif = 1;
+            break;
+        case 0x0f:
+            s->gActif = 0;
+            break;
+        case 0x18:   /* CAN, SUB : abandon de la séquence en cours */
+        case 0x1a:
+            s->etat = ETAT_NORMAL;
+            break;
+        case 0x1b:
+            s->etat = ETAT_ESC;
+            s->intermediaire = 0;
+            break;
+    }
+}
+
+
+
+/******************************************************************************
+ * Séquences d'échappement
+ */
+
+static int param(const struct ttyScreen_s* s, int i, int defaut) {
+    return i < s->nparams && s->params[i] != 0 ? (int)s->params[i] : defaut;
+}
+
+/* couleur 24 bits ramenée au cube 6x6x6 de la palette 256 */
+static uint8_t couleurProche(uint32_t r, uint32_t g, uint32_t b) {
+    r = r > 255 ? 5 : (r * 5 + 127) / 255;
+    g = g > 255 ? 5 : (g * 5 + 127) / 255;
+    b = b > 255 ? 5 : (b * 5 + 127) / 255;
+    return 16 + 36 * r + 6 * g + b;
+}
+
+static void sgr(struct ttyScreen_s* s) {
+    struct ttyCell_s* p = &s->pinceau;
+    if (s->nparams == 0) s->params[s->nparams++] = 0;
+
+    for (int i=0; i<s->nparams; i++) {
+        uint32_t v = s->params[i];
+        switch (v) {
+            case 0:  p->attr = TTY_ATTR_FG_DEFAULT | TTY_ATTR_BG_DEFAULT; break;
+            case 1:  p->attr |= TTY_ATTR_BOLD; break;
+            case 2:  p->attr |= TTY_ATTR_DIM; break;
+            case 3:  p->attr |= TTY_ATTR_ITALIC; break;
+            case 4:  p->attr |= TTY_ATTR_UNDERLINE; break;
+            case 5:  p->attr |= TTY_ATTR_BLINK; break;
+            case 7:  p->attr |= TTY_ATTR_REVERSE; break;
+            case 8:  p->attr |= TTY_ATTR_INVISIBLE; break;
+            case 22: p->attr &= ~(TTY_ATTR_BOLD | TTY_ATTR_DIM); break;
+            case 23: p->attr &= ~TTY_ATTR_ITALIC; break;
+            case 24: p->attr &= ~TTY_ATTR_UNDERLINE; break;
+            case 25: p->attr &= ~TTY_ATTR_BLINK; break;
+            case 27: p->attr &= ~TTY_ATTR_REVERSE; break;
+            case 28: p->attr &= ~TTY_ATTR_INVISIBLE; break;
+            case 39: p->attr |= TTY_ATTR_FG_DEFAULT; break;
+            case 49: p->attr |= TTY_ATTR_BG_DEFAULT; break;
+
+            case 38:
+            case 48: {
+                uint8_t couleur;
+                if (i + 2 < s->nparams && s->params[i+1] == 5) {
+                    couleur = s->params[i+2];
+                    i += 2;
+                } else if (i + 4 < s->nparams && s->params[i+1] == 2) {
+                    couleur = couleurProche(s->params[i+2], s->params[i+3], s->params[i+4]);
+                    i += 4;
+                } else {
+                    i = s->nparams;
+                    break;
+                }
+                if (v == 38) {
+                    p->fg = couleur;
+                    p->attr &= ~TTY_ATTR_FG_DEFAULT;
+                } else {
+                    p->bg = couleur;
+                    p->attr &= ~TTY_ATTR_BG_DEFAULT;
+                }
+                break;
+            }
+
+            default:
+                if (v >= 30 && v <= 37)   { p->fg = v - 30;      p->attr &= ~TTY_ATTR_FG_DEFAULT; }
+                if (v >= 40 && v <= 47)   { p->bg = v - 40;      p->attr &= ~TTY_ATTR_BG_DEFAULT; }
+                if (v >= 90 && v <= 97)   { p->fg = v - 90 + 8;  p->attr &= ~TTY_ATTR_FG_DEFAULT; }
+                if (v >= 100 && v <= 107) { p->bg = v - 100 + 8; p->attr &= ~TTY_ATTR_BG_DEFAULT; }
+        }
+    }
+}
+
+static void modes(struct ttyScreen_s* s, bool actif) {
+    for (int i=0; i<s->nparams; i++) {
+        if (s->prive == '?') {
+            switch (s->params[i]) {
+                case 6:
+                    s->origine = actif;
+                    placeCurseur(s, 0, 0);
+                    break;
+                case 7:
+                    s->autowrap = actif;
+                    break;
+                case 25:
+                    s->curseurVisible = actif;
+                    break;
+                case 47:
+                case 1047:
+                    basculeAlternatif(s, actif);
+                    break;
+                case 1049:
+                    if (actif) sauveCurseur(s);
+                    basculeAlternatif(s, actif);
+                    if (!actif) restaureCurseur(s);
+                    break;
+            }
+        } else if (s->prive == 0 && s->params[i] == 4) {
+            s->insertion = actif;
+        }
+    }
+}
+
+static void csi(struct ttyScreen_s* s, uint8_t final) {
+    int n = param(s, 0, 1);
+    struct ttyCell_s* ligne = cellule(s, s->y, 0);
+
+    if (s->intermediaire) return;   /* DECSCUSR, DECSTR... sans effet sur le contenu */
+    if (s->prive && final != 'h' && final != 'l') return;
+
+    switch (final) {
+        case '@':   /* ICH */
+            if (n > s->cols - s->x) n = s->cols - s->x;
+            memmove(&ligne[s->x + n], &ligne[s->x], (s->cols - s->x - n) * sizeof(struct ttyCell_s));
+            efface(s, s->y, s->x, n);
+            break;
+        case 'A': { /* CUU, bloqué en haut de la région de défilement si on y est */
+            int min = s->y >= s->haut ? s->haut : 0;
+            s->y = s->y - n < min ? min : s->y - n;
+            s->wrapPending = false;
+            break;
+        }
+        case 'B':   /* CUD */
+        case 'e': {
+            int max = s->y <= s->bas ? s->bas : s->rows - 1;
+            s->y = s->y + n > max ? max : s->y + n;
+            s->wrapPending = false;
+            break;
+        }
+        case 'C':   /* CUF */
+        case 'a':
+            s->x = s->x + n >= s->cols ? s->cols - 1 : s->x + n;
+            s->wrapPending = false;
+            break;
+        case 'D':   /* CUB */
+            s->x = s->x - n < 0 ? 0 : s->x - n;
+            s->wrapPending = false;
+            break;
+        case 'E':   /* CNL, CPL */
+        case 'F':
+            s->x = 0;
+            csi(s, final == 'E' ? 'B' : 'A');
+            break;
+        case 'G':   /* CHA */
+        case '`':
+            placeCurseur(s, s->y - (s->origine ? s->haut : 0), n - 1);
+            break;
+        case 'H':   /* CUP */
+        case 'f':
+            placeCurseur(s, param(s, 0, 1) - 1, param(s, 1, 1) - 1);
+            break;
+        case 'd':   /* VPA */
+            placeCurseur(s, n - 1, s->x);
+            break;
+        case 'I':   /* CHT */
+            while (n-- > 0) controle(s, 0x09);
+            break;
+        case 'Z':   /* CBT */
+            while (n-- > 0 && s->x > 0) while (--s->x > 0 && !s->tabs[s->x]);
+            break;
+
+        case 'J':   /* ED */
+            switch (param(s, 0, 0)) {
+                case 0:
+                    efface(s, s->y, s->x, s->cols);
+                    for (int y=s->y+1; y<s->rows; y++) efface(s, y, 0, s->cols);
+                    break;
+                case 1:
+                    for (int y=0; y<s->y; y++) efface(s, y, 0, s->cols);
+                    efface(s, s->y, 0, s->x + 1);
+                    break;
+                case 2:
+                case 3:
+                    for (int y=0; y<s->rows; y++) efface(s, y, 0, s->cols);
+                    break;
+            }
+            break;
+        case 'K':   /* EL */
+            switch (param(s, 0, 0)) {
+                case 0: efface(s, s->y, s->x, s->cols); break;
+                case 1: efface(s, s->y, 0, s->x + 1); break;
+                case 2: efface(s, s->y, 0, s->cols); break;
+            }
+            break;
+        case 'X':   /* ECH */
+            efface(s, s->y, s->x, n);
+            break;
+
+        case 'L':   /* IL, DL : seulement dans la région de défilement */
+        case 'M':
+            if (s->y < s->haut || s->y > s->bas) break;
+            if (final == 'L') defileBas(s, s->y, s->bas, n);
+            else defileHaut(s, s->y, s->bas, n);
+            s->x = 0;
+            s->wrapPending = false;
+            break;
+        case 'P':   /* DCH */
+            if (n > s->cols - s->x) n = s->cols - s->x;
+            memmove(&ligne[s->x], &ligne[s->x + n], (s->cols - s->x - n) * sizeof(struct ttyCell_s));
+            efface(s, s->y, s->cols - n, n);
+            break;
+        case 'S':   /* SU, SD */
+            defileHaut(s, s->haut, s->bas, n);
+            break;
+        case 'T':
+            if (s->nparams <= 1) defileBas(s, s->haut, s->bas, n);
+            break;
+        case 'b':   /* REP */
+            while (n-- > 0) affiche(s, s->dernier);
+            break;
+
+        case 'g':   /* TBC */
+            if (param(s, 0, 0) == 0) s->tabs[s->x] = 0;
+            else if (param(s, 0, 0) == 3) memset(s->tabs, 0, s->cols);
+            break;
+        case 'h':
+        case 'l':
+            modes(s, final == 'h');
+            break;
+        case 'm':
+            sgr(s);
+            break;
+        case 'r': { /* DECSTBM */
+            int haut = param(s, 0, 1) - 1;
+            int bas  = param(s, 1, s->rows) - 1;
+            if (bas >= s->rows) bas = s->rows - 1;
+            if (haut < bas) {
+                s->haut = haut;
+                s->bas  = bas;
+                placeCurseur(s, 0, 0);
+            }
+            break;
+        }
+        case 's':
+            sauveCurseur(s);
+            break;
+        case 'u':
+            restaureCurseur(s);
+            break;
+    }
+}
+
+static void esc(struct ttyScreen_s* s, uint8_t c) {
+    s->etat = ETAT_NORMAL;
+    if (s->intermediaire) return;   /* S7C1T, DECDHL... sans effet sur le contenu */
+    switch (c) {
+        case '[':
+            s->etat    = ETAT_CSI;
+            s->nparams = 0;
+            s->prive   = 0;
+            s->intermediaire = 0;
+            memset(s->params, 0, sizeof(s->params));
+            break;
+        case ']':
+        case 'P':
+        case 'X':
+        case '^':
+        case '_':
+            s->etat = ETAT_CHAINE;
+            break;
+        case '(':
+        case ')':
+        case '%':
+            s->charsetCible = c == '(' ? 0 : c == ')' ? 1 : -1;
+            s->etat = ETAT_CHARSET;
+            break;
+        case '#':
+            s->etat = ETAT_DIESE;
+            break;
+        case '7': sauveCurseur(s); break;
+        case '8': restaureCurseur(s); break;
+        case 'D': nouvelleLigne(s); s->wrapPending = false; break;
+        case 'E': s->x = 0; nouvelleLigne(s); s->wrapPending = false; break;
+        case 'M': ligneInverse(s); s->wrapPending = false; break;
+        case 'H': s->tabs[s->x] = 1; break;
+        case 'c': ttyScreenReset(s); break;
+    }
+}
+
+static void csiOctet(struct ttyScreen_s* s, uint8_t c) {
+    if (c >= '0' && c <= '9') {
+        if (s->nparams == 0) s->nparams = 1;
+        uint32_t* p = &s->params[s->nparams - 1];
+        if (*p < 100000) *p = *p * 10 + (c - '0');
+    } else if (c == ';' || c == ':') {
+        if (s->nparams == 0) s->nparams = 1;
+        if (s->nparams < TTY_SCREEN_PARAMS) s->nparams++;
+    } else if (c >= '<' && c <= '?') {
+        s->prive = c;
+    } else if (c >= 0x20 && c <= 0x2f) {
+        s->intermediaire = c;
+    } else if (c >= 0x40 && c <= 0x7e) {
+        s->etat = ETAT_NORMAL;
+        csi(s, c);
+    } else if (c < 0x20) {
+        controle(s, c);   /* les contrôles C0 sont exécutés au milieu d'une séquence */
+    }
+}
+
+void ttyScreenFeed(struct ttyScreen_s* s, const char* data, size_t len) {
+    const uint8_t* p   = (const uint8_t*)data;
+    const uint8_t* fin = p + len;
+
+    while (p < fin) {
+        uint8_t c = *p++;
+
+        switch (s->etat) {
+            case ETAT_NORMAL:
+                if (s->utf8Reste > 0) {
+                    if ((c & 0xc0) == 0x80) {
+                        s->utf8 = s->utf8 << 6 | (c & 0x3f);
+                        if (--s->utf8Reste == 0) affiche(s, s->utf8 > 0x10ffff ? 0xfffd : s->utf8);
+                        continue;
+                    }
+                    s->utf8Reste = 0;
+                    affiche(s, 0xfffd);
+                }
+                if (c >= 0x20 && c < 0x7f) affiche(s, c);
+                else if (c < 0x20) controle(s, c);
+                else if (c >= 0xc2 && c <= 0xdf) { s->utf8 = c & 0x1f; s->utf8Reste = 1; }
+                else if (c >= 0xe0 && c <= 0xef) { s->utf8 = c & 0x0f; s->utf8Reste = 2; }
+                else if (c >= 0xf0 && c <= 0xf4) { s->utf8 = c & 0x07; s->utf8Reste = 3; }
+                else if (c != 0x7f) affiche(s, 0xfffd);
+                break;
+
+            case ETAT_ESC:
+                if (c >= 0x20 && c <= 0x2f && c != '(' && c != ')' && c != '%' && c != '#') s->intermediaire = c;
+                else if (c < 0x20) controle(s, c);
+                else esc(s, c);
+                break;
+
+            case ETAT_CSI:
+                csiOctet(s, c);
+                break;
+
+            case ETAT_CHAINE:
+                if (c == 0x07 || c == 0x18 || c == 0x1a) s->etat = ETAT_NORMAL;
+                else if (c == 0x1b) s->etat = ETAT_CHAINE_ESC;
+                break;
+
+            case ETAT_CHAINE_ESC:
+                s->etat = c == '\\' ? ETAT_NORMAL : ETAT_CHAINE;
+                break;
+
+            case ETAT_CHARSET:
+                if (s->charsetCible >= 0) s->g[s->charsetCible] = c;
+                s->etat = ETAT_NORMAL;
+                break;
+
+            case ETAT_DIESE:
+                if (c == '8') {   /* DECALN : écran rempli de E */
+                    for (int y=0; y<s->rows; y++) {
+                        for (int x=0; x<s->cols; x++) *cellule(s, y, x) = (struct ttyCell_s) { 'E', TTY_ATTR_FG_DEFAULT | TTY_ATTR_BG_DEFAULT, 0, 0 };
+                    }
+                }
+                s->etat = ETAT_NORMAL;
+                break;
+        }
+    }
+}
+
+
+
+/******************************************************************************
+ * Rendu et instantanés
+ */
+
+static size_t utf8Put(char* out, uint32_t c) {
+    if (c < 0x80)    { out[0] = c; return 1; }
+    if (c < 0x800)   { out[0] = 0xc0 | c >> 6;  out[1] = 0x80 | (c & 0x3f); return 2; }
+    if (c < 0x10000) { out[0] = 0xe0 | c >> 12; out[1] = 0x80 | (c >> 6 & 0x3f); out[2] = 0x80 | (c & 0x3f); return 3; }
+    out[0] = 0xf0 | c >> 18; out[1] = 0x80 | (c >> 12 & 0x3f); out[2] = 0x80 | (c >> 6 & 0x3f); out[3] = 0x80 | (c & 0x3f);
+    return 4;
+}
+
+void ttyScreenDump(const struct ttyScreen_s* s, FILE* f) {
+    char ligne[TTY_SCREEN_MAX * 4 + 1];
+
+    for (int y=0; y<s->rows; y++) {
+        const struct ttyCell_s* c = &s->grille[(size_t)s->ordre[y] * s->cols];
+        size_t n = 0, utile = 0;
+        for (int x=0; x<s->cols; x++) {
+            if (c[x].attr & TTY_ATTR_WIDE_SUITE) continue;
+            n += utf8Put(ligne + n, c[x].c ? c[x].c : ' ');
+            if (c[x].c != ' ' && c[x].c != 0) utile = n;
+        }
+        ligne[utile] = '\n';
+        fwrite(ligne, 1, utile + 1, f);
+    }
+}
+
+/*
+  Instantané : longueur brute (4 octets) puis, compressés, la structure (sans
+  ses pointeurs), les deux grilles et les taquets. Valable pour ce binaire
+  seulement, la structure est copiée telle quelle.
+ */
+int ttyScreenSnapshot(const struct ttyScreen_s* s, uint8_t** data, size_t* len) {
+    size_t grille = (size_t)s->rows * s->cols * sizeof(struct ttyCell_s);
+    size_t brut   = sizeof(*s) + 2 * grille + s->cols;
+    uint8_t* tampon = malloc(brut);
+    uLongf clen = compressBound(brut);
+    uint8_t* out = malloc(4 + clen);
+    if (tampon == NULL || out == NULL) {
+        free(tampon);
+        free(out);
+        return -1;
+    }
+
+    struct ttyScreen_s copie = *s;
+    copie.grille = copie.principal = copie.alternatif = NULL;
+    copie.ordre  = copie.ordrePrincipal = copie.ordreAlternatif = NULL;
+    copie.tabs   = NULL;
+    memcpy(tampon, &copie, sizeof(copie));
+    /* rangées remises dans l'ordre d'affichage */
+    size_t ligne = (size_t)s->cols * sizeof(struct ttyCell_s);
+    for (int y=0; y<s->rows; y++) {
+        memcpy(tampon + sizeof(copie) + y * ligne, &s->principal[(size_t)s->ordrePrincipal[y] * s->cols], ligne);
+        memcpy(tampon + sizeof(copie) + grille + y * ligne, &s->alternatif[(size_t)s->ordreAlternatif[y] * s->cols], ligne);
+    }
+    memcpy(tampon + sizeof(copie) + 2 * grille, s->tabs, s->cols);
+
+    out[0] = brut & 0xff;
+    out[1] = brut >> 8 & 0xff;
+    out[2] = brut >> 16 & 0xff;
+    out[3] = brut >> 24 & 0xff;
+    compress2(out + 4, &clen, tampon, brut, 1);
+    free(tampon);
+
+    *data = out;
+    *len  = 4 + clen;
+    return 0;
+}
+
+int ttyScreenRestore(struct ttyScreen_s* s, const uint8_t* data, size_t len) {
+    struct ttyScreen_s copie;
+    if (len < 4) return -1;
+    uLongf brut = data[0] | data[1] << 8 | data[2] << 16 | (uLongf)data[3] << 24;
+    if (brut < sizeof(copie) || brut > sizeof(copie) + 2 * (size_t)TTY_SCREEN_MAX * TTY_SCREEN_MAX * sizeof(struct ttyCell_s) + TTY_SCREEN_MAX) return -1;
+
+    uint8_t* tampon = malloc(brut);
+    if (tampon == NULL) return -1;
+    uLongf n = brut;
+    if (uncompress(tampon, &n, data + 4, len - 4) != Z_OK || n != brut) {
+        free(tampon);
+        return -1;
+    }
+    memcpy(&copie, tampon, sizeof(copie));
+    size_t grille = (size_t)copie.rows * copie.cols * sizeof(struct ttyCell_s);
+    if (copie.rows < 1 || copie.cols < 1 || copie.rows > TTY_SCREEN_MAX || copie.cols > TTY_SCREEN_MAX
+            || brut != sizeof(copie) + 2 * grille + copie.cols) {
+        free(tampon);
+        return -1;
+    }
+
+    if (copie.rows != s->rows || copie.cols != s->cols) {
+        ttyScreenFree(s);
+        allocation(s, copie.rows, copie.cols);
+    }
+    copie.principal  = s->principal;
+    copie.alternatif = s->alternatif;
+    copie.tabs       = s->tabs;
+    copie.grille     = copie.alterne ? copie.alternatif : copie.principal;
+    copie.ordrePrincipal  = s->ordrePrincipal;
+    copie.ordreAlternatif = s->ordreAlternatif;
+    copie.ordre      = copie.alterne ? copie.ordreAlternatif : copie.ordrePrincipal;
+    for (int y=0; y<copie.rows; y++) copie.ordrePrincipal[y] = copie.ordreAlternatif[y] = y;
+    memcpy(copie.principal, tampon + sizeof(copie), grille);
+    memcpy(copie.alternatif, tampon + sizeof(copie) + grille, grille);
+    memcpy(copie.tabs, tampon + sizeof(copie) + 2 * grille, copie.cols);
+    *s = copie;
+    free(tampon);
+    return 0;
+}
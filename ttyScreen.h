@@ -0,0 +1,102 @@
+/******************************************************************************
+ * Modèle d'écran VT100 / xterm pour replay : la sortie du serveur est passée
+ * dans un automate de terminal qui tient à jour une grille de cellules, ce
+ * qui permet de montrer ce que l'utilisateur voyait à un instant donné.
+ *
+ * Couvre ce qu'utilisent shells, éditeurs et pagers : déplacements du curseur,
+ * effacements, insertion/suppression de lignes et de caractères, région de
+ * défilement, écran alternatif, attributs et couleurs (256), UTF-8 et caractères
+ * larges, jeu graphique DEC. Le reste (OSC, DCS, requêtes) est absorbé.
+ *
+ * L'état complet tient dans la structure et deux grilles : ttyScreenSnapshot()
+ * le fige en un bloc compressé que ttyScreenRestore() recharge, pour repartir
+ * d'un point intermédiaire sans rejouer toute la session.
+ * Bertrand sept 2024
+ ******************************************************************************/
+#ifndef TTYSCREEN_H
+#define TTYSCREEN_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+
+#define TTY_SCREEN_ROWS_DEFAULT  24    /* sans record de taille (v1, anciens enregistrements) */
+#define TTY_SCREEN_COLS_DEFAULT  80
+#define TTY_SCREEN_MAX           1000  /* lignes ou colonnes, au-delà la taille est tronquée */
+#define TTY_SCREEN_PARAMS        16
+
+/* attributs d'une cellule */
+#define TTY_ATTR_BOLD       0x001
+#define TTY_ATTR_DIM        0x002
+#define TTY_ATTR_ITALIC     0x004
+#define TTY_ATTR_UNDERLINE  0x008
+#define TTY_ATTR_BLINK      0x010
+#define TTY_ATTR_REVERSE    0x020
+#define TTY_ATTR_INVISIBLE  0x040
+#define TTY_ATTR_WIDE_SUITE 0x080  /* moitié droite d'un caractère large, c = 0 */
+#define TTY_ATTR_FG_DEFAULT 0x100  /* couleur par défaut du terminal, fg ignoré */
+#define TTY_ATTR_BG_DEFAULT 0x200
+
+struct ttyCell_s {
+    uint32_t c;           /* point de code unicode */
+    uint16_t attr;
+    uint8_t  fg;          /* palette 256 couleurs */
+    uint8_t  bg;
+};
+
+struct ttyScreen_s {
+    int      rows;
+    int      cols;
+    struct ttyCell_s* grille;      /* écran affiché : principal ou alternatif */
+    struct ttyCell_s* principal;
+    struct ttyCell_s* alternatif;
+    int*     ordre;                /* rangée physique de chaque ligne affichée : défiler ne déplace pas les cellules */
+    int*     ordrePrincipal;
+    int*     ordreAlternatif;
+    uint8_t* tabs;                 /* un octet par colonne, 1 = taquet */
+    bool     alterne;
+
+    int      x, y;
+    bool     wrapPending;          /* dernière colonne écrite, retour à la ligne au prochain caractère */
+    struct ttyCell_s pinceau;      /* attributs courants */
+    int      haut, bas;            /* région de défilement, bornes incluses */
+    bool     autowrap;
+    bool     origine;
+    bool     insertion;
+    bool     curseurVisible;
+    uint8_t  g[2];                 /* jeux G0 et G1 : 'B' ascii, '0' graphique DEC */
+    int      gActif;
+
+    int      sauveX, sauveY;       /* DECSC / DECRC */
+    struct ttyCell_s sauvePinceau;
+    bool     sauveOrigine;
+    int      sauveGActif;
+
+    /* analyseur */
+    int      etat;
+    uint32_t params[TTY_SCREEN_PARAMS];
+    int      nparams;
+    char     prive;
+    char     intermediaire;
+    int      charsetCible;
+    uint32_t utf8;
+    int      utf8Reste;
+    uint32_t dernier;              /* dernier caractère affiché, pour REP */
+};
+
+void ttyScreenInit(struct ttyScreen_s* s, int rows, int cols);
+void ttyScreenFree(struct ttyScreen_s* s);
+void ttyScreenReset(struct ttyScreen_s* s);
+void ttyScreenResize(struct ttyScreen_s* s, int rows, int cols);
+void ttyScreenFeed(struct ttyScreen_s* s, const char* data, size_t len);
+
+/* Texte de l'écran, une ligne par rangée, espaces de fin supprimés */
+void ttyScreenDump(const struct ttyScreen_s* s, FILE* f);
+
+/* Etat complet compressé, alloué par malloc(). -1 si la mémoire manque */
+int  ttyScreenSnapshot(const struct ttyScreen_s* s, uint8_t** data, size_t* len);
+int  ttyScreenRestore(struct ttyScreen_s* s, const uint8_t* data, size_t len);
+
+#endif
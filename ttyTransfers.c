@@ -0,0 +1,1413 @@
+/******************************************************************************
+ * Transferts de fichiers, voir ttyTransfers.h
+ * Bertrand sept 2024
+ ******************************************************************************/
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <ctype.h>
+#include <zlib.h>            /* crc32() des trames zmodem */
+
+#include "ttyRecord.h"
+#include "ttyTransfers.h"
+
+
+
+/******************************************************************************
+ * SHA-256 (FIPS 180-4), au fil de l'eau
+ */
+
+struct sha256_s {
+    uint32_t h[8];
+    uint64_t total;
+    uint8_t  bloc[64];
+    size_t   n;
+};
+
+static const uint32_t sha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTD(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256Init(struct sha256_s* s) {
+    static const uint32_t h0[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    memcpy(s->h, h0, sizeof(h0));
+    s->total = 0;
+    s->n = 0;
+}
+
+static void sha256Bloc(struct sha256_s* s, const uint8_t* p) {
+    uint32_t w[64];
+    for (int i=0; i<16; i++) w[i] = (uint32_t)p[4*i] << 24 | (uint32_t)p[4*i+1] << 16 | (uint32_t)p[4*i+2] << 8 | p[4*i+3];
+    for (int i=16; i<64; i++) {
+        uint32_t s0 = ROTD(w[i-15], 7) ^ ROTD(w[i-15], 18) ^ (w[i-15] >> 3);
+        uint32_t s1 = ROTD(w[i-2], 17) ^ ROTD(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+    uint32_t a = s->h[0], b = s->h[1], c = s->h[2], d = s->h[3], e = s->h[4], f = s->h[5], g = s->h[6], h = s->h[7];
+    for (int i=0; i<64; i++) {
+        uint32_t t1 = h + (ROTD(e, 6) ^ ROTD(e, 11) ^ ROTD(e, 25)) + ((e & f) ^ (~e & g)) + sha256K[i] + w[i];
+        uint32_t t2 = (ROTD(a, 2) ^ ROTD(a, 13) ^ ROTD(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    s->h[0] += a; s->h[1] += b; s->h[2] += c; s->h[3] += d;
+    s->h[4] += e; s->h[5] += f; s->h[6] += g; s->h[7] += h;
+}
+
+static void sha256Update(struct sha256_s* s, const uint8_t* p, size_t len) {
+    s->total += len;
+    if (s->n > 0) {
+        size_t k = 64 - s->n < len ? 64 - s->n : len;
+        memcpy(s->bloc + s->n, p, k);
+        s->n += k;
+        p += k;
+        len -= k;
+        if (s->n < 64) return;
+        sha256Bloc(s, s->bloc);
+        s->n = 0;
+    }
+    for (; len >= 64; p += 64, len -= 64) sha256Bloc(s, p);
+    memcpy(s->bloc, p, len);
+    s->n = len;
+}
+
+static void sha256Final(struct sha256_s* s, uint8_t out[32]) {
+    uint64_t bits = s->total * 8;
+    uint8_t fin[72] = { 0x80 };
+    size_t pad = (s->n < 56 ? 56 : 120) - s->n;
+    for (int i=0; i<8; i++) fin[pad + i] = (uint8_t)(bits >> (56 - 8*i));
+    sha256Update(s, fin, pad + 8);
+    for (int i=0; i<8; i++) {
+        out[4*i]   = s->h[i] >> 24;
+        out[4*i+1] = s->h[i] >> 16;
+        out[4*i+2] = s->h[i] >> 8;
+        out[4*i+3] = s->h[i];
+    }
+}
+
+
+
+/******************************************************************************
+ * Etat
+ */
+
+#define FLUX_ATTENTE   4096   /* octets décodés un par un, passés au hachage par blocs */
+
+/* Un transfert en cours : hachage, et contenu pour le magasin */
+struct flux_s {
+    bool     ouvert;
+    bool     ajout;               /* un >> suivant vers le même nom le continue */
+    bool     erreur;              /* magasin inaccessible : haché seulement */
+    struct transfert_s t;
+    struct sha256_s sha;
+    uint8_t  attente[FLUX_ATTENTE];
+    size_t   attenteLen;
+    char*    memoire;             /* jusqu'à TRANSFERT_MEMOIRE octets */
+    size_t   memoireLen;
+    size_t   memoireCap;
+    int      tmp;                 /* au delà, fichier temporaire du magasin */
+    char     tmpNom[PATH_MAX];
+};
+
+struct base64_s {
+    uint32_t acc;
+    int      n;
+};
+
+struct zmodem_s {
+    int      etat;
+    int      format;              /* ZBIN, ZHEX ou ZBIN32 de l'entête en cours */
+    bool     zdle;
+    int      nbCan;               /* ZDLE consécutifs : 5 = annulation */
+    uint8_t  precedent;
+    uint8_t  entete[24];          /* binaire au début, hexadécimal reçu à partir de 8 */
+    int      lenEntete;
+    bool     crc32;               /* des sous-paquets qui suivent l'entête */
+    int      sousPaquet;          /* ZFILE ou ZDATA */
+    int      fin;                 /* ZCRCx du sous-paquet */
+    uint8_t  crc[4];
+    int      lenCrc;
+    uint8_t* donnees;
+    size_t   len;
+    uint64_t position;
+    struct flux_s flux;
+};
+
+struct transferts_s {
+    char*    magasin;
+    void   (*emet)(const struct transfert_s* t, void* ctx);
+    void*    ctx;
+    int64_t  usec;                /* record en cours */
+    uint64_t recno;
+
+    /* ligne tapée ou collée par le client */
+    char*    ligne;
+    size_t   len;
+    size_t   cap;
+    bool     enCours;
+    bool     incertaine;          /* historique, déplacements : le texte n'est pas connu */
+    bool     tropLongue;
+    bool     cr;
+    int      toucheLen;
+
+    /* corps d'un heredoc, jusqu'à son délimiteur */
+    bool     heredoc;
+    bool     heredocTabs;
+    bool     heredocCapture;
+    bool     heredocBase64;
+    char     delimiteur[TRANSFERT_NOM_MAX];
+    struct base64_s b64;
+    struct flux_s depot;          /* commande ou heredoc en cours */
+
+    /* sortie de base64 <fichier> côté serveur */
+    int      recupEtat;
+    struct base64_s recupB64;
+    char     fenetre[TRANSFERT_INVITE_MAX];   /* fin de ligne pas encore décodée */
+    size_t   fenetreDebut;
+    size_t   fenetreLen;
+    size_t   partielLen;
+    struct flux_s recup;
+    char     invite[TRANSFERT_INVITE_MAX];
+    size_t   inviteLen;
+    char     ligneServeur[TRANSFERT_INVITE_MAX];
+    size_t   ligneServeurLen;
+
+    struct zmodem_s zmodem[2];    /* données du client, du serveur */
+    bool     zmodemActif;
+
+    /* découpage de la ligne */
+    char*    mots;
+    size_t   motsCap;
+};
+
+enum { RECUP_AUCUNE, RECUP_ECHO, RECUP_SEQUENCE, RECUP_DONNEES };
+
+static unsigned long compteurTmp;   /* noms des fichiers temporaires, entre threads */
+
+
+
+/******************************************************************************
+ * Flux et magasin
+ */
+
+static void fluxOuvre(struct transferts_s* ts, struct flux_s* f, int type, const char* methode, const char* nom, size_t lenNom) {
+    f->ouvert     = true;
+    f->ajout      = false;
+    f->erreur     = false;
+    f->attenteLen = 0;
+    f->memoireLen = 0;
+    f->tmp        = -1;
+    memset(&f->t, 0, sizeof(f->t));
+    f->t.debut    = ts->usec;
+    f->t.type     = type;
+    f->t.methode  = methode;
+    if (lenNom >= TRANSFERT_NOM_MAX) lenNom = TRANSFERT_NOM_MAX - 1;
+    memcpy(f->t.nom, nom, lenNom);
+    f->t.nom[lenNom] = 0;
+    sha256Init(&f->sha);
+}
+
+/* Au delà de TRANSFERT_MEMOIRE : la suite va dans un fichier temporaire du magasin */
+static void fluxDeborde(struct transferts_s* ts, struct flux_s* f) {
+    snprintf(f->tmpNom, sizeof(f->tmpNom), "%s/.tmp-%d-%lu", ts->magasin, (int)getpid(), __atomic_add_fetch(&compteurTmp, 1, __ATOMIC_RELAXED));
+    f->tmp = open(f->tmpNom, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0444);
+    if (f->tmp < 0 || write(f->tmp, f->memoire, f->memoireLen) != (ssize_t)f->memoireLen) {
+        fprintf(stderr, "Ecriture impossible dans le magasin %s : %s\n", ts->magasin, strerror(errno));
+        if (f->tmp >= 0) {
+            close(f->tmp);
+            unlink(f->tmpNom);
+        }
+        f->tmp = -1;
+        f->erreur = true;
+    }
+    f->memoireLen = 0;
+}
+
+static void fluxEcrit(struct transferts_s* ts, struct flux_s* f, const uint8_t* p, size_t len) {
+    sha256Update(&f->sha, p, len);
+    if (ts->magasin == NULL || f->erreur) return;
+    if (f->tmp < 0 && f->memoireLen + len > TRANSFERT_MEMOIRE) fluxDeborde(ts, f);
+    if (f->tmp >= 0) {
+        if (write(f->tmp, p, len) != (ssize_t)len) {
+            fprintf(stderr, "Ecriture impossible dans le magasin %s : %s\n", ts->magasin, strerror(errno));
+            close(f->tmp);
+            unlink(f->tmpNom);
+            f->tmp = -1;
+            f->erreur = true;
+        }
+    } else if (!f->erreur) {
+        f->memoire = agrandit(f->memoire, &f->memoireCap, f->memoireLen + len);
+        memcpy(f->memoire + f->memoireLen, p, len);
+        f->memoireLen += len;
+    }
+}
+
+static void fluxOctets(struct transferts_s* ts, struct flux_s* f, const uint8_t* p, size_t len) {
+    f->t.taille += len;
+    if (f->attenteLen + len > FLUX_ATTENTE) {
+        fluxEcrit(ts, f, (uint8_t*)f->attente, f->attenteLen);
+        f->attenteLen = 0;
+    }
+    if (len > FLUX_ATTENTE) {
+        fluxEcrit(ts, f, p, len);
+        return;
+    }
+    memcpy(f->attente + f->attenteLen, p, len);
+    f->attenteLen += len;
+}
+
+static void fluxAbandonne(struct flux_s* f) {
+    if (f->tmp >= 0) {
+        close(f->tmp);
+        unlink(f->tmpNom);
+        f->tmp = -1;
+    }
+    f->ouvert = false;
+}
+
+/* Rangé sous son condensat, sauf s'il y est déjà : link() échoue alors sans rien écraser */
+static void magasinRange(struct transferts_s* ts, struct flux_s* f) {
+    char final[PATH_MAX];
+    snprintf(final, sizeof(final), "%s/%.2s", ts->magasin, f->t.condensat);
+    if (mkdir(final, 0755) < 0 && errno != EEXIST) f->erreur = true;
+    snprintf(final, sizeof(final), "%s/%.2s/%s", ts->magasin, f->t.condensat, f->t.condensat);
+    if (f->erreur || access(final, F_OK) == 0) return;
+
+    if (f->tmp < 0) fluxDeborde(ts, f);
+    if (f->tmp < 0) return;
+    close(f->tmp);
+    f->tmp = -1;
+    if (link(f->tmpNom, final) == 0) f->t.flags |= TRANSFERT_NOUVEAU;
+    else if (errno != EEXIST) fprintf(stderr, "Impossible de ranger %s : %s\n", final, strerror(errno));
+    unlink(f->tmpNom);
+}
+
+/* Fin du transfert : condensat, magasin, émission. Un transfert vide est oublié. */
+static void fluxFerme(struct transferts_s* ts, struct flux_s* f, int flags) {
+    if (!f->ouvert) return;
+    if (f->attenteLen) fluxEcrit(ts, f, f->attente, f->attenteLen);
+    f->attenteLen = 0;
+    if (f->t.taille == 0) {
+        fluxAbandonne(f);
+        return;
+    }
+    f->t.fin    = ts->usec;
+    f->t.recno  = ts->recno;
+    f->t.flags |= flags;
+    sha256Final(&f->sha, f->t.sha256);
+    for (int i=0; i<32; i++) snprintf(f->t.condensat + 2*i, 3, "%02x", f->t.sha256[i]);
+    if (ts->magasin) magasinRange(ts, f);
+    fluxAbandonne(f);
+    ts->emet(&f->t, ts->ctx);
+}
+
+
+
+/******************************************************************************
+ * Base64, alphabet standard, blancs ignorés
+ */
+
+static int base64Valeur(uint8_t c) {
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    if (c == '+') return 62;
+    if (c == '/') return 63;
+    return -1;
+}
+
+/* Retourne le nombre d'octets produits dans out (3 au plus), -1 si c n'est pas du base64 */
+static int base64Octet(struct base64_s* b, uint8_t c, uint8_t* out) {
+    if (c == ' ' || c == '\t' || c == '\r' || c == '\n') return 0;
+    if (c == '=') {
+        /* fin de bloc : ce qui reste, comme un bloc incomplet */
+        int n = b->n == 2 ? 1 : b->n == 3 ? 2 : 0;
+        if (n >= 1) out[0] = b->acc >> (b->n == 2 ? 4 : 10);
+        if (n == 2) out[1] = b->acc >> 2;
+        b->acc = b->n = 0;
+        return n;
+    }
+    int v = base64Valeur(c);
+    if (v < 0) return -1;
+    b->acc = b->acc << 6 | v;
+    if (++b->n < 4) return 0;
+    out[0] = b->acc >> 16;
+    out[1] = b->acc >> 8;
+    out[2] = b->acc;
+    b->acc = b->n = 0;
+    return 3;
+}
+
+/* Décode vers le flux ; false au premier caractère qui n'est pas du base64 */
+static bool base64Flux(struct transferts_s* ts, struct base64_s* b, struct flux_s* f, const char* p, size_t len) {
+    uint8_t out[3];
+    for (size_t i=0; i<len; i++) {
+        int n = base64Octet(b, p[i], out);
+        if (n < 0) return false;
+        if (n > 0) fluxOctets(ts, f, out, n);
+    }
+    return true;
+}
+
+/* Bloc incomplet en fin de données, sans les = */
+static void base64Fin(struct transferts_s* ts, struct base64_s* b, struct flux_s* f) {
+    uint8_t out[3];
+    int n = base64Octet(b, '=', out);
+    if (n > 0) fluxOctets(ts, f, out, n);
+}
+
+
+
+/******************************************************************************
+ * Zmodem : les trames de données de l'émetteur, quel que soit le côté. Les
+ * sous-paquets dont le crc est faux sont ignorés, l'émetteur les renvoie après
+ * le ZRPOS du récepteur ; un ZDATA qui reprend avant la fin connue ne rapporte
+ * que ce qui manquait.
+ */
+
+#define ZPAD     '*'
+#define ZDLE     0x18
+#define ZBIN     'A'
+#define ZHEX     'B'
+#define ZBIN32   'C'
+#define ZCRCE    'h'
+#define ZCRCG    'i'
+#define ZCRCQ    'j'
+#define ZCRCW    'k'
+#define ZRUB0    'l'
+#define ZRUB1    'm'
+
+#define ZRQINIT  0
+#define ZFILE    4
+#define ZFIN     8
+#define ZDATA    10
+#define ZEOF     11
+
+#define ZMODEM_PAQUET_MAX  16384   /* sous-paquet plus long : ce n'est pas du zmodem */
+
+enum { Z_ATTENTE, Z_FORMAT, Z_ENTETE, Z_DONNEES, Z_CRC };
+
+static uint16_t crc16(uint16_t crc, const uint8_t* p, size_t n) {
+    for (size_t i=0; i<n; i++) {
+        crc ^= (uint16_t)p[i] << 8;
+        for (int k=0; k<8; k++) crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+static int hexValeur(uint8_t c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+/* Octet échappé : 0 = octet dans *octet, 1 = rien, 2 = fin de sous-paquet (*octet = ZCRCx) */
+static int zmodemDeZdle(struct zmodem_s* z, uint8_t c, int* octet) {
+    if (z->zdle) {
+        z->zdle = false;
+        if (c == ZDLE) {
+            z->zdle = true;
+            return 1;
+        }
+        if (c >= ZCRCE && c <= ZCRCW) {
+            *octet = c;
+            return 2;
+        }
+        *octet = c == ZRUB0 ? 0x7f : c == ZRUB1 ? 0xff : c ^ 0x40;
+        return 0;
+    }
+    if (c == ZDLE) {
+        z->zdle = true;
+        return 1;
+    }
+    if ((c & 0x7f) == 0x11 || (c & 0x7f) == 0x13) return 1;   /* XON, XOFF */
+    *octet = c;
+    return 0;
+}
+
+static void zmodemAnnule(struct transferts_s* ts, struct zmodem_s* z) {
+    fluxFerme(ts, &z->flux, TRANSFERT_INCOMPLET);
+    ts->zmodemActif = false;
+    z->etat = Z_ATTENTE;
+}
+
+static void zmodemEntete(struct transferts_s* ts, struct zmodem_s* z) {
+    uint8_t* e = z->entete;
+    bool valide;
+    if (z->format == ZHEX) {
+        for (int i=0; i<7; i++) e[i] = hexValeur(e[8 + 2*i]) << 4 | hexValeur(e[8 + 2*i + 1]);
+        valide = crc16(0, e, 5) == (e[5] << 8 | e[6]);
+    } else if (z->format == ZBIN32) {
+        valide = crc32(0, e, 5) == le32Get(e + 5);
+    } else {
+        valide = crc16(0, e, 5) == (e[5] << 8 | e[6]);
+    }
+    z->etat = Z_ATTENTE;
+    if (!valide) return;
+
+    ts->zmodemActif = true;
+    switch (e[0]) {
+        case ZFILE:
+        case ZDATA:
+            z->sousPaquet = e[0];
+            z->position   = le32Get(e + 1);
+            z->crc32      = z->format == ZBIN32;
+            z->len        = 0;
+            z->etat       = Z_DONNEES;
+            break;
+        case ZEOF:
+            if (z->flux.ouvert && le32Get(e + 1) == z->flux.t.taille) fluxFerme(ts, &z->flux, 0);
+            break;
+        case ZFIN:
+            zmodemAnnule(ts, z);
+            break;
+    }
+}
+
+static void zmodemSousPaquet(struct transferts_s* ts, struct zmodem_s* z, int type) {
+    struct flux_s* f = &z->flux;
+    if (z->sousPaquet == ZFILE) {
+        /* nom, 0, puis taille date mode... en décimal */
+        size_t lenNom = strnlen((char*)z->donnees, z->len);
+        fluxFerme(ts, f, TRANSFERT_INCOMPLET);
+        fluxOuvre(ts, f, type, "zmodem", (char*)z->donnees, lenNom);
+        return;
+    }
+    if (!f->ouvert) fluxOuvre(ts, f, type, "zmodem", "", 0);
+    uint64_t taille = f->t.taille;
+    if (z->position > taille) {
+        f->t.flags |= TRANSFERT_INCOMPLET;   /* trou : le début manque */
+    } else if (z->position + z->len > taille) {
+        fluxOctets(ts, f, z->donnees + (taille - z->position), z->position + z->len - taille);
+    }
+    z->position += z->len;
+}
+
+static void zmodemOctets(struct transferts_s* ts, struct zmodem_s* z, int type, const uint8_t* p, size_t len) {
+    size_t i = 0;
+    int octet;
+    while (i < len) {
+        if (z->etat == Z_ATTENTE) {
+            /* ZPAD ZDLE, cherché par memchr() : presque rien pour une session ordinaire */
+            const uint8_t* q = memchr(p + i, ZDLE, len - i);
+            if (q == NULL) {
+                z->precedent = p[len - 1];
+                z->nbCan = 0;
+                return;
+            }
+            size_t k = q - p;
+            uint8_t avant = k > 0 ? p[k-1] : z->precedent;
+            if (avant != ZDLE) z->nbCan = 0;
+            z->nbCan++;
+            z->precedent = ZDLE;
+            i = k + 1;
+            if (z->nbCan >= 5 && ts->zmodemActif) zmodemAnnule(ts, z);
+            else if (avant == ZPAD) z->etat = Z_FORMAT;
+            continue;
+        }
+
+        uint8_t c = p[i++];
+        z->precedent = c;
+        if (c != ZDLE) {
+            z->nbCan = 0;
+        } else if (++z->nbCan >= 5) {
+            zmodemAnnule(ts, z);
+            continue;
+        }
+        switch (z->etat) {
+            case Z_FORMAT:
+                z->format    = c;
+                z->lenEntete = 0;
+                z->zdle      = false;
+                z->etat      = c == ZBIN || c == ZBIN32 || c == ZHEX ? Z_ENTETE : Z_ATTENTE;
+                break;
+            case Z_ENTETE:
+                if (z->format == ZHEX) {
+                    /* type, 4 octets et crc16 en hexadécimal, rangés après la place du binaire */
+                    if (hexValeur(c) < 0) {
+                        z->etat = Z_ATTENTE;
+                        break;
+                    }
+                    z->entete[8 + z->lenEntete++] = c;
+                    if (z->lenEntete == 14) zmodemEntete(ts, z);
+                    break;
+                }
+                switch (zmodemDeZdle(z, c, &octet)) {
+                    case 0:
+                        z->entete[z->lenEntete++] = octet;
+                        if (z->lenEntete == (z->format == ZBIN32 ? 9 : 7)) zmodemEntete(ts, z);
+                        break;
+                    case 2:
+                        z->etat = Z_ATTENTE;
+                        break;
+                }
+                break;
+            case Z_DONNEES:
+                switch (zmodemDeZdle(z, c, &octet)) {
+                    case 0:
+                        if (z->len == ZMODEM_PAQUET_MAX) {
+                            z->etat = Z_ATTENTE;
+                            break;
+                        }
+                        if (z->donnees == NULL) z->donnees = malloc(ZMODEM_PAQUET_MAX);
+                        if (z->donnees == NULL) {
+                            perror("Erreur sur malloc() ");
+                            abort();
+                        }
+                        z->donnees[z->len++] = octet;
+                        break;
+                    case 2:
+                        z->fin    = octet;
+                        z->lenCrc = 0;
+                        z->etat   = Z_CRC;
+                        break;
+                }
+                break;
+            case Z_CRC:
+                if (zmodemDeZdle(z, c, &octet) != 0) break;
+                z->crc[z->lenCrc++] = octet;
+                if (z->lenCrc < (z->crc32 ? 4 : 2)) break;
+                uint8_t fin = z->fin;
+                bool valide = z->crc32
+                    ? crc32(crc32(0, z->donnees, z->len), &fin, 1) == le32Get(z->crc)
+                    : crc16(crc16(0, z->donnees, z->len), &fin, 1) == (z->crc[0] << 8 | z->crc[1]);
+                if (valide) zmodemSousPaquet(ts, z, type);
+                z->len  = 0;
+                z->etat = valide && (fin == ZCRCG || fin == ZCRCQ) ? Z_DONNEES : Z_ATTENTE;
+                break;
+        }
+    }
+}
+
+
+
+/******************************************************************************
+ * Ligne de commande : découpée à la manière du shell, puis reconnue
+ */
+
+#define MOTS_MAX       256
+#define COMMANDES_MAX  16
+#define ARGS_MAX       16
+
+enum { MOT, OP_TUBE, OP_SEPARATEUR, OP_SORTIE, OP_AJOUT, OP_AUTRE, OP_HEREDOC, OP_HEREDOC_TABS };
+
+struct mot_s {
+    int         op;
+    const char* texte;
+    size_t      len;
+};
+
+/* Une commande d'un tube ou d'une liste, avec ses redirections */
+struct commandeShell_s {
+    const struct mot_s* args[ARGS_MAX];
+    int         argc;
+    const struct mot_s* sortie;      /* > ou >> */
+    bool        ajout;
+    const struct mot_s* delimiteur;  /* << */
+    bool        tabs;                /* <<- */
+    bool        tube;                /* sa sortie va à la commande suivante */
+};
+
+/*
+  Séquence d'échappement de echo -e, printf ou $'...', p[*i] suit la barre.
+  Retourne true pour \xHH et l'octal, qui ne servent qu'à écrire du binaire.
+  *octet = -1 : rien à écrire, -2 : \c, fin de la sortie.
+ */
+static bool echappement(const char* p, size_t n, size_t* i, bool octal3, int* octet) {
+    char c = p[(*i)++];
+    int v = 0, k;
+    switch (c) {
+        case 'a':  *octet = '\a'; return false;
+        case 'b':  *octet = '\b'; return false;
+        case 'e':
+        case 'E':  *octet = 0x1b; return false;
+        case 'f':  *octet = '\f'; return false;
+        case 'n':  *octet = '\n'; return false;
+        case 'r':  *octet = '\r'; return false;
+        case 't':  *octet = '\t'; return false;
+        case 'v':  *octet = '\v'; return false;
+        case '\\': *octet = '\\'; return false;
+        case 'c':  *octet = -2;   return false;
+        case 'x':
+            for (k=0; k<2 && *i < n && isxdigit((uint8_t)p[*i]); k++, (*i)++) v = v * 16 + (isdigit((uint8_t)p[*i]) ? p[*i] - '0' : (p[*i] | 0x20) - 'a' + 10);
+            if (k == 0) break;
+            *octet = v;
+            return true;
+        default:
+            /* echo : \0NNN ; printf et $'...' : \NNN */
+            if (c < '0' || c > '7' || (!octal3 && c != '0')) break;
+            v = octal3 ? c - '0' : 0;
+            for (k=0; k<(octal3 ? 2 : 3) && *i < n && p[*i] >= '0' && p[*i] <= '7'; k++, (*i)++) v = v * 8 + p[*i] - '0';
+            *octet = v & 0xff;
+            return true;
+    }
+    /* inconnue : la barre reste, le caractère est repris ensuite */
+    (*i)--;
+    *octet = '\\';
+    return false;
+}
+
+/* Retourne le nombre de mots, -1 si un guillemet reste ouvert (la suite est sur d'autres lignes) */
+static int decoupe(struct transferts_s* ts, struct mot_s* mots, int max) {
+    const char* p = ts->ligne;
+    size_t n = ts->len;
+    size_t i = 0;
+    int nb = 0;
+
+    ts->mots = agrandit(ts->mots, &ts->motsCap, n + 1);
+    char* o = ts->mots;
+
+    while (i < n && nb < max) {
+        char c = p[i];
+        struct mot_s* m = &mots[nb];
+        if (c == ' ' || c == '\t') {
+            i++;
+            continue;
+        }
+        if (c == '#') break;
+
+        /* redirection d'un descripteur donné : 2> 1>> ... */
+        int fd = 1;
+        size_t j = i;
+        while (j < n && isdigit((uint8_t)p[j])) j++;
+        if (j > i && j < n && (p[j] == '>' || p[j] == '<')) {
+            fd = atoi(p + i);
+            i = j;
+            c = p[i];
+        }
+
+        m->texte = o;
+        m->len = 0;
+        if (c == '|') {
+            m->op = i + 1 < n && p[i+1] == '|' ? OP_SEPARATEUR : OP_TUBE;
+            i += m->op == OP_SEPARATEUR || (i + 1 < n && p[i+1] == '&') ? 2 : 1;
+        } else if (c == ';' || (c == '&' && !(i + 1 < n && p[i+1] == '>'))) {
+            m->op = OP_SEPARATEUR;
+            i += c == '&' && i + 1 < n && p[i+1] == '&' ? 2 : 1;
+        } else if (c == '>' || c == '&') {
+            if (c == '&') i++;                      /* &> : sortie et erreurs */
+            i++;
+            bool ajout = i < n && p[i] == '>';
+            if (ajout) i++;
+            if (i < n && p[i] == '|') i++;
+            if (i < n && p[i] == '&') {             /* >&2 : duplication, le mot suivant est un descripteur */
+                i++;
+                fd = -1;
+            }
+            m->op = fd != 1 ? OP_AUTRE : ajout ? OP_AJOUT : OP_SORTIE;
+        } else if (c == '<') {
+            if (i + 2 < n && p[i+1] == '<' && p[i+2] == '<') {
+                m->op = OP_AUTRE;                   /* <<< : chaîne, pas de corps */
+                i += 3;
+            } else if (i + 1 < n && p[i+1] == '<') {
+                m->op = i + 2 < n && p[i+2] == '-' ? OP_HEREDOC_TABS : OP_HEREDOC;
+                i += m->op == OP_HEREDOC_TABS ? 3 : 2;
+            } else {
+                m->op = OP_AUTRE;
+                i++;
+            }
+        } else {
+            m->op = MOT;
+            while (i < n) {
+                c = p[i];
+                if (c == ' ' || c == '\t' || c == '|' || c == ';' || c == '&' || c == '>' || c == '<') break;
+                if (c == '\'') {
+                    for (i++; i < n && p[i] != '\''; ) *o++ = p[i++];
+                    if (i++ == n) return -1;
+                } else if (c == '$' && i + 1 < n && p[i+1] == '\'') {
+                    /* $'...' : échappements de bash */
+                    for (i += 2; i < n && p[i] != '\''; ) {
+                        int octet = p[i++];
+                        if (octet == '\\' && i < n) {
+                            if (p[i] == '\'' || p[i] == '"' || p[i] == '?') octet = p[i++];
+                            else echappement(p, n, &i, true, &octet);
+                        }
+                        if (octet >= 0) *o++ = octet;
+                    }
+                    if (i++ == n) return -1;
+                } else if (c == '"') {
+                    for (i++; i < n && p[i] != '"'; ) {
+                        if (p[i] == '\\' && i + 1 < n && strchr("\\\"$`", p[i+1])) i++;
+                        *o++ = p[i++];
+                    }
+                    if (i++ == n) return -1;
+                } else if (c == '\\') {
+                    if (++i < n) *o++ = p[i++];
+                } else {
+                    *o++ = p[i++];
+                }
+            }
+        }
+        m->len = o - m->texte;
+        nb++;
+    }
+    return nb;
+}
+
+/* Regroupe les mots en commandes ; retourne leur nombre */
+static int commandes(const struct mot_s* mots, int nbMots, struct commandeShell_s* cmds, int max) {
+    int nb = 0;
+    memset(&cmds[0], 0, sizeof(cmds[0]));
+    for (int k=0; k<nbMots; k++) {
+        const struct mot_s* m = &mots[k];
+        struct commandeShell_s* c = &cmds[nb];
+        const struct mot_s* suivant = k + 1 < nbMots && mots[k+1].op == MOT ? &mots[k+1] : NULL;
+        switch (m->op) {
+            case MOT:
+                if (c->argc < ARGS_MAX) c->args[c->argc++] = m;
+                break;
+            case OP_SORTIE:
+            case OP_AJOUT:
+                c->sortie = suivant;
+                c->ajout  = m->op == OP_AJOUT;
+                k += suivant != NULL;
+                break;
+            case OP_HEREDOC:
+            case OP_HEREDOC_TABS:
+                if (c->delimiteur == NULL) {
+                    c->delimiteur = suivant;
+                    c->tabs = m->op == OP_HEREDOC_TABS;
+                }
+                k += suivant != NULL;
+                break;
+            case OP_AUTRE:
+                k += suivant != NULL;
+                break;
+            case OP_TUBE:
+            case OP_SEPARATEUR:
+                c->tube = m->op == OP_TUBE;
+                if (c->argc > 0 && nb + 1 < max) memset(&cmds[++nb], 0, sizeof(cmds[0]));
+                break;
+        }
+    }
+    return cmds[nb].argc > 0 ? nb + 1 : nb;
+}
+
+static bool motEgal(const struct mot_s* m, const char* s) {
+    return m->len == strlen(s) && memcmp(m->texte, s, m->len) == 0;
+}
+
+/* Nom de la commande, sans son chemin ni busybox devant ; retourne l'indice de son premier argument */
+static int commandeNom(const struct commandeShell_s* c, const char** nom, size_t* len) {
+    int k = 0;
+    if (c->argc > 1 && c->args[0]->len >= 7 && memcmp(c->args[0]->texte + c->args[0]->len - 7, "busybox", 7) == 0) k = 1;
+    const struct mot_s* m = c->args[k];
+    const char* slash = memrchr(m->texte, '/', m->len);
+    *nom = slash ? slash + 1 : m->texte;
+    *len = m->texte + m->len - *nom;
+    return k + 1;
+}
+
+/* Indice du premier argument si la commande est nom, 0 sinon */
+static int commandeEst(const struct commandeShell_s* c, const char* nom) {
+    const char* n;
+    size_t len;
+    if (c->argc == 0) return 0;
+    int k = commandeNom(c, &n, &len);
+    return len == strlen(nom) && memcmp(n, nom, len) == 0 ? k : 0;
+}
+
+/* base64 ou openssl base64 ; *decode si -d, --decode ou -D */
+static bool commandeBase64(const struct commandeShell_s* c, bool* decode) {
+    int k = commandeEst(c, "base64");
+    if (k == 0 && (k = commandeEst(c, "openssl")) > 0) {
+        if (k < c->argc && (motEgal(c->args[k], "base64") || motEgal(c->args[k], "enc"))) k++;
+        else k = 0;
+    }
+    if (k == 0) return false;
+    *decode = false;
+    for (; k<c->argc; k++) {
+        const struct mot_s* m = c->args[k];
+        if (motEgal(m, "--decode") || (m->len >= 2 && m->texte[0] == '-' && m->texte[1] != '-' && memchr(m->texte, 'd', m->len)) || motEgal(m, "-D")) *decode = true;
+    }
+    return true;
+}
+
+/*
+  Suit ce qui entre dans la commande k le long du tube : décodé par base64 -d,
+  recopié par cat, tee ou dd, jusqu'à un fichier. Retourne false si rien ne le
+  décode ni ne l'amène dans un fichier (sh, python...).
+ */
+static bool suitFlux(const struct commandeShell_s* cmds, int nb, int k, bool* decode, const char** nom, size_t* lenNom, bool* ajout) {
+    *decode = false;
+    *nom    = NULL;
+    *lenNom = 0;
+    *ajout  = false;
+    for (; k < nb; k++) {
+        const struct commandeShell_s* c = &cmds[k];
+        bool d;
+        int a;
+        if (commandeBase64(c, &d) && d && !*decode) {
+            *decode = true;
+        } else if ((a = commandeEst(c, "cat")) > 0 && a == c->argc) {
+        } else if ((a = commandeEst(c, "tee")) > 0) {
+            for (; a < c->argc && *nom == NULL; a++) {
+                const struct mot_s* m = c->args[a];
+                if (motEgal(m, "-a")) *ajout = true;
+                else if (m->len > 0 && m->texte[0] != '-') {
+                    *nom    = m->texte;
+                    *lenNom = m->len;
+                }
+            }
+        } else if ((a = commandeEst(c, "dd")) > 0) {
+            for (; a < c->argc; a++) {
+                const struct mot_s* m = c->args[a];
+                if (m->len > 3 && memcmp(m->texte, "of=", 3) == 0) {
+                    *nom    = m->texte + 3;
+                    *lenNom = m->len - 3;
+                }
+            }
+        } else {
+            break;
+        }
+        if (c->sortie && *nom == NULL) {
+            *nom    = c->sortie->texte;
+            *lenNom = c->sortie->len;
+            *ajout  = c->ajout;
+        }
+        if (*nom || !c->tube) break;
+    }
+    return *decode || *nom;
+}
+
+
+
+/******************************************************************************
+ * Dépôts : echo ou printf, heredoc
+ */
+
+/* Texte écrit par echo ou printf : les arguments, avec leurs échappements si interprete */
+struct charge_s {
+    const struct mot_s* mots[ARGS_MAX];
+    int  nb;
+    bool interprete;
+    bool octal3;          /* printf : \NNN, echo : \0NNN */
+    bool finLigne;        /* echo sans -n */
+};
+
+static bool chargeDe(const struct commandeShell_s* c, int k, struct charge_s* ch) {
+    memset(ch, 0, sizeof(*ch));
+    if (motEgal(c->args[k-1], "printf") || (c->args[k-1]->len > 7 && memcmp(c->args[k-1]->texte + c->args[k-1]->len - 7, "/printf", 7) == 0)) {
+        if (k >= c->argc) return false;
+        ch->interprete = ch->octal3 = true;
+        /* printf '%s' x : x tel quel ; printf '%b' x : x avec les échappements de echo */
+        if ((motEgal(c->args[k], "%s") || motEgal(c->args[k], "%b")) && k + 1 < c->argc) {
+            ch->interprete = c->args[k]->texte[1] == 'b';
+            ch->octal3 = false;
+            k++;
+        }
+        ch->mots[ch->nb++] = c->args[k];
+        return true;
+    }
+    ch->finLigne = true;
+    for (; k < c->argc; k++) {
+        const struct mot_s* m = c->args[k];
+        bool option = ch->nb == 0 && m->len >= 2 && m->texte[0] == '-' && strspn(m->texte + 1, "neE") == m->len - 1;
+        if (!option) {
+            ch->mots[ch->nb++] = m;
+            continue;
+        }
+        if (memchr(m->texte, 'n', m->len)) ch->finLigne = false;
+        if (memchr(m->texte, 'e', m->len)) ch->interprete = true;
+    }
+    return ch->nb > 0;
+}
+
+/* Passe la charge au flux, ou seulement compte ses échappements binaires si f est NULL */
+static int chargeEcrit(struct transferts_s* ts, const struct charge_s* ch, struct flux_s* f) {
+    int binaires = 0;
+    uint8_t o;
+    for (int k=0; k<ch->nb; k++) {
+        const char* p = ch->mots[k]->texte;
+        size_t n = ch->mots[k]->len;
+        if (k > 0 && f) fluxOctets(ts, f, (uint8_t*)" ", 1);
+        if (!ch->interprete) {
+            if (f) fluxOctets(ts, f, (uint8_t*)p, n);
+            continue;
+        }
+        size_t debut = 0;
+        for (size_t i=0; i<n; ) {
+            if (p[i] != '\\' || i + 1 == n) {
+                i++;
+                continue;
+            }
+            if (f && i > debut) fluxOctets(ts, f, (uint8_t*)p + debut, i - debut);
+            i++;
+            int octet;
+            binaires += echappement(p, n, &i, ch->octal3, &octet);
+            if (octet == -2) return binaires;
+            o = octet;
+            if (f && octet >= 0) fluxOctets(ts, f, &o, 1);
+            debut = i;
+        }
+        if (f && n > debut) fluxOctets(ts, f, (uint8_t*)p + debut, n - debut);
+    }
+    if (f && ch->finLigne) fluxOctets(ts, f, (uint8_t*)"\n", 1);
+    return binaires;
+}
+
+/* Ouvre le dépôt, ou continue celui en cours si c'est un >> vers le même fichier par la même méthode */
+static struct flux_s* depotPour(struct transferts_s* ts, const char* methode, const char* nom, size_t lenNom, bool ajout) {
+    struct flux_s* f = &ts->depot;
+    if (ajout && f->ouvert && f->ajout && strcmp(f->t.methode, methode) == 0 && strlen(f->t.nom) == lenNom && memcmp(f->t.nom, nom, lenNom) == 0) return f;
+    fluxFerme(ts, f, 0);
+    fluxOuvre(ts, f, TTY_RECORD_FILE_UPLOAD, methode, nom, lenNom);
+    f->ajout = nom != NULL && lenNom > 0;
+    return f;
+}
+
+/* echo ou printf de la commande k : retourne true si c'est un dépôt */
+static bool depotCharge(struct transferts_s* ts, const struct commandeShell_s* cmds, int nb, int k) {
+    const struct commandeShell_s* c = &cmds[k];
+    struct charge_s ch;
+    int a = commandeEst(c, "echo");
+    if (a == 0) a = commandeEst(c, "printf");
+    if (a == 0 || !chargeDe(c, a, &ch)) return false;
+
+    bool decode = false, ajout = c->ajout;
+    const char* nom = c->sortie ? c->sortie->texte : NULL;
+    size_t lenNom = c->sortie ? c->sortie->len : 0;
+    if (c->sortie == NULL && (!c->tube || !suitFlux(cmds, nb, k + 1, &decode, &nom, &lenNom, &ajout))) return false;
+
+    if (decode) {
+        /* base64 seulement : le premier caractère étranger, et ce n'en est pas */
+        for (int m=0; m<ch.nb; m++) {
+            for (size_t i=0; i<ch.mots[m]->len; i++) {
+                uint8_t x = ch.mots[m]->texte[i];
+                if (base64Valeur(x) < 0 && x != '=' && x != ' ' && x != '\n' && x != '\\') return false;
+            }
+        }
+        struct flux_s* f = depotPour(ts, "base64", nom ? nom : "", lenNom, ajout);
+        struct base64_s b = { 0, 0 };
+        for (int m=0; m<ch.nb; m++) {
+            const char* p = ch.mots[m]->texte;
+            size_t n = ch.mots[m]->len;
+            /* echo -e "...\n..." : les \n sont des fins de ligne pour base64 -d */
+            for (size_t i=0; i<n; i++) {
+                if (p[i] == '\\') continue;
+                uint8_t out[3];
+                int r = base64Octet(&b, p[i], out);
+                if (r > 0) fluxOctets(ts, f, out, r);
+            }
+        }
+        base64Fin(ts, &b, f);
+        return true;
+    }
+
+    /* sans décodage : seulement des octets écrits par échappements, vers un fichier */
+    if (nom == NULL || lenNom == 0 || !ch.interprete || chargeEcrit(ts, &ch, NULL) == 0) return false;
+    chargeEcrit(ts, &ch, depotPour(ts, "escapes", nom, lenNom, ajout));
+    return true;
+}
+
+static void heredocDebut(struct transferts_s* ts, const struct commandeShell_s* cmds, int nb, int k) {
+    const struct mot_s* d = cmds[k].delimiteur;
+    size_t len = d->len < sizeof(ts->delimiteur) - 1 ? d->len : sizeof(ts->delimiteur) - 1;
+    memcpy(ts->delimiteur, d->texte, len);
+    ts->delimiteur[len] = 0;
+    ts->heredoc     = true;
+    ts->heredocTabs = cmds[k].tabs;
+
+    bool decode, ajout;
+    const char* nom;
+    size_t lenNom;
+    fluxFerme(ts, &ts->depot, 0);
+    ts->heredocCapture = suitFlux(cmds, nb, k, &decode, &nom, &lenNom, &ajout);
+    ts->heredocBase64  = decode;
+    ts->b64 = (struct base64_s) { 0, 0 };
+    if (ts->heredocCapture) fluxOuvre(ts, &ts->depot, TTY_RECORD_FILE_UPLOAD, decode ? "heredoc-base64" : "heredoc", nom ? nom : "", lenNom);
+}
+
+static void heredocFin(struct transferts_s* ts, int flags) {
+    if (ts->heredocCapture && ts->heredocBase64) base64Fin(ts, &ts->b64, &ts->depot);
+    if (ts->heredocCapture) fluxFerme(ts, &ts->depot, flags);
+    ts->heredoc = ts->heredocCapture = false;
+}
+
+static void heredocLigne(struct transferts_s* ts) {
+    const char* p = ts->ligne;
+    size_t n = ts->len;
+    if (ts->heredocTabs) {
+        while (n > 0 && *p == '\t') {
+            p++;
+            n--;
+        }
+    }
+    if (n == strlen(ts->delimiteur) && memcmp(p, ts->delimiteur, n) == 0) {
+        heredocFin(ts, 0);
+        return;
+    }
+    if (!ts->heredocCapture || ts->tropLongue) return;
+    if (!ts->heredocBase64) {
+        fluxOctets(ts, &ts->depot, (uint8_t*)p, n);
+        fluxOctets(ts, &ts->depot, (uint8_t*)"\n", 1);
+    } else if (!base64Flux(ts, &ts->b64, &ts->depot, p, n)) {
+        /* base64 -d s'arrêtera là avec une erreur : le fichier s'arrête aussi */
+        fluxFerme(ts, &ts->depot, TRANSFERT_INCOMPLET);
+        ts->heredocCapture = false;
+    }
+}
+
+
+
+/******************************************************************************
+ * Récupération : sortie de base64 <fichier> sur le terminal. Elle commence à
+ * la ligne qui suit l'écho de la commande et s'arrête au premier caractère qui
+ * n'est pas du base64, ou à la frappe suivante. La fin d'une ligne reste dans
+ * une fenêtre : c'est peut-être le début de l'invite du shell (base64 -w0 ne
+ * finit pas sa ligne), ou un message d'erreur.
+ */
+
+static char fenetreCar(struct transferts_s* ts, size_t j) {
+    return ts->fenetre[(ts->fenetreDebut + j) % TRANSFERT_INVITE_MAX];
+}
+
+static void fenetreDecode(struct transferts_s* ts, size_t n) {
+    for (size_t j=0; j<n; j++) base64Flux(ts, &ts->recupB64, &ts->recup, &ts->fenetre[(ts->fenetreDebut + j) % TRANSFERT_INVITE_MAX], 1);
+    ts->fenetreDebut = (ts->fenetreDebut + n) % TRANSFERT_INVITE_MAX;
+    ts->fenetreLen  -= n;
+}
+
+/* Plus longue fin de la fenêtre qui, suivie de c (0 : rien), commence l'invite ; -1 si aucune */
+static long suffixeInvite(struct transferts_s* ts, int c) {
+    for (long k = ts->fenetreLen; k >= 0; k--) {
+        if ((size_t)k + (c != 0) > ts->inviteLen) continue;
+        if (c != 0 && (uint8_t)ts->invite[k] != c) continue;
+        bool egal = true;
+        for (long j=0; j<k && egal; j++) egal = fenetreCar(ts, ts->fenetreLen - k + j) == ts->invite[j];
+        if (egal) return k;
+    }
+    return -1;
+}
+
+static void recupFin(struct transferts_s* ts, int c) {
+    if (ts->recupEtat == RECUP_AUCUNE) return;
+    if (ts->recupEtat >= RECUP_SEQUENCE) {
+        long s = suffixeInvite(ts, c);
+        size_t garde;
+        if (ts->partielLen > ts->fenetreLen) garde = ts->fenetreLen - (s > 0 ? s : 0);   /* longue ligne : des données */
+        else garde = s < 0 ? 0 : ts->fenetreLen - s;
+        fenetreDecode(ts, garde);
+        base64Fin(ts, &ts->recupB64, &ts->recup);
+    }
+    fluxFerme(ts, &ts->recup, 0);
+    ts->recupEtat = RECUP_AUCUNE;
+}
+
+static void recupDebut(struct transferts_s* ts, const struct commandeShell_s* cmds, int k) {
+    const struct commandeShell_s* c = &cmds[k];
+    const struct mot_s* nom = NULL;
+    for (int a = commandeEst(c, "base64"); a > 0 && a < c->argc && nom == NULL; a++) {
+        const struct mot_s* m = c->args[a];
+        if (motEgal(m, "-w") || motEgal(m, "--wrap")) a++;
+        else if (m->len > 0 && m->texte[0] != '-') nom = m;
+    }
+    int a;
+    if (nom == NULL && k > 0 && cmds[k-1].tube && (a = commandeEst(&cmds[k-1], "cat")) > 0 && a < cmds[k-1].argc) nom = cmds[k-1].args[a];
+
+    recupFin(ts, 0);
+    fluxOuvre(ts, &ts->recup, TTY_RECORD_FILE_DOWNLOAD, "base64", nom ? nom->texte : "", nom ? nom->len : 0);
+    ts->recupEtat    = RECUP_ECHO;
+    ts->recupB64     = (struct base64_s) { 0, 0 };
+    ts->fenetreDebut = ts->fenetreLen = ts->partielLen = 0;
+}
+
+static void recupOctets(struct transferts_s* ts, const uint8_t* p, size_t len) {
+    for (size_t i=0; i<len && ts->recupEtat != RECUP_AUCUNE; i++) {
+        uint8_t c = p[i];
+        if (ts->recupEtat == RECUP_ECHO) {
+            if (c == '\n') ts->recupEtat = RECUP_DONNEES;
+            continue;
+        }
+        if (ts->recupEtat == RECUP_SEQUENCE) {
+            if (c >= 0x40 && c <= 0x7e && c != '[') ts->recupEtat = RECUP_DONNEES;
+            continue;
+        }
+        if (c == '\r') continue;
+        if (c == 0x1b && ts->fenetreLen == 0 && ts->recup.t.taille == 0 && ts->recupB64.n == 0) {
+            /* avant les données : ESC[?2004l de bash (fin du collage protégé) ou autre séquence */
+            ts->recupEtat = RECUP_SEQUENCE;
+            continue;
+        }
+        if (c == '\n' && ts->partielLen > 0) {
+            fenetreDecode(ts, ts->fenetreLen);
+            ts->partielLen = 0;
+            continue;
+        }
+        if (base64Valeur(c) >= 0 || c == '=') {
+            if (ts->fenetreLen == TRANSFERT_INVITE_MAX) fenetreDecode(ts, 1);
+            ts->fenetre[(ts->fenetreDebut + ts->fenetreLen++) % TRANSFERT_INVITE_MAX] = c;
+            ts->partielLen++;
+            continue;
+        }
+        recupFin(ts, c);
+    }
+}
+
+/* Fin de ligne courante du serveur : l'invite, quand le client commence une commande */
+static void serveurLigne(struct transferts_s* ts, const char* p, size_t len) {
+    const char* nl = memrchr(p, '\n', len);
+    if (nl) {
+        len -= nl + 1 - p;
+        p = nl + 1;
+        ts->ligneServeurLen = 0;
+    }
+    if (len >= TRANSFERT_INVITE_MAX) {
+        p += len - TRANSFERT_INVITE_MAX;
+        len = TRANSFERT_INVITE_MAX;
+        ts->ligneServeurLen = 0;
+    } else if (ts->ligneServeurLen + len > TRANSFERT_INVITE_MAX) {
+        size_t retire = ts->ligneServeurLen + len - TRANSFERT_INVITE_MAX;
+        memmove(ts->ligneServeur, ts->ligneServeur + retire, ts->ligneServeurLen - retire);
+        ts->ligneServeurLen -= retire;
+    }
+    memcpy(ts->ligneServeur + ts->ligneServeurLen, p, len);
+    ts->ligneServeurLen += len;
+}
+
+
+
+/******************************************************************************
+ * Frappes du client
+ */
+
+/* Tri rapide : sans base64, heredoc ni échappement redirigé, la ligne ne transfère rien */
+static bool candidate(const struct transferts_s* ts) {
+    return memmem(ts->ligne, ts->len, "base64", 6) || memmem(ts->ligne, ts->len, "<<", 2)
+        || (memchr(ts->ligne, '\\', ts->len) && (memchr(ts->ligne, '>', ts->len) || memchr(ts->ligne, '|', ts->len)));
+}
+
+static void analyseCommande(struct transferts_s* ts) {
+    struct mot_s mots[MOTS_MAX];
+    struct commandeShell_s cmds[COMMANDES_MAX];
+    int nbMots = candidate(ts) ? decoupe(ts, mots, MOTS_MAX) : 0;
+    if (nbMots <= 0) {
+        fluxFerme(ts, &ts->depot, 0);
+        return;
+    }
+    int nb = commandes(mots, nbMots, cmds, COMMANDES_MAX);
+
+    bool depot = false;
+    for (int k=0; k<nb; k++) {
+        const struct commandeShell_s* c = &cmds[k];
+        bool decode;
+        if (c->delimiteur && !ts->heredoc) {
+            heredocDebut(ts, cmds, nb, k);
+            depot = true;
+        } else if (depotCharge(ts, cmds, nb, k)) {
+            depot = true;
+        } else if (!c->tube && !c->sortie && commandeBase64(c, &decode) && !decode) {
+            recupDebut(ts, cmds, k);
+        }
+    }
+    /* une ligne qui n'ajoute rien au fichier en cours le termine */
+    if (!depot && !ts->heredoc) fluxFerme(ts, &ts->depot, 0);
+}
+
+static void finLigne(struct transferts_s* ts) {
+    if (ts->heredoc) heredocLigne(ts);
+    else if (!ts->incertaine && !ts->tropLongue) analyseCommande(ts);
+    ts->len = 0;
+    ts->enCours = ts->incertaine = ts->tropLongue = false;
+}
+
+static void transfertsClavier(struct transferts_s* ts, const uint8_t* p, size_t len) {
+    for (size_t i=0; i<len; i++) {
+        uint8_t c = p[i];
+        if (c == '\n' && ts->cr) {
+            ts->cr = false;
+            continue;
+        }
+        ts->cr = c == '\r';
+
+        if (ts->toucheLen > 0) {
+            /* touche spéciale : ESC [ ... ou ESC O x */
+            bool fini = ts->toucheLen == 1 ? (c != '[' && c != 'O') : (ts->toucheLen > 2 || c != 'O') && c >= 0x40 && c <= 0x7e;
+            ts->toucheLen = fini ? 0 : ts->toucheLen + 1;
+            continue;
+        }
+        if (!ts->enCours && c != '\r' && c != '\n') {
+            /* première frappe : la sortie de la commande précédente est terminée */
+            ts->enCours = true;
+            if (!ts->heredoc) {
+                memcpy(ts->invite, ts->ligneServeur, ts->ligneServeurLen);
+                ts->inviteLen = ts->ligneServeurLen;
+                recupFin(ts, 0);
+            }
+        }
+
+        switch (c) {
+            case '\r':
+            case '\n':
+                finLigne(ts);
+                break;
+            case 0x03:   /* ^C : ligne, et heredoc, abandonnés */
+                if (ts->heredoc && ts->heredocCapture) fluxAbandonne(&ts->depot);
+                ts->heredoc = ts->heredocCapture = false;
+                ts->len = 0;
+                ts->enCours = ts->incertaine = ts->tropLongue = false;
+                break;
+            case 0x04:   /* ^D sur une ligne vide : fin du heredoc */
+                if (ts->heredoc && ts->len == 0) heredocFin(ts, 0);
+                break;
+            case 0x7f:
+            case 0x08:
+                if (ts->len > 0) ts->len--;
+                break;
+            case 0x15:   /* ^U */
+                ts->len = 0;
+                break;
+            case 0x1b:
+                ts->toucheLen = 1;
+                ts->incertaine = true;
+                break;
+            case '\t':
+                if (ts->heredoc) goto insere;
+                ts->incertaine = true;
+                break;
+            default:
+                if (c < 0x20) {
+                    ts->incertaine = true;   /* historique, déplacements, ^W... */
+                    break;
+                }
+            insere:
+                if (ts->len == TRANSFERT_LIGNE_MAX) {
+                    ts->tropLongue = true;
+                    break;
+                }
+                if (ts->len == ts->cap) ts->ligne = agrandit(ts->ligne, &ts->cap, ts->len + 1);
+                ts->ligne[ts->len++] = c;
+        }
+    }
+}
+
+
+
+/******************************************************************************
+ * Etage de traitement
+ */
+
+static void fluxInit(struct flux_s* f) {
+    f->ouvert = false;
+    f->tmp = -1;
+}
+
+struct transferts_s* transfertsNew(const char* magasin, void (*emet)(const struct transfert_s*, void*), void* ctx) {
+    struct transferts_s* ts = calloc(1, sizeof(*ts));
+    if (ts == NULL) {
+        perror("Erreur sur calloc() ");
+        abort();
+    }
+    if (magasin) {
+        if (mkdir(magasin, 0755) < 0 && errno != EEXIST) {
+            fprintf(stderr, "Impossible de créer le magasin %s : %s\n", magasin, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        ts->magasin = strdup(magasin);
+    }
+    ts->emet = emet;
+    fluxInit(&ts->depot);
+    fluxInit(&ts->recup);
+    fluxInit(&ts->zmodem[0].flux);
+    fluxInit(&ts->zmodem[1].flux);
+    transfertsReset(ts, ctx);
+    return ts;
+}
+
+void transfertsReset(struct transferts_s* ts, void* ctx) {
+    fluxAbandonne(&ts->depot);
+    fluxAbandonne(&ts->recup);
+    fluxAbandonne(&ts->zmodem[0].flux);
+    fluxAbandonne(&ts->zmodem[1].flux);
+    fluxInit(&ts->depot);
+    fluxInit(&ts->recup);
+    for (int k=0; k<2; k++) {
+        struct zmodem_s* z = &ts->zmodem[k];
+        uint8_t* donnees = z->donnees;
+        memset(z, 0, offsetof(struct zmodem_s, flux));
+        z->donnees = donnees;
+        fluxInit(&z->flux);
+    }
+    ts->ctx = ctx;
+    ts->len = 0;
+    ts->enCours = ts->incertaine = ts->tropLongue = ts->cr = false;
+    ts->toucheLen = 0;
+    ts->heredoc = ts->heredocCapture = false;
+    ts->recupEtat = RECUP_AUCUNE;
+    ts->inviteLen = ts->ligneServeurLen = 0;
+    ts->zmodemActif = false;
+}
+
+void transfertsRecord(struct transferts_s* ts, const struct ttyRecordView_s* v) {
+    ts->usec  = v->usec;
+    ts->recno = v->recno;
+    if (v->type == TTY_RECORD_CLIENT_TO_SERVER) {
+        zmodemOctets(ts, &ts->zmodem[0], TTY_RECORD_FILE_UPLOAD, (uint8_t*)v->data, v->len);
+        if (!ts->zmodemActif) transfertsClavier(ts, (uint8_t*)v->data, v->len);
+        else ts->len = 0;
+    } else if (v->type == TTY_RECORD_SERVER_TO_CLIENT) {
+        zmodemOctets(ts, &ts->zmodem[1], TTY_RECORD_FILE_DOWNLOAD, (uint8_t*)v->data, v->len);
+        if (ts->recupEtat != RECUP_AUCUNE) recupOctets(ts, (uint8_t*)v->data, v->len);
+        serveurLigne(ts, v->data, v->len);
+    }
+}
+
+void transfertsFin(struct transferts_s* ts, const struct ttyRecordView_s* dernier) {
+    if (dernier) {
+        ts->usec  = dernier->usec;
+        ts->recno = dernier->recno;
+    }
+    recupFin(ts, 0);
+    if (ts->heredoc) heredocFin(ts, TRANSFERT_INCOMPLET);
+    fluxFerme(ts, &ts->depot, 0);
+    fluxFerme(ts, &ts->zmodem[0].flux, TRANSFERT_INCOMPLET);
+    fluxFerme(ts, &ts->zmodem[1].flux, TRANSFERT_INCOMPLET);
+}
+
+void transfertsFree(struct transferts_s* ts) {
+    transfertsReset(ts, NULL);
+    free(ts->depot.memoire);
+    free(ts->recup.memoire);
+    for (int k=0; k<2; k++) {
+        free(ts->zmodem[k].donnees);
+        free(ts->zmodem[k].flux.memoire);
+    }
+    free(ts->ligne);
+    free(ts->mots);
+    free(ts->magasin);
+    free(ts);
+}
+
+/* Drapeaux lisibles : 2 lettres ou tirets, dans l'ordre n (nouveau) i (incomplet) */
+void transfertFlags(const struct transfert_s* t, char flags[3]) {
+    flags[0] = t->flags & TRANSFERT_NOUVEAU   ? 'n' : '-';
+    flags[1] = t->flags & TRANSFERT_INCOMPLET ? 'i' : '-';
+    flags[2] = 0;
+}
+
+size_t transfertRecord(const struct transfert_s* t, char out[TRANSFERT_RECORD_MAX]) {
+    int n = snprintf(out, TRANSFERT_RECORD_MAX, "sha256: %s\nsize: %llu\nmethod: %s\n%s%s%s%s",
+                     t->condensat, (unsigned long long)t->taille, t->methode,
+                     t->nom[0] ? "name: " : "", t->nom, t->nom[0] ? "\n" : "",
+                     t->flags & TRANSFERT_INCOMPLET ? "incomplete: 1\n" : "");
+    return n < 0 ? 0 : (size_t)n < TRANSFERT_RECORD_MAX ? (size_t)n : TRANSFERT_RECORD_MAX - 1;
+}
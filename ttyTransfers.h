@@ -0,0 +1,90 @@
+/******************************************************************************
+ * Transferts de fichiers : ce qu'un attaquant fait passer par le terminal pour
+ * déposer un binaire ou récupérer un fichier. Etage de traitement des records,
+ * comme ttyCommands, en une passe : chaque transfert reconnu est décodé au fil
+ * de l'eau, haché en SHA-256, et s'il y a un magasin rangé sous son condensat,
+ * une seule fois quel que soit le nombre de sessions qui l'ont transféré.
+ *
+ * Reconnus, côté client (dépôt) :
+ *   base64          echo|printf '<base64>' | base64 -d [> nom]
+ *   heredoc-base64  base64 -d [> nom] <<FIN ... FIN
+ *   heredoc         cat > nom <<FIN ... FIN, tee nom <<FIN ... FIN
+ *   escapes         echo -ne|printf "\x7f\x45..." > nom ; les >> successifs
+ *                   vers le même fichier forment un seul transfert
+ *   zmodem          rz : trames ZDATA envoyées par le client
+ * côté serveur (récupération) :
+ *   base64          sortie de base64 <fichier>, découpée ou non
+ *   zmodem          sz : trames ZDATA envoyées par le serveur
+ *
+ * Magasin : <magasin>/<2 premiers chiffres>/<condensat en hexadécimal>. Un
+ * transfert est gardé en mémoire jusqu'à TRANSFERT_MEMOIRE octets, puis
+ * continué dans un fichier temporaire du magasin ; s'il y est déjà, rien n'est
+ * écrit. Plusieurs process ou threads peuvent remplir le même magasin.
+ *
+ * Records : replay --files --insert réécrit l'enregistrement avec, après le
+ * record qui termine chaque transfert, un record TTY_RECORD_FILE_UPLOAD ou
+ * TTY_RECORD_FILE_DOWNLOAD en lignes "clé: valeur" comme le record START :
+ *   sha256: <condensat>     nom du contenu dans le magasin
+ *   size: <octets>
+ *   method: <méthode>
+ *   name: <fichier>         si la commande le donne
+ *   incomplete: 1           si TRANSFERT_INCOMPLET
+ * Bertrand sept 2024
+ ******************************************************************************/
+#ifndef TTYTRANSFERS_H
+#define TTYTRANSFERS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "ttyRecordReader.h"
+
+
+#define TRANSFERT_MEMOIRE       (1 << 20)   /* au delà, la suite va dans un fichier temporaire du magasin */
+#define TRANSFERT_LIGNE_MAX     (64 << 20)  /* ligne de commande collée plus longue : ignorée */
+#define TRANSFERT_NOM_MAX       256
+#define TRANSFERT_INVITE_MAX    256         /* invite du shell, retirée de la fin d'une récupération base64 */
+
+#define TRANSFERT_INCOMPLET     1   /* heredoc non terminé, trames zmodem manquantes ou annulées */
+#define TRANSFERT_NOUVEAU       2   /* pas encore dans le magasin : vient d'y être écrit */
+
+struct transfert_s {
+    int64_t  debut;                 /* µs, commande ou première trame */
+    int64_t  fin;
+    uint64_t recno;                 /* record de la fin */
+    int      type;                  /* TTY_RECORD_FILE_UPLOAD ou TTY_RECORD_FILE_DOWNLOAD */
+    const char* methode;            /* base64, heredoc, escapes, zmodem... */
+    uint64_t taille;
+    uint8_t  sha256[32];
+    char     condensat[65];         /* sha256 en hexadécimal */
+    int      flags;                 /* TRANSFERT_xxx */
+    char     nom[TRANSFERT_NOM_MAX];   /* fichier de destination, vide si inconnu (| sh...) */
+};
+
+struct transferts_s;
+
+/* magasin NULL : transferts seulement reconnus et hachés */
+struct transferts_s* transfertsNew(const char* magasin, void (*emet)(const struct transfert_s*, void*), void* ctx);
+
+/* Etage de traitement : reçoit tous les records dans l'ordre */
+void transfertsRecord(struct transferts_s* ts, const struct ttyRecordView_s* v);
+
+/* Fin de session : termine les transferts en cours, marqués incomplets */
+void transfertsFin(struct transferts_s* ts, const struct ttyRecordView_s* dernier);
+
+/* Remet à zéro pour une autre session, avec un autre contexte d'émission */
+void transfertsReset(struct transferts_s* ts, void* ctx);
+
+void transfertsFree(struct transferts_s* ts);
+
+#define TRANSFERT_RECORD_MAX    (TRANSFERT_NOM_MAX + 160)
+
+/* Données du record TTY_RECORD_FILE_UPLOAD ou TTY_RECORD_FILE_DOWNLOAD de ce transfert ; retourne leur taille */
+size_t transfertRecord(const struct transfert_s* t, char out[TRANSFERT_RECORD_MAX]);
+
+/* Drapeaux lisibles : 2 lettres ou tirets, dans l'ordre n (nouveau) i (incomplet) */
+void transfertFlags(const struct transfert_s* t, char flags[3]);
+
+#endif